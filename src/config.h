@@ -32,8 +32,10 @@
 // Protocol version should be increased whenever new features/messages are added,
 // so either the client or server can run in compatibility mode, or they can
 // cancel the connection right away if the protocol has changed too much
-#define PROTOCOL_VERSION 3
+#define PROTOCOL_VERSION 5
 // 2017-10-16: Update to v3: Change header to support request hop-counting
+// 2026-10-17: Update to v4: Add CMD_GET_BLOCK_HASHES
+// 2026-10-17: Update to v5: Servers can select multiple images on one connection, see DNBD3_HANDLE_SLOT
 
 #define NUMBER_SERVERS 8 // Number of alt servers per image/device
 
@@ -27,6 +27,7 @@ static pthread_t altThread;
 
 static void *altservers_main(void *data);
 static unsigned int altservers_updateRtt(const dnbd3_host_t * const host, const unsigned int rtt);
+static void altservers_removeUplinkLocked(dnbd3_connection_t *uplink);
 
 void altservers_init()
 {
@@ -42,10 +43,13 @@ void altservers_init()
 		exit( EXIT_FAILURE );
 	}
 	memset( altServers, 0, SERVER_MAX_ALTS * sizeof(dnbd3_alt_server_t) );
-	if ( 0 != thread_create( &altThread, NULL, &altservers_main, (void *)NULL ) ) {
+	pthread_attr_t attrs;
+	initThreadAttrs( &attrs, false );
+	if ( 0 != thread_create( &altThread, &attrs, &altservers_main, (void *)NULL ) ) {
 		logadd( LOG_ERROR, "Could not start altservers connector thread" );
 		exit( EXIT_FAILURE );
 	}
+	pthread_attr_destroy( &attrs );
 	// Init waiting links queue -- this is currently a global static array so
 	// it will already be zero, but in case we refactor later do it explicitly
 	// while also holding the write lock so thread sanitizer is happy
@@ -126,13 +130,13 @@ bool altservers_add(dnbd3_host_t *host, const char *comment, const int isPrivate
 }
 
 /**
- * ONLY called from the passed uplink's main thread
+ * ONLY called from the reactor thread of the passed uplink
  */
 void altservers_findUplink(dnbd3_connection_t *uplink)
 {
 	int i;
 	// if betterFd != -1 it means the uplink is supposed to switch to another
-	// server. As this function here is called by the uplink thread, it can
+	// server. As this function here is called by the reactor thread, it can
 	// never be that the uplink is supposed to switch, but instead calls
 	// this function.
 	assert( uplink->betterFd == -1 );
@@ -167,6 +171,29 @@ void altservers_findUplink(dnbd3_connection_t *uplink)
 void altservers_removeUplink(dnbd3_connection_t *uplink)
 {
 	mutex_lock( &pendingLockConsume );
+	altservers_removeUplinkLocked( uplink );
+	mutex_unlock( &pendingLockConsume );
+}
+
+/**
+ * Same as altservers_removeUplink, but don't wait for an RTT
+ * measurement that is currently running.
+ * @return false if the uplink could not be removed (yet)
+ */
+bool altservers_tryRemoveUplink(dnbd3_connection_t *uplink)
+{
+	if ( mutex_trylock( &pendingLockConsume ) != 0 )
+		return false;
+	altservers_removeUplinkLocked( uplink );
+	mutex_unlock( &pendingLockConsume );
+	return true;
+}
+
+/**
+ * Caller must hold pendingLockConsume
+ */
+static void altservers_removeUplinkLocked(dnbd3_connection_t *uplink)
+{
 	mutex_lock( &pendingLockWrite );
 	for (int i = 0; i < SERVER_MAX_PENDING_ALT_CHECKS; ++i) {
 		if ( pending[i] == uplink ) {
@@ -175,7 +202,6 @@ void altservers_removeUplink(dnbd3_connection_t *uplink)
 		}
 	}
 	mutex_unlock( &pendingLockWrite );
-	mutex_unlock( &pendingLockConsume );
 }
 
 /**
@@ -417,10 +443,12 @@ static void *altservers_main(void *data UNUSED)
 	serialized_buffer_t serialized;
 	struct timespec start, end;
 	ticks nextCloseUnusedFd;
+	ticks nextFreeUnusedCrc;
 
 	setThreadName( "altserver-check" );
 	blockNoncriticalSignals();
 	timing_gets( &nextCloseUnusedFd, 900 );
+	timing_gets( &nextFreeUnusedCrc, 900 );
 	// LOOP
 	while ( !_shutdown ) {
 		// Wait 5 seconds max.
@@ -604,6 +632,12 @@ static void *altservers_main(void *data UNUSED)
 			timing_gets( &nextCloseUnusedFd, 900 );
 			image_closeUnusedFd();
 		}
+		if ( timing_reached( &nextFreeUnusedCrc, &now ) ) {
+			timing_gets( &nextFreeUnusedCrc, 900 );
+			image_freeUnusedCrcLists();
+		}
+		image_freeRequestedDiskSpace();
+		image_freeRetired();
 	}
 	cleanup: ;
 	if ( runSignal != NULL ) signal_close( runSignal );
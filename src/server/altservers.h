@@ -17,6 +17,8 @@ void altservers_findUplink(dnbd3_connection_t *uplink);
 
 void altservers_removeUplink(dnbd3_connection_t *uplink);
 
+bool altservers_tryRemoveUplink(dnbd3_connection_t *uplink);
+
 int altservers_getListForClient(dnbd3_host_t *host, dnbd3_server_entry_t *output, int size);
 
 int altservers_getListForUplink(dnbd3_host_t *output, int size, int emergency);
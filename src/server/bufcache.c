@@ -0,0 +1,313 @@
+#include "bufcache.h"
+
+#include "helper.h"
+#include "locks.h"
+#include "../shared/sockhelper.h"
+
+#include <assert.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+
+#define CHUNK_SIZE SERVER_BUFCACHE_CHUNK
+
+enum
+{
+	SLOT_EMPTY = 0,
+	SLOT_LOADING,
+	SLOT_VALID,
+	SLOT_FAILED,
+};
+
+typedef struct
+{
+	dnbd3_image_t *image; // NULL if slot is unused
+	uint64_t chunk;       // offset / CHUNK_SIZE
+	uint8_t *data;        // CHUNK_SIZE bytes, suitably aligned for O_DIRECT
+	uint32_t len;         // valid bytes in data, less than CHUNK_SIZE at end of image
+	int refs;             // threads currently reading from or loading into data
+	int state;
+	int prev, next;       // LRU list, head is most recently used
+	int hashNext;         // next slot in same hash bucket
+} slot_t;
+
+static pthread_mutex_t cacheLock;
+static pthread_cond_t loadedSignal;
+// Protected by cacheLock
+static slot_t *slots = NULL;
+static int slotCount = 0;
+static int *hashTable = NULL;
+static uint32_t hashMask = 0;
+static int lruHead = -1, lruTail = -1;
+static uint8_t *buffer = NULL;
+static size_t bufferSize = 0;
+static atomic_uint_fast64_t hits = 0, misses = 0;
+
+static int acquire(dnbd3_image_t *image, uint64_t chunk);
+static void release(int idx);
+static void releaseLocked(int idx);
+static uint32_t hashOf(const dnbd3_image_t *image, uint64_t chunk);
+static void hashInsert(int idx);
+static void hashRemove(int idx);
+static void lruMoveToFront(int idx);
+
+void bufcache_init()
+{
+	const uint64_t size = _directIoCacheSize;
+	if ( size == 0 )
+		return;
+	assert( slots == NULL );
+	slotCount = (int)MIN( size / CHUNK_SIZE, (uint64_t)INT_MAX / 2 );
+	if ( slotCount < 2 ) {
+		logadd( LOG_WARNING, "directIoCacheSize too small, need at least %d KiB", 2 * CHUNK_SIZE / 1024 );
+		return;
+	}
+	bufferSize = (size_t)slotCount * CHUNK_SIZE;
+	// mmap gives us page aligned memory which is good enough for O_DIRECT,
+	// and only gets backed by physical memory once it's used
+	buffer = mmap( NULL, bufferSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+	if ( buffer == MAP_FAILED ) {
+		logadd( LOG_WARNING, "Could not allocate %" PRIu64 " MiB for direct I/O buffer cache", (uint64_t)( bufferSize >> 20 ) );
+		buffer = NULL;
+		return;
+	}
+	uint32_t buckets = 64;
+	while ( buckets < (uint32_t)slotCount * 2 ) {
+		buckets *= 2;
+	}
+	slots = calloc( (size_t)slotCount, sizeof(*slots) );
+	hashTable = malloc( buckets * sizeof(*hashTable) );
+	if ( slots == NULL || hashTable == NULL ) {
+		logadd( LOG_WARNING, "Could not allocate direct I/O buffer cache management structures" );
+		bufcache_shutdown();
+		return;
+	}
+	hashMask = buckets - 1;
+	for ( uint32_t i = 0; i < buckets; ++i ) {
+		hashTable[i] = -1;
+	}
+	for ( int i = 0; i < slotCount; ++i ) {
+		slots[i].data = buffer + (size_t)i * CHUNK_SIZE;
+		slots[i].hashNext = -1;
+		slots[i].prev = i - 1;
+		slots[i].next = ( i + 1 == slotCount ) ? -1 : i + 1;
+	}
+	lruHead = 0;
+	lruTail = slotCount - 1;
+	mutex_init( &cacheLock );
+	pthread_cond_init( &loadedSignal, NULL );
+	logadd( LOG_INFO, "Direct I/O buffer cache: %d chunks of %d KiB", slotCount, CHUNK_SIZE / 1024 );
+}
+
+/**
+ * Free the buffer cache. Call after all images were freed.
+ */
+void bufcache_shutdown()
+{
+	if ( buffer != NULL ) {
+		munmap( buffer, bufferSize );
+		buffer = NULL;
+	}
+	free( slots );
+	free( hashTable );
+	slots = NULL;
+	hashTable = NULL;
+}
+
+void bufcache_imageOpen(dnbd3_image_t *image)
+{
+	image->directFd = -1;
+	if ( slots == NULL || image->realFilesize < _directIoMinSize )
+		return;
+	image->directFd = open( image->path, O_RDONLY | O_DIRECT );
+	if ( image->directFd == -1 ) {
+		logadd( LOG_DEBUG1, "Cannot open %s with O_DIRECT (errno=%d), using page cache", image->path, errno );
+	}
+}
+
+void bufcache_imageClose(dnbd3_image_t *image)
+{
+	if ( image->directFd == -1 )
+		return;
+	mutex_lock( &cacheLock );
+	for ( int i = 0; i < slotCount; ++i ) {
+		if ( slots[i].image != image )
+			continue;
+		// Nobody can be sending from this image anymore, as it's being freed
+		assert( slots[i].refs == 0 );
+		hashRemove( i );
+		slots[i].image = NULL;
+		slots[i].state = SLOT_EMPTY;
+	}
+	mutex_unlock( &cacheLock );
+	close( image->directFd );
+	image->directFd = -1;
+}
+
+ssize_t bufcache_send(dnbd3_image_t *image, int sock, uint64_t offset, size_t len)
+{
+	// Incomplete images get written to by the uplink, which would bypass the
+	// buffer cache and leave stale data in it, so only use it for complete ones
+	if ( image->directFd == -1 || image->cache_map != NULL )
+		return 0;
+	size_t done = 0;
+	while ( done < len ) {
+		const uint64_t pos = offset + done;
+		const uint32_t inChunk = (uint32_t)( pos % CHUNK_SIZE );
+		const int idx = acquire( image, pos / CHUNK_SIZE );
+		if ( idx == -1 )
+			break;
+		if ( slots[idx].len <= inChunk ) {
+			release( idx );
+			break;
+		}
+		const size_t bytes = MIN( len - done, (size_t)( slots[idx].len - inChunk ) );
+		const ssize_t ret = sock_sendAll( sock, slots[idx].data + inChunk, bytes, 10 );
+		release( idx );
+		if ( ret != (ssize_t)bytes )
+			return -1;
+		done += bytes;
+	}
+	return (ssize_t)done;
+}
+
+void bufcache_getStats(uint64_t *size, uint64_t *hitCount, uint64_t *missCount)
+{
+	*size = bufferSize;
+	*hitCount = hits;
+	*missCount = misses;
+}
+
+/**
+ * Get slot holding given chunk of image, reading it from disk if
+ * it's not cached yet, evicting the least recently used chunk.
+ * @return slot index with refs increased, -1 if no slot is available or reading failed
+ */
+static int acquire(dnbd3_image_t *image, uint64_t chunk)
+{
+	mutex_lock( &cacheLock );
+	int idx;
+	for ( idx = hashTable[hashOf( image, chunk )]; idx != -1; idx = slots[idx].hashNext ) {
+		if ( slots[idx].image == image && slots[idx].chunk == chunk )
+			break;
+	}
+	if ( idx != -1 ) {
+		slot_t * const slot = &slots[idx];
+		slot->refs++;
+		while ( slot->state == SLOT_LOADING ) {
+			mutex_cond_wait( &loadedSignal, &cacheLock );
+		}
+		if ( slot->state != SLOT_VALID ) {
+			releaseLocked( idx );
+			mutex_unlock( &cacheLock );
+			return -1;
+		}
+		lruMoveToFront( idx );
+		mutex_unlock( &cacheLock );
+		hits++;
+		return idx;
+	}
+	// Not cached, find least recently used slot that is not in use
+	for ( idx = lruTail; idx != -1 && slots[idx].refs != 0; idx = slots[idx].prev ) { }
+	if ( idx == -1 ) {
+		mutex_unlock( &cacheLock );
+		return -1;
+	}
+	slot_t * const slot = &slots[idx];
+	if ( slot->image != NULL ) {
+		hashRemove( idx );
+	}
+	slot->image = image;
+	slot->chunk = chunk;
+	slot->state = SLOT_LOADING;
+	slot->refs = 1;
+	hashInsert( idx );
+	lruMoveToFront( idx );
+	mutex_unlock( &cacheLock );
+	misses++;
+	ssize_t ret;
+	do {
+		ret = pread( image->directFd, slot->data, CHUNK_SIZE, (off_t)( chunk * CHUNK_SIZE ) );
+	} while ( ret == -1 && errno == EINTR );
+	if ( ret <= 0 ) {
+		logadd( LOG_DEBUG1, "Direct read at %" PRIu64 " from %s failed (errno=%d)", chunk * CHUNK_SIZE, image->path, errno );
+	}
+	mutex_lock( &cacheLock );
+	if ( ret > 0 ) {
+		slot->len = (uint32_t)ret;
+		slot->state = SLOT_VALID;
+	} else {
+		slot->state = SLOT_FAILED;
+	}
+	pthread_cond_broadcast( &loadedSignal );
+	if ( ret <= 0 ) {
+		releaseLocked( idx );
+		idx = -1;
+	}
+	mutex_unlock( &cacheLock );
+	return idx;
+}
+
+static void release(int idx)
+{
+	mutex_lock( &cacheLock );
+	releaseLocked( idx );
+	mutex_unlock( &cacheLock );
+}
+
+static void releaseLocked(int idx)
+{
+	slot_t * const slot = &slots[idx];
+	assert( slot->refs > 0 );
+	if ( --slot->refs == 0 && slot->state == SLOT_FAILED ) {
+		// Don't keep failed reads around, so the next request tries again
+		hashRemove( idx );
+		slot->image = NULL;
+		slot->state = SLOT_EMPTY;
+	}
+}
+
+static uint32_t hashOf(const dnbd3_image_t *image, uint64_t chunk)
+{
+	const uint64_t h = ( (uintptr_t)image >> 6 ) ^ ( chunk * 0x9E3779B97F4A7C15ull );
+	return (uint32_t)( h ^ ( h >> 32 ) ) & hashMask;
+}
+
+static void hashInsert(int idx)
+{
+	const uint32_t bucket = hashOf( slots[idx].image, slots[idx].chunk );
+	slots[idx].hashNext = hashTable[bucket];
+	hashTable[bucket] = idx;
+}
+
+static void hashRemove(int idx)
+{
+	int *p = &hashTable[hashOf( slots[idx].image, slots[idx].chunk )];
+	while ( *p != idx ) {
+		assert( *p != -1 );
+		p = &slots[*p].hashNext;
+	}
+	*p = slots[idx].hashNext;
+	slots[idx].hashNext = -1;
+}
+
+static void lruMoveToFront(int idx)
+{
+	if ( idx == lruHead )
+		return;
+	slot_t * const slot = &slots[idx];
+	// Unlink; slot is not head, so prev != -1
+	slots[slot->prev].next = slot->next;
+	if ( slot->next != -1 ) {
+		slots[slot->next].prev = slot->prev;
+	} else {
+		lruTail = slot->prev;
+	}
+	slot->prev = -1;
+	slot->next = lruHead;
+	slots[lruHead].prev = idx;
+	lruHead = idx;
+}
@@ -0,0 +1,44 @@
+#ifndef _BUFCACHE_H_
+#define _BUFCACHE_H_
+
+#include "globals.h"
+#include <sys/types.h>
+
+/*
+ * Alternative read path for large images: Instead of going through the
+ * kernel's page cache via sendfile, the image is read with O_DIRECT into
+ * a fixed size buffer cache managed by the server, and sent from there.
+ * This keeps memory usage predictable and prevents hundreds of large
+ * images from evicting each other from the page cache.
+ */
+
+void bufcache_init();
+
+void bufcache_shutdown();
+
+/**
+ * Open image for direct I/O if it's large enough.
+ */
+void bufcache_imageOpen(dnbd3_image_t *image);
+
+/**
+ * Drop all cached chunks of image and close its fd. Called when the image gets freed.
+ */
+void bufcache_imageClose(dnbd3_image_t *image);
+
+/**
+ * Send given range of image to sock, using the buffer cache.
+ * Sending might stop early if no buffer is available, or reading
+ * from disk fails, in which case the caller should send the rest
+ * via the usual path.
+ * The caller has to acquire the sendMutex first.
+ * @return number of bytes sent, -1 if sending to the socket failed
+ */
+ssize_t bufcache_send(dnbd3_image_t *image, int sock, uint64_t offset, size_t len);
+
+/**
+ * Get statistics of the buffer cache.
+ */
+void bufcache_getStats(uint64_t *size, uint64_t *hits, uint64_t *misses);
+
+#endif
@@ -0,0 +1,427 @@
+#include "dedup.h"
+
+#include "helper.h"
+#include "locks.h"
+#include "image.h"
+#include "stats.h"
+#include "../shared/fdsignal.h"
+#include "../shared/protocol.h"
+#include "../shared/timing.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#define DEDUP_MAGIC (0x70646564) // "dedp"
+
+typedef struct
+{
+	uint32_t magic;
+	uint32_t blockSize;
+	uint64_t realFilesize;
+} dedup_header_t;
+
+typedef struct
+{
+	uint64_t hash;
+	int source;     // index into image array, -1 = empty
+	uint32_t block;
+} source_entry_t;
+
+typedef struct
+{
+	int id;      // of seeded image
+	int sources; // number of other revisions with block index at that time
+	bool seen;   // still incomplete in current pass
+} seeded_t;
+
+static pthread_t thread;
+static bool haveThread = false;
+static dnbd3_signal_t *workSignal = NULL;
+// Only accessed by dedup thread
+static seeded_t *seeded = NULL;
+static int seededCount = 0;
+
+static void* dedup_main(void *data);
+static void processAll();
+static bool buildIndex(dnbd3_image_t *image);
+static void seedImage(dnbd3_image_t *image);
+static bool needsSeeding(dnbd3_image_t *image, int sources);
+static bool isBlockCached(dnbd3_image_t *image, int block);
+static bool saveIndex(const char *imagePath, const uint64_t *hashes, int count, uint64_t realFilesize);
+static uint64_t hashBlock(const uint8_t *data, size_t len);
+
+void dedup_init()
+{
+	if ( !_dedupIndex )
+		return;
+	workSignal = signal_newBlocking();
+	if ( workSignal == NULL ) {
+		logadd( LOG_WARNING, "Could not create signal for dedup thread" );
+		return;
+	}
+	pthread_attr_t attrs;
+	initThreadAttrs( &attrs, false );
+	haveThread = ( 0 == thread_create( &thread, &attrs, &dedup_main, (void *)NULL ) );
+	if ( !haveThread ) {
+		logadd( LOG_WARNING, "Could not start dedup thread" );
+	}
+	pthread_attr_destroy( &attrs );
+}
+
+void dedup_shutdown()
+{
+	if ( !haveThread )
+		return;
+	logadd( LOG_DEBUG1, "Shutting down dedup thread...\n" );
+	signal_call( workSignal );
+	thread_join( thread, NULL );
+	haveThread = false;
+	logadd( LOG_DEBUG1, "Dedup thread exited normally.\n" );
+}
+
+void dedup_imageOpen(dnbd3_image_t *image)
+{
+	if ( !_dedupIndex || image->realFilesize == 0 )
+		return;
+	const int count = DEDUP_BLOCKS( image->realFilesize );
+	char path[strlen( image->path ) + 7];
+	snprintf( path, sizeof(path), "%s.dedup", image->path );
+	const int fd = open( path, O_RDONLY );
+	if ( fd != -1 ) {
+		dedup_header_t header;
+		uint64_t *hashes = malloc( (size_t)count * sizeof(uint64_t) );
+		const ssize_t len = (ssize_t)( (size_t)count * sizeof(uint64_t) );
+		if ( hashes != NULL && read( fd, &header, sizeof(header) ) == sizeof(header)
+				&& header.magic == DEDUP_MAGIC && header.blockSize == DEDUP_BLOCK_SIZE
+				&& header.realFilesize == image->realFilesize && read( fd, hashes, (size_t)len ) == len ) {
+			mutex_lock( &image->lock );
+			image->blockHashes = hashes;
+			mutex_unlock( &image->lock );
+		} else {
+			logadd( LOG_DEBUG1, "Ignoring invalid block index %s", path );
+			free( hashes );
+		}
+		close( fd );
+	}
+	if ( workSignal != NULL ) {
+		signal_call( workSignal );
+	}
+}
+
+void dedup_imageClose(dnbd3_image_t *image)
+{
+	free( image->blockHashes );
+	image->blockHashes = NULL;
+}
+
+bool dedup_fetchIndex(int sock, const char *imagePath, uint64_t imageSize)
+{
+	const int count = DEDUP_BLOCKS( imageSize );
+	uint64_t *hashes = malloc( (size_t)count * sizeof(uint64_t) );
+	if ( hashes == NULL )
+		return false;
+	int done = 0;
+	while ( done < count ) {
+		uint32_t num = (uint32_t)MIN( count - done, DEDUP_HASHES_PER_REPLY );
+		if ( !dnbd3_get_block_hashes( sock, (uint64_t)done, hashes + done, &num ) || num == 0 )
+			break;
+		done += (int)num;
+	}
+	const bool ok = done == count && saveIndex( imagePath, hashes, count, imageSize );
+	free( hashes );
+	return ok;
+}
+
+static void* dedup_main(void *data UNUSED)
+{
+	setThreadName( "dedup" );
+	blockNoncriticalSignals();
+	while ( !_shutdown ) {
+		processAll();
+		// New images signal us, but rescan now and then for images that just got complete
+		signal_wait( workSignal, SERVER_DEDUP_RESCAN_INTERVAL * 1000 );
+	}
+	free( seeded );
+	return NULL;
+}
+
+/**
+ * Index all complete images that don't have an index yet,
+ * then seed incomplete images from other revisions.
+ */
+static void processAll()
+{
+	dnbd3_image_t *image;
+	for ( int i = 0; !_shutdown && ( image = image_getByIndex( i ) ) != NULL; ++i ) {
+		mutex_lock( &image->lock );
+		const bool needsIndex = image->blockHashes == NULL && image->cache_map == NULL;
+		mutex_unlock( &image->lock );
+		if ( needsIndex ) {
+			buildIndex( image );
+		}
+		image_release( image );
+	}
+	for ( int j = 0; j < seededCount; ++j ) {
+		seeded[j].seen = false;
+	}
+	for ( int i = 0; !_shutdown && ( image = image_getByIndex( i ) ) != NULL; ++i ) {
+		mutex_lock( &image->lock );
+		const bool canSeed = image->blockHashes != NULL && image->cache_map != NULL;
+		mutex_unlock( &image->lock );
+		if ( canSeed ) {
+			seedImage( image );
+		}
+		image_release( image );
+	}
+	if ( _shutdown )
+		return;
+	// Forget about images that got complete or vanished
+	int j = 0;
+	for ( int i = 0; i < seededCount; ++i ) {
+		if ( seeded[i].seen ) {
+			seeded[j++] = seeded[i];
+		}
+	}
+	seededCount = j;
+}
+
+/**
+ * Check whether image should be seeded, given the number of other revisions
+ * with a block index. Only true the first time, and whenever that number grew.
+ */
+static bool needsSeeding(dnbd3_image_t *image, int sources)
+{
+	for ( int i = 0; i < seededCount; ++i ) {
+		if ( seeded[i].id != image->id )
+			continue;
+		seeded[i].seen = true;
+		if ( seeded[i].sources >= sources )
+			return false;
+		seeded[i].sources = sources;
+		return true;
+	}
+	seeded_t *tmp = realloc( seeded, (size_t)( seededCount + 1 ) * sizeof(*seeded) );
+	if ( tmp == NULL )
+		return false;
+	seeded = tmp;
+	seeded[seededCount++] = (seeded_t){ .id = image->id, .sources = sources, .seen = true };
+	return true;
+}
+
+/**
+ * Hash all blocks of given complete image and save the index.
+ */
+static bool buildIndex(dnbd3_image_t *image)
+{
+	if ( !image_ensureOpen( image ) )
+		return false;
+	const int count = DEDUP_BLOCKS( image->realFilesize );
+	uint64_t *hashes = malloc( (size_t)count * sizeof(uint64_t) );
+	uint8_t *buffer = malloc( DEDUP_BLOCK_SIZE );
+	bool ok = hashes != NULL && buffer != NULL;
+	declare_now;
+	ticks start = now;
+	for ( int i = 0; i < count && ok; ++i ) {
+		if ( _shutdown ) {
+			ok = false;
+			break;
+		}
+		const uint64_t offset = (uint64_t)i * DEDUP_BLOCK_SIZE;
+		const size_t len = (size_t)MIN( (uint64_t)DEDUP_BLOCK_SIZE, image->realFilesize - offset );
+		if ( pread( image->readFd, buffer, len, (off_t)offset ) != (ssize_t)len ) {
+			logadd( LOG_WARNING, "Dedup: Cannot read %s for indexing (errno=%d)", image->path, errno );
+			ok = false;
+			break;
+		}
+		hashes[i] = hashBlock( buffer, len );
+	}
+	free( buffer );
+	if ( !ok ) {
+		free( hashes );
+		return false;
+	}
+	saveIndex( image->path, hashes, count, image->realFilesize );
+	mutex_lock( &image->lock );
+	if ( image->blockHashes == NULL ) {
+		image->blockHashes = hashes;
+		hashes = NULL;
+	}
+	mutex_unlock( &image->lock );
+	free( hashes );
+	timing_get( &now );
+	logadd( LOG_DEBUG1, "Dedup: Indexed %s:%d in %ds", image->name, (int)image->rid, (int)timing_diff( &start, &now ) );
+	return true;
+}
+
+/**
+ * Copy all blocks of incomplete image that are cached locally in
+ * another revision of the same image, according to their block index.
+ */
+static void seedImage(dnbd3_image_t *image)
+{
+	int imageCount;
+	dnbd3_image_t **images = image_getRevisionsReferenced( image->name, &imageCount );
+	if ( images == NULL )
+		return;
+	source_entry_t *table = NULL;
+	uint8_t *buffer = NULL;
+	bool locked = false;
+	// Collect full size blocks of other revisions, partial ones at the end won't match anyways
+	int total = 0, sources = 0;
+	for ( int i = 0; i < imageCount; ++i ) {
+		dnbd3_image_t * const src = images[i];
+		if ( src == image || src->blockHashes == NULL )
+			continue;
+		total += (int)( src->realFilesize / DEDUP_BLOCK_SIZE );
+		sources++;
+	}
+	if ( total == 0 || !needsSeeding( image, sources ) )
+		goto cleanup;
+	uint32_t tableSize = 64;
+	while ( tableSize < (uint32_t)total * 2 ) {
+		tableSize *= 2;
+	}
+	table = malloc( tableSize * sizeof(*table) );
+	buffer = malloc( DEDUP_BLOCK_SIZE );
+	if ( table == NULL || buffer == NULL )
+		goto cleanup;
+	for ( uint32_t i = 0; i < tableSize; ++i ) {
+		table[i].source = -1;
+	}
+	for ( int i = 0; i < imageCount; ++i ) {
+		dnbd3_image_t * const src = images[i];
+		if ( src == image || src->blockHashes == NULL )
+			continue;
+		const int blocks = (int)( src->realFilesize / DEDUP_BLOCK_SIZE );
+		for ( int b = 0; b < blocks; ++b ) {
+			if ( !isBlockCached( src, b ) )
+				continue;
+			uint32_t slot = (uint32_t)src->blockHashes[b] & ( tableSize - 1 );
+			while ( table[slot].source != -1 && table[slot].hash != src->blockHashes[b] ) {
+				slot = ( slot + 1 ) & ( tableSize - 1 );
+			}
+			if ( table[slot].source == -1 ) {
+				table[slot].hash = src->blockHashes[b];
+				table[slot].source = i;
+				table[slot].block = (uint32_t)b;
+			}
+		}
+	}
+	const int fd = open( image->path, O_WRONLY );
+	if ( fd == -1 ) {
+		logadd( LOG_WARNING, "Dedup: Cannot open %s for writing (errno=%d)", image->path, errno );
+		goto cleanup;
+	}
+	uint64_t copied = 0;
+	const int blocks = (int)( image->realFilesize / DEDUP_BLOCK_SIZE );
+	// Don't race image_seedWorker() copying into the same revision
+	mutex_lock( &image->seedLock );
+	locked = true;
+	for ( int b = 0; b < blocks && !_shutdown; ++b ) {
+		if ( isBlockCached( image, b ) )
+			continue;
+		uint32_t slot = (uint32_t)image->blockHashes[b] & ( tableSize - 1 );
+		while ( table[slot].source != -1 && table[slot].hash != image->blockHashes[b] ) {
+			slot = ( slot + 1 ) & ( tableSize - 1 );
+		}
+		if ( table[slot].source == -1 )
+			continue;
+		dnbd3_image_t * const src = images[table[slot].source];
+		const off_t srcOffset = (off_t)table[slot].block * DEDUP_BLOCK_SIZE;
+		const off_t dstOffset = (off_t)b * DEDUP_BLOCK_SIZE;
+		if ( !image_ensureOpen( src )
+				|| pread( src->readFd, buffer, DEDUP_BLOCK_SIZE, srcOffset ) != DEDUP_BLOCK_SIZE
+				|| hashBlock( buffer, DEDUP_BLOCK_SIZE ) != image->blockHashes[b] )
+			continue; // Source changed or is damaged, leave it to the uplink
+		if ( pwrite( fd, buffer, DEDUP_BLOCK_SIZE, dstOffset ) != DEDUP_BLOCK_SIZE ) {
+			logadd( LOG_WARNING, "Dedup: Writing to %s failed (errno=%d)", image->path, errno );
+			break;
+		}
+		image_updateCachemap( image, (uint64_t)dstOffset, (uint64_t)dstOffset + DEDUP_BLOCK_SIZE, true );
+		copied += DEDUP_BLOCK_SIZE;
+	}
+	close( fd );
+	if ( copied != 0 ) {
+		stats_add( STATS_DEDUP_BYTES, copied );
+		logadd( LOG_INFO, "Dedup: Copied %" PRIu64 " MiB of %s:%d from other local revisions",
+				copied / ( 1024 * 1024 ), image->name, (int)image->rid );
+	}
+cleanup:
+	if ( locked ) {
+		mutex_unlock( &image->seedLock );
+	}
+	for ( int i = 0; i < imageCount; ++i ) {
+		image_release( images[i] );
+	}
+	free( images );
+	free( table );
+	free( buffer );
+}
+
+static bool isBlockCached(dnbd3_image_t *image, int block)
+{
+	// 16 blocks of 4k per byte pair in cache map
+	const size_t idx = (size_t)block * ( DEDUP_BLOCK_SIZE / DNBD3_BLOCK_SIZE / 8 );
+	bool cached = true;
+	mutex_lock( &image->lock );
+	if ( image->cache_map != NULL ) {
+		cached = image->cache_map[idx] == 0xff && image->cache_map[idx + 1] == 0xff;
+	}
+	mutex_unlock( &image->lock );
+	return cached;
+}
+
+static bool saveIndex(const char *imagePath, const uint64_t *hashes, int count, uint64_t realFilesize)
+{
+	char path[strlen( imagePath ) + 7];
+	snprintf( path, sizeof(path), "%s.dedup", imagePath );
+	const int fd = open( path, O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+	if ( fd == -1 ) {
+		logadd( LOG_DEBUG1, "Cannot write %s (errno=%d)", path, errno );
+		return false;
+	}
+	const dedup_header_t header = {
+		.magic = DEDUP_MAGIC,
+		.blockSize = DEDUP_BLOCK_SIZE,
+		.realFilesize = realFilesize,
+	};
+	const ssize_t len = (ssize_t)( (size_t)count * sizeof(uint64_t) );
+	const bool ok = write( fd, &header, sizeof(header) ) == sizeof(header)
+			&& write( fd, hashes, (size_t)len ) == len;
+	close( fd );
+	if ( !ok ) {
+		logadd( LOG_DEBUG1, "Cannot write %s (errno=%d)", path, errno );
+		unlink( path );
+	}
+	return ok;
+}
+
+/**
+ * Fast 64 bit hash over block contents. Not cryptographically secure,
+ * but matches get verified via the image's CRC32 list afterwards.
+ */
+static uint64_t hashBlock(const uint8_t *data, size_t len)
+{
+	uint64_t h = 0x9E3779B97F4A7C15ull ^ len;
+	size_t i;
+	for ( i = 0; i + 8 <= len; i += 8 ) {
+		uint64_t w;
+		memcpy( &w, data + i, sizeof(w) );
+		h ^= w * 0xC2B2AE3D27D4EB4Full;
+		h = ( ( h << 31 ) | ( h >> 33 ) ) * 0x9E3779B97F4A7C15ull;
+	}
+	for ( ; i < len; ++i ) {
+		h = ( h ^ data[i] ) * 0x100000001B3ull;
+	}
+	h ^= h >> 33;
+	h *= 0xFF51AFD7ED558CCDull;
+	h ^= h >> 33;
+	h *= 0xC4CEB9FE1A85EC53ull;
+	h ^= h >> 33;
+	return h;
+}
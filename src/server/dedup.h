@@ -0,0 +1,44 @@
+#ifndef _DEDUP_H_
+#define _DEDUP_H_
+
+#include "globals.h"
+
+/*
+ * Content addressed block index: For every DEDUP_BLOCK_SIZE bytes of an
+ * image, a 64 bit hash of its contents is kept in <image>.dedup.
+ * Complete images get indexed in the background. When a proxy clones a
+ * new revision, it fetches the index from upstream along with the CRC
+ * list, then copies all blocks whose contents are available in another
+ * local revision of the same image instead of requesting them from the
+ * uplink. Copied blocks are still verified by the usual CRC32 check
+ * once their hash block is complete.
+ */
+
+#define DEDUP_BLOCK_SIZE (64 * 1024)
+#define DEDUP_BLOCKS(size) ( (int)( ( (size) + DEDUP_BLOCK_SIZE - 1 ) / DEDUP_BLOCK_SIZE ) )
+// Max number of hashes sent in reply to one CMD_GET_BLOCK_HASHES
+#define DEDUP_HASHES_PER_REPLY (64 * 1024)
+
+void dedup_init();
+
+void dedup_shutdown();
+
+/**
+ * Load block index of image that was just added to the
+ * image list, or queue it for indexing if there is none.
+ */
+void dedup_imageOpen(dnbd3_image_t *image);
+
+/**
+ * Free block index of image. Called when the image gets freed.
+ */
+void dedup_imageClose(dnbd3_image_t *image);
+
+/**
+ * Fetch block index of the image selected on sock from the
+ * remote server and write it to disk for the given local image.
+ * @return true if the complete index was received
+ */
+bool dedup_fetchIndex(int sock, const char *imagePath, uint64_t imageSize);
+
+#endif
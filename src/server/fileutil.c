@@ -10,6 +10,12 @@
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/statvfs.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+
+#define COPY_BUFFER_SIZE (1024 * 1024)
 
 bool file_isReadable(char *file)
 {
@@ -73,6 +79,50 @@ bool file_setSize(int fd, uint64_t size)
 	return false;
 }
 
+/**
+ * Copy len bytes from one file to another, possibly at a different offset.
+ * Tries to share the data via reflink first, which is almost free on btrfs
+ * and XFS, then copy_file_range, which at least keeps the data in the kernel,
+ * and finally falls back to reading and writing.
+ */
+bool file_copyRange(int fdIn, uint64_t inOffset, int fdOut, uint64_t outOffset, uint64_t len)
+{
+#ifdef __linux__
+#ifdef FICLONERANGE
+	// Only works for ranges aligned to the file system's block size, except at EOF
+	struct file_clone_range fcr = {
+		.src_fd = fdIn,
+		.src_offset = inOffset,
+		.src_length = len,
+		.dest_offset = outOffset,
+	};
+	if ( ioctl( fdOut, FICLONERANGE, &fcr ) == 0 ) return true;
+#endif
+	while ( len > 0 ) {
+		loff_t in = (loff_t)inOffset, out = (loff_t)outOffset;
+		const ssize_t ret = copy_file_range( fdIn, &in, fdOut, &out, len, 0 );
+		if ( ret == -1 && errno == EINTR ) continue;
+		if ( ret <= 0 ) break; // Not supported for these files, or EOF; let the fallback sort it out
+		inOffset += (uint64_t)ret;
+		outOffset += (uint64_t)ret;
+		len -= (uint64_t)ret;
+	}
+	if ( len == 0 ) return true;
+#endif
+	uint8_t *buffer = malloc( (size_t)MIN( (uint64_t)COPY_BUFFER_SIZE, len ) );
+	if ( buffer == NULL ) return false;
+	while ( len > 0 ) {
+		const size_t chunk = (size_t)MIN( (uint64_t)COPY_BUFFER_SIZE, len );
+		const ssize_t ret = pread( fdIn, buffer, chunk, (off_t)inOffset );
+		if ( ret <= 0 || pwrite( fdOut, buffer, (size_t)ret, (off_t)outOffset ) != ret ) break;
+		inOffset += (uint64_t)ret;
+		outOffset += (uint64_t)ret;
+		len -= (uint64_t)ret;
+	}
+	free( buffer );
+	return len == 0;
+}
+
 bool file_freeDiskSpace(const char * const path, uint64_t *total, uint64_t *avail)
 {
 	struct statvfs fiData;
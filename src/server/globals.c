@@ -8,12 +8,15 @@
 #include <limits.h>
 #include <sys/resource.h>
 #include <errno.h>
+#include <unistd.h>
 
 char *_configDir = NULL;
 atomic_bool _shutdown = false;
 // [dnbd3]
 atomic_int _listenPort = PORT;
 char *_basePath = NULL;
+char *_ssdCachePath = NULL;
+char *_imageIndexFile = NULL;
 atomic_int _serverPenalty = 0;
 atomic_int _clientPenalty = 0;
 atomic_bool _isProxy = false;
@@ -26,14 +29,28 @@ atomic_int _uplinkTimeout = SOCKET_TIMEOUT_UPLINK;
 atomic_int _clientTimeout = SOCKET_TIMEOUT_CLIENT;
 atomic_bool _closeUnusedFd = false;
 atomic_bool _vmdkLegacyMode = false;
+atomic_bool _dedupIndex = false;
+atomic_bool _watchImages = false;
 // Not really needed anymore since we have '+' and '-' in alt-servers
 atomic_bool _proxyPrivateOnly = false;
 // [limits]
 atomic_int _maxClients = SERVER_MAX_CLIENTS;
 atomic_int _maxImages = SERVER_MAX_IMAGES;
 atomic_int _maxPayload = 9000000; // 9MB
+atomic_int _minThreads = 8;
+atomic_int _maxThreads = 0; // 0 = derive from maxClients
+atomic_int _maxQueuedJobs = 100;
+atomic_int _threadStackSize = 256 * 1024;
 atomic_uint_fast64_t _maxReplicationSize = (uint64_t)100000000000LL;
 atomic_bool _pretendClient = false;
+atomic_int _lockProfileRate = 0;
+atomic_int _ssdCacheMinHits = 3;
+atomic_uint_fast64_t _ssdCacheMaxSize = 0;
+atomic_uint_fast64_t _warmupSize = 0;
+atomic_uint_fast64_t _warmupLockSize = 0;
+atomic_uint_fast64_t _readaheadSize = 0;
+atomic_uint_fast64_t _directIoCacheSize = 0;
+atomic_uint_fast64_t _directIoMinSize = (uint64_t)4 * 1024 * 1024 * 1024;
 
 /**
  * True when loading config the first time. Consecutive loads will
@@ -64,10 +81,22 @@ static int ini_handler(void *custom UNUSED, const char* section, const char* key
 {
 	if ( initialLoad ) {
 		if ( _basePath == NULL ) SAVE_TO_VAR_STR( dnbd3, basePath );
+		SAVE_TO_VAR_STR( dnbd3, ssdCachePath );
+		SAVE_TO_VAR_STR( dnbd3, imageIndexFile );
 		SAVE_TO_VAR_BOOL( dnbd3, vmdkLegacyMode );
+		SAVE_TO_VAR_BOOL( dnbd3, dedupIndex );
+		SAVE_TO_VAR_BOOL( dnbd3, watchImages );
 		SAVE_TO_VAR_UINT( dnbd3, listenPort );
 		SAVE_TO_VAR_UINT( limits, maxClients );
 		SAVE_TO_VAR_UINT( limits, maxImages );
+		SAVE_TO_VAR_UINT( limits, minThreads );
+		SAVE_TO_VAR_UINT( limits, maxThreads );
+		SAVE_TO_VAR_UINT( limits, maxQueuedJobs );
+		SAVE_TO_VAR_UINT( limits, threadStackSize );
+		SAVE_TO_VAR_UINT64( limits, warmupSize );
+		SAVE_TO_VAR_UINT64( limits, directIoCacheSize );
+		SAVE_TO_VAR_UINT64( limits, directIoMinSize );
+		SAVE_TO_VAR_UINT64( limits, warmupLockSize );
 	}
 	SAVE_TO_VAR_BOOL( dnbd3, isProxy );
 	SAVE_TO_VAR_BOOL( dnbd3, proxyPrivateOnly );
@@ -83,6 +112,10 @@ static int ini_handler(void *custom UNUSED, const char* section, const char* key
 	SAVE_TO_VAR_UINT( limits, maxPayload );
 	SAVE_TO_VAR_UINT64( limits, maxReplicationSize );
 	SAVE_TO_VAR_BOOL( dnbd3, pretendClient );
+	SAVE_TO_VAR_UINT( dnbd3, lockProfileRate );
+	SAVE_TO_VAR_UINT( dnbd3, ssdCacheMinHits );
+	SAVE_TO_VAR_UINT64( limits, ssdCacheMaxSize );
+	SAVE_TO_VAR_UINT64( limits, readaheadSize );
 	if ( strcmp( section, "dnbd3" ) == 0 && strcmp( key, "backgroundReplication" ) == 0 ) {
 		if ( strcmp( value, "hashblock" ) == 0 ) {
 			_backgroundReplication = BGR_HASHBLOCK;
@@ -153,6 +186,27 @@ static void sanitizeFixedConfig()
 			*end-- = '\0';
 		}
 	}
+	// SSD cache tier, same rules as basePath, but missing means disabled
+	if ( _ssdCachePath != NULL && ( _ssdCachePath[0] != '/' || _ssdCachePath[1] == '\0' ) ) {
+		if ( _ssdCachePath[0] != '\0' ) {
+			logadd( LOG_WARNING, "ssdCachePath must be absolute and not /, disabling SSD cache" );
+		}
+		free( _ssdCachePath );
+		_ssdCachePath = NULL;
+	} else if ( _ssdCachePath != NULL ) {
+		char *end = _ssdCachePath + strlen( _ssdCachePath ) - 1;
+		while ( end > _ssdCachePath && *end == '/' ) {
+			*end-- = '\0';
+		}
+	}
+	// Image index, has to be an absolute path, missing means disabled
+	if ( _imageIndexFile != NULL && _imageIndexFile[0] != '/' ) {
+		if ( _imageIndexFile[0] != '\0' ) {
+			logadd( LOG_WARNING, "imageIndexFile must be an absolute path, disabling image index" );
+		}
+		free( _imageIndexFile );
+		_imageIndexFile = NULL;
+	}
 	// listen port
 	if ( _listenPort < 1 || _listenPort > 65535 ) {
 		logadd( LOG_ERROR, "listenPort must be 1-65535, but is %d", _listenPort );
@@ -161,6 +215,19 @@ static void sanitizeFixedConfig()
 	// Cap to hard limit
 	if ( _maxClients > SERVER_MAX_CLIENTS ) _maxClients = SERVER_MAX_CLIENTS;
 	if ( _maxImages > SERVER_MAX_IMAGES ) _maxImages = SERVER_MAX_IMAGES;
+	// Thread pool: Every client occupies one thread, plus some for RPC and housekeeping
+	if ( _maxThreads == 0 ) _maxThreads = _maxClients + 50;
+	if ( _maxThreads < 4 ) _maxThreads = 4;
+	if ( _minThreads > _maxThreads ) _minThreads = _maxThreads;
+	if ( _maxQueuedJobs < 1 ) _maxQueuedJobs = 1;
+	// Thread stack size: 0 = libc default, otherwise round up to page size
+	if ( _threadStackSize != 0 ) {
+		const long pageSize = sysconf( _SC_PAGESIZE );
+		if ( _threadStackSize < SERVER_THREAD_STACK_MIN ) _threadStackSize = SERVER_THREAD_STACK_MIN;
+		if ( pageSize > 0 ) {
+			_threadStackSize = (int)( ( ( _threadStackSize + pageSize - 1 ) / pageSize ) * pageSize );
+		}
+	}
 	// Consider rlimits
 	struct rlimit limit;
 	if ( getrlimit( RLIMIT_NOFILE, &limit ) != 0 ) {
@@ -300,6 +367,13 @@ size_t globals_dumpConfig(char *buffer, size_t size)
 	P_ARG("[dnbd3]\n");
 	PINT(listenPort);
 	PSTR(basePath);
+	if ( _ssdCachePath != NULL ) {
+		PSTR(ssdCachePath);
+		PINT(ssdCacheMinHits);
+	}
+	if ( _imageIndexFile != NULL ) {
+		PSTR(imageIndexFile);
+	}
 	PINT(serverPenalty);
 	PINT(clientPenalty);
 	PBOOL(isProxy);
@@ -316,13 +390,26 @@ size_t globals_dumpConfig(char *buffer, size_t size)
 	PINT(clientTimeout);
 	PBOOL(closeUnusedFd);
 	PBOOL(vmdkLegacyMode);
+	PBOOL(dedupIndex);
+	PBOOL(watchImages);
 	PBOOL(proxyPrivateOnly);
 	PBOOL(pretendClient);
+	PINT(lockProfileRate);
 	P_ARG("[limits]\n");
 	PINT(maxClients);
 	PINT(maxImages);
 	PINT(maxPayload);
+	PINT(minThreads);
+	PINT(maxThreads);
+	PINT(maxQueuedJobs);
+	PINT(threadStackSize);
 	PUINT64(maxReplicationSize);
+	PUINT64(ssdCacheMaxSize);
+	PUINT64(warmupSize);
+	PUINT64(warmupLockSize);
+	PUINT64(readaheadSize);
+	PUINT64(directIoCacheSize);
+	PUINT64(directIoMinSize);
 	return size - rem;
 }
 
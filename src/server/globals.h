@@ -16,6 +16,7 @@ typedef struct timespec ticks;
 typedef struct _dnbd3_connection dnbd3_connection_t;
 typedef struct _dnbd3_image dnbd3_image_t;
 typedef struct _dnbd3_client dnbd3_client_t;
+struct _dnbd3_ssdcache;
 
 // Slot is free, can be used.
 // Must only be set in uplink_handle_receive() or uplink_remove_client()
@@ -24,9 +25,10 @@ typedef struct _dnbd3_client dnbd3_client_t;
 // Must only be set in uplink_request()
 #define ULR_NEW 1
 // Slot is occupied, reply has not yet been received, matching request can safely rely on reuse.
-// Must only be set in uplink_mainloop() or uplink_request()
+// Must only be set in uplink_process() or uplink_request()
 #define ULR_PENDING 2
-// Slot is being processed, do not consider for hop on.
+// Slot is being processed, do not consider for hop on. The client is still in use
+// until the slot is freed, so uplink_removeClient() waits for that.
 // Must only be set in uplink_handle_receive()
 #define ULR_PROCESSING 3
 typedef struct
@@ -34,6 +36,8 @@ typedef struct
 	uint64_t handle;  // Client defined handle to pass back in reply
 	uint64_t from;    // First byte offset of requested block (ie. 4096)
 	uint64_t to;      // Last byte + 1 of requested block (ie. 8192, if request len is 4096, resulting in bytes 4096-8191)
+	uint32_t localHead; // Bytes right before from the client asked for too, which are already cached locally
+	uint32_t localTail; // Same for bytes right after to
 	dnbd3_client_t * client; // Client to send reply to
 	int status;      // status of this entry: ULR_*
 #ifdef _DEBUG
@@ -47,34 +51,66 @@ typedef struct
 #define RTT_DONTCHANGE 2 // Finished, but no better alternative found
 #define RTT_DOCHANGE 3 // Finished, better alternative written to .betterServer + .betterFd
 #define RTT_NOT_REACHABLE 4 // No uplink was reachable
+/*
+ * The following structs are grouped by access pattern, and groups that are
+ * written frequently by different threads start on their own cache line.
+ * Allocate with callocCacheAligned() so the alignment actually holds.
+ */
 struct _dnbd3_connection
 {
-	int fd;                     // socket fd to remote server
-	int version;                // remote server protocol version
-	dnbd3_signal_t* signal;     // used to wake up the process
-	pthread_t thread;           // thread holding the connection
-	pthread_mutex_t sendMutex;  // For locking socket while sending
-	pthread_mutex_t queueLock;  // lock for synchronization on request queue etc.
+	// Read-mostly, also read by client threads
 	dnbd3_image_t *image;       // image that this uplink is used for; do not call get/release for this pointer
+	dnbd3_signal_t* signal;     // used to wake up the reactor thread for this uplink
+	struct _uplink_reactor *reactor; // reactor thread handling this uplink
 	dnbd3_host_t currentServer; // Current server we're connected to
+	int version;                // remote server protocol version
+	volatile bool shutdown;     // signal this uplink to stop, must only be set from uplink_shutdown() or uplink_detach()
+	// Request queue, written by client threads and the reactor thread
+	_Alignas(CACHE_LINE_SIZE)
+	pthread_mutex_t queueLock;  // lock for synchronization on request queue etc.
+	dnbd3_queued_request_t *queue; // Might be realloc'd by uplink_request() - only hold pointers into it while holding queueLock
+	pthread_cond_t relayDone;   // signalled with queueLock held when a ULR_PROCESSING request was sent, see uplink_removeClient()
+	int queueLen;               // length of queue
+	int queueCapacity;          // allocated length of queue, at most SERVER_MAX_UPLINK_QUEUE
+	// Socket, used by client threads for direct requests
+	_Alignas(CACHE_LINE_SIZE)
+	pthread_mutex_t sendMutex;  // For locking socket while sending
+	int fd;                     // socket fd to remote server, might be the socket of session
+	struct _uplink_session *session; // shared connection this uplink uses, NULL if it has its own; set with sendMutex held
+	// Owned by reactor thread
+	_Alignas(CACHE_LINE_SIZE)
+	dnbd3_connection_t *next;   // next uplink in list of reactor
+	int watchedFd;              // socket fd the reactor is currently watching, -1 if none
+	int revents;                // events not yet processed by uplink_process()
+	bool detached;              // uplink_detach() was called, will be freed soon
+	bool busy;                  // a job uses the connection right now, see uplink_dispatch()
+	bool saving;                // a job is saving the cache map
+	bool saved;                 // cache map was saved after detaching, can be freed
+	int slot;                   // image slot on shared connection, see DNBD3_HANDLE_SLOT
+	uint64_t handleBits;        // slot and generation of slot, ORed into handles of all requests
+	bool noSession;             // remote server refused image on shared connection, use own connection
+	int cacheFd;                // used to write to the image, in case it is relayed. Only used by the reactor thread and the job receiving for the uplink
+	uint32_t recvBufferLen;     // Len of recvBuffer
+	uint8_t *recvBuffer;        // Buffer for receiving payload, only held while receiving, see uplink_handleReceive()
+	atomic_uint_fast64_t bytesReceived; // Number of bytes received by the uplink since startup.
+	uint64_t replicationHandle; // Handle of pending replication request
+	int nextReplicationIndex;   // Which index in the cache map we should start looking for incomplete blocks at
+	                            // If BGR == BGR_HASHBLOCK, -1 means "currently no incomplete block"
+	uint32_t idleTime;          // How many seconds the uplink was idle (apart from keep-alives)
+	uint32_t unsavedSeconds;    // Seconds since cache map was last saved
+	uint32_t discoverFailCount; // Number of RTT measurements in a row that found no server
+	int altCheckInterval;       // Seconds between RTT measurements, grows over time
+	ticks nextAltCheck;         // When to do the next RTT measurement
+	ticks lastKeepalive;        // Last time periodic housekeeping ran
+	bool replicatedLastBlock;   // bool telling if the last block has been replicated yet
+	// RTT measurement, shared with altservers thread
+	_Alignas(CACHE_LINE_SIZE)
 	pthread_mutex_t rttLock;    // When accessing rttTestResult, betterFd or betterServer
 	int rttTestResult;          // RTT_*
-	int cacheFd;                // used to write to the image, in case it is relayed. ONLY USE FROM UPLINK THREAD!
 	int betterVersion;          // protocol version of better server
 	int betterFd;               // Active connection to better server, ready to use
 	dnbd3_host_t betterServer;  // The better server
-	uint8_t *recvBuffer;        // Buffer for receiving payload
-	uint32_t recvBufferLen;     // Len of ^^
-	volatile bool shutdown;     // signal this thread to stop, must only be set from uplink_shutdown() or cleanup in uplink_mainloop()
-	bool replicatedLastBlock;   // bool telling if the last block has been replicated yet
 	bool cycleDetected;         // connection cycle between proxies detected for current remote server
-	int nextReplicationIndex;   // Which index in the cache map we should start looking for incomplete blocks at
-	                            // If BGR == BGR_HASHBLOCK, -1 means "currently no incomplete block"
-	uint64_t replicationHandle; // Handle of pending replication request
-	atomic_uint_fast64_t bytesReceived; // Number of bytes received by the uplink since startup.
-	int queueLen;               // length of queue
-	uint32_t idleTime;          // How many seconds the uplink was idle (apart from keep-alives)
-	dnbd3_queued_request_t queue[SERVER_MAX_UPLINK_QUEUE];
 };
 
 typedef struct
@@ -104,37 +140,55 @@ typedef struct
  */
 struct _dnbd3_image
 {
+	// Read-mostly, used on every client request
 	char *path;            // absolute path of the image
 	char *name;            // public name of the image (usually relative path minus revision ID)
 	dnbd3_connection_t *uplink; // pointer to a server connection
 	uint8_t *cache_map;    // cache map telling which parts are locally cached, NULL if complete
 	uint64_t virtualFilesize;   // virtual size of image (real size rounded up to multiple of 4k)
 	uint64_t realFilesize;      // actual file size on disk
-	ticks atime;                // last access time
-	ticks lastWorkCheck;   // last time a non-working image has been checked
-	ticks nextCompletenessEstimate; // next time the completeness estimate should be updated
 	uint32_t *crc32;       // list of crc32 checksums for each 16MiB block in image
 	uint32_t masterCrc32;  // CRC-32 of the crc-32 list
+	bool crc32Deferred;    // crc32 not in memory (yet) but on disk, see image_ensureCrcList
 	int readFd;            // used to read the image. Used from multiple threads, so use atomic operations (pread et al)
-	int completenessEstimate; // Completeness estimate in percent
-	int users;             // clients currently using this image
+	int directFd;          // opened with O_DIRECT for the buffer cache, -1 if image is read via page cache only
+	struct _dnbd3_ssdcache *ssd; // copies of hot hash blocks on SSD, NULL if SSD cache is disabled
+	atomic_uint_least16_t *heat; // client visits per hash block, for cache warming; NULL if disabled
+	uint64_t *blockHashes; // content hash per 64k block for deduplication, NULL if not known (yet)
 	int id;                // Unique ID of this image. Only unique in the context of this running instance of DNBD3-Server
-	bool working;          // true if image exists and completeness is == 100% or a working upstream proxy is connected
 	uint16_t rid;          // revision of image
+	bool working;          // true if image exists and completeness is == 100% or a working upstream proxy is connected
+	// Written now and then by housekeeping
+	int completenessEstimate; // Completeness estimate in percent
+	ticks lastWorkCheck;   // last time a non-working image has been checked
+	ticks nextCompletenessEstimate; // next time the completeness estimate should be updated
+	pthread_mutex_t seedLock;   // held while copying blocks from other local revisions into this one
+	// Written whenever clients come and go, or request uncached blocks
+	_Alignas(CACHE_LINE_SIZE)
 	pthread_mutex_t lock;
+	ticks atime;                // last access time
+	int users;             // clients currently using this image
+	bool retired;          // not referenced by any image list snapshot anymore, free once users reaches 0
+	struct _dnbd3_image *nextFree; // next image waiting for image_freeRetired()
 };
 
 struct _dnbd3_client
 {
 #define HOSTNAMELEN (48)
-	atomic_uint_fast64_t bytesSent;   // Byte counter for this client.
+	// Read-mostly, set up during handshake
 	dnbd3_image_t *image;             // Image in use by this client, or NULL during handshake
 	int sock;
+	int listSlot;                     // Position in client list, see net.c
 	bool isServer;                    // true if a server in proxy mode, false if real client
 	dnbd3_host_t host;
 	char hostName[HOSTNAMELEN];       // inet_ntop version of host
-	pthread_mutex_t sendMutex;        // Held while writing to sock if image is incomplete (since uplink uses socket too)
 	pthread_mutex_t lock;
+	// Written on every request by the client's thread and by uplink threads
+	_Alignas(CACHE_LINE_SIZE)
+	pthread_mutex_t sendMutex;        // Held while writing to sock if image is incomplete (since uplink uses socket too)
+	bool streaming;                   // uplink is relaying a reply piece by piece, see net_lockSend(); set with sendMutex held
+	pthread_cond_t streamDone;        // signalled with sendMutex held when streaming is cleared
+	atomic_uint_fast64_t bytesSent;   // Byte counter for this client.
 };
 
 // #######################################################
@@ -150,11 +204,37 @@ extern char *_configDir;
  */
 extern char *_basePath;
 
+/**
+ * Directory on fast local storage (SSD) where copies of frequently
+ * read hash blocks are kept. NULL if the SSD cache tier is disabled.
+ * Will never have a trailing slash.
+ */
+extern char *_ssdCachePath;
+
+/**
+ * File to persist metadata of loaded images in, so unchanged
+ * images can be loaded without any checks on startup.
+ * NULL if disabled.
+ */
+extern char *_imageIndexFile;
+
 /**
  * Whether or not simple *.vmdk files should be treated as revision 1
  */
 extern atomic_bool _vmdkLegacyMode;
 
+/**
+ * Keep a content hash per 64k block of every image, so proxies
+ * can copy unchanged blocks from older local revisions.
+ */
+extern atomic_bool _dedupIndex;
+
+/**
+ * Watch basePath for new, changed and deleted images
+ * instead of relying on SIGHUP to pick them up.
+ */
+extern atomic_bool _watchImages;
+
 /**
  * How much artificial delay should we add when a server connects to us?
  */
@@ -259,6 +339,30 @@ extern atomic_int _maxImages;
  */
 extern atomic_int _maxPayload;
 
+/**
+ * Number of worker threads to spawn at startup. The thread pool
+ * will not shrink below this number.
+ */
+extern atomic_int _minThreads;
+
+/**
+ * Max number of threads in the thread pool. Every connected client
+ * occupies one thread.
+ */
+extern atomic_int _maxThreads;
+
+/**
+ * Max number of jobs (e.g. new connections) waiting for a pool
+ * thread once maxThreads has been reached. Further jobs get rejected.
+ */
+extern atomic_int _maxQueuedJobs;
+
+/**
+ * Stack size of server threads (pool/clients, uplinks, ...).
+ * 0 means use the libc default, which is usually 8MiB.
+ */
+extern atomic_int _threadStackSize;
+
 /**
  * If in proxy mode, don't replicate images that are
  * larger than this according to the uplink server.
@@ -272,6 +376,55 @@ extern atomic_uint_fast64_t _maxReplicationSize;
  */
 extern atomic_bool _pretendClient;
 
+/**
+ * Number of times a hash block has to be visited by a client
+ * before it gets copied to the SSD cache tier.
+ */
+extern atomic_int _ssdCacheMinHits;
+
+/**
+ * Maximum number of bytes to store in the SSD cache tier.
+ * 0 = only limited by free space.
+ */
+extern atomic_uint_fast64_t _ssdCacheMaxSize;
+
+/**
+ * After startup, read this many bytes of the most frequently
+ * accessed hash blocks into the page cache. 0 = disabled.
+ */
+extern atomic_uint_fast64_t _warmupSize;
+
+/**
+ * Additionally pin this many bytes of the hottest hash blocks
+ * in memory via mmap + mlock. 0 = disabled.
+ */
+extern atomic_uint_fast64_t _warmupLockSize;
+
+/**
+ * Maximum readahead window per sequentially reading client.
+ * The server tells the kernel about upcoming reads itself, since
+ * the kernel's readahead state is shared by all clients of an image.
+ * 0 = disabled.
+ */
+extern atomic_uint_fast64_t _readaheadSize;
+
+/**
+ * Size of buffer cache for images read via O_DIRECT. 0 = disabled,
+ * all images are served from the kernel's page cache.
+ */
+extern atomic_uint_fast64_t _directIoCacheSize;
+
+/**
+ * Only images of at least this size are read via O_DIRECT.
+ */
+extern atomic_uint_fast64_t _directIoMinSize;
+
+/**
+ * Sample every n-th lock acquisition per thread for the
+ * contention profiler (release builds only). 0 = off.
+ */
+extern atomic_int _lockProfileRate;
+
 /**
  * Load the server configuration.
  */
@@ -144,3 +144,24 @@ void blockNoncriticalSignals()
 	pthread_sigmask( SIG_BLOCK, &sigmask, NULL );
 }
 
+
+/**
+ * Initialize attributes for a new server thread, using the
+ * configured stack size and a guard area below the stack that
+ * is larger than any stack frame we create, so an overflow
+ * will reliably crash instead of silently corrupting memory.
+ */
+void initThreadAttrs(pthread_attr_t *attr, bool detached)
+{
+	pthread_attr_init( attr );
+	if ( detached ) {
+		pthread_attr_setdetachstate( attr, PTHREAD_CREATE_DETACHED );
+	}
+	if ( _threadStackSize > 0 ) {
+		const int ret = pthread_attr_setstacksize( attr, (size_t)_threadStackSize );
+		if ( ret != 0 ) {
+			logadd( LOG_WARNING, "Cannot set thread stack size to %d (error %d)", (int)_threadStackSize, ret );
+		}
+	}
+	pthread_attr_setguardsize( attr, SERVER_THREAD_GUARD_SIZE );
+}
@@ -7,6 +7,8 @@
 #include <netinet/in.h>
 #include <string.h>
 #include <unistd.h>
+#include <stdlib.h>
+#include <pthread.h>
 
 bool parse_address(char *string, dnbd3_host_t *host);
 bool host_to_string(const dnbd3_host_t *host, char *target, size_t targetlen);
@@ -14,6 +16,7 @@ void remove_trailing_slash(char *string);
 void trim_right(char * const string);
 void setThreadName(const char *name);
 void blockNoncriticalSignals();
+void initThreadAttrs(pthread_attr_t *attr, bool detached);
 
 static inline bool isSameAddress(const dnbd3_host_t * const a, const dnbd3_host_t * const b)
 {
@@ -25,6 +28,19 @@ static inline bool isSameAddressPort(const dnbd3_host_t * const a, const dnbd3_h
 	return (a->type == b->type) && (a->port == b->port) && (0 == memcmp( a->addr, b->addr, (a->type == HOST_IP4 ? 4 : 16) ));
 }
 
+/**
+ * Allocate zeroed memory that starts on a cache line boundary.
+ * Use for structs that align members to CACHE_LINE_SIZE.
+ * Free with plain free().
+ */
+static inline void* callocCacheAligned(size_t size)
+{
+	void *ptr;
+	size = ( size + CACHE_LINE_SIZE - 1 ) & ~(size_t)( CACHE_LINE_SIZE - 1 );
+	if ( posix_memalign( &ptr, CACHE_LINE_SIZE, size ) != 0 ) return NULL;
+	return memset( ptr, 0, size );
+}
+
 /**
  * Test whether string ends in suffix.
  * @return true if string =~ /suffix$/
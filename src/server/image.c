@@ -5,6 +5,12 @@
 #include "locks.h"
 #include "integrity.h"
 #include "altservers.h"
+#include "ssdcache.h"
+#include "warmup.h"
+#include "bufcache.h"
+#include "dedup.h"
+#include "imageindex.h"
+#include "threadpool.h"
 #include "../shared/protocol.h"
 #include "../shared/timing.h"
 #include "../shared/crc32.h"
@@ -15,19 +21,45 @@
 #include <dirent.h>
 #include <inttypes.h>
 #include <glob.h>
-#include <jansson.h>
+#include <sched.h>
 
 #define PATHLEN (2000)
 #define NONWORKING_RECHECK_INTERVAL_SECONDS (60)
 
 // ##########################################
 
-static dnbd3_image_t *_images[SERVER_MAX_IMAGES];
-static int _num_images = 0;
-
+/**
+ * Immutable snapshot of the image list. Readers grab the current one
+ * via imagelist_acquire() and iterate without any lock; writers build
+ * a new array and swap it in. Every snapshot holds a reference to its
+ * successor, so a snapshot is only freed after all older ones are gone.
+ * Images removed from the list are attached to the last snapshot that
+ * contained them and can only be freed after that snapshot died.
+ */
+typedef struct _imagelist
+{
+	atomic_int refCount;
+	struct _imagelist *next;   // Newer snapshot, set when it gets published
+	dnbd3_image_t **retired;   // Images that are not in next anymore
+	int retiredCount;
+	int count;
+	dnbd3_image_t *images[];
+} imagelist_t;
+
+static _Atomic(imagelist_t *) currentList = NULL;
+// Number of readers between loading currentList and increasing its refCount
+static atomic_int listReaders = 0;
+
+// Serializes writers of the image list, readers don't need it
 static pthread_mutex_t imageListLock;
 static pthread_mutex_t remoteCloneLock;
 static pthread_mutex_t reloadLock;
+// Retired images nobody uses anymore, freed by image_freeRetired()
+static pthread_mutex_t freeListLock;
+static dnbd3_image_t *freeList = NULL;
+// Image that ran out of disk space, see image_requestDiskSpace()
+static _Atomic(dnbd3_image_t *) diskSpaceImage = NULL;
+static atomic_uint_fast64_t diskSpaceSize = 0;
 #define NAMELEN  500
 #define CACHELEN 20
 typedef struct
@@ -40,14 +72,25 @@ static imagecache remoteCloneCache[CACHELEN];
 
 // ##########################################
 
+static imagelist_t* imagelist_acquire();
+static void imagelist_release(imagelist_t *list);
+static imagelist_t* imagelist_updateLocked(dnbd3_image_t *add, dnbd3_image_t **remove, int removeCount);
+static void imagelist_retire(imagelist_t *old);
 static bool isForbiddenExtension(const char* name);
 static dnbd3_image_t* image_remove(dnbd3_image_t *image);
 static dnbd3_image_t* image_free(dnbd3_image_t *image);
+static void image_queueFree(dnbd3_image_t *image);
 static bool image_load_all_internal(char *base, char *path);
+static void image_checkVanished(const char *path);
 static bool image_addToList(dnbd3_image_t *image);
 static bool image_load(char *base, char *path, int withUplink);
-static bool image_clone(int sock, char *name, uint16_t revision, uint64_t imageSize);
+static bool image_isLoadedComplete(const char *name, uint16_t revision, uint64_t realFilesize);
+static bool image_clone(int sock, char *name, uint16_t revision, uint64_t imageSize, uint16_t protocolVersion);
+static void image_seedFromPreviousRevision(char *name, uint16_t revision);
+static bool image_canSeedHashBlock(dnbd3_image_t *image, dnbd3_image_t *source, int block);
+static void* image_seedWorker(void *data);
 static bool image_calcBlockCrc32(const int fd, const size_t block, const uint64_t realFilesize, uint32_t *crc);
+static bool image_ensureDiskSpaceLocked(uint64_t size, bool force);
 static bool image_ensureDiskSpace(uint64_t size, bool force);
 
 static uint8_t* image_loadCacheMap(const char * const imagePath, const int64_t fileSize);
@@ -62,6 +105,120 @@ void image_serverStartup()
 	mutex_init( &imageListLock );
 	mutex_init( &remoteCloneLock );
 	mutex_init( &reloadLock );
+	mutex_init( &freeListLock );
+	imagelist_t *list = calloc( 1, sizeof(imagelist_t) );
+	atomic_init( &list->refCount, 1 );
+	currentList = list;
+}
+
+/**
+ * Get reference to current image list snapshot. Never blocks.
+ * Pass to imagelist_release() when done.
+ */
+static imagelist_t* imagelist_acquire()
+{
+	atomic_fetch_add( &listReaders, 1 );
+	imagelist_t *list = atomic_load( &currentList );
+	atomic_fetch_add( &list->refCount, 1 );
+	atomic_fetch_sub( &listReaders, 1 );
+	return list;
+}
+
+/**
+ * Drop reference to snapshot. If this was the last one, free it and queue
+ * all images that were retired with it and are not in use anymore for
+ * image_freeRetired(). Readers might hold all sorts of locks, so they
+ * must not free images themselves.
+ * Locks on: _images[].lock (of retired images), freeListLock
+ */
+static void imagelist_release(imagelist_t *list)
+{
+	while ( list != NULL && atomic_fetch_sub( &list->refCount, 1 ) == 1 ) {
+		imagelist_t * const next = list->next;
+		for ( int i = 0; i < list->retiredCount; ++i ) {
+			dnbd3_image_t * const image = list->retired[i];
+			mutex_lock( &image->lock );
+			image->retired = true;
+			const bool mustFree = ( image->users == 0 );
+			mutex_unlock( &image->lock );
+			if ( mustFree ) {
+				image_queueFree( image );
+			}
+		}
+		free( list->retired );
+		free( list );
+		list = next;
+	}
+}
+
+/**
+ * Create and publish a new snapshot, containing all images of the current
+ * one minus the ones in remove, plus add, if not NULL.
+ * Returns the old snapshot, which needs to be passed to imagelist_retire()
+ * after releasing imageListLock, or NULL if nothing changed or we ran out
+ * of memory.
+ * Locks on: imageListLock (must already be held by caller)
+ */
+static imagelist_t* imagelist_updateLocked(dnbd3_image_t *add, dnbd3_image_t **remove, int removeCount)
+{
+	imagelist_t * const old = atomic_load( &currentList );
+	imagelist_t *list = malloc( sizeof(imagelist_t) + sizeof(dnbd3_image_t*) * (size_t)( old->count + 1 ) );
+	dnbd3_image_t **retired = removeCount == 0 ? NULL : malloc( sizeof(dnbd3_image_t*) * (size_t)removeCount );
+	if ( list == NULL || ( removeCount != 0 && retired == NULL ) ) {
+		logadd( LOG_ERROR, "Out of memory while updating image list" );
+		free( list );
+		free( retired );
+		return NULL;
+	}
+	int count = 0, retiredCount = 0;
+	for ( int i = 0; i < old->count; ++i ) {
+		dnbd3_image_t * const image = old->images[i];
+		bool keep = true;
+		for ( int j = 0; j < removeCount; ++j ) {
+			if ( remove[j] == image ) {
+				keep = false;
+				break;
+			}
+		}
+		if ( keep ) {
+			list->images[count++] = image;
+		} else {
+			retired[retiredCount++] = image;
+		}
+	}
+	if ( add != NULL ) {
+		list->images[count++] = add;
+	}
+	if ( add == NULL && retiredCount == 0 ) {
+		free( list );
+		free( retired );
+		return NULL;
+	}
+	list->count = count;
+	list->next = NULL;
+	list->retired = NULL;
+	list->retiredCount = 0;
+	atomic_init( &list->refCount, 2 ); // currentList + old->next
+	old->retired = retired;
+	old->retiredCount = retiredCount;
+	old->next = list;
+	atomic_store( &currentList, list );
+	return old;
+}
+
+/**
+ * Drop the reference currentList had on a replaced snapshot.
+ * Waits for readers that might have loaded the old pointer
+ * but not increased its refCount yet.
+ */
+static void imagelist_retire(imagelist_t *old)
+{
+	if ( old == NULL )
+		return;
+	while ( atomic_load( &listReaders ) != 0 ) {
+		sched_yield();
+	}
+	imagelist_release( old );
 }
 
 /**
@@ -238,7 +395,7 @@ bool image_ensureOpen(dnbd3_image_t *image)
  * Get an image by name+rid. This function increases a reference counter,
  * so you HAVE TO CALL image_release for every image_get() call at some
  * point...
- * Locks on: imageListLock, _images[].lock
+ * Locks on: _images[].lock
  */
 dnbd3_image_t* image_get(char *name, uint16_t revision, bool checkIfWorking)
 {
@@ -249,10 +406,10 @@ dnbd3_image_t* image_get(char *name, uint16_t revision, bool checkIfWorking)
 	const size_t slen = strlen( name );
 	if ( slen == 0 || name[slen - 1] == '/' || name[0] == '/' ) return NULL ;
 	// Go through array
-	mutex_lock( &imageListLock );
-	for (i = 0; i < _num_images; ++i) {
-		dnbd3_image_t * const image = _images[i];
-		if ( image == NULL || strcmp( image->name, name ) != 0 ) continue;
+	imagelist_t * const list = imagelist_acquire();
+	for (i = 0; i < list->count; ++i) {
+		dnbd3_image_t * const image = list->images[i];
+		if ( strcmp( image->name, name ) != 0 ) continue;
 		if ( revision == image->rid ) {
 			candidate = image;
 			break;
@@ -263,14 +420,19 @@ dnbd3_image_t* image_get(char *name, uint16_t revision, bool checkIfWorking)
 
 	// Not found
 	if ( candidate == NULL ) {
-		mutex_unlock( &imageListLock );
+		imagelist_release( list );
 		return NULL ;
 	}
 
 	mutex_lock( &candidate->lock );
-	mutex_unlock( &imageListLock );
 	candidate->users++;
+	const bool loadCrc = candidate->crc32Deferred;
 	mutex_unlock( &candidate->lock );
+	imagelist_release( list );
+
+	if ( loadCrc ) {
+		image_ensureCrcList( candidate );
+	}
 
 	// Found, see if it works
 // TODO: Also make sure a non-working image still has old fd open but created a new one and removed itself from the list
@@ -338,7 +500,7 @@ dnbd3_image_t* image_get(char *name, uint16_t revision, bool checkIfWorking)
 		// Could not access the image with exising fd - mark for reload which will re-open the file.
 		// make a copy of the image struct but keep the old one around. If/When it's not being used
 		// anymore, it will be freed automatically.
-		dnbd3_image_t *img = calloc( sizeof(dnbd3_image_t), 1 );
+		dnbd3_image_t *img = callocCacheAligned( sizeof(dnbd3_image_t) );
 		img->path = strdup( candidate->path );
 		img->name = strdup( candidate->name );
 		img->virtualFilesize = candidate->virtualFilesize;
@@ -346,6 +508,7 @@ dnbd3_image_t* image_get(char *name, uint16_t revision, bool checkIfWorking)
 		img->atime = now;
 		img->masterCrc32 = candidate->masterCrc32;
 		img->readFd = -1;
+		img->directFd = -1;
 		img->rid = candidate->rid;
 		img->users = 1;
 		img->working = false;
@@ -389,58 +552,147 @@ dnbd3_image_t* image_get(char *name, uint16_t revision, bool checkIfWorking)
  * Lock the image by increasing its users count
  * Returns the image on success, NULL if it is not found in the image list
  * Every call to image_lock() needs to be followed by a call to image_release() at some point.
- * Locks on: imageListLock, _images[].lock
+ * Locks on: _images[].lock
  */
 dnbd3_image_t* image_lock(dnbd3_image_t *image) // TODO: get rid, fix places that do image->users--
 {
 	if ( image == NULL ) return NULL ;
-	int i;
-	mutex_lock( &imageListLock );
-	for (i = 0; i < _num_images; ++i) {
-		if ( _images[i] == image ) {
+	dnbd3_image_t *ret = NULL;
+	imagelist_t * const list = imagelist_acquire();
+	for (int i = 0; i < list->count; ++i) {
+		if ( list->images[i] == image ) {
 			mutex_lock( &image->lock );
-			mutex_unlock( &imageListLock );
 			image->users++;
 			mutex_unlock( &image->lock );
-			return image;
+			ret = image;
+			break;
 		}
 	}
-	mutex_unlock( &imageListLock );
-	return NULL ;
+	imagelist_release( list );
+	return ret;
+}
+
+/**
+ * Get all images currently in the list, with their users count increased.
+ * Call image_release() on every entry and free() the array when done.
+ * Locks on: _images[].lock
+ * @return array of images, NULL on error
+ */
+dnbd3_image_t** image_getAllReferenced(int *count)
+{
+	imagelist_t * const list = imagelist_acquire();
+	dnbd3_image_t **images = malloc( (size_t)MAX( list->count, 1 ) * sizeof(*images) );
+	if ( images != NULL ) {
+		for ( int i = 0; i < list->count; ++i ) {
+			dnbd3_image_t * const image = list->images[i];
+			mutex_lock( &image->lock );
+			image->users++;
+			mutex_unlock( &image->lock );
+			images[i] = image;
+		}
+		*count = list->count;
+	}
+	imagelist_release( list );
+	return images;
+}
+
+/**
+ * Get image at given position in the image list, with its users count
+ * increased, to walk the list without referencing all images at once.
+ * The list might change in between calls, so an image can be skipped
+ * or returned twice.
+ * @return image, NULL if index is past the end of the list
+ */
+dnbd3_image_t* image_getByIndex(int index)
+{
+	dnbd3_image_t *image = NULL;
+	imagelist_t * const list = imagelist_acquire();
+	if ( index >= 0 && index < list->count ) {
+		image = list->images[index];
+		mutex_lock( &image->lock );
+		image->users++;
+		mutex_unlock( &image->lock );
+	}
+	imagelist_release( list );
+	return image;
+}
+
+/**
+ * Like image_getAllReferenced(), but only get the revisions of given image.
+ * @return array of images, NULL on error
+ */
+dnbd3_image_t** image_getRevisionsReferenced(const char *name, int *count)
+{
+	imagelist_t * const list = imagelist_acquire();
+	dnbd3_image_t **images = malloc( (size_t)MAX( list->count, 1 ) * sizeof(*images) );
+	if ( images != NULL ) {
+		*count = 0;
+		for ( int i = 0; i < list->count; ++i ) {
+			dnbd3_image_t * const image = list->images[i];
+			if ( strcmp( image->name, name ) != 0 )
+				continue;
+			mutex_lock( &image->lock );
+			image->users++;
+			mutex_unlock( &image->lock );
+			images[(*count)++] = image;
+		}
+	}
+	imagelist_release( list );
+	return images;
 }
 
 /**
  * Release given image. This will decrease the reference counter of the image.
- * If the usage counter reaches 0 and the image is not in the images array
- * anymore, the image will be freed
- * Locks on: imageListLock, _images[].lock
+ * If the usage counter reaches 0 and the image is not referenced by
+ * any image list snapshot anymore, the image is queued for image_freeRetired()
+ * Locks on: _images[].lock, freeListLock
  */
 dnbd3_image_t* image_release(dnbd3_image_t *image)
 {
 	if ( image == NULL ) return NULL;
-	mutex_lock( &imageListLock );
 	mutex_lock( &image->lock );
 	assert( image->users > 0 );
 	image->users--;
-	bool inUse = image->users != 0;
+	const bool mustFree = image->users == 0 && image->retired;
 	mutex_unlock( &image->lock );
-	if ( inUse ) { // Still in use, do nothing
-		mutex_unlock( &imageListLock );
-		return NULL;
-	}
-	// Getting here means we decreased the usage counter to zero
-	// If the image is not in the images list anymore, we're
-	// responsible for freeing it
-	for (int i = 0; i < _num_images; ++i) {
-		if ( _images[i] == image ) { // Found, do nothing
-			mutex_unlock( &imageListLock );
-			return NULL;
+	// If the image has been retired already, nobody can find it
+	// anymore, so we were the last one to use it
+	if ( mustFree ) image_queueFree( image );
+	return NULL;
+}
+
+/**
+ * Queue image that nobody can find or use anymore for image_freeRetired().
+ * Locks on: freeListLock
+ */
+static void image_queueFree(dnbd3_image_t *image)
+{
+	mutex_lock( &freeListLock );
+	image->nextFree = freeList;
+	freeList = image;
+	mutex_unlock( &freeListLock );
+}
+
+/**
+ * Free all images queued by image_queueFree(). Freeing waits for the
+ * uplink to save its cache map and takes the locks of the caches, so
+ * this is only called by threads that don't hold any locks, and never
+ * by a reactor of the uplinks.
+ * Locks on: freeListLock, and everything image_free() locks on
+ */
+void image_freeRetired()
+{
+	for ( ;; ) {
+		mutex_lock( &freeListLock );
+		dnbd3_image_t * const image = freeList;
+		if ( image != NULL ) {
+			freeList = image->nextFree;
 		}
+		mutex_unlock( &freeListLock );
+		if ( image == NULL )
+			break;
+		image_free( image );
 	}
-	mutex_unlock( &imageListLock );
-	// So it wasn't in the images list anymore either, get rid of it
-	if ( !inUse ) image = image_free( image );
-	return NULL;
 }
 
 /**
@@ -457,30 +709,26 @@ static bool isForbiddenExtension(const char* name)
 	if ( len < 5 ) return false;
 	--ptr;
 	if ( strcmp( ptr, ".meta" ) == 0 ) return true; // Meta data (currently not in use)
+	if ( strcmp( ptr, ".heat" ) == 0 ) return true; // Access statistics for warmup
+	if ( len < 6 ) return false;
+	--ptr;
+	if ( strcmp( ptr, ".dedup" ) == 0 ) return true; // Block index for deduplication
 	return false;
 }
 
 /**
- * Remove image from images array. Only free it if it has
- * no active users and was actually in the list.
+ * Remove image from images array. The caller must hold a reference
+ * to the image; it will be freed once that and all snapshots that
+ * still contain the image are released.
  * Locks on: imageListLock, image[].lock
- * @return NULL if image was also freed, image otherwise
+ * @return image
  */
 static dnbd3_image_t* image_remove(dnbd3_image_t *image)
 {
-	bool mustFree = false;
 	mutex_lock( &imageListLock );
-	mutex_lock( &image->lock );
-	for ( int i = _num_images - 1; i >= 0; --i ) {
-		if ( _images[i] == image ) {
-			_images[i] = NULL;
-			mustFree = ( image->users == 0 );
-		}
-		if ( _images[i] == NULL && i + 1 == _num_images ) _num_images--;
-	}
-	mutex_unlock( &image->lock );
+	imagelist_t * const old = imagelist_updateLocked( NULL, &image, 1 );
 	mutex_unlock( &imageListLock );
-	if ( mustFree ) image = image_free( image );
+	imagelist_retire( old );
 	return image;
 }
 
@@ -489,23 +737,19 @@ static dnbd3_image_t* image_remove(dnbd3_image_t *image)
  */
 void image_killUplinks()
 {
-	int i;
-	mutex_lock( &imageListLock );
-	for (i = 0; i < _num_images; ++i) {
-		if ( _images[i] == NULL ) continue;
-		mutex_lock( &_images[i]->lock );
-		if ( _images[i]->uplink != NULL ) {
-			mutex_lock( &_images[i]->uplink->queueLock );
-			if ( !_images[i]->uplink->shutdown ) {
-				thread_detach( _images[i]->uplink->thread );
-				_images[i]->uplink->shutdown = true;
-			}
-			mutex_unlock( &_images[i]->uplink->queueLock );
-			signal_call( _images[i]->uplink->signal );
+	imagelist_t * const list = imagelist_acquire();
+	for (int i = 0; i < list->count; ++i) {
+		dnbd3_image_t * const image = list->images[i];
+		mutex_lock( &image->lock );
+		if ( image->uplink != NULL ) {
+			mutex_lock( &image->uplink->queueLock );
+			image->uplink->shutdown = true;
+			mutex_unlock( &image->uplink->queueLock );
+			signal_call( image->uplink->signal );
 		}
-		mutex_unlock( &_images[i]->lock );
+		mutex_unlock( &image->lock );
 	}
-	mutex_unlock( &imageListLock );
+	imagelist_release( list );
 }
 
 /**
@@ -515,9 +759,6 @@ void image_killUplinks()
 bool image_loadAll(char *path)
 {
 	bool ret;
-	char imgPath[PATHLEN];
-	int imgId;
-	dnbd3_image_t *imgHandle;
 
 	if ( path == NULL ) path = _basePath;
 	if ( mutex_trylock( &reloadLock ) != 0 ) {
@@ -527,38 +768,7 @@ bool image_loadAll(char *path)
 	if ( _removeMissingImages ) {
 		// Check if all loaded images still exist on disk
 		logadd( LOG_INFO, "Checking for vanished images" );
-		mutex_lock( &imageListLock );
-		for ( int i = _num_images - 1; i >= 0; --i ) {
-			if ( _shutdown ) break;
-			if ( _images[i] == NULL ) {
-				if ( i + 1 == _num_images ) _num_images--;
-				continue;
-			}
-			imgId = _images[i]->id;
-			snprintf( imgPath, PATHLEN, "%s", _images[i]->path );
-			mutex_unlock( &imageListLock ); // isReadable hits the fs; unlock
-			// Check if fill can still be opened for reading
-			ret = file_isReadable( imgPath );
-			// Lock again, see if image is still there, free if required
-			mutex_lock( &imageListLock );
-			if ( ret || i >= _num_images || _images[i] == NULL || _images[i]->id != imgId ) continue;
-			// Image needs to be removed
-			imgHandle = _images[i];
-			_images[i] = NULL;
-			if ( i + 1 == _num_images ) _num_images--;
-			mutex_lock( &imgHandle->lock );
-			const bool freeImg = ( imgHandle->users == 0 );
-			mutex_unlock( &imgHandle->lock );
-			// We unlocked, but the image has been removed from the list already, so
-			// there's no way the users-counter can increase at this point.
-			if ( freeImg ) {
-				// Image is not in use anymore, free the dangling entry immediately
-				mutex_unlock( &imageListLock ); // image_free might do several fs operations; unlock
-				image_free( imgHandle );
-				mutex_lock( &imageListLock );
-			}
-		}
-		mutex_unlock( &imageListLock );
+		image_checkVanished( NULL );
 		if ( _shutdown ) {
 			mutex_unlock( &reloadLock );
 			return true;
@@ -567,31 +777,89 @@ bool image_loadAll(char *path)
 	// Now scan for new images
 	logadd( LOG_INFO, "Scanning for new or modified images" );
 	ret = image_load_all_internal( path, path );
+	imageindex_save();
 	mutex_unlock( &reloadLock );
 	logadd( LOG_INFO, "Finished scanning %s", path );
 	return ret;
 }
 
+/**
+ * Load a single new or modified image file below basePath. If file is
+ * the CRC-32 list of an image, the image itself gets loaded instead,
+ * so a list that appears after the image is picked up too.
+ * Images that are incomplete are ignored, as they are being written
+ * to by our own uplink.
+ * @return true if the image was loaded, or didn't change
+ */
+bool image_loadFile(const char *file)
+{
+	const size_t baseLen = strlen( _basePath );
+	const size_t len = strlen( file );
+	if ( len >= PATHLEN || len <= baseLen + 1 || strncmp( file, _basePath, baseLen ) != 0 || file[baseLen] != '/' )
+		return false;
+	char path[PATHLEN];
+	memcpy( path, file, len + 1 );
+	if ( len > 4 && strcmp( path + len - 4, ".crc" ) == 0 ) {
+		path[len - 4] = '\0';
+		if ( !file_isReadable( path ) )
+			return false;
+	} else if ( isForbiddenExtension( path ) ) {
+		return false;
+	}
+	mutex_lock( &reloadLock );
+	bool incomplete = false;
+	imagelist_t * const list = imagelist_acquire();
+	for ( int i = 0; i < list->count && !incomplete; ++i ) {
+		incomplete = list->images[i]->cache_map != NULL && strcmp( list->images[i]->path, path ) == 0;
+	}
+	imagelist_release( list );
+	bool ret = incomplete;
+	if ( !incomplete ) {
+		ret = image_load( _basePath, path, true );
+		imageindex_save();
+	}
+	mutex_unlock( &reloadLock );
+	return ret;
+}
+
+/**
+ * Remove images at or below given path from the list
+ * if they cannot be opened anymore.
+ */
+void image_removeVanished(const char *path)
+{
+	mutex_lock( &reloadLock );
+	image_checkVanished( path );
+	mutex_unlock( &reloadLock );
+}
+
 /**
  * Free all images we have, but only if they're not in use anymore.
- * Locks on imageListLock
+ * Locks on imageListLock, _images[].lock
  * @return true if all images have been freed
  */
 bool image_tryFreeAll()
 {
 	mutex_lock( &imageListLock );
-	for (int i = _num_images - 1; i >= 0; --i) {
-		if ( _images[i] != NULL && _images[i]->users == 0 ) { // XXX Data race...
-			dnbd3_image_t *image = _images[i];
-			_images[i] = NULL;
-			mutex_unlock( &imageListLock );
-			image = image_free( image );
-			mutex_lock( &imageListLock );
+	imagelist_t *list = atomic_load( &currentList );
+	dnbd3_image_t **unused = malloc( sizeof(dnbd3_image_t*) * (size_t)MAX( list->count, 1 ) );
+	int count = 0;
+	for ( int i = 0; unused != NULL && i < list->count; ++i ) {
+		dnbd3_image_t * const image = list->images[i];
+		mutex_lock( &image->lock );
+		if ( image->users == 0 ) {
+			unused[count++] = image;
 		}
-		if ( i + 1 == _num_images && _images[i] == NULL ) _num_images--;
+		mutex_unlock( &image->lock );
 	}
+	imagelist_t * const old = imagelist_updateLocked( NULL, unused, count );
+	const bool empty = atomic_load( &currentList )->count == 0;
 	mutex_unlock( &imageListLock );
-	return _num_images == 0;
+	free( unused );
+	imagelist_retire( old );
+	image_release( atomic_exchange( &diskSpaceImage, NULL ) );
+	image_freeRetired();
+	return empty;
 }
 
 /**
@@ -606,6 +874,10 @@ static dnbd3_image_t* image_free(dnbd3_image_t *image)
 	}
 	//
 	uplink_shutdown( image );
+	bufcache_imageClose( image );
+	ssdcache_imageClose( image );
+	warmup_imageClose( image );
+	dedup_imageClose( image );
 	mutex_lock( &image->lock );
 	free( image->cache_map );
 	free( image->crc32 );
@@ -617,6 +889,7 @@ static dnbd3_image_t* image_free(dnbd3_image_t *image)
 	image->name = NULL;
 	mutex_unlock( &image->lock );
 	if ( image->readFd != -1 ) close( image->readFd );
+	mutex_destroy( &image->seedLock );
 	mutex_destroy( &image->lock );
 	//
 	memset( image, 0, sizeof(*image) );
@@ -649,6 +922,34 @@ bool image_isHashBlockComplete(const uint8_t * const cacheMap, const uint64_t bl
 	return true;
 }
 
+/**
+ * Remove images whose file cannot be opened anymore. Only check those
+ * at or below path, or all of them if path is NULL.
+ * Caller must hold reloadLock.
+ */
+static void image_checkVanished(const char *path)
+{
+	const size_t len = path == NULL ? 0 : strlen( path );
+	// Our snapshot keeps the images alive, so no locking needed while we hit the fs
+	imagelist_t * const list = imagelist_acquire();
+	for ( int i = list->count - 1; i >= 0; --i ) {
+		if ( _shutdown ) break;
+		dnbd3_image_t *image = list->images[i];
+		if ( path != NULL && ( strncmp( image->path, path, len ) != 0
+				|| ( image->path[len] != '\0' && image->path[len] != '/' ) ) )
+			continue;
+		// Check if file can still be opened for reading
+		if ( file_isReadable( image->path ) ) continue;
+		// Image needs to be removed; it will be freed as soon as nobody uses it anymore
+		ssdcache_discard( image );
+		mutex_lock( &imageListLock );
+		imagelist_t * const old = imagelist_updateLocked( NULL, &image, 1 );
+		mutex_unlock( &imageListLock );
+		imagelist_retire( old );
+	}
+	imagelist_release( list );
+}
+
 /**
  * Load all images in the given path recursively,
  * consider *base the base path that is to be cut off
@@ -700,24 +1001,19 @@ static bool image_load_all_internal(char *base, char *path)
  */
 static bool image_addToList(dnbd3_image_t *image)
 {
-	int i;
 	static int imgIdCounter = 0; // Used to assign unique numeric IDs to images
 	mutex_lock( &imageListLock );
+	if ( atomic_load( &currentList )->count >= _maxImages ) {
+		mutex_unlock( &imageListLock );
+		return false;
+	}
 	// Now we're locked, assign unique ID to image (unique for this running server instance!)
 	image->id = ++imgIdCounter;
-	for ( i = 0; i < _num_images; ++i ) {
-		if ( _images[i] != NULL ) continue;
-		_images[i] = image;
-		break;
-	}
-	if ( i >= _num_images ) {
-		if ( _num_images >= _maxImages ) {
-			mutex_unlock( &imageListLock );
-			return false;
-		}
-		_images[_num_images++] = image;
-	}
+	imagelist_t * const old = imagelist_updateLocked( image, NULL, 0 );
 	mutex_unlock( &imageListLock );
+	if ( old == NULL )
+		return false;
+	imagelist_retire( old );
 	return true;
 }
 
@@ -787,48 +1083,64 @@ static bool image_load(char *base, char *path, int withUplink)
 		goto load_error;
 	}
 
+	// Image and CRC-32 list unchanged since we last checked them? Check before
+	// image_get(), which would load the CRC-32 list and open the image.
+	uint64_t realFilesize = 0;
+	uint32_t masterCrc = 0;
+	const bool indexed = imageindex_isUnchanged( path, &realFilesize, &masterCrc );
+	if ( indexed && image_isLoadedComplete( imgName, (uint16_t)revision, realFilesize ) ) {
+		logadd( LOG_DEBUG1, "Did not change" );
+		function_return = true;
+		goto load_error; // Keep existing
+	}
+
 	// Get pointer to already existing image if possible
 	existing = image_get( imgName, (uint16_t)revision, true );
 
 	// ### Now load the actual image related data ###
-	if ( fdImage == -1 ) {
-		fdImage = open( path, O_RDONLY );
+	// If it's in the index, opening the file is deferred until the first client shows up
+	if ( !indexed ) {
+		if ( fdImage == -1 ) {
+			fdImage = open( path, O_RDONLY );
+		}
+		if ( fdImage == -1 ) {
+			logadd( LOG_ERROR, "Could not open '%s' for reading...", path );
+			goto load_error;
+		}
+		// Determine file size
+		const off_t seekret = lseek( fdImage, 0, SEEK_END );
+		if ( seekret < 0 ) {
+			logadd( LOG_ERROR, "Could not seek to end of file '%s'", path );
+			goto load_error;
+		} else if ( seekret == 0 ) {
+			logadd( LOG_WARNING, "Empty image file '%s'", path );
+			goto load_error;
+		}
+		realFilesize = (uint64_t)seekret;
 	}
-	if ( fdImage == -1 ) {
-		logadd( LOG_ERROR, "Could not open '%s' for reading...", path );
-		goto load_error;
-	}
-	// Determine file size
-	const off_t seekret = lseek( fdImage, 0, SEEK_END );
-	if ( seekret < 0 ) {
-		logadd( LOG_ERROR, "Could not seek to end of file '%s'", path );
-		goto load_error;
-	} else if ( seekret == 0 ) {
-		logadd( LOG_WARNING, "Empty image file '%s'", path );
-		goto load_error;
-	}
-	const uint64_t realFilesize = (uint64_t)seekret;
 	const uint64_t virtualFilesize = ( realFilesize + (DNBD3_BLOCK_SIZE - 1) ) & ~(DNBD3_BLOCK_SIZE - 1);
 	if ( realFilesize != virtualFilesize ) {
 		logadd( LOG_DEBUG1, "Image size of '%s' is %" PRIu64 ", virtual size: %" PRIu64, path, realFilesize, virtualFilesize );
 	}
 
-	// 1. Allocate memory for the cache map if the image is incomplete
-	cache_map = image_loadCacheMap( path, virtualFilesize );
-
-	// XXX: Maybe try sha-256 or 512 first if you're paranoid (to be implemented)
-
-	// 2. Load CRC-32 list of image
+	// Indexed images are complete and get their CRC-32 list loaded on first use
 	bool doFullCheck = false;
-	uint32_t masterCrc = 0;
 	const int hashBlockCount = IMGSIZE_TO_HASHBLOCKS( virtualFilesize );
-	crc32list = image_loadCrcList( path, virtualFilesize, &masterCrc );
+	if ( !indexed ) {
+		// 1. Allocate memory for the cache map if the image is incomplete
+		cache_map = image_loadCacheMap( path, virtualFilesize );
+
+		// XXX: Maybe try sha-256 or 512 first if you're paranoid (to be implemented)
+
+		// 2. Load CRC-32 list of image
+		crc32list = image_loadCrcList( path, virtualFilesize, &masterCrc );
 
-	// Check CRC32
-	if ( crc32list != NULL ) {
-		if ( !image_checkRandomBlocks( 4, fdImage, realFilesize, crc32list, cache_map ) ) {
-			logadd( LOG_ERROR, "quick crc32 check of %s failed. Data corruption?", path );
-			doFullCheck = true;
+		// Check CRC32
+		if ( crc32list != NULL ) {
+			if ( !image_checkRandomBlocks( 4, fdImage, realFilesize, crc32list, cache_map ) ) {
+				logadd( LOG_ERROR, "quick crc32 check of %s failed. Data corruption?", path );
+				doFullCheck = true;
+			}
 		}
 	}
 
@@ -867,12 +1179,13 @@ static bool image_load(char *base, char *path, int withUplink)
 	}
 
 	// Load fresh image
-	dnbd3_image_t *image = calloc( 1, sizeof(dnbd3_image_t) );
+	dnbd3_image_t *image = callocCacheAligned( sizeof(dnbd3_image_t) );
 	image->path = strdup( path );
 	image->name = strdup( imgName );
 	image->cache_map = cache_map;
 	image->crc32 = crc32list;
 	image->masterCrc32 = masterCrc;
+	image->crc32Deferred = indexed;
 	image->uplink = NULL;
 	image->realFilesize = realFilesize;
 	image->virtualFilesize = virtualFilesize;
@@ -883,6 +1196,7 @@ static bool image_load(char *base, char *path, int withUplink)
 	timing_get( &image->nextCompletenessEstimate );
 	image->completenessEstimate = -1;
 	mutex_init( &image->lock );
+	mutex_init( &image->seedLock );
 	int32_t offset;
 	if ( stat( path, &st ) == 0 ) {
 		// Negatively offset atime by file modification time
@@ -892,6 +1206,9 @@ static bool image_load(char *base, char *path, int withUplink)
 		offset = 0;
 	}
 	timing_gets( &image->atime, offset );
+	bufcache_imageOpen( image );
+	ssdcache_imageOpen( image );
+	warmup_imageOpen( image );
 
 	// Prevent freeing in cleanup
 	cache_map = NULL;
@@ -922,10 +1239,13 @@ static bool image_load(char *base, char *path, int withUplink)
 		goto load_error;
 	}
 	logadd( LOG_DEBUG1, "Loaded image '%s:%d'\n", image->name, (int)image->rid );
+	dedup_imageOpen( image );
 	// CRC errors found...
 	if ( doFullCheck ) {
 		logadd( LOG_INFO, "Queueing full CRC32 check for '%s:%d'\n", image->name, (int)image->rid );
 		integrity_check( image, -1 );
+	} else if ( !indexed && image->cache_map == NULL && image->crc32 != NULL ) {
+		imageindex_update( path, masterCrc );
 	}
 
 	function_return = true;
@@ -1009,6 +1329,36 @@ static uint32_t* image_loadCrcList(const char * const imagePath, const int64_t f
 	return retval;
 }
 
+/**
+ * Load CRC-32 list of image if it's not in memory, either because the
+ * image was known from the image index, or the list was freed by
+ * image_freeUnusedCrcLists(). Caller must hold a reference to the image.
+ */
+void image_ensureCrcList(dnbd3_image_t *image)
+{
+	mutex_lock( &image->lock );
+	const bool deferred = image->crc32Deferred;
+	mutex_unlock( &image->lock );
+	if ( !deferred )
+		return;
+	uint32_t masterCrc;
+	uint32_t *crc32list = image_loadCrcList( image->path, image->virtualFilesize, &masterCrc );
+	if ( crc32list != NULL && masterCrc != image->masterCrc32 ) {
+		logadd( LOG_WARNING, "CRC-32 list of '%s:%d' changed since the image was loaded", image->name, (int)image->rid );
+		free( crc32list );
+		crc32list = NULL;
+	}
+	mutex_lock( &image->lock );
+	if ( image->crc32Deferred ) {
+		// Lost a race otherwise, keep what the other thread loaded
+		image->crc32 = crc32list;
+		image->crc32Deferred = false;
+		crc32list = NULL;
+	}
+	mutex_unlock( &image->lock );
+	free( crc32list );
+}
+
 static bool image_checkRandomBlocks(const int count, int fdImage, const int64_t realFilesize, uint32_t * const crc32list, uint8_t * const cache_map)
 {
 	// This checks the first block and (up to) count - 1 random blocks for corruption
@@ -1238,7 +1588,7 @@ static dnbd3_image_t *loadImageProxy(char * const name, const uint16_t revision,
 		} else {
 			ok = image_ensureDiskSpace( remoteImageSize + ( 10 * 1024 * 1024 ), false ); // some extra space for cache map etc.
 		}
-		ok = ok && image_clone( sock, name, remoteRid, remoteImageSize ); // This sets up the file+map+crc and loads the img
+		ok = ok && image_clone( sock, name, remoteRid, remoteImageSize, remoteProtocolVersion ); // This sets up the file+map+crc and loads the img
 		mutex_unlock( &reloadLock );
 		if ( !ok ) goto server_fail;
 
@@ -1369,7 +1719,7 @@ static dnbd3_image_t *loadImageServer(char * const name, const uint16_t requeste
  * 3. Load the image from disk
  * Returns: true on success, false otherwise
  */
-static bool image_clone(int sock, char *name, uint16_t revision, uint64_t imageSize)
+static bool image_clone(int sock, char *name, uint16_t revision, uint64_t imageSize, uint16_t protocolVersion)
 {
 	// Allocate disk space and create cache map
 	if ( !image_create( name, revision, imageSize ) ) return false;
@@ -1403,7 +1753,181 @@ static bool image_clone(int sock, char *name, uint16_t revision, uint64_t imageS
 	}
 	// HACK: Chop of ".crc" to get the image file name
 	crcFile[strlen( crcFile ) - 4] = '\0';
-	return image_load( _basePath, crcFile, false );
+	if ( _dedupIndex && protocolVersion >= 4 ) {
+		// Block index of new revision, so we can copy unchanged blocks from older ones
+		if ( !dedup_fetchIndex( sock, crcFile, imageSize ) ) {
+			logadd( LOG_DEBUG1, "OTF-Clone: No block index for %s from upstream", crcFile );
+		}
+	}
+	if ( !image_load( _basePath, crcFile, false ) )
+		return false;
+	image_seedFromPreviousRevision( name, revision );
+	return true;
+}
+
+typedef struct
+{
+	dnbd3_image_t *image;  // freshly cloned revision
+	dnbd3_image_t *source; // older local revision
+	int count;
+	int blocks[];          // hash blocks to copy from source
+} seedjob_t;
+
+/**
+ * Hash blocks of a new revision that have the same CRC32 as in the
+ * previous local revision are most likely unchanged. Copy those in
+ * the background instead of fetching them from the uplink.
+ * The usual integrity check verifies them once they are marked cached.
+ */
+static void image_seedFromPreviousRevision(char *name, uint16_t revision)
+{
+	dnbd3_image_t *image = image_get( name, revision, false );
+	if ( image == NULL )
+		return;
+	dnbd3_image_t *source = NULL;
+	imagelist_t * const list = imagelist_acquire();
+	for ( int i = 0; i < list->count; ++i ) {
+		dnbd3_image_t * const candidate = list->images[i];
+		if ( candidate->rid >= revision || ( candidate->crc32 == NULL && !candidate->crc32Deferred )
+				|| strcmp( candidate->name, name ) != 0 )
+			continue;
+		if ( source == NULL || source->rid < candidate->rid ) {
+			source = candidate;
+		}
+	}
+	if ( source != NULL ) {
+		mutex_lock( &source->lock );
+		source->users++;
+		mutex_unlock( &source->lock );
+	}
+	imagelist_release( list );
+	seedjob_t *job = NULL;
+	if ( source != NULL ) {
+		image_ensureCrcList( source );
+	}
+	if ( source == NULL || source->crc32 == NULL || image->crc32 == NULL )
+		goto cleanup;
+	const int blocks = IMGSIZE_TO_HASHBLOCKS( image->realFilesize );
+	job = malloc( sizeof(*job) + (size_t)blocks * sizeof(int) );
+	if ( job == NULL )
+		goto cleanup;
+	job->count = 0;
+	for ( int block = 0; block < blocks; ++block ) {
+		if ( image_canSeedHashBlock( image, source, block ) ) {
+			job->blocks[job->count++] = block;
+		}
+	}
+	if ( job->count == 0 )
+		goto cleanup;
+	job->image = image;
+	job->source = source;
+	logadd( LOG_INFO, "OTF-Clone: %d of %d hash blocks of %s:%d unchanged since revision %d, copying locally",
+			job->count, blocks, name, (int)revision, (int)source->rid );
+	if ( threadpool_runInternal( &image_seedWorker, job ) )
+		return; // Worker releases images
+	logadd( LOG_WARNING, "OTF-Clone: Could not start thread for copying blocks from previous revision" );
+cleanup:
+	free( job );
+	image_release( image );
+	if ( source != NULL ) {
+		image_release( source );
+	}
+}
+
+static bool image_canSeedHashBlock(dnbd3_image_t *image, dnbd3_image_t *source, int block)
+{
+	const uint64_t start = (uint64_t)block * HASH_BLOCK_SIZE;
+	const uint64_t end = MIN( start + HASH_BLOCK_SIZE, image->realFilesize );
+	if ( end > source->realFilesize )
+		return false;
+	// CRC of a partial hash block at the end only means the same if the images are of equal size
+	if ( end - start < HASH_BLOCK_SIZE && image->realFilesize != source->realFilesize )
+		return false;
+	if ( image->crc32[block] != source->crc32[block] )
+		return false;
+	if ( image->blockHashes != NULL && source->blockHashes != NULL ) {
+		// Block index available, use it to rule out CRC32 collisions
+		const int first = (int)( start / DEDUP_BLOCK_SIZE );
+		const int last = DEDUP_BLOCKS( end );
+		if ( memcmp( image->blockHashes + first, source->blockHashes + first, (size_t)( last - first ) * sizeof(uint64_t) ) != 0 )
+			return false;
+	}
+	mutex_lock( &image->lock );
+	const bool needed = image->cache_map != NULL && !image_isHashBlockComplete( image->cache_map, (uint64_t)block, image->realFilesize );
+	mutex_unlock( &image->lock );
+	if ( !needed )
+		return false;
+	mutex_lock( &source->lock );
+	const bool available = image_isHashBlockComplete( source->cache_map, (uint64_t)block, source->realFilesize );
+	mutex_unlock( &source->lock );
+	return available;
+}
+
+static void* image_seedWorker(void *data)
+{
+	seedjob_t * const job = (seedjob_t*)data;
+	dnbd3_image_t * const image = job->image;
+	dnbd3_image_t * const source = job->source;
+	setThreadName( "seed" );
+	int done = 0;
+	const int fd = open( image->path, O_WRONLY );
+	if ( fd == -1 ) {
+		logadd( LOG_WARNING, "OTF-Clone: Cannot open %s for writing (errno=%d)", image->path, errno );
+		goto cleanup;
+	}
+	if ( !image_ensureOpen( source ) )
+		goto cleanup;
+	mutex_lock( &image->seedLock );
+	for ( int i = 0; i < job->count && !_shutdown; ++i ) {
+		const uint64_t start = (uint64_t)job->blocks[i] * HASH_BLOCK_SIZE;
+		const uint64_t end = MIN( start + HASH_BLOCK_SIZE, image->realFilesize );
+		// Might have been filled by the dedup thread or the uplink by now
+		mutex_lock( &image->lock );
+		const bool needed = image->cache_map != NULL
+				&& !image_isHashBlockComplete( image->cache_map, (uint64_t)job->blocks[i], image->realFilesize );
+		mutex_unlock( &image->lock );
+		if ( !needed )
+			continue;
+		// Same offset in both revisions, so on btrfs/XFS this just shares the extents
+		if ( !file_copyRange( source->readFd, start, fd, start, end - start ) ) {
+			logadd( LOG_WARNING, "OTF-Clone: Copying from %s to %s failed (errno=%d)", source->path, image->path, errno );
+			break;
+		}
+		image_updateCachemap( image, start, MIN( start + HASH_BLOCK_SIZE, image->virtualFilesize ), true );
+		done++;
+	}
+	mutex_unlock( &image->seedLock );
+cleanup:
+	if ( fd != -1 ) {
+		close( fd );
+	}
+	logadd( LOG_INFO, "OTF-Clone: Copied %d hash blocks of %s:%d from revision %d",
+			done, image->name, (int)image->rid, (int)source->rid );
+	image_release( image );
+	image_release( source );
+	free( job );
+	return NULL;
+}
+
+/**
+ * Check if given revision of image is in the image list, complete
+ * and of the given size. Doesn't touch the image otherwise.
+ */
+static bool image_isLoadedComplete(const char *name, uint16_t revision, uint64_t realFilesize)
+{
+	bool ret = false;
+	imagelist_t * const list = imagelist_acquire();
+	for ( int i = 0; i < list->count; ++i ) {
+		dnbd3_image_t * const image = list->images[i];
+		if ( image->rid != revision || strcmp( image->name, name ) != 0 )
+			continue;
+		mutex_lock( &image->lock );
+		ret = image->cache_map == NULL && image->realFilesize == realFilesize;
+		mutex_unlock( &image->lock );
+		break;
+	}
+	imagelist_release( list );
+	return ret;
 }
 
 /**
@@ -1499,25 +2023,30 @@ cleanup_fail:;
 	return false;
 }
 
-json_t* image_getListAsJson()
+/**
+ * Write list of all images as JSON array to given stream.
+ * Fields are copied under the image's lock, no lock is held while writing.
+ */
+void image_writeListJson(jsonstream_t *js)
 {
-	json_t *imagesJson = json_array();
-	json_t *jsonImage;
 	int i;
 	char uplinkName[100] = { 0 };
 	uint64_t bytesReceived;
 	int users, completeness, idleTime;
 	declare_now;
 
-	mutex_lock( &imageListLock );
-	for ( i = 0; i < _num_images; ++i ) {
-		if ( _images[i] == NULL ) continue;
-		dnbd3_image_t *image = _images[i];
+	jsonstream_arrayStart( js, "images" );
+	// The snapshot keeps all images in it alive, no need to increase users
+	imagelist_t * const list = imagelist_acquire();
+	for ( i = 0; i < list->count; ++i ) {
+		dnbd3_image_t * const image = list->images[i];
+		jsonstream_objectStart( js, NULL );
+		// Estimating completeness is somewhat expensive, skip if filtered out
+		const bool needComplete = jsonstream_wants( js, "complete" );
 		mutex_lock( &image->lock );
-		mutex_unlock( &imageListLock );
 		users = image->users;
 		idleTime = (int)timing_diff( &image->atime, &now );
-		completeness = image_getCompletenessEstimate( image );
+		completeness = needComplete ? image_getCompletenessEstimate( image ) : 0;
 		if ( image->uplink == NULL ) {
 			bytesReceived = 0;
 			uplinkName[0] = '\0';
@@ -1527,30 +2056,57 @@ json_t* image_getListAsJson()
 				uplinkName[0] = '\0';
 			}
 		}
-		image->users++; // Prevent freeing after we unlock
 		mutex_unlock( &image->lock );
 
-		jsonImage = json_pack( "{sisssisisisisI}",
-				"id", image->id, // id, name, rid never change, so access them without locking
-				"name", image->name,
-				"rid", (int) image->rid,
-				"users", users,
-				"complete",  completeness,
-				"idle", idleTime,
-				"size", (json_int_t)image->virtualFilesize );
+		// id, name, rid never change, so access them without locking
+		jsonstream_int( js, "id", image->id );
+		jsonstream_string( js, "name", image->name );
+		jsonstream_int( js, "rid", image->rid );
+		jsonstream_int( js, "users", users );
+		jsonstream_int( js, "complete", completeness );
+		jsonstream_int( js, "idle", idleTime );
+		jsonstream_int( js, "size", (int64_t)image->virtualFilesize );
 		if ( bytesReceived != 0 ) {
-			json_object_set_new( jsonImage, "bytesReceived", json_integer( (json_int_t) bytesReceived ) );
+			jsonstream_int( js, "bytesReceived", (int64_t)bytesReceived );
 		}
 		if ( uplinkName[0] != '\0' ) {
-			json_object_set_new( jsonImage, "uplinkServer", json_string( uplinkName ) );
+			jsonstream_string( js, "uplinkServer", uplinkName );
 		}
-		json_array_append_new( imagesJson, jsonImage );
+		jsonstream_objectEnd( js );
+	}
+	imagelist_release( list );
+	jsonstream_arrayEnd( js );
+}
 
-		image = image_release( image ); // Since we did image->users++;
-		mutex_lock( &imageListLock );
+/**
+ * Get approximate amount of memory used by image structs, including
+ * cache maps and crc lists, and by uplinks, including receive buffers.
+ * Locks on: _images[].lock
+ */
+void image_getMemoryStats(int *imageCount, uint64_t *imageBytes, int *uplinkCount, uint64_t *uplinkBytes)
+{
+	*imageCount = *uplinkCount = 0;
+	*imageBytes = *uplinkBytes = 0;
+	imagelist_t * const list = imagelist_acquire();
+	for ( int i = 0; i < list->count; ++i ) {
+		dnbd3_image_t * const image = list->images[i];
+		(*imageCount)++;
+		*imageBytes += sizeof(*image) + strlen( image->path ) + strlen( image->name ) + 2;
+		mutex_lock( &image->lock );
+		if ( image->cache_map != NULL ) {
+			*imageBytes += IMGSIZE_TO_MAPBYTES( image->virtualFilesize );
+		}
+		if ( image->crc32 != NULL ) {
+			*imageBytes += IMGSIZE_TO_HASHBLOCKS( image->virtualFilesize ) * sizeof(uint32_t);
+		}
+		if ( image->uplink != NULL ) {
+			(*uplinkCount)++;
+			*uplinkBytes += sizeof(*image->uplink) + image->uplink->recvBufferLen
+				+ (uint64_t)image->uplink->queueCapacity * sizeof(dnbd3_queued_request_t);
+		}
+		mutex_unlock( &image->lock );
 	}
-	mutex_unlock( &imageListLock );
-	return imagesJson;
+	imagelist_release( list );
 }
 
 /**
@@ -1611,9 +2167,13 @@ bool image_checkBlocksCrc32(const int fd, uint32_t *crc32list, const int *blocks
 static bool image_calcBlockCrc32(const int fd, const size_t block, const uint64_t realFilesize, uint32_t *crc)
 {
 	// Make buffer 4k aligned in case fd has O_DIRECT set
+	// Don't put this on the stack, server threads run with small stacks
 #define BSIZE 262144
-	char rawBuffer[BSIZE + DNBD3_BLOCK_SIZE];
-	char * const buffer = (char*)( ( (uintptr_t)rawBuffer + ( DNBD3_BLOCK_SIZE - 1 ) ) & ~( DNBD3_BLOCK_SIZE - 1 ) );
+	char *buffer;
+	if ( posix_memalign( (void**)&buffer, DNBD3_BLOCK_SIZE, BSIZE ) != 0 ) {
+		logadd( LOG_WARNING, "CRC: Cannot allocate buffer" );
+		return false;
+	}
 	// How many bytes to read from the input file
 	const uint64_t bytesFromFile = MIN( HASH_BLOCK_SIZE, realFilesize - ( block * HASH_BLOCK_SIZE) );
 	// Determine how many bytes we had to read if the file size were a multiple of 4k
@@ -1630,6 +2190,7 @@ static bool image_calcBlockCrc32(const int fd, const size_t block, const uint64_
 		const ssize_t r = pread( fd, buffer, n, readPos + bytes );
 		if ( r <= 0 ) {
 			logadd( LOG_WARNING, "CRC: Read error (errno=%d)", errno );
+			free( buffer );
 			return false;
 		}
 		*crc = crc32( *crc, (uint8_t*)buffer, r );
@@ -1645,16 +2206,50 @@ static bool image_calcBlockCrc32(const int fd, const size_t block, const uint64_
 			bytes -= len;
 		}
 	}
+	free( buffer );
 	*crc = net_order_32( *crc );
 	return true;
 #undef BSIZE
 }
 
+/**
+ * Have housekeeping free disk space for given image, which failed to cache
+ * data. For threads that cannot wait for that, since freeing an image waits
+ * for its uplink, which in turn might wait for the caller. Does nothing if
+ * a request is pending already.
+ * Locks on: image.lock
+ */
+void image_requestDiskSpace(dnbd3_image_t *image, uint64_t size)
+{
+	dnbd3_image_t *expected = NULL;
+	// Hold a reference so this image won't be picked
+	mutex_lock( &image->lock );
+	image->users++;
+	mutex_unlock( &image->lock );
+	atomic_store( &diskSpaceSize, size );
+	if ( !atomic_compare_exchange_strong( &diskSpaceImage, &expected, image ) ) {
+		image_release( image );
+	}
+}
+
+/**
+ * Handle request made by image_requestDiskSpace(), if any.
+ * Locks on: reloadLock, and everything image_freeRetired() locks on
+ */
+void image_freeRequestedDiskSpace()
+{
+	dnbd3_image_t * const image = atomic_exchange( &diskSpaceImage, NULL );
+	if ( image == NULL )
+		return;
+	image_ensureDiskSpaceLocked( atomic_load( &diskSpaceSize ), true );
+	image_release( image );
+}
+
 /**
  * Call image_ensureDiskSpace (below), but aquire
  * reloadLock first.
  */
-bool image_ensureDiskSpaceLocked(uint64_t size, bool force)
+static bool image_ensureDiskSpaceLocked(uint64_t size, bool force)
 {
 	bool ret;
 	mutex_lock( &reloadLock );
@@ -1693,21 +2288,23 @@ static bool image_ensureDiskSpace(uint64_t size, bool force)
 				(int)(size / (1024 * 1024)) );
 		// Find least recently used image
 		dnbd3_image_t *oldest = NULL;
-		int i; // XXX improve locking
-		for (i = 0; i < _num_images; ++i) {
-			if ( _images[i] == NULL ) continue;
-			dnbd3_image_t *current = image_lock( _images[i] );
-			if ( current == NULL ) continue;
-			if ( current->users == 1 ) { // Just from the lock above
-				if ( oldest == NULL || timing_1le2( &current->atime, &oldest->atime ) ) {
+		ticks oldestAtime;
+		imagelist_t * const list = imagelist_acquire();
+		for ( int i = 0; i < list->count; ++i ) {
+			dnbd3_image_t * const current = list->images[i];
+			mutex_lock( &current->lock );
+			if ( current->users == 0 ) {
+				if ( oldest == NULL || timing_1le2( &current->atime, &oldestAtime ) ) {
 					// Oldest access time so far
 					oldest = current;
+					oldestAtime = current->atime;
 				}
 			}
-			current = image_release( current );
+			mutex_unlock( &current->lock );
 		}
 		declare_now;
-		if ( oldest == NULL || ( !_sparseFiles && timing_diff( &oldest->atime, &now ) < 86400 ) ) {
+		if ( oldest == NULL || ( !_sparseFiles && timing_diff( &oldestAtime, &now ) < 86400 ) ) {
+			imagelist_release( list );
 			if ( oldest == NULL ) {
 				logadd( LOG_INFO, "All images are currently in use :-(" );
 			} else {
@@ -1715,12 +2312,18 @@ static bool image_ensureDiskSpace(uint64_t size, bool force)
 			}
 			return false;
 		}
-		oldest = image_lock( oldest );
-		if ( oldest == NULL ) continue; // Image freed in the meantime? Try again
+		// Still valid thanks to our snapshot, grab a reference before dropping it
+		mutex_lock( &oldest->lock );
+		oldest->users++;
+		mutex_unlock( &oldest->lock );
+		imagelist_release( list );
 		logadd( LOG_INFO, "'%s:%d' has to go!", oldest->name, (int)oldest->rid );
 		char *filename = strdup( oldest->path );
+		ssdcache_discard( oldest );
 		oldest = image_remove( oldest );
 		oldest = image_release( oldest );
+		// Space is only available again once the file is closed
+		image_freeRetired();
 		unlink( filename );
 		size_t len = strlen( filename ) + 10;
 		char buffer[len];
@@ -1730,6 +2333,10 @@ static bool image_ensureDiskSpace(uint64_t size, bool force)
 		unlink( buffer );
 		snprintf( buffer, len, "%s.meta", filename );
 		unlink( buffer );
+		snprintf( buffer, len, "%s.heat", filename );
+		unlink( buffer );
+		snprintf( buffer, len, "%s.dedup", filename );
+		unlink( buffer );
 		free( filename );
 	}
 	return false;
@@ -1741,13 +2348,10 @@ void image_closeUnusedFd()
 	ticks deadline;
 	timing_gets( &deadline, -UNUSED_FD_TIMEOUT );
 	char imgstr[300];
-	mutex_lock( &imageListLock );
-	for (i = 0; i < _num_images; ++i) {
-		dnbd3_image_t * const image = _images[i];
-		if ( image == NULL )
-			continue;
+	imagelist_t * const list = imagelist_acquire();
+	for (i = 0; i < list->count; ++i) {
+		dnbd3_image_t * const image = list->images[i];
 		mutex_lock( &image->lock );
-		mutex_unlock( &imageListLock );
 		if ( image->users == 0 && image->uplink == NULL && timing_reached( &image->atime, &deadline ) ) {
 			snprintf( imgstr, sizeof(imgstr), "%s:%d", image->name, (int)image->rid );
 			fd = image->readFd;
@@ -1760,9 +2364,40 @@ void image_closeUnusedFd()
 			close( fd );
 			logadd( LOG_DEBUG1, "Inactive fd closed for %s", imgstr );
 		}
-		mutex_lock( &imageListLock );
 	}
-	mutex_unlock( &imageListLock );
+	imagelist_release( list );
+}
+
+/**
+ * Free CRC-32 lists of images nobody used for a while. They get
+ * loaded from disk again by image_ensureCrcList() when needed.
+ */
+void image_freeUnusedCrcLists()
+{
+	ticks deadline;
+	timing_gets( &deadline, -UNUSED_CRC_TIMEOUT );
+	int count = 0;
+	imagelist_t * const list = imagelist_acquire();
+	for ( int i = 0; i < list->count; ++i ) {
+		dnbd3_image_t * const image = list->images[i];
+		uint32_t *crc32list = NULL;
+		mutex_lock( &image->lock );
+		if ( image->users == 0 && image->uplink == NULL && image->crc32 != NULL
+				&& timing_reached( &image->atime, &deadline ) ) {
+			crc32list = image->crc32;
+			image->crc32 = NULL;
+			image->crc32Deferred = true;
+		}
+		mutex_unlock( &image->lock );
+		if ( crc32list != NULL ) {
+			free( crc32list );
+			count++;
+		}
+	}
+	imagelist_release( list );
+	if ( count != 0 ) {
+		logadd( LOG_DEBUG1, "Freed CRC-32 lists of %d inactive images", count );
+	}
 }
 
 /*
@@ -3,7 +3,7 @@
 
 #include "globals.h"
 
-struct json_t;
+#include "jsonstream.h"
 
 void image_serverStartup();
 
@@ -17,6 +17,8 @@ void image_markComplete(dnbd3_image_t *image);
 
 bool image_ensureOpen(dnbd3_image_t *image);
 
+void image_ensureCrcList(dnbd3_image_t *image);
+
 dnbd3_image_t* image_get(char *name, uint16_t revision, bool checkIfWorking);
 
 bool image_reopenCacheFd(dnbd3_image_t *image, const bool force);
@@ -27,25 +29,43 @@ dnbd3_image_t* image_lock(dnbd3_image_t *image);
 
 dnbd3_image_t* image_release(dnbd3_image_t *image);
 
+dnbd3_image_t** image_getAllReferenced(int *count);
+
+dnbd3_image_t* image_getByIndex(int index);
+
+dnbd3_image_t** image_getRevisionsReferenced(const char *name, int *count);
+
 bool image_checkBlocksCrc32(int fd, uint32_t *crc32list, const int *blocks, const uint64_t fileSize);
 
 void image_killUplinks();
 
 bool image_loadAll(char *path);
 
+bool image_loadFile(const char *file);
+
+void image_removeVanished(const char *path);
+
 bool image_tryFreeAll();
 
+void image_freeRetired();
+
 bool image_create(char *image, int revision, uint64_t size);
 
 bool image_generateCrcFile(char *image);
 
-struct json_t* image_getListAsJson();
+void image_writeListJson(jsonstream_t *js);
+
+void image_getMemoryStats(int *imageCount, uint64_t *imageBytes, int *uplinkCount, uint64_t *uplinkBytes);
 
 int image_getCompletenessEstimate(dnbd3_image_t * const image);
 
 void image_closeUnusedFd();
 
-bool image_ensureDiskSpaceLocked(uint64_t size, bool force);
+void image_freeUnusedCrcLists();
+
+void image_requestDiskSpace(dnbd3_image_t *image, uint64_t size);
+
+void image_freeRequestedDiskSpace();
 
 // one byte in the map covers 8 4kib blocks, so 32kib per byte
 // "+ (1 << 15) - 1" is required to account for the last bit of
@@ -0,0 +1,249 @@
+#include "imageindex.h"
+
+#include "helper.h"
+#include "locks.h"
+#include "image.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#define INDEX_HEADER "dnbd3-image-index 1\n"
+#define TABLE_SIZE (8192) // Power of two, somewhat larger than SERVER_MAX_IMAGES
+
+typedef struct _index_entry
+{
+	struct _index_entry *next;
+	uint64_t size;
+	uint64_t inode;
+	int64_t mtime;     // ns
+	uint64_t crcSize;
+	uint64_t crcInode;
+	int64_t crcMtime;  // ns
+	uint32_t masterCrc;
+	char path[];
+} index_entry_t;
+
+static pthread_mutex_t indexLock;
+// Protected by indexLock
+static index_entry_t *table[TABLE_SIZE];
+static bool changed = false;
+
+static bool statFiles(const char *path, index_entry_t *entry);
+static index_entry_t* find(const char *path);
+static bool insert(const char *path, const index_entry_t *data);
+static uint32_t hashOf(const char *path);
+
+void imageindex_init()
+{
+	mutex_init( &indexLock );
+	if ( _imageIndexFile == NULL )
+		return;
+	FILE *fh = fopen( _imageIndexFile, "r" );
+	if ( fh == NULL ) {
+		logadd( LOG_INFO, "No image index at %s, all images will be checked while loading", _imageIndexFile );
+		return;
+	}
+	char line[2200];
+	if ( fgets( line, sizeof(line), fh ) == NULL || strcmp( line, INDEX_HEADER ) != 0 ) {
+		logadd( LOG_WARNING, "Ignoring image index %s: Unknown format", _imageIndexFile );
+		fclose( fh );
+		return;
+	}
+	int count = 0;
+	mutex_lock( &indexLock );
+	while ( fgets( line, sizeof(line), fh ) != NULL ) {
+		index_entry_t e;
+		int pathStart = -1;
+		sscanf( line, "%" SCNu64 " %" SCNu64 " %" SCNd64 " %" SCNu64 " %" SCNu64 " %" SCNd64 " %" SCNu32 " %n",
+				&e.size, &e.inode, &e.mtime, &e.crcSize, &e.crcInode, &e.crcMtime, &e.masterCrc, &pathStart );
+		const size_t len = strlen( line );
+		if ( pathStart <= 0 || len == 0 || line[len - 1] != '\n' || line[pathStart] != '/' ) {
+			logadd( LOG_WARNING, "Ignoring malformed entry in image index %s", _imageIndexFile );
+			continue;
+		}
+		line[len - 1] = '\0';
+		if ( insert( line + pathStart, &e ) ) {
+			count++;
+		}
+	}
+	mutex_unlock( &indexLock );
+	fclose( fh );
+	logadd( LOG_INFO, "Loaded %d entries from image index %s", count, _imageIndexFile );
+}
+
+void imageindex_shutdown()
+{
+	if ( _imageIndexFile == NULL )
+		return;
+	imageindex_save();
+	mutex_lock( &indexLock );
+	for ( int i = 0; i < TABLE_SIZE; ++i ) {
+		while ( table[i] != NULL ) {
+			index_entry_t *e = table[i];
+			table[i] = e->next;
+			free( e );
+		}
+	}
+	mutex_unlock( &indexLock );
+}
+
+bool imageindex_isUnchanged(const char *path, uint64_t *size, uint32_t *masterCrc)
+{
+	if ( _imageIndexFile == NULL )
+		return false;
+	index_entry_t now;
+	if ( !statFiles( path, &now ) )
+		return false;
+	bool ret = false;
+	mutex_lock( &indexLock );
+	const index_entry_t * const e = find( path );
+	if ( e != NULL && e->size == now.size && e->inode == now.inode && e->mtime == now.mtime
+			&& e->crcSize == now.crcSize && e->crcInode == now.crcInode && e->crcMtime == now.crcMtime ) {
+		*size = e->size;
+		*masterCrc = e->masterCrc;
+		ret = true;
+	}
+	mutex_unlock( &indexLock );
+	return ret;
+}
+
+void imageindex_update(const char *path, uint32_t masterCrc)
+{
+	if ( _imageIndexFile == NULL )
+		return;
+	index_entry_t now;
+	if ( !statFiles( path, &now ) )
+		return;
+	now.masterCrc = masterCrc;
+	mutex_lock( &indexLock );
+	if ( insert( path, &now ) ) {
+		changed = true;
+	}
+	mutex_unlock( &indexLock );
+}
+
+void imageindex_save()
+{
+	if ( _imageIndexFile == NULL )
+		return;
+	mutex_lock( &indexLock );
+	const bool needed = changed;
+	changed = false;
+	mutex_unlock( &indexLock );
+	if ( !needed )
+		return;
+	char tmpFile[strlen( _imageIndexFile ) + 5];
+	snprintf( tmpFile, sizeof(tmpFile), "%s.tmp", _imageIndexFile );
+	FILE *fh = fopen( tmpFile, "w" );
+	if ( fh == NULL ) {
+		logadd( LOG_WARNING, "Cannot write image index %s (errno=%d)", tmpFile, errno );
+		return;
+	}
+	int imageCount, count = 0;
+	dnbd3_image_t **images = image_getAllReferenced( &imageCount );
+	bool ok = fputs( INDEX_HEADER, fh ) >= 0;
+	for ( int i = 0; i < imageCount; ++i ) {
+		dnbd3_image_t * const image = images[i];
+		mutex_lock( &image->lock );
+		const bool complete = image->cache_map == NULL;
+		mutex_unlock( &image->lock );
+		if ( complete ) {
+			mutex_lock( &indexLock );
+			const index_entry_t * const e = find( image->path );
+			if ( e != NULL && strchr( e->path, '\n' ) == NULL ) {
+				ok = ok && fprintf( fh, "%" PRIu64 " %" PRIu64 " %" PRId64 " %" PRIu64 " %" PRIu64 " %" PRId64 " %" PRIu32 " %s\n",
+						e->size, e->inode, e->mtime, e->crcSize, e->crcInode, e->crcMtime, e->masterCrc, e->path ) > 0;
+				count++;
+			}
+			mutex_unlock( &indexLock );
+		}
+		image_release( image );
+	}
+	free( images );
+	if ( fclose( fh ) != 0 || !ok || rename( tmpFile, _imageIndexFile ) != 0 ) {
+		logadd( LOG_WARNING, "Could not write image index %s (errno=%d)", _imageIndexFile, errno );
+		unlink( tmpFile );
+		mutex_lock( &indexLock );
+		changed = true;
+		mutex_unlock( &indexLock );
+		return;
+	}
+	logadd( LOG_DEBUG1, "Saved %d entries to image index %s", count, _imageIndexFile );
+}
+
+/**
+ * Fill in metadata of image file and its CRC-32 list.
+ * @return false if either is missing, or the image has a cache map
+ */
+static bool statFiles(const char *path, index_entry_t *entry)
+{
+	struct stat st;
+	char extra[strlen( path ) + 5];
+	snprintf( extra, sizeof(extra), "%s.map", path );
+	if ( stat( extra, &st ) == 0 || errno != ENOENT )
+		return false;
+	if ( stat( path, &st ) != 0 )
+		return false;
+	entry->size = (uint64_t)st.st_size;
+	entry->inode = (uint64_t)st.st_ino;
+	entry->mtime = (int64_t)st.st_mtim.tv_sec * 1000000000ll + st.st_mtim.tv_nsec;
+	snprintf( extra, sizeof(extra), "%s.crc", path );
+	if ( stat( extra, &st ) != 0 )
+		return false;
+	entry->crcSize = (uint64_t)st.st_size;
+	entry->crcInode = (uint64_t)st.st_ino;
+	entry->crcMtime = (int64_t)st.st_mtim.tv_sec * 1000000000ll + st.st_mtim.tv_nsec;
+	return true;
+}
+
+/**
+ * Find entry for path. Caller must hold indexLock.
+ */
+static index_entry_t* find(const char *path)
+{
+	for ( index_entry_t *e = table[hashOf( path )]; e != NULL; e = e->next ) {
+		if ( strcmp( e->path, path ) == 0 )
+			return e;
+	}
+	return NULL;
+}
+
+/**
+ * Add or replace entry for path. Caller must hold indexLock.
+ */
+static bool insert(const char *path, const index_entry_t *data)
+{
+	index_entry_t *e = find( path );
+	if ( e == NULL ) {
+		const size_t len = strlen( path ) + 1;
+		e = malloc( sizeof(*e) + len );
+		if ( e == NULL )
+			return false;
+		memcpy( e->path, path, len );
+		const uint32_t bucket = hashOf( path );
+		e->next = table[bucket];
+		table[bucket] = e;
+	}
+	e->size = data->size;
+	e->inode = data->inode;
+	e->mtime = data->mtime;
+	e->crcSize = data->crcSize;
+	e->crcInode = data->crcInode;
+	e->crcMtime = data->crcMtime;
+	e->masterCrc = data->masterCrc;
+	return true;
+}
+
+static uint32_t hashOf(const char *path)
+{
+	// FNV-1a
+	uint32_t h = 2166136261u;
+	while ( *path != '\0' ) {
+		h = ( h ^ (uint8_t)*path++ ) * 16777619u;
+	}
+	return h & ( TABLE_SIZE - 1 );
+}
@@ -0,0 +1,46 @@
+#ifndef _IMAGEINDEX_H_
+#define _IMAGEINDEX_H_
+
+#include "globals.h"
+
+/*
+ * Persistent index of complete images that passed the checks in
+ * image_load(). For each image, the size, mtime and inode of the image
+ * and its CRC-32 list are recorded, along with the master CRC. If none
+ * of these changed since the last run, the image can be added to the
+ * list right away, without opening it, reading its CRC-32 list or
+ * spot-checking random blocks.
+ */
+
+/**
+ * Load index from imageIndexFile, if configured.
+ * Call before loading images.
+ */
+void imageindex_init();
+
+/**
+ * Save index if it changed and free it.
+ */
+void imageindex_shutdown();
+
+/**
+ * Check if the image at path is known and neither the image file nor
+ * its CRC-32 list changed since, and it has no cache map.
+ * @param size set to the image's size if true is returned
+ * @param masterCrc set to the CRC-32 of the CRC-32 list if true is returned
+ */
+bool imageindex_isUnchanged(const char *path, uint64_t *size, uint32_t *masterCrc);
+
+/**
+ * Record current metadata of the complete image at path,
+ * after it was loaded and checked successfully.
+ */
+void imageindex_update(const char *path, uint32_t masterCrc);
+
+/**
+ * Write index to disk if it changed, only keeping entries of images
+ * that are currently loaded.
+ */
+void imageindex_save();
+
+#endif
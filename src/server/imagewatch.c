@@ -0,0 +1,240 @@
+#include "imagewatch.h"
+
+#include "helper.h"
+#include "locks.h"
+#include "image.h"
+#include "../shared/fdsignal.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+
+#define WATCH_MASK ( IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE | IN_CREATE | IN_ONLYDIR )
+#define WATCH_PATHLEN (2000)
+
+static pthread_t thread;
+static bool haveThread = false;
+static dnbd3_signal_t *stopSignal = NULL;
+static int inotifyFd = -1;
+// Only accessed by watch thread after init: Watched directory per watch descriptor
+static char **watchPaths = NULL;
+static int watchCapacity = 0;
+
+static void* imagewatch_main(void *data);
+static void handleEvent(const struct inotify_event *event);
+static void watchTree(const char *path, bool loadImages);
+static void unwatchTree(const char *path);
+static void setWatchPath(int wd, const char *path);
+#endif
+
+void imagewatch_init()
+{
+	if ( !_watchImages )
+		return;
+#ifdef __linux__
+	inotifyFd = inotify_init1( IN_NONBLOCK | IN_CLOEXEC );
+	if ( inotifyFd == -1 ) {
+		logadd( LOG_WARNING, "Could not initialize inotify (errno=%d), not watching %s", errno, _basePath );
+		return;
+	}
+	stopSignal = signal_new();
+	if ( stopSignal == NULL ) {
+		logadd( LOG_WARNING, "Could not create signal for image watch thread" );
+		close( inotifyFd );
+		inotifyFd = -1;
+		return;
+	}
+	watchTree( _basePath, false );
+	pthread_attr_t attrs;
+	initThreadAttrs( &attrs, false );
+	haveThread = ( 0 == thread_create( &thread, &attrs, &imagewatch_main, (void *)NULL ) );
+	pthread_attr_destroy( &attrs );
+	if ( !haveThread ) {
+		logadd( LOG_WARNING, "Could not start image watch thread" );
+		imagewatch_shutdown();
+		return;
+	}
+	logadd( LOG_INFO, "Watching %s for new images", _basePath );
+#else
+	logadd( LOG_WARNING, "watchImages is only supported on Linux" );
+#endif
+}
+
+void imagewatch_shutdown()
+{
+#ifdef __linux__
+	if ( haveThread ) {
+		logadd( LOG_DEBUG1, "Shutting down image watch thread...\n" );
+		signal_call( stopSignal );
+		thread_join( thread, NULL );
+		haveThread = false;
+		logadd( LOG_DEBUG1, "Image watch thread exited normally.\n" );
+	}
+	if ( stopSignal != NULL ) {
+		signal_close( stopSignal );
+		stopSignal = NULL;
+	}
+	if ( inotifyFd != -1 ) {
+		close( inotifyFd );
+		inotifyFd = -1;
+	}
+	for ( int i = 0; i < watchCapacity; ++i ) {
+		free( watchPaths[i] );
+	}
+	free( watchPaths );
+	watchPaths = NULL;
+	watchCapacity = 0;
+#endif
+}
+
+#ifdef __linux__
+
+static void* imagewatch_main(void *data UNUSED)
+{
+	_Alignas(struct inotify_event) char buffer[16384];
+	setThreadName( "image-watch" );
+	blockNoncriticalSignals();
+	struct pollfd pfd[2] = {
+		{ .fd = inotifyFd, .events = POLLIN },
+		{ .fd = signal_getWaitFd( stopSignal ), .events = POLLIN },
+	};
+	while ( !_shutdown ) {
+		if ( poll( pfd, 2, -1 ) == -1 ) {
+			if ( errno == EINTR )
+				continue;
+			logadd( LOG_WARNING, "poll() on inotify fd failed (errno=%d), not watching %s anymore", errno, _basePath );
+			break;
+		}
+		if ( pfd[1].revents != 0 )
+			break;
+		for ( ;; ) {
+			const ssize_t len = read( inotifyFd, buffer, sizeof(buffer) );
+			if ( len <= 0 )
+				break; // EAGAIN
+			for ( ssize_t pos = 0; pos < len && !_shutdown; ) {
+				const struct inotify_event * const event = (const struct inotify_event*)( buffer + pos );
+				handleEvent( event );
+				pos += (ssize_t)( sizeof(*event) + event->len );
+			}
+		}
+	}
+	return NULL;
+}
+
+static void handleEvent(const struct inotify_event *event)
+{
+	if ( event->mask & IN_Q_OVERFLOW ) {
+		logadd( LOG_WARNING, "Lost inotify events for %s, re-scanning image directory", _basePath );
+		watchTree( _basePath, false );
+		image_loadAll( NULL );
+		return;
+	}
+	if ( event->wd < 0 || event->wd >= watchCapacity || watchPaths[event->wd] == NULL )
+		return;
+	if ( event->mask & IN_IGNORED ) {
+		// Directory was deleted, or we removed the watch
+		free( watchPaths[event->wd] );
+		watchPaths[event->wd] = NULL;
+		return;
+	}
+	if ( event->len == 0 || event->name[0] == '.' )
+		return; // Event for the directory itself, or hidden file (like temporary files of rsync)
+	char path[WATCH_PATHLEN];
+	if ( snprintf( path, sizeof(path), "%s/%s", watchPaths[event->wd], event->name ) >= (int)sizeof(path) )
+		return;
+	if ( event->mask & IN_ISDIR ) {
+		if ( event->mask & ( IN_CREATE | IN_MOVED_TO ) ) {
+			watchTree( path, true );
+		} else if ( event->mask & ( IN_MOVED_FROM | IN_DELETE ) ) {
+			unwatchTree( path );
+			if ( _removeMissingImages ) {
+				image_removeVanished( path );
+			}
+		}
+	} else if ( event->mask & ( IN_CLOSE_WRITE | IN_MOVED_TO ) ) {
+		// New files trigger IN_CREATE too, but wait until they're complete
+		logadd( LOG_DEBUG1, "Image directory changed: %s", path );
+		image_loadFile( path );
+	} else if ( event->mask & ( IN_MOVED_FROM | IN_DELETE ) ) {
+		if ( _removeMissingImages ) {
+			image_removeVanished( path );
+		}
+	}
+}
+
+/**
+ * Add watches for path and all directories below it,
+ * optionally loading all images found on the way.
+ */
+static void watchTree(const char *path, bool loadImages)
+{
+	const int wd = inotify_add_watch( inotifyFd, path, WATCH_MASK );
+	if ( wd == -1 ) {
+		// ENOSPC means fs.inotify.max_user_watches is too low
+		logadd( LOG_WARNING, "Cannot watch %s (errno=%d), SIGHUP needed to pick up changes there", path, errno );
+	} else {
+		setWatchPath( wd, path );
+	}
+	DIR * const dir = opendir( path );
+	if ( dir == NULL )
+		return;
+	struct dirent *entry;
+	char subpath[WATCH_PATHLEN];
+	struct stat st;
+	while ( !_shutdown && ( entry = readdir( dir ) ) != NULL ) {
+		if ( entry->d_name[0] == '.' )
+			continue;
+		if ( snprintf( subpath, sizeof(subpath), "%s/%s", path, entry->d_name ) >= (int)sizeof(subpath) )
+			continue;
+		if ( stat( subpath, &st ) != 0 )
+			continue;
+		if ( S_ISDIR( st.st_mode ) ) {
+			watchTree( subpath, loadImages );
+		} else if ( loadImages ) {
+			image_loadFile( subpath );
+		}
+	}
+	closedir( dir );
+}
+
+/**
+ * Remove watches of directory that was moved away or deleted, and all
+ * of its subdirectories, as they wouldn't match their path anymore.
+ */
+static void unwatchTree(const char *path)
+{
+	const size_t len = strlen( path );
+	for ( int i = 0; i < watchCapacity; ++i ) {
+		if ( watchPaths[i] != NULL && strncmp( watchPaths[i], path, len ) == 0
+				&& ( watchPaths[i][len] == '\0' || watchPaths[i][len] == '/' ) ) {
+			inotify_rm_watch( inotifyFd, i );
+			free( watchPaths[i] );
+			watchPaths[i] = NULL;
+		}
+	}
+}
+
+static void setWatchPath(int wd, const char *path)
+{
+	if ( wd >= watchCapacity ) {
+		const int capacity = MAX( wd + 1, watchCapacity * 2 );
+		char **p = realloc( watchPaths, (size_t)capacity * sizeof(*watchPaths) );
+		if ( p == NULL )
+			return;
+		memset( p + watchCapacity, 0, (size_t)( capacity - watchCapacity ) * sizeof(*p) );
+		watchPaths = p;
+		watchCapacity = capacity;
+	}
+	free( watchPaths[wd] );
+	watchPaths[wd] = strdup( path );
+}
+
+#endif
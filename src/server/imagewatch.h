@@ -0,0 +1,20 @@
+#ifndef _IMAGEWATCH_H_
+#define _IMAGEWATCH_H_
+
+#include "globals.h"
+
+/*
+ * Watch basePath via inotify, loading image files once they have been
+ * written or moved into place, and dropping images whose files got
+ * deleted or moved away. This saves the full rescan triggered by
+ * SIGHUP, which is still used as a fallback if events got lost.
+ */
+
+/**
+ * Start watching basePath. Call once the image list has been loaded.
+ */
+void imagewatch_init();
+
+void imagewatch_shutdown();
+
+#endif
@@ -45,11 +45,13 @@ void integrity_init()
 	queueLen = 0;
 	mutex_unlock( &integrityQueueLock );
 	bRunning = true;
-	if ( 0 != thread_create( &thread, NULL, &integrity_main, (void *)NULL ) ) {
+	pthread_attr_t attrs;
+	initThreadAttrs( &attrs, false );
+	if ( 0 != thread_create( &thread, &attrs, &integrity_main, (void *)NULL ) ) {
 		bRunning = false;
 		logadd( LOG_WARNING, "Could not start integrity check thread. Corrupted images will not be detected." );
-		return;
 	}
+	pthread_attr_destroy( &attrs );
 }
 
 void integrity_shutdown()
@@ -144,6 +146,9 @@ static void* integrity_main(void * data UNUSED)
 				continue;
 			}
 			// We have the image. Call image_release() some time
+			mutex_unlock( &integrityQueueLock );
+			image_ensureCrcList( image );
+			mutex_lock( &integrityQueueLock );
 			const int qCount = checkQueue[i].count;
 			bool foundCorrupted = false;
 			mutex_lock( &image->lock );
@@ -0,0 +1,262 @@
+#include "jsonstream.h"
+#include "../shared/sockhelper.h"
+#include "../types.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+
+static void flush(jsonstream_t *js);
+static void put(jsonstream_t *js, const char *data, size_t len);
+static bool beginValue(jsonstream_t *js, const char *key);
+static void putEscaped(jsonstream_t *js, const char *str, size_t len);
+static void endContainer(jsonstream_t *js, char c);
+
+void jsonstream_init(jsonstream_t *js, int sock, bool chunked)
+{
+	js->sock = sock;
+	js->chunked = chunked;
+	js->failed = false;
+	js->depth = 0;
+	js->suppressDepth = 0;
+	js->filterCount = 0;
+	js->len = 0;
+	js->needComma[0] = false;
+}
+
+void jsonstream_addFilter(jsonstream_t *js, const struct string *fields)
+{
+	size_t start = 0;
+	for ( size_t i = 0; i <= fields->l; ++i ) {
+		if ( i < fields->l && fields->s[i] != ',' )
+			continue;
+		if ( i > start && js->filterCount < JSONSTREAM_MAXFILTER ) {
+			js->filter[js->filterCount].s = fields->s + start;
+			js->filter[js->filterCount].l = i - start;
+			js->filterCount++;
+		}
+		start = i + 1;
+	}
+}
+
+bool jsonstream_wants(jsonstream_t *js, const char *key)
+{
+	if ( js->failed || js->suppressDepth > 0 )
+		return false;
+	// Only filter members of objects that are array elements
+	if ( key == NULL || js->filterCount == 0 || js->depth < 2
+			|| js->isArray[js->depth - 1] || !js->isArray[js->depth - 2] )
+		return true;
+	const size_t len = strlen( key );
+	for ( int i = 0; i < js->filterCount; ++i ) {
+		if ( js->filter[i].l == len && memcmp( js->filter[i].s, key, len ) == 0 )
+			return true;
+	}
+	return false;
+}
+
+void jsonstream_objectStart(jsonstream_t *js, const char *key)
+{
+	if ( js->depth >= JSONSTREAM_MAXDEPTH || !beginValue( js, key ) ) {
+		js->suppressDepth++;
+		return;
+	}
+	put( js, "{", 1 );
+	js->isArray[js->depth] = false;
+	js->needComma[js->depth] = false;
+	js->depth++;
+}
+
+void jsonstream_objectEnd(jsonstream_t *js)
+{
+	endContainer( js, '}' );
+}
+
+void jsonstream_arrayStart(jsonstream_t *js, const char *key)
+{
+	if ( js->depth >= JSONSTREAM_MAXDEPTH || !beginValue( js, key ) ) {
+		js->suppressDepth++;
+		return;
+	}
+	put( js, "[", 1 );
+	js->isArray[js->depth] = true;
+	js->needComma[js->depth] = false;
+	js->depth++;
+}
+
+void jsonstream_arrayEnd(jsonstream_t *js)
+{
+	endContainer( js, ']' );
+}
+
+void jsonstream_string(jsonstream_t *js, const char *key, const char *value)
+{
+	jsonstream_stringn( js, key, value, strlen( value ) );
+}
+
+void jsonstream_stringn(jsonstream_t *js, const char *key, const char *value, size_t len)
+{
+	if ( !beginValue( js, key ) )
+		return;
+	put( js, "\"", 1 );
+	putEscaped( js, value, len );
+	put( js, "\"", 1 );
+}
+
+void jsonstream_int(jsonstream_t *js, const char *key, int64_t value)
+{
+	if ( !beginValue( js, key ) )
+		return;
+	char buf[24];
+	int len = snprintf( buf, sizeof(buf), "%" PRId64, value );
+	put( js, buf, (size_t)len );
+}
+
+void jsonstream_bool(jsonstream_t *js, const char *key, bool value)
+{
+	if ( !beginValue( js, key ) )
+		return;
+	if ( value ) {
+		put( js, "true", 4 );
+	} else {
+		put( js, "false", 5 );
+	}
+}
+
+void jsonstream_null(jsonstream_t *js, const char *key)
+{
+	if ( !beginValue( js, key ) )
+		return;
+	put( js, "null", 4 );
+}
+
+void jsonstream_raw(jsonstream_t *js, const char *key, const char *json)
+{
+	if ( !beginValue( js, key ) )
+		return;
+	put( js, json, strlen( json ) );
+}
+
+bool jsonstream_finish(jsonstream_t *js)
+{
+	while ( js->suppressDepth > 0 || js->depth > 0 ) {
+		// Unbalanced calls, close everything so we at least send valid JSON
+		if ( js->suppressDepth == 0 && js->isArray[js->depth - 1] ) {
+			jsonstream_arrayEnd( js );
+		} else {
+			jsonstream_objectEnd( js );
+		}
+	}
+	flush( js );
+	if ( js->chunked && !js->failed ) {
+		if ( sock_sendAll( js->sock, "0\r\n\r\n", 5, 10 ) != 5 ) {
+			js->failed = true;
+		}
+	}
+	return !js->failed;
+}
+
+/**
+ * Write separator and key for the next value at the current level.
+ * @return false if the value should not be written
+ */
+static bool beginValue(jsonstream_t *js, const char *key)
+{
+	if ( !jsonstream_wants( js, key ) )
+		return false;
+	if ( js->depth == 0 )
+		return true;
+	const int d = js->depth - 1;
+	if ( js->needComma[d] ) {
+		put( js, ",", 1 );
+	}
+	js->needComma[d] = true;
+	if ( key != NULL && !js->isArray[d] ) {
+		put( js, "\"", 1 );
+		putEscaped( js, key, strlen( key ) );
+		put( js, "\":", 2 );
+	}
+	return true;
+}
+
+static void endContainer(jsonstream_t *js, char c)
+{
+	if ( js->suppressDepth > 0 ) {
+		js->suppressDepth--;
+		return;
+	}
+	if ( js->depth == 0 )
+		return;
+	js->depth--;
+	put( js, &c, 1 );
+}
+
+static void putEscaped(jsonstream_t *js, const char *str, size_t len)
+{
+	static const char hex[] = "0123456789abcdef";
+	size_t start = 0;
+	for ( size_t i = 0; i < len; ++i ) {
+		const unsigned char c = (unsigned char)str[i];
+		if ( c >= 0x20 && c != '"' && c != '\\' )
+			continue;
+		put( js, str + start, i - start );
+		start = i + 1;
+		char esc[6] = { '\\', 0 };
+		size_t elen = 2;
+		switch ( c ) {
+		case '"': esc[1] = '"'; break;
+		case '\\': esc[1] = '\\'; break;
+		case '\n': esc[1] = 'n'; break;
+		case '\r': esc[1] = 'r'; break;
+		case '\t': esc[1] = 't'; break;
+		default:
+			esc[1] = 'u';
+			esc[2] = '0';
+			esc[3] = '0';
+			esc[4] = hex[c >> 4];
+			esc[5] = hex[c & 0xf];
+			elen = 6;
+		}
+		put( js, esc, elen );
+	}
+	put( js, str + start, len - start );
+}
+
+static void put(jsonstream_t *js, const char *data, size_t len)
+{
+	while ( len > 0 && !js->failed ) {
+		if ( js->len == JSONSTREAM_BUFSIZE ) {
+			flush( js );
+			continue;
+		}
+		const size_t n = MIN( len, JSONSTREAM_BUFSIZE - js->len );
+		memcpy( js->buffer + JSONSTREAM_HEADROOM + js->len, data, n );
+		js->len += n;
+		data += n;
+		len -= n;
+	}
+}
+
+/**
+ * Send buffer contents. In chunked mode, the chunk header gets
+ * written right in front of the payload, so it's a single send.
+ */
+static void flush(jsonstream_t *js)
+{
+	if ( js->len == 0 || js->failed )
+		return;
+	char *start = js->buffer + JSONSTREAM_HEADROOM;
+	size_t total = js->len;
+	if ( js->chunked ) {
+		char head[JSONSTREAM_HEADROOM + 1];
+		const int hlen = snprintf( head, sizeof(head), "%zx\r\n", js->len );
+		start -= hlen;
+		memcpy( start, head, (size_t)hlen );
+		memcpy( start + hlen + js->len, "\r\n", 2 );
+		total += (size_t)hlen + 2;
+	}
+	if ( sock_sendAll( js->sock, start, total, 10 ) != (ssize_t)total ) {
+		js->failed = true;
+	}
+	js->len = 0;
+}
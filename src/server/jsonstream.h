@@ -0,0 +1,83 @@
+#ifndef _JSONSTREAM_H_
+#define _JSONSTREAM_H_
+
+#include "picohttpparser/picohttpparser.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Minimal JSON writer that serializes straight into a socket, flushing
+ * whenever its buffer fills up, optionally using HTTP chunked encoding.
+ * Errors are sticky: once a send fails, everything else is a no-op and
+ * jsonstream_finish() returns false.
+ *
+ * Pass key = NULL for values inside arrays or for the top level value.
+ */
+
+#define JSONSTREAM_BUFSIZE (16 * 1024)
+#define JSONSTREAM_HEADROOM 8 // Room for chunk header in front of payload
+#define JSONSTREAM_MAXDEPTH 16
+#define JSONSTREAM_MAXFILTER 20
+
+typedef struct
+{
+	int sock;
+	bool chunked;
+	bool failed;
+	int depth;
+	int suppressDepth;  // > 0 while writing a filtered out value
+	bool isArray[JSONSTREAM_MAXDEPTH];
+	bool needComma[JSONSTREAM_MAXDEPTH];
+	int filterCount;
+	struct string filter[JSONSTREAM_MAXFILTER];
+	size_t len;
+	char buffer[JSONSTREAM_HEADROOM + JSONSTREAM_BUFSIZE + 2];
+} jsonstream_t;
+
+void jsonstream_init(jsonstream_t *js, int sock, bool chunked);
+
+/**
+ * Only output the given keys in objects that are array elements,
+ * like the entries of the image or client list. Comma separated
+ * lists are split up. Other objects are not affected.
+ */
+void jsonstream_addFilter(jsonstream_t *js, const struct string *fields);
+
+/**
+ * Check whether the value for key would be written at the current
+ * position, so callers can skip expensive computations.
+ */
+bool jsonstream_wants(jsonstream_t *js, const char *key);
+
+void jsonstream_objectStart(jsonstream_t *js, const char *key);
+
+void jsonstream_objectEnd(jsonstream_t *js);
+
+void jsonstream_arrayStart(jsonstream_t *js, const char *key);
+
+void jsonstream_arrayEnd(jsonstream_t *js);
+
+void jsonstream_string(jsonstream_t *js, const char *key, const char *value);
+
+void jsonstream_stringn(jsonstream_t *js, const char *key, const char *value, size_t len);
+
+void jsonstream_int(jsonstream_t *js, const char *key, int64_t value);
+
+void jsonstream_bool(jsonstream_t *js, const char *key, bool value);
+
+void jsonstream_null(jsonstream_t *js, const char *key);
+
+/**
+ * Write already serialized JSON value.
+ */
+void jsonstream_raw(jsonstream_t *js, const char *key, const char *json);
+
+/**
+ * Flush remaining data, and write the terminating chunk
+ * if in chunked mode.
+ * @return false if sending failed at any point
+ */
+bool jsonstream_finish(jsonstream_t *js);
+
+#endif
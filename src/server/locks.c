@@ -8,6 +8,139 @@
 #include "locks.h"
 #include "helper.h"
 #include "../shared/timing.h"
+#include <string.h>
+#include <time.h>
+
+#define LOCKPROF_SLOTS 128 // Power of two
+
+typedef struct
+{
+	_Alignas(CACHE_LINE_SIZE) _Atomic(const char *) name;
+	atomic_uint_fast64_t sampled, sampledContended, contended;
+	atomic_uint_fast64_t waitTotalNs, waitMaxNs, holdTotalNs, holdMaxNs;
+	atomic_uint_fast64_t waitHist[LOCKPROF_BUCKETS];
+	atomic_uint_fast64_t holdHist[LOCKPROF_BUCKETS];
+} lockprof_entry_t;
+
+static lockprof_entry_t profEntries[LOCKPROF_SLOTS];
+
+_Thread_local int lockprof_countdown = 0;
+_Thread_local pthread_mutex_t *lockprof_heldLock = NULL;
+static _Thread_local lockprof_entry_t *heldEntry = NULL;
+static _Thread_local uint64_t heldSince;
+
+static uint64_t nowNs()
+{
+	struct timespec ts;
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * Find or create the entry for given lock name. Lock-free, entries
+ * are never removed. Returns NULL if the table is full.
+ */
+static lockprof_entry_t* getEntry(const char *name)
+{
+	uint32_t hash = 2166136261u;
+	for ( const char *p = name; *p != '\0'; ++p ) {
+		hash = ( hash ^ (uint8_t)*p ) * 16777619u;
+	}
+	for ( uint32_t i = 0; i < LOCKPROF_SLOTS; ++i ) {
+		lockprof_entry_t *e = &profEntries[( hash + i ) & ( LOCKPROF_SLOTS - 1 )];
+		const char *current = atomic_load_explicit( &e->name, memory_order_acquire );
+		if ( current == NULL ) {
+			if ( atomic_compare_exchange_strong( &e->name, &current, name ) )
+				return e;
+			// Lost race, current now holds the winner's name
+		}
+		if ( current == name || strcmp( current, name ) == 0 )
+			return e;
+	}
+	return NULL;
+}
+
+static void addSample(atomic_uint_fast64_t *hist, atomic_uint_fast64_t *total, atomic_uint_fast64_t *max, uint64_t ns)
+{
+	const uint64_t us = ns / 1000;
+	const int bucket = us == 0 ? 0 : MIN( LOCKPROF_BUCKETS - 1, 64 - __builtin_clzll( us ) );
+	atomic_fetch_add_explicit( &hist[bucket], 1, memory_order_relaxed );
+	atomic_fetch_add_explicit( total, ns, memory_order_relaxed );
+	uint64_t old = atomic_load_explicit( max, memory_order_relaxed );
+	while ( ns > old && !atomic_compare_exchange_weak_explicit( max, &old, ns,
+				memory_order_relaxed, memory_order_relaxed ) ) { }
+}
+
+int lockprof_lockSlow(const char *name, pthread_mutex_t *lock, bool sample)
+{
+	lockprof_entry_t *e = getEntry( name );
+	bool contended = true;
+	if ( sample ) {
+		lockprof_countdown = atomic_load_explicit( &_lockProfileRate, memory_order_relaxed );
+		contended = pthread_mutex_trylock( lock ) != 0;
+	}
+	if ( contended ) {
+		const uint64_t start = nowNs();
+		const int ret = pthread_mutex_lock( lock );
+		if ( ret != 0 )
+			return ret;
+		if ( e != NULL ) {
+			atomic_fetch_add_explicit( &e->contended, 1, memory_order_relaxed );
+			addSample( e->waitHist, &e->waitTotalNs, &e->waitMaxNs, nowNs() - start );
+		}
+	}
+	if ( sample && e != NULL ) {
+		atomic_fetch_add_explicit( &e->sampled, 1, memory_order_relaxed );
+		if ( contended ) {
+			atomic_fetch_add_explicit( &e->sampledContended, 1, memory_order_relaxed );
+		}
+		heldEntry = e;
+		lockprof_heldLock = lock;
+		heldSince = nowNs();
+	}
+	return 0;
+}
+
+void lockprof_releaseSampled()
+{
+	lockprof_entry_t *e = heldEntry;
+	addSample( e->holdHist, &e->holdTotalNs, &e->holdMaxNs, nowNs() - heldSince );
+	heldEntry = NULL;
+	lockprof_heldLock = NULL;
+}
+
+static int cmpWaitTotal(const void *a, const void *b)
+{
+	const uint64_t wa = ((const lockprof_stats_t*)a)->waitTotalNs;
+	const uint64_t wb = ((const lockprof_stats_t*)b)->waitTotalNs;
+	return wa < wb ? 1 : ( wa > wb ? -1 : 0 );
+}
+
+int lockprof_getStats(lockprof_stats_t *out, int max)
+{
+	int count = 0;
+	for ( int i = 0; i < LOCKPROF_SLOTS && count < max; ++i ) {
+		lockprof_entry_t *e = &profEntries[i];
+		lockprof_stats_t *s = &out[count];
+		s->name = atomic_load_explicit( &e->name, memory_order_acquire );
+		if ( s->name == NULL )
+			continue;
+		s->sampled = e->sampled;
+		s->sampledContended = e->sampledContended;
+		s->contended = e->contended;
+		s->waitTotalNs = e->waitTotalNs;
+		s->waitMaxNs = e->waitMaxNs;
+		s->holdTotalNs = e->holdTotalNs;
+		s->holdMaxNs = e->holdMaxNs;
+		for ( int b = 0; b < LOCKPROF_BUCKETS; ++b ) {
+			s->waitHist[b] = e->waitHist[b];
+			s->holdHist[b] = e->holdHist[b];
+		}
+		count++;
+	}
+	qsort( out, count, sizeof(*out), &cmpWaitTotal );
+	return count;
+}
 
 #ifdef _DEBUG
 #define MAXLOCKS (SERVER_MAX_CLIENTS * 2 + SERVER_MAX_ALTS + 200 + SERVER_MAX_IMAGES)
@@ -5,6 +5,9 @@
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
 
 #ifdef _DEBUG
 
@@ -28,14 +31,79 @@ void debug_dump_lock_stats();
 #else
 
 #define mutex_init( lock ) pthread_mutex_init(lock, NULL)
-#define mutex_lock( lock ) pthread_mutex_lock(lock)
+#define mutex_lock( lock ) lockprof_lock( #lock, lock )
 #define mutex_trylock( lock ) pthread_mutex_trylock(lock)
-#define mutex_unlock( lock ) pthread_mutex_unlock(lock)
-#define mutex_cond_wait( cond, lock ) pthread_cond_wait(cond, lock)
+#define mutex_unlock( lock ) lockprof_unlock( lock )
+#define mutex_cond_wait( cond, lock ) lockprof_cond_wait( cond, lock )
 #define mutex_destroy( lock ) pthread_mutex_destroy(lock)
 
 #endif
 
+/*
+ * Sampling lock contention profiler for release builds.
+ * Every contended acquisition is timed (that path is slow anyway), plus
+ * every n-th acquisition per thread, for which the hold time is measured
+ * too. Locks are grouped by the expression passed to mutex_lock().
+ * n is taken from _lockProfileRate (globals.c), 0 disables profiling.
+ */
+
+#define LOCKPROF_BUCKETS 16 // log2 buckets, starting at < 1µs
+
+typedef struct
+{
+	const char *name;
+	uint64_t sampled;          // Sampled acquisitions
+	uint64_t sampledContended; // ... of which had to wait
+	uint64_t contended;        // All contended acquisitions
+	uint64_t waitTotalNs, waitMaxNs;
+	uint64_t holdTotalNs, holdMaxNs;
+	uint64_t waitHist[LOCKPROF_BUCKETS];
+	uint64_t holdHist[LOCKPROF_BUCKETS];
+} lockprof_stats_t;
+
+extern atomic_int _lockProfileRate;
+extern _Thread_local int lockprof_countdown;
+extern _Thread_local pthread_mutex_t *lockprof_heldLock;
+
+int lockprof_lockSlow(const char *name, pthread_mutex_t *lock, bool sample);
+
+void lockprof_releaseSampled();
+
+/**
+ * Copy statistics of up to max locks to out, most contended first.
+ * Returns number of entries written.
+ */
+int lockprof_getStats(lockprof_stats_t *out, int max);
+
+static inline int lockprof_lock(const char *name, pthread_mutex_t *lock)
+{
+	const int rate = atomic_load_explicit( &_lockProfileRate, memory_order_relaxed );
+	if ( rate == 0 )
+		return pthread_mutex_lock( lock );
+	// Only sample if we're not already measuring the hold time of another lock
+	const bool sample = --lockprof_countdown <= 0 && lockprof_heldLock == NULL;
+	if ( !sample && pthread_mutex_trylock( lock ) == 0 )
+		return 0;
+	return lockprof_lockSlow( name, lock, sample );
+}
+
+static inline int lockprof_unlock(pthread_mutex_t *lock)
+{
+	if ( lockprof_heldLock == lock ) {
+		lockprof_releaseSampled();
+	}
+	return pthread_mutex_unlock( lock );
+}
+
+static inline int lockprof_cond_wait(pthread_cond_t *restrict cond, pthread_mutex_t *restrict lock)
+{
+	// Time spent sleeping doesn't count as holding the lock
+	if ( lockprof_heldLock == lock ) {
+		lockprof_releaseSampled();
+	}
+	return pthread_cond_wait( cond, lock );
+}
+
 #ifdef DEBUG_THREADS
 
 extern int debugThreadCount;
@@ -18,12 +18,18 @@
  *
  */
 
+#include "net.h"
 #include "helper.h"
 #include "image.h"
 #include "uplink.h"
 #include "locks.h"
 #include "rpc.h"
 #include "altservers.h"
+#include "stats.h"
+#include "ssdcache.h"
+#include "warmup.h"
+#include "bufcache.h"
+#include "dedup.h"
 
 #include "../shared/sockhelper.h"
 #include "../shared/timing.h"
@@ -31,6 +37,7 @@
 #include "../serialize.h"
 
 #include <assert.h>
+#include <fcntl.h>
 
 #ifdef __linux__
 #include <sys/sendfile.h>
@@ -40,22 +47,56 @@
 #include <sys/socket.h>
 #include <sys/uio.h>
 #endif
-#include <jansson.h>
 #include <inttypes.h>
 #include <stdatomic.h>
 
-static dnbd3_client_t *_clients[SERVER_MAX_CLIENTS];
-static int _num_clients = 0;
-static pthread_mutex_t _clients_lock;
+/*
+ * The client list is split into shards with their own lock, so clients
+ * connecting and disconnecting at the same time rarely contend. Within
+ * a shard, a bitmap tracks used slots, making add and remove O(1).
+ * Holding a shard's lock guarantees the clients in it won't be freed.
+ */
+#define SLOTS_PER_SHARD ( ( ( SERVER_MAX_CLIENTS + SERVER_CLIENT_LIST_SHARDS - 1 ) / SERVER_CLIENT_LIST_SHARDS + 63 ) & ~63 )
+#define WORDS_PER_SHARD ( SLOTS_PER_SHARD / 64 )
+typedef struct
+{
+	_Alignas(CACHE_LINE_SIZE)
+	pthread_mutex_t lock;
+	int count;
+	uint64_t used[WORDS_PER_SHARD];
+	dnbd3_client_t *clients[SLOTS_PER_SHARD];
+} clientshard_t;
+
+static clientshard_t _shards[SERVER_CLIENT_LIST_SHARDS];
+static atomic_int _clientCount = 0;
+static atomic_uint _nextShard = 0;
 
 static char nullbytes[500];
 
-static atomic_uint_fast64_t totalBytesSent = 0;
+/*
+ * All clients of an image share the same readFd, so the kernel's readahead
+ * heuristic sees interleaved requests of all of them and mostly gives up.
+ * Instead, track each client's stream separately and announce upcoming
+ * reads via posix_fadvise, with a window that grows while the client keeps
+ * reading sequentially, up to _readaheadSize.
+ */
+typedef struct
+{
+	uint64_t next;   // Offset the client will request next if reading sequentially
+	uint64_t hinted; // End of range already passed to the kernel
+	uint64_t window; // Current readahead window size
+	int fd;          // File the state belongs to, start over if it changes
+} readahead_t;
 
 // Adding and removing clients -- list management
 static bool addToList(dnbd3_client_t *client);
 static void removeFromList(dnbd3_client_t *client);
 static dnbd3_client_t* freeClientStruct(dnbd3_client_t *client);
+static dnbd3_image_t* getImageForClient(dnbd3_client_t *client, char *name, uint16_t rid, uint8_t flags, bool mayLoad);
+static bool selectAdditionalImage(dnbd3_client_t *client, dnbd3_request_t *request, dnbd3_image_t ***slots);
+static void releaseImageOfClient(dnbd3_client_t *client, dnbd3_image_t *image);
+static bool findUncachedRange(const uint8_t *cacheMap, uint64_t *start, uint64_t *end);
+static void prefetchPipelined(dnbd3_client_t *client, dnbd3_image_t *image, dnbd3_image_t **slots, int *pending);
 
 static inline bool recv_request_header(int sock, dnbd3_request_t *request)
 {
@@ -143,9 +184,234 @@ static inline bool sendPadding( const int fd, uint32_t bytes )
 	return sock_sendAll( fd, nullbytes, bytes, 2 ) == (ssize_t)bytes;
 }
 
+/**
+ * Update client's readahead state after serving a request,
+ * and tell the kernel about the next window if it's sequential.
+ */
+static void hintReadahead(readahead_t *ra, int fd, uint64_t offset, uint32_t size, uint64_t fileSize)
+{
+	const uint64_t maxWindow = _readaheadSize;
+	const uint64_t end = offset + size;
+	if ( offset != ra->next || fd != ra->fd || maxWindow == 0 ) {
+		// Random access, or different image, start over
+		ra->fd = fd;
+		ra->next = ra->hinted = end;
+		ra->window = 0;
+		return;
+	}
+	ra->next = end;
+	if ( ra->hinted < end ) {
+		ra->hinted = end;
+	}
+	// Wait until half of the current window was consumed
+	if ( ra->hinted - end > ra->window / 2 || ra->hinted >= fileSize )
+		return;
+	ra->window = MIN( maxWindow, ra->window == 0 ? SERVER_READAHEAD_MIN : ra->window * 2 );
+	const uint64_t target = MIN( fileSize, end + ra->window );
+	if ( target <= ra->hinted )
+		return;
+	posix_fadvise( fd, (off_t)ra->hinted, (off_t)( target - ra->hinted ), POSIX_FADV_WILLNEED );
+	ra->hinted = target;
+}
+
+/**
+ * Clients like the kernel module or fuse usually have many requests in
+ * flight, but they're served one after another, so the disk would only
+ * see one read at a time. Look at the requests already waiting in the
+ * socket buffer and have the kernel read their data in the background,
+ * so the disk can work on them in parallel, while the replies are still
+ * sent in order. The hint goes to the fd the reply will be read from,
+ * which is the SSD copy if there is one; ranges served by the buffer
+ * cache are read with O_DIRECT, so they're skipped.
+ * @param pending number of requests at the head of the socket buffer that
+ *        were handled by a previous call already; updated on return
+ */
+static void prefetchPipelined(dnbd3_client_t *client, dnbd3_image_t *image, dnbd3_image_t **slots, int *pending)
+{
+	dnbd3_request_t requests[SERVER_PREFETCH_REQUESTS];
+	const ssize_t ret = recv( client->sock, requests, sizeof(requests), MSG_PEEK | MSG_DONTWAIT );
+	if ( ret < (ssize_t)sizeof(*requests) )
+		return;
+	const int num = (int)( ret / (ssize_t)sizeof(*requests) );
+	int i;
+	for ( i = *pending; i < num; ++i ) {
+		dnbd3_request_t * const request = &requests[i];
+		fixup_request( *request );
+		// Other commands might carry a payload, so we wouldn't know where the next header starts
+		if ( request->magic != dnbd3_packet_magic || request->cmd != CMD_GET_BLOCK )
+			break;
+		dnbd3_image_t * const target = slots == NULL ? image : slots[DNBD3_HANDLE_SLOT( request->handle )];
+		const uint64_t offset = request->offset_small;
+		if ( target == NULL || target->readFd == -1 || request->size == 0 || offset >= target->realFilesize )
+			continue;
+		int fd = ssdcache_getFd( target, offset, request->size, false );
+		if ( fd == -1 ) {
+			// Same condition as in bufcache_send()
+			if ( target->directFd != -1 && target->cache_map == NULL )
+				continue;
+			fd = target->readFd;
+		}
+		posix_fadvise( fd, (off_t)offset, (off_t)MIN( request->size, target->realFilesize - offset ), POSIX_FADV_WILLNEED );
+	}
+	if ( i > *pending ) {
+		*pending = i;
+	}
+}
+
+/**
+ * Get image requested by client, either during the handshake, or when
+ * selecting an additional image on an established connection.
+ * @param mayLoad load image from disk or clone it from another server if it
+ * isn't known yet, which might take a while
+ * @return image with users count increased, NULL if not available
+ */
+static dnbd3_image_t* getImageForClient(dnbd3_client_t *client, char *name, uint16_t rid, uint8_t flags, bool mayLoad)
+{
+	dnbd3_image_t *image;
+	if ( !client->isServer || !_isProxy ) {
+		// Is a normal client, or we're not proxy
+		image = mayLoad ? image_getOrLoad( name, rid ) : image_get( name, rid, true );
+	} else if ( _backgroundReplication != BGR_FULL && ( flags & FLAGS8_BG_REP ) ) {
+		// We're a proxy, client is another proxy, we don't do BGR, but connecting proxy does...
+		// Reject, as this would basically force this proxy to do BGR too.
+		image = image_get( name, rid, true );
+		if ( image != NULL && image->cache_map != NULL ) {
+			// Only exception is if the image is complete locally
+			image = image_release( image );
+		}
+	} else if ( _lookupMissingForProxy ) {
+		// No BGR mismatch and we're told to lookup missing images on a known uplink server
+		// if the requesting client is a proxy
+		image = mayLoad ? image_getOrLoad( name, rid ) : image_get( name, rid, true );
+	} else {
+		// No BGR mismatch, but don't lookup if image is unknown locally
+		image = image_get( name, rid, true );
+	}
+	return image;
+}
+
+/**
+ * Narrow the block aligned range [start, end) down to the part between
+ * the first and the last block that is missing in the cache map.
+ * @return false if all blocks are cached
+ */
+static bool findUncachedRange(const uint8_t *cacheMap, uint64_t *start, uint64_t *end)
+{
+	uint64_t pos = *start;
+	// One byte in the map covers eight blocks, 32KiB; skip over full bytes quickly
+	while ( pos < *end ) {
+		if ( ( pos & 32767 ) == 0 && pos + 32768 <= *end && cacheMap[pos >> 15] == 0xff ) {
+			pos += 32768;
+			continue;
+		}
+		if ( ( cacheMap[pos >> 15] & ( 1 << ( ( pos >> 12 ) & 7 ) ) ) == 0 )
+			break;
+		pos += DNBD3_BLOCK_SIZE;
+	}
+	if ( pos >= *end )
+		return false;
+	*start = pos;
+	pos = *end;
+	while ( pos > *start ) {
+		if ( ( pos & 32767 ) == 0 && pos - 32768 >= *start && cacheMap[( pos - 1 ) >> 15] == 0xff ) {
+			pos -= 32768;
+			continue;
+		}
+		const uint64_t block = pos - DNBD3_BLOCK_SIZE;
+		if ( ( cacheMap[block >> 15] & ( 1 << ( ( block >> 12 ) & 7 ) ) ) == 0 )
+			break;
+		pos = block;
+	}
+	*end = pos;
+	return true;
+}
+
+/**
+ * Handle CMD_SELECT_IMAGE on an established connection: Put the requested
+ * image into the slot given in the request's handle, so the other server
+ * can request blocks of multiple images over this one connection.
+ * @param slots array of images by slot, allocated on first call
+ * @return false if the connection should be dropped
+ */
+static bool selectAdditionalImage(dnbd3_client_t *client, dnbd3_request_t *request, dnbd3_image_t ***slots)
+{
+	serialized_buffer_t payload;
+	dnbd3_reply_t reply = { .magic = dnbd3_packet_magic, .cmd = CMD_SELECT_IMAGE, .size = 0, .handle = request->handle };
+	dnbd3_image_t *image = NULL;
+	if ( request->size == 0 || !recv_request_payload( client->sock, request->size, &payload ) )
+		return false;
+	const int slot = DNBD3_HANDLE_SLOT( request->handle );
+	const uint16_t version = serializer_get_uint16( &payload );
+	char * const name = serializer_get_string( &payload );
+	const uint16_t rid = serializer_get_uint16( &payload );
+	const uint8_t flags = serializer_get_uint8( &payload );
+	if ( !client->isServer || version < DNBD3_MIN_VERSION_MULTI_IMAGE || name == NULL || slot == 0 ) {
+		logadd( LOG_DEBUG1, "Invalid image selection by %s on established connection", client->hostName );
+		return false;
+	}
+	if ( *slots == NULL ) {
+		*slots = calloc( 256, sizeof(**slots) );
+		if ( *slots == NULL )
+			return false;
+		(*slots)[0] = client->image;
+	}
+	if ( *name != '\0' ) {
+		// Loading would hold up the requests for all other slots. If the image isn't
+		// there yet, the other server uses a connection of its own, which loads it
+		image = getImageForClient( client, name, rid, flags, false );
+	}
+	if ( image != NULL && !image->working ) {
+		image = image_release( image );
+	}
+	// Replace whatever was in this slot before
+	releaseImageOfClient( client, (*slots)[slot] );
+	(*slots)[slot] = image;
+	if ( image != NULL ) {
+		serializer_reset_write( &payload );
+		serializer_put_uint16( &payload, PROTOCOL_VERSION );
+		serializer_put_string( &payload, image->name );
+		serializer_put_uint16( &payload, (uint16_t)image->rid );
+		serializer_put_uint64( &payload, image->virtualFilesize );
+		reply.size = serializer_get_written_length( &payload );
+	}
+	net_lockSend( client );
+	const bool ok = send_reply( client->sock, &reply, &payload );
+	mutex_unlock( &client->sendMutex );
+	return ok;
+}
+
+/**
+ * Drop reference to image the client was using, removing
+ * all of its pending requests from the image's uplink.
+ */
+static void releaseImageOfClient(dnbd3_client_t *client, dnbd3_image_t *image)
+{
+	if ( image == NULL )
+		return;
+	mutex_lock( &image->lock );
+	if ( image->uplink != NULL ) uplink_removeClient( image->uplink, client );
+	mutex_unlock( &image->lock );
+	image_release( image );
+}
+
+/**
+ * Lock client's socket for sending a reply. Waits for the uplink to finish
+ * a reply it relays piece by piece, which doesn't hold the lock in between.
+ * Unlock with mutex_unlock( &client->sendMutex ).
+ */
+void net_lockSend(dnbd3_client_t *client)
+{
+	mutex_lock( &client->sendMutex );
+	while ( client->streaming ) {
+		mutex_cond_wait( &client->streamDone, &client->sendMutex );
+	}
+}
+
 void net_init()
 {
-	mutex_init( &_clients_lock );
+	for ( int i = 0; i < SERVER_CLIENT_LIST_SHARDS; ++i ) {
+		mutex_init( &_shards[i].lock );
+	}
 }
 
 void* net_handleNewConnection(void *clientPtr)
@@ -188,6 +454,7 @@ void* net_handleNewConnection(void *clientPtr)
 	// Fully init client struct
 	mutex_init( &client->lock );
 	mutex_init( &client->sendMutex );
+	pthread_cond_init( &client->streamDone, NULL );
 
 	mutex_lock( &client->lock );
 	host_to_string( &client->host, client->hostName, HOSTNAMELEN );
@@ -204,7 +471,11 @@ void* net_handleNewConnection(void *clientPtr)
 	dnbd3_reply_t reply;
 
 	dnbd3_image_t *image = NULL;
+	dnbd3_image_t **slots = NULL; // Additional images selected by other server, see DNBD3_HANDLE_SLOT
 	int image_file = -1;
+	int lastHashBlock = -1; // For access statistics (SSD cache, warmup)
+	readahead_t ra = { .next = UINT64_MAX, .fd = -1 };
+	int prefetched = 0; // Pipelined requests already passed to prefetchPipelined()
 
 	int num;
 	bool bOk = false;
@@ -236,25 +507,7 @@ void* net_handleNewConnection(void *clientPtr)
 				logadd( LOG_DEBUG1, "Incomplete handshake received from %s", client->hostName );
 			}
 		} else {
-			if ( !client->isServer || !_isProxy ) {
-				// Is a normal client, or we're not proxy
-				image = image_getOrLoad( image_name, rid );
-			} else if ( _backgroundReplication != BGR_FULL && ( flags & FLAGS8_BG_REP ) ) {
-				// We're a proxy, client is another proxy, we don't do BGR, but connecting proxy does...
-				// Reject, as this would basically force this proxy to do BGR too.
-				image = image_get( image_name, rid, true );
-				if ( image != NULL && image->cache_map != NULL ) {
-					// Only exception is if the image is complete locally
-					image = image_release( image );
-				}
-			} else if ( _lookupMissingForProxy ) {
-				// No BGR mismatch and we're told to lookup missing images on a known uplink server
-				// if the requesting client is a proxy
-				image = image_getOrLoad( image_name, rid );
-			} else {
-				// No BGR mismatch, but don't lookup if image is unknown locally
-				image = image_get( image_name, rid, true );
-			}
+			image = getImageForClient( client, image_name, rid, flags, true );
 			mutex_lock( &client->lock );
 			client->image = image;
 			mutex_unlock( &client->lock );
@@ -311,16 +564,40 @@ void* net_handleNewConnection(void *clientPtr)
 		// client handling mainloop
 		while ( recv_request_header( client->sock, &request ) ) {
 			if ( _shutdown ) break;
+			if ( prefetched > 0 ) {
+				prefetched--;
+			}
+			if ( slots != NULL && request.cmd != CMD_SELECT_IMAGE ) {
+				// Connection carries multiple images, pick the one this request refers to
+				image = slots[DNBD3_HANDLE_SLOT( request.handle )];
+				if ( image == NULL ) {
+					// Might have been freed while the request was on its way, so only this request fails
+					logadd( LOG_DEBUG1, "Server %s sent request for unused image slot %d", client->hostName, DNBD3_HANDLE_SLOT( request.handle ) );
+					reply.cmd = CMD_ERROR;
+					reply.size = 0;
+					reply.handle = request.handle;
+					net_lockSend( client );
+					const bool sent = send_reply( client->sock, &reply, NULL );
+					mutex_unlock( &client->sendMutex );
+					if ( !sent )
+						goto exit_client_cleanup;
+					continue;
+				}
+				image_file = image->readFd;
+			}
 			switch ( request.cmd ) {
 
 			case CMD_GET_BLOCK:;
 				const uint64_t offset = request.offset_small; // Copy to full uint64 to prevent repeated masking
+				stats_add( STATS_REQUESTS, 1 );
 				if ( offset >= image->virtualFilesize ) {
 					// Sanity check
 					logadd( LOG_WARNING, "Client %s requested non-existent block", client->hostName );
 					reply.size = 0;
 					reply.cmd = CMD_ERROR;
+					net_lockSend( client );
 					send_reply( client->sock, &reply, NULL );
+					mutex_unlock( &client->sendMutex );
 					break;
 				}
 				if ( offset + request.size > image->virtualFilesize ) {
@@ -328,7 +605,9 @@ void* net_handleNewConnection(void *clientPtr)
 					logadd( LOG_WARNING, "Client %s requested data block that extends beyond image size", client->hostName );
 					reply.size = 0;
 					reply.cmd = CMD_ERROR;
+					net_lockSend( client );
 					send_reply( client->sock, &reply, NULL );
+					mutex_unlock( &client->sendMutex );
 					break;
 				}
 
@@ -340,51 +619,17 @@ void* net_handleNewConnection(void *clientPtr)
 					mutex_lock( &image->lock );
 					// Check again as we only aquired the lock just now
 					if ( image->cache_map != NULL ) {
-						const uint64_t firstByteInMap = start >> 15;
-						const uint64_t lastByteInMap = (end - 1) >> 15;
-						uint64_t pos;
-						// Middle - quick checking
-						if ( isCached ) {
-							pos = firstByteInMap + 1;
-							while ( pos < lastByteInMap ) {
-								if ( image->cache_map[pos] != 0xff ) {
-									isCached = false;
-									break;
-								}
-								++pos;
-							}
-						}
-						// First byte
-						if ( isCached ) {
-							pos = start;
-							do {
-								const int map_x = (pos >> 12) & 7; // mod 8
-								const uint8_t bit_mask = (uint8_t)( 1 << map_x );
-								if ( (image->cache_map[firstByteInMap] & bit_mask) == 0 ) {
-									isCached = false;
-									break;
-								}
-								pos += DNBD3_BLOCK_SIZE;
-							} while ( firstByteInMap == (pos >> 15) && pos < end );
-						}
-						// Last byte - only check if request spans multiple bytes in cache map
-						if ( isCached && firstByteInMap != lastByteInMap ) {
-							pos = lastByteInMap << 15;
-							while ( pos < end ) {
-								assert( lastByteInMap == (pos >> 15) );
-								const int map_x = (pos >> 12) & 7; // mod 8
-								const uint8_t bit_mask = (uint8_t)( 1 << map_x );
-								if ( (image->cache_map[lastByteInMap] & bit_mask) == 0 ) {
-									isCached = false;
-									break;
-								}
-								pos += DNBD3_BLOCK_SIZE;
-							}
-						}
+						isCached = !findUncachedRange( image->cache_map, &start, &end );
 					}
 					mutex_unlock( &image->lock );
 					if ( !isCached ) {
-						if ( !uplink_request( client, request.handle, offset, request.size, request.hops ) ) {
+						// Only relay the part between the first and last missing block, the rest
+						// gets sent from the local cache along with the data from the uplink
+						const uint64_t relayStart = MAX( offset, start );
+						const uint64_t relayEnd = MIN( offset + request.size, end );
+						stats_add( STATS_CACHE_MISSES, 1 );
+						if ( !uplink_request( client, image, request.handle, relayStart, (uint32_t)( relayEnd - relayStart ),
+								(uint32_t)( relayStart - offset ), (uint32_t)( offset + request.size - relayEnd ), request.hops ) ) {
 							logadd( LOG_DEBUG1, "Could not relay uncached request from %s to upstream proxy, disabling image %s:%d",
 									client->hostName, image->name, image->rid );
 							image->working = false;
@@ -394,13 +639,30 @@ void* net_handleNewConnection(void *clientPtr)
 					}
 				}
 
+				stats_add( STATS_CACHE_HITS, 1 );
+				// Get disk busy with the following requests while we're sending this one
+				prefetchPipelined( client, image, slots, &prefetched );
+				// Count visits to hash blocks, not requests, so a single client reading sequentially doesn't skew the statistics
+				const int hashBlock = (int)( offset / HASH_BLOCK_SIZE );
+				const bool newVisit = hashBlock != lastHashBlock;
+				lastHashBlock = hashBlock;
+				if ( newVisit ) {
+					warmup_countAccess( image, hashBlock );
+				}
+				int readFd = ssdcache_getFd( image, offset, request.size, newVisit );
+				if ( readFd == -1 ) {
+					readFd = image_file;
+				} else {
+					stats_add( STATS_SSD_HITS, 1 );
+				}
 				reply.cmd = CMD_GET_BLOCK;
 				reply.size = request.size;
 				reply.handle = request.handle;
 
 				fixup_reply( reply );
-				const bool lock = image->uplink != NULL;
-				if ( lock ) mutex_lock( &client->sendMutex );
+				// Relayed replies of the uplink, possibly of another image on this connection, use the socket too
+				const bool lock = image->uplink != NULL || slots != NULL;
+				if ( lock ) net_lockSend( client );
 				// Send reply header
 				if ( send( client->sock, &reply, sizeof(dnbd3_reply_t), (request.size == 0 ? 0 : MSG_MORE) ) != sizeof(dnbd3_reply_t) ) {
 					if ( lock ) mutex_unlock( &client->sendMutex );
@@ -418,6 +680,16 @@ void* net_handleNewConnection(void *clientPtr)
 					} else {
 						realBytes = (size_t)(image->realFilesize - offset);
 					}
+					if ( readFd == image_file ) {
+						const ssize_t sent = bufcache_send( image, client->sock, offset, realBytes );
+						if ( sent == -1 ) {
+							if ( lock ) mutex_unlock( &client->sendMutex );
+							goto exit_client_cleanup;
+						}
+						// Send anything that couldn't be served from the buffer cache the usual way
+						done = (size_t)sent;
+						foffset += sent;
+					}
 					while ( done < realBytes ) {
 						// TODO: Should we consider EOPNOTSUPP on BSD for sendfile and fallback to read/write?
 						// Linux would set EINVAL or ENOSYS instead, which it unfortunately also does for a couple of other failures :/
@@ -428,18 +700,18 @@ void* net_handleNewConnection(void *clientPtr)
 						if ( cnt > 1000 ) {
 							cnt = 1000;
 						}
-						const ssize_t sent = pread( image_file, buf, cnt, foffset );
+						const ssize_t sent = pread( readFd, buf, cnt, foffset );
 						if ( sent > 0 ) {
 							//write( client->sock, buf, sent ); // This is not verified in any way, so why even do it...
 						} else {
 							const int err = errno;
 #elif defined(__linux__)
-						const ssize_t sent = sendfile( client->sock, image_file, &foffset, realBytes - done );
+						const ssize_t sent = sendfile( client->sock, readFd, &foffset, realBytes - done );
 						if ( sent <= 0 ) {
 							const int err = errno;
 #elif defined(__FreeBSD__)
 						off_t sent;
-						const int ret = sendfile( image_file, client->sock, foffset, realBytes - done, NULL, &sent, 0 );
+						const int ret = sendfile( readFd, client->sock, foffset, realBytes - done, NULL, &sent, 0 );
 						if ( ret == -1 || sent == 0 ) {
 							const int err = errno;
 							if ( ret == -1 ) {
@@ -450,6 +722,14 @@ void* net_handleNewConnection(void *clientPtr)
 								sent = -1;
 							}
 #endif
+							if ( readFd != image_file && ( sent == 0 || ( err != EPIPE && err != ECONNRESET && err != ESHUTDOWN
+									&& err != EAGAIN && err != EWOULDBLOCK ) ) ) {
+								// Something's wrong with the SSD copy, the image file should still be fine
+								logadd( LOG_DEBUG1, "Reading %s:%d from SSD cache failed (errno=%d), using image file",
+										image->name, (int)image->rid, err );
+								readFd = image_file;
+								continue;
+							}
 							if ( lock ) mutex_unlock( &client->sendMutex );
 							if ( sent == -1 ) {
 								if ( err != EPIPE && err != ECONNRESET && err != ESHUTDOWN
@@ -457,7 +737,7 @@ void* net_handleNewConnection(void *clientPtr)
 									logadd( LOG_DEBUG1, "sendfile to %s failed (image to net. sent %d/%d, errno=%d)",
 											client->hostName, (int)done, (int)realBytes, err );
 								}
-								if ( err == EBADF || err == EFAULT || err == EINVAL || err == EIO ) {
+								if ( readFd == image_file && ( err == EBADF || err == EFAULT || err == EINVAL || err == EIO ) ) {
 									logadd( LOG_INFO, "Disabling %s:%d", image->name, image->rid );
 									image->working = false;
 								}
@@ -474,8 +754,13 @@ void* net_handleNewConnection(void *clientPtr)
 					}
 				}
 				if ( lock ) mutex_unlock( &client->sendMutex );
-				// Global per-client counter
+				// Per-client and global counter
 				client->bytesSent += request.size; // Increase counter for statistics.
+				stats_add( STATS_BYTES_SENT, request.size );
+				if ( readFd == image_file ) {
+					// The SSD doesn't need readahead, and it would mess up the image file's state
+					hintReadahead( &ra, image_file, offset, request.size, image->realFilesize );
+				}
 				break;
 
 			case CMD_GET_SERVERS:
@@ -483,7 +768,7 @@ void* net_handleNewConnection(void *clientPtr)
 				num = altservers_getListForClient( &client->host, server_list, NUMBER_SERVERS );
 				reply.cmd = CMD_GET_SERVERS;
 				reply.size = (uint32_t)( num * sizeof(dnbd3_server_entry_t) );
-				mutex_lock( &client->sendMutex );
+				net_lockSend( client );
 				send_reply( client->sock, &reply, server_list );
 				mutex_unlock( &client->sendMutex );
 				goto set_name;
@@ -492,7 +777,7 @@ void* net_handleNewConnection(void *clientPtr)
 			case CMD_KEEPALIVE:
 				reply.cmd = CMD_KEEPALIVE;
 				reply.size = 0;
-				mutex_lock( &client->sendMutex );
+				net_lockSend( client );
 				send_reply( client->sock, &reply, NULL );
 				mutex_unlock( &client->sendMutex );
 set_name: ;
@@ -506,9 +791,14 @@ set_name: ;
 				client->isServer = false;
 				break;
 
+			case CMD_SELECT_IMAGE:
+				if ( !selectAdditionalImage( client, &request, &slots ) )
+					goto exit_client_cleanup;
+				break;
+
 			case CMD_GET_CRC32:
 				reply.cmd = CMD_GET_CRC32;
-				mutex_lock( &client->sendMutex );
+				net_lockSend( client );
 				if ( image->crc32 == NULL ) {
 					reply.size = 0;
 					send_reply( client->sock, &reply, NULL );
@@ -521,6 +811,40 @@ set_name: ;
 				mutex_unlock( &client->sendMutex );
 				break;
 
+			case CMD_GET_BLOCK_HASHES:
+				reply.cmd = CMD_GET_BLOCK_HASHES;
+				reply.handle = request.handle;
+				mutex_lock( &image->lock );
+				const uint64_t *hashes = image->blockHashes;
+				mutex_unlock( &image->lock );
+				{
+					const uint64_t total = (uint64_t)DEDUP_BLOCKS( image->realFilesize );
+					uint64_t *converted = NULL;
+					if ( hashes == NULL || request.offset >= total ) {
+						reply.size = 0;
+					} else {
+						hashes += request.offset;
+						reply.size = (uint32_t)( MIN( total - request.offset, DEDUP_HASHES_PER_REPLY ) * sizeof(uint64_t) );
+					}
+					if ( reply.size != 0 && net_order_64( (uint64_t)1 ) != 1 ) {
+						// Index is kept in host byte order
+						converted = malloc( reply.size );
+						if ( converted == NULL ) {
+							reply.size = 0;
+						} else {
+							for ( uint32_t i = 0; i < reply.size / sizeof(uint64_t); ++i ) {
+								converted[i] = net_order_64( hashes[i] );
+							}
+							hashes = converted;
+						}
+					}
+					net_lockSend( client );
+					send_reply( client->sock, &reply, (void*)hashes );
+					mutex_unlock( &client->sendMutex );
+					free( converted );
+				}
+				break;
+
 			default:
 				logadd( LOG_ERROR, "Unknown command from client %s: %d", client->hostName, (int)request.cmd );
 				break;
@@ -529,10 +853,9 @@ set_name: ;
 		}
 	}
 exit_client_cleanup: ;
-	// First remove from list, then add to counter to prevent race condition
 	removeFromList( client );
-	totalBytesSent += client->bytesSent;
 	// Access time, but only if client didn't just probe
+	image = client->image;
 	if ( image != NULL ) {
 		mutex_lock( &image->lock );
 		if ( client->bytesSent > DNBD3_BLOCK_SIZE * 10 ) {
@@ -540,6 +863,16 @@ exit_client_cleanup: ;
 		}
 		mutex_unlock( &image->lock );
 	}
+	if ( slots != NULL ) {
+		for ( int i = 1; i < 256; ++i ) {
+			if ( slots[i] == NULL ) continue;
+			mutex_lock( &slots[i]->lock );
+			timing_get( &slots[i]->atime );
+			mutex_unlock( &slots[i]->lock );
+			releaseImageOfClient( client, slots[i] );
+		}
+		free( slots );
+	}
 	freeClientStruct( client ); // This will also call image_release on client->image
 	return NULL ;
 fail_preadd: ;
@@ -549,67 +882,85 @@ fail_preadd: ;
 }
 
 /**
- * Get list of all clients.
+ * Write list of all clients as JSON array to given stream.
  */
-struct json_t* net_getListAsJson()
+void net_writeListJson(jsonstream_t *js)
 {
-	json_t *jsonClients = json_array();
-	json_t *clientStats;
-	int imgId, isServer;
-	uint64_t bytesSent;
-	char host[HOSTNAMELEN];
-	host[HOSTNAMELEN-1] = '\0';
-
-	mutex_lock( &_clients_lock );
-	for ( int i = 0; i < _num_clients; ++i ) {
-		dnbd3_client_t * const client = _clients[i];
-		if ( client == NULL || client->image == NULL )
-			continue;
-		mutex_lock( &client->lock );
-		// Unlock so we give other threads a chance to access the client list.
-		// We might not get an atomic snapshot of the currently connected clients,
-		// but that doesn't really make a difference anyways.
-		mutex_unlock( &_clients_lock );
-		strncpy( host, client->hostName, HOSTNAMELEN - 1 );
-		imgId = client->image->id;
-		isServer = (int)client->isServer;
-		bytesSent = client->bytesSent;
-		mutex_unlock( &client->lock );
-		clientStats = json_pack( "{sssisisI}",
-				"address", host,
-				"imageId", imgId,
-				"isServer", isServer,
-				"bytesSent", (json_int_t)bytesSent );
-		json_array_append_new( jsonClients, clientStats );
-		mutex_lock( &_clients_lock );
-	}
-	mutex_unlock( &_clients_lock );
-	return jsonClients;
+	struct {
+		char host[HOSTNAMELEN];
+		int imgId;
+		bool isServer;
+		uint64_t bytesSent;
+	} *entries = malloc( SLOTS_PER_SHARD * sizeof(*entries) );
+
+	jsonstream_arrayStart( js, "clients" );
+	if ( entries == NULL ) {
+		jsonstream_arrayEnd( js );
+		return;
+	}
+	// One shard at a time, so we don't hold up clients connecting to other shards.
+	// We might not get an atomic snapshot of the currently connected clients,
+	// but that doesn't really make a difference anyways.
+	// Copy the data first, so no lock is held while writing to the socket.
+	for ( int s = 0; s < SERVER_CLIENT_LIST_SHARDS; ++s ) {
+		clientshard_t * const shard = &_shards[s];
+		int num = 0;
+		mutex_lock( &shard->lock );
+		for ( int w = 0; w < WORDS_PER_SHARD && shard->count != 0; ++w ) {
+			for ( uint64_t bits = shard->used[w]; bits != 0; bits &= bits - 1 ) {
+				dnbd3_client_t * const client = shard->clients[w * 64 + __builtin_ctzll( bits )];
+				if ( client->image == NULL )
+					continue;
+				mutex_lock( &client->lock );
+				memcpy( entries[num].host, client->hostName, HOSTNAMELEN );
+				entries[num].host[HOSTNAMELEN-1] = '\0';
+				entries[num].imgId = client->image->id;
+				entries[num].isServer = client->isServer;
+				entries[num].bytesSent = client->bytesSent;
+				mutex_unlock( &client->lock );
+				num++;
+			}
+		}
+		mutex_unlock( &shard->lock );
+		for ( int i = 0; i < num; ++i ) {
+			jsonstream_objectStart( js, NULL );
+			jsonstream_string( js, "address", entries[i].host );
+			jsonstream_int( js, "imageId", entries[i].imgId );
+			jsonstream_int( js, "isServer", entries[i].isServer );
+			jsonstream_int( js, "bytesSent", (int64_t)entries[i].bytesSent );
+			jsonstream_objectEnd( js );
+		}
+	}
+	free( entries );
+	jsonstream_arrayEnd( js );
 }
 
 /**
  * Get number of clients connected, total bytes sent, or both.
- * we don't unlock the list while iterating or we might get an
- * incorrect result if a client is disconnecting while iterating.
+ * Shards are locked one after another, so the counts are
+ * not an atomic snapshot across the whole list.
  */
 void net_getStats(int *clientCount, int *serverCount, uint64_t *bytesSent)
 {
 	int cc = 0, sc = 0;
-	uint64_t bs = 0;
 
-	mutex_lock( &_clients_lock );
-	for ( int i = 0; i < _num_clients; ++i ) {
-		const dnbd3_client_t * const client = _clients[i];
-		if ( client == NULL || client->image == NULL )
-			continue;
-		if ( client->isServer ) {
-			sc += 1;
-		} else {
-			cc += 1;
+	for ( int s = 0; s < SERVER_CLIENT_LIST_SHARDS && ( clientCount != NULL || serverCount != NULL ); ++s ) {
+		clientshard_t * const shard = &_shards[s];
+		mutex_lock( &shard->lock );
+		for ( int w = 0; w < WORDS_PER_SHARD && shard->count != 0; ++w ) {
+			for ( uint64_t bits = shard->used[w]; bits != 0; bits &= bits - 1 ) {
+				const dnbd3_client_t * const client = shard->clients[w * 64 + __builtin_ctzll( bits )];
+				if ( client->image == NULL )
+					continue;
+				if ( client->isServer ) {
+					sc += 1;
+				} else {
+					cc += 1;
+				}
+			}
 		}
-		bs += client->bytesSent;
+		mutex_unlock( &shard->lock );
 	}
-	mutex_unlock( &_clients_lock );
 	if ( clientCount != NULL ) {
 		*clientCount = cc;
 	}
@@ -617,41 +968,37 @@ void net_getStats(int *clientCount, int *serverCount, uint64_t *bytesSent)
 		*serverCount = sc;
 	}
 	if ( bytesSent != NULL ) {
-		*bytesSent = totalBytesSent + bs;
+		*bytesSent = stats_get( STATS_BYTES_SENT );
 	}
 }
 
 void net_disconnectAll()
 {
-	int i;
-	mutex_lock( &_clients_lock );
-	for (i = 0; i < _num_clients; ++i) {
-		if ( _clients[i] == NULL ) continue;
-		dnbd3_client_t * const client = _clients[i];
-		mutex_lock( &client->lock );
-		if ( client->sock >= 0 ) shutdown( client->sock, SHUT_RDWR );
-		mutex_unlock( &client->lock );
-	}
-	mutex_unlock( &_clients_lock );
+	for ( int s = 0; s < SERVER_CLIENT_LIST_SHARDS; ++s ) {
+		clientshard_t * const shard = &_shards[s];
+		mutex_lock( &shard->lock );
+		for ( int w = 0; w < WORDS_PER_SHARD; ++w ) {
+			for ( uint64_t bits = shard->used[w]; bits != 0; bits &= bits - 1 ) {
+				dnbd3_client_t * const client = shard->clients[w * 64 + __builtin_ctzll( bits )];
+				mutex_lock( &client->lock );
+				if ( client->sock >= 0 ) shutdown( client->sock, SHUT_RDWR );
+				mutex_unlock( &client->lock );
+			}
+		}
+		mutex_unlock( &shard->lock );
+	}
 }
 
 void net_waitForAllDisconnected()
 {
-	int retries = 10, count, i;
+	int retries = 10, count;
 	do {
-		count = 0;
-		mutex_lock( &_clients_lock );
-		for (i = 0; i < _num_clients; ++i) {
-			if ( _clients[i] == NULL ) continue;
-			count++;
-		}
-		mutex_unlock( &_clients_lock );
+		count = _clientCount;
 		if ( count != 0 ) {
 			logadd( LOG_INFO, "%d clients still active...\n", count );
 			sleep( 1 );
 		}
 	} while ( count != 0 && --retries > 0 );
-	_num_clients = 0;
 }
 
 /* +++
@@ -662,19 +1009,20 @@ void net_waitForAllDisconnected()
 
 /**
  * Remove a client from the clients array
- * Locks on: _clients_lock
+ * Locks on: _shards[].lock
  */
 static void removeFromList(dnbd3_client_t *client)
 {
-	int i;
-	mutex_lock( &_clients_lock );
-	for ( i = _num_clients - 1; i >= 0; --i ) {
-		if ( _clients[i] == client ) {
-			_clients[i] = NULL;
-		}
-		if ( _clients[i] == NULL && i + 1 == _num_clients ) --_num_clients;
-	}
-	mutex_unlock( &_clients_lock );
+	const int slot = client->listSlot;
+	clientshard_t * const shard = &_shards[slot / SLOTS_PER_SHARD];
+	const int index = slot % SLOTS_PER_SHARD;
+	mutex_lock( &shard->lock );
+	assert( shard->clients[index] == client );
+	shard->clients[index] = NULL;
+	shard->used[index / 64] &= ~( 1ull << ( index % 64 ) );
+	shard->count--;
+	mutex_unlock( &shard->lock );
+	_clientCount--;
 }
 
 /**
@@ -690,15 +1038,12 @@ static dnbd3_client_t* freeClientStruct(dnbd3_client_t *client)
 	if ( client->sock != -1 ) close( client->sock );
 	client->sock = -1;
 	mutex_unlock( &client->sendMutex );
-	if ( client->image != NULL ) {
-		mutex_lock( &client->image->lock );
-		if ( client->image->uplink != NULL ) uplink_removeClient( client->image->uplink, client );
-		mutex_unlock( &client->image->lock );
-		client->image = image_release( client->image );
-	}
+	releaseImageOfClient( client, client->image );
+	client->image = NULL;
 	mutex_unlock( &client->lock );
 	mutex_destroy( &client->lock );
 	mutex_destroy( &client->sendMutex );
+	pthread_cond_destroy( &client->streamDone );
 	free( client );
 	return NULL ;
 }
@@ -707,25 +1052,40 @@ static dnbd3_client_t* freeClientStruct(dnbd3_client_t *client)
 
 /**
  * Add client to the clients array.
- * Locks on: _clients_lock
+ * Shards are used round robin; if the chosen one happens to be
+ * full, the next ones are tried.
+ * Locks on: _shards[].lock
  */
 static bool addToList(dnbd3_client_t *client)
 {
-	int i;
-	mutex_lock( &_clients_lock );
-	for (i = 0; i < _num_clients; ++i) {
-		if ( _clients[i] != NULL ) continue;
-		_clients[i] = client;
-		mutex_unlock( &_clients_lock );
-		return true;
-	}
-	if ( _num_clients >= _maxClients ) {
-		mutex_unlock( &_clients_lock );
+	if ( ++_clientCount > _maxClients ) {
+		_clientCount--;
 		logadd( LOG_ERROR, "Maximum number of clients reached!" );
 		return false;
 	}
-	_clients[_num_clients++] = client;
-	mutex_unlock( &_clients_lock );
-	return true;
+	const unsigned int first = _nextShard++;
+	for ( unsigned int s = 0; s < SERVER_CLIENT_LIST_SHARDS; ++s ) {
+		const int shardIdx = (int)( ( first + s ) % SERVER_CLIENT_LIST_SHARDS );
+		clientshard_t * const shard = &_shards[shardIdx];
+		mutex_lock( &shard->lock );
+		if ( shard->count < SLOTS_PER_SHARD ) {
+			for ( int w = 0; w < WORDS_PER_SHARD; ++w ) {
+				if ( shard->used[w] == UINT64_MAX )
+					continue;
+				const int index = w * 64 + __builtin_ctzll( ~shard->used[w] );
+				shard->used[w] |= 1ull << ( index % 64 );
+				shard->clients[index] = client;
+				shard->count++;
+				client->listSlot = shardIdx * SLOTS_PER_SHARD + index;
+				mutex_unlock( &shard->lock );
+				return true;
+			}
+		}
+		mutex_unlock( &shard->lock );
+	}
+	// Can't happen as long as _maxClients <= SERVER_MAX_CLIENTS
+	_clientCount--;
+	logadd( LOG_ERROR, "Client list full!" );
+	return false;
 }
 
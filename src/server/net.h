@@ -23,16 +23,18 @@
 
 #include "globals.h"
 
-struct json_t;
+#include "jsonstream.h"
 
 void net_init();
 
 void* net_handleNewConnection(void *clientPtr);
 
-struct json_t* net_getListAsJson();
+void net_writeListJson(jsonstream_t *js);
 
 void net_getStats(int *clientCount, int *serverCount, uint64_t *bytesSent);
 
+void net_lockSend(dnbd3_client_t *client);
+
 void net_disconnectAll();
 
 void net_waitForAllDisconnected();
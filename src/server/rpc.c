@@ -5,10 +5,16 @@
 #include "locks.h"
 #include "image.h"
 #include "altservers.h"
+#include "threadpool.h"
+#include "stats.h"
+#include "ssdcache.h"
+#include "warmup.h"
+#include "bufcache.h"
 #include "../shared/sockhelper.h"
 #include "fileutil.h"
 #include "picohttpparser/picohttpparser.h"
 #include "urldecode.h"
+#include "jsonstream.h"
 
 #include <jansson.h>
 #include <sys/types.h>
@@ -16,10 +22,6 @@
 #include <fcntl.h>
 #include <unistd.h>
 
-#if JANSSON_VERSION_HEX < 0x020600
-#define json_stringn_nocheck(a,b) json_string_nocheck(a)
-#endif
-
 #define ACL_ALL        0x7fffffff
 #define ACL_STATS               1
 #define ACL_CLIENT_LIST         2
@@ -44,6 +46,7 @@ DEFSTR(STR_CONNECTION, "connection")
 DEFSTR(STR_CLOSE, "close")
 DEFSTR(STR_QUERY, "/query")
 DEFSTR(STR_Q, "q")
+DEFSTR(STR_FIELDS, "fields")
 
 static inline bool equals(struct string *s1,struct string *s2)
 {
@@ -83,11 +86,16 @@ static struct {
 
 static bool handleStatus(int sock, int permissions, struct field *fields, size_t fields_num, int keepAlive);
 static bool sendReply(int sock, const char *status, const char *ctype, const char *payload, ssize_t plen, int keepAlive);
+static bool sendHeader(int sock, const char *status, const char *ctype, ssize_t plen, int keepAlive);
+static bool finishReply(int sock, int keepAlive);
 static void parsePath(struct string *path, struct string *file, struct field *getv, size_t *getc);
 static bool hasHeaderValue(struct phr_header *headers, size_t numHeaders, struct string *name, struct string *value);
 static int getacl(dnbd3_host_t *host);
 static void addacl(int argc, char **argv, void *data);
 static void loadAcl();
+static json_t* getMemoryJson();
+static json_t* getLocksJson();
+static void writeJansson(jsonstream_t *js, const char *key, json_t *value);
 
 void rpc_init()
 {
@@ -258,7 +266,7 @@ static bool handleStatus(int sock, int permissions, struct field *fields, size_t
 {
 	bool ok;
 	bool stats = false, images = false, clients = false, space = false;
-	bool logfile = false, config = false, altservers = false;
+	bool logfile = false, config = false, altservers = false, memory = false, locks = false;
 #define SETVAR(var) if ( !var && STRCMP(fields[i].value, #var) ) var = true
 	for (size_t i = 0; i < fields_num; ++i) {
 		if ( !equals( &fields[i].name, &STR_Q ) ) continue;
@@ -269,9 +277,11 @@ static bool handleStatus(int sock, int permissions, struct field *fields, size_t
 		else SETVAR(logfile);
 		else SETVAR(config);
 		else SETVAR(altservers);
+		else SETVAR(memory);
+		else SETVAR(locks);
 	}
 #undef SETVAR
-	if ( ( stats || space ) && !(permissions & ACL_STATS) ) {
+	if ( ( stats || space || memory || locks ) && !(permissions & ACL_STATS) ) {
 		return sendReply( sock, "403 Forbidden", "text/plain", "No permission to access statistics", -1, keepAlive );
 	}
 	if ( images && !(permissions & ACL_IMAGE_LIST) ) {
@@ -290,78 +300,249 @@ static bool handleStatus(int sock, int permissions, struct field *fields, size_t
 		return sendReply( sock, "403 Forbidden", "text/plain", "No permission to access altservers", -1, keepAlive );
 	}
 
-	json_t *statisticsJson;
+	// Stream the reply, so we don't have to build the whole document in memory first.
+	// Chunked encoding if the connection stays open, otherwise closing it terminates the body
+	jsonstream_t *js = malloc( sizeof(*js) );
+	if ( js == NULL ) {
+		return sendReply( sock, "500 Internal Server Error", "text/plain", "Out of memory", -1, HTTP_CLOSE );
+	}
+	const bool chunked = ( keepAlive == HTTP_KEEPALIVE );
+	if ( !sendHeader( sock, "200 OK", "application/json", chunked ? -2 : -1, keepAlive ) ) {
+		free( js );
+		return false;
+	}
+	jsonstream_init( js, sock, chunked );
+	for ( size_t i = 0; i < fields_num; ++i ) {
+		if ( equals( &fields[i].name, &STR_FIELDS ) ) {
+			jsonstream_addFilter( js, &fields[i].value );
+		}
+	}
+	jsonstream_objectStart( js, NULL );
 	if ( stats ) {
 		int clientCount, serverCount;
 		uint64_t bytesSent;
-		const uint64_t bytesReceived = uplink_getTotalBytesReceived();
+		const uint64_t bytesReceived = stats_get( STATS_BYTES_RECEIVED );
 		net_getStats( &clientCount, &serverCount, &bytesSent );
-		statisticsJson = json_pack( "{sIsIsisisIsI}",
-				"bytesReceived", (json_int_t) bytesReceived,
-				"bytesSent", (json_int_t) bytesSent,
-				"clientCount", clientCount,
-				"serverCount", serverCount,
-				"uptime", (json_int_t) dnbd3_serverUptime(),
-				"runId", randomRunId );
-	} else {
-		statisticsJson = json_pack( "{sI}",
-				"runId", randomRunId );
+		jsonstream_int( js, "bytesReceived", (int64_t)bytesReceived );
+		jsonstream_int( js, "bytesSent", (int64_t)bytesSent );
+		jsonstream_int( js, "clientCount", clientCount );
+		jsonstream_int( js, "serverCount", serverCount );
+		jsonstream_int( js, "uptime", (int64_t)dnbd3_serverUptime() );
+		jsonstream_int( js, "requests", (int64_t)stats_get( STATS_REQUESTS ) );
+		jsonstream_int( js, "cacheHits", (int64_t)stats_get( STATS_CACHE_HITS ) );
+		jsonstream_int( js, "cacheMisses", (int64_t)stats_get( STATS_CACHE_MISSES ) );
+		jsonstream_int( js, "uplinkRequests", (int64_t)stats_get( STATS_UPLINK_REQUESTS ) );
+		if ( _ssdCachePath != NULL ) {
+			jsonstream_int( js, "ssdHits", (int64_t)stats_get( STATS_SSD_HITS ) );
+			jsonstream_int( js, "ssdCacheBytes", (int64_t)ssdcache_getUsedBytes() );
+		}
+		if ( _dedupIndex ) {
+			jsonstream_int( js, "dedupBytes", (int64_t)stats_get( STATS_DEDUP_BYTES ) );
+		}
+		if ( _directIoCacheSize != 0 ) {
+			uint64_t size, hits, misses;
+			bufcache_getStats( &size, &hits, &misses );
+			jsonstream_int( js, "directIoCacheBytes", (int64_t)size );
+			jsonstream_int( js, "directIoHits", (int64_t)hits );
+			jsonstream_int( js, "directIoMisses", (int64_t)misses );
+		}
+		jsonstream_int( js, "logDropped", (int64_t)log_getDroppedCount() );
 	}
+	jsonstream_int( js, "runId", randomRunId );
 	if ( space ) {
 		uint64_t spaceTotal = 0, spaceAvail = 0;
 		file_freeDiskSpace( _basePath, &spaceTotal, &spaceAvail );
-		json_object_set_new( statisticsJson, "spaceTotal", json_integer( spaceTotal ) );
-		json_object_set_new( statisticsJson, "spaceFree", json_integer( spaceAvail ) );
+		jsonstream_int( js, "spaceTotal", (int64_t)spaceTotal );
+		jsonstream_int( js, "spaceFree", (int64_t)spaceAvail );
 	}
 	if ( clients ) {
-		json_object_set_new( statisticsJson, "clients", net_getListAsJson() );
+		net_writeListJson( js );
 	}
 	if ( images ) {
-		json_object_set_new( statisticsJson, "images", image_getListAsJson() );
+		image_writeListJson( js );
 	}
 	if ( logfile ) {
 		char logbuf[4000];
 		ssize_t len = log_fetch( logbuf, sizeof(logbuf) );
-		json_t *val;
 		if ( len <= 0 ) {
-			val = json_null();
+			jsonstream_null( js, "logfile" );
 		} else {
-			val = json_stringn_nocheck( logbuf, (size_t)len );
-
+			jsonstream_stringn( js, "logfile", logbuf, (size_t)len );
 		}
-		json_object_set_new( statisticsJson, "logfile", val );
 	}
 	if ( config ) {
 		char buf[2000];
 		size_t len = globals_dumpConfig( buf, sizeof(buf) );
-		json_object_set_new( statisticsJson, "config", json_stringn_nocheck( buf, len ) );
+		jsonstream_stringn( js, "config", buf, len );
 	}
+	// These are small, keep building them via jansson
 	if ( altservers ) {
-		json_object_set_new( statisticsJson, "altservers", altservers_toJson() );
+		writeJansson( js, "altservers", altservers_toJson() );
+	}
+	if ( memory ) {
+		writeJansson( js, "memory", getMemoryJson() );
+	}
+	if ( locks ) {
+		writeJansson( js, "locks", getLocksJson() );
 	}
+	jsonstream_objectEnd( js );
+	ok = jsonstream_finish( js );
+	free( js );
+	return finishReply( sock, keepAlive ) && ok;
+}
+
+/**
+ * Serialize given jansson object to stream and free it.
+ */
+static void writeJansson(jsonstream_t *js, const char *key, json_t *value)
+{
+	char *str = json_dumps( value, 0 );
+	json_decref( value );
+	if ( str == NULL ) {
+		jsonstream_null( js, key );
+	} else {
+		jsonstream_raw( js, key, str );
+		free( str );
+	}
+}
 
-	char *jsonString = json_dumps( statisticsJson, 0 );
-	json_decref( statisticsJson );
-	ok = sendReply( sock, "200 OK", "application/json", jsonString, -1, keepAlive );
-	free( jsonString );
-	return ok;
+/**
+ * Lock contention profile, most waited-for lock first. Times are in ns.
+ * Histogram bucket 0 counts < 1µs, bucket n counts [2^(n-1), 2^n) µs,
+ * the last bucket is open-ended. Hold times are only measured for sampled
+ * acquisitions; waits are recorded for every contended one.
+ */
+static json_t* getLocksJson()
+{
+	lockprof_stats_t *stats = malloc( sizeof(*stats) * 128 );
+	json_t *list = json_array();
+	const int count = stats == NULL ? 0 : lockprof_getStats( stats, 128 );
+	for ( int i = 0; i < count; ++i ) {
+		const lockprof_stats_t *s = &stats[i];
+		json_t *waitHist = json_array(), *holdHist = json_array();
+		for ( int b = 0; b < LOCKPROF_BUCKETS; ++b ) {
+			json_array_append_new( waitHist, json_integer( (json_int_t)s->waitHist[b] ) );
+			json_array_append_new( holdHist, json_integer( (json_int_t)s->holdHist[b] ) );
+		}
+		json_array_append_new( list, json_pack( "{sssIsIsIsIsIsIsIsoso}",
+				"name", s->name[0] == '&' ? s->name + 1 : s->name,
+				"sampled", (json_int_t)s->sampled,
+				"sampledContended", (json_int_t)s->sampledContended,
+				"contended", (json_int_t)s->contended,
+				"waitTotal", (json_int_t)s->waitTotalNs,
+				"waitMax", (json_int_t)s->waitMaxNs,
+				"holdTotal", (json_int_t)s->holdTotalNs,
+				"holdMax", (json_int_t)s->holdMaxNs,
+				"waitHist", waitHist,
+				"holdHist", holdHist ) );
+	}
+	free( stats );
+	return json_pack( "{siso}",
+			"sampleRate", (int)_lockProfileRate,
+			"locks", list );
+}
+
+/**
+ * Thread counts and approximate memory usage per subsystem.
+ * Thread stacks are reported as reserved size, not resident size.
+ */
+static json_t* getMemoryJson()
+{
+	int poolThreads, poolIdle, poolQueued, clientCount, serverCount, imageCount, uplinkCount;
+	uint64_t imageBytes, uplinkBytes;
+	threadpool_getStats( &poolThreads, &poolIdle, &poolQueued );
+	net_getStats( &clientCount, &serverCount, NULL );
+	image_getMemoryStats( &imageCount, &imageBytes, &uplinkCount, &uplinkBytes );
+	size_t stackSize = (size_t)_threadStackSize;
+	if ( stackSize == 0 ) {
+		pthread_attr_t attr;
+		pthread_attr_init( &attr );
+		pthread_attr_getstacksize( &attr, &stackSize );
+		pthread_attr_destroy( &attr );
+	}
+	// Pool threads, uplinks, altservers + integrity checker
+	const int serverThreads = poolThreads + uplinkCount + 2;
+	json_t *threads = json_pack( "{sisisisisi}",
+			"pool", poolThreads,
+			"poolIdle", poolIdle,
+			"poolQueued", poolQueued,
+			"uplink", uplinkCount,
+			"total", serverThreads );
+	json_t *bytes = json_pack( "{sIsIsIsIsIsI}",
+			"threadStacks", (json_int_t)( (uint64_t)serverThreads * stackSize ),
+			"clients", (json_int_t)( (uint64_t)( clientCount + serverCount ) * sizeof(dnbd3_client_t) ),
+			"images", (json_int_t)imageBytes,
+			"uplinks", (json_int_t)uplinkBytes,
+			"uplinkBufferPool", (json_int_t)uplink_getRecvPoolBytes(),
+			"warmupPinned", (json_int_t)warmup_getLockedBytes() );
+	json_t *result = json_pack( "{soso}",
+			"threads", threads,
+			"bytes", bytes );
+	json_object_set_new( result, "stackSize", json_integer( (json_int_t)stackSize ) );
+	// What the kernel says
+	FILE *fh = fopen( "/proc/self/status", "r" );
+	if ( fh != NULL ) {
+		char line[200];
+		long long val;
+		while ( fgets( line, sizeof(line), fh ) != NULL ) {
+			if ( sscanf( line, "Threads: %lld", &val ) == 1 ) {
+				json_object_set_new( result, "processThreads", json_integer( (json_int_t)val ) );
+			} else if ( sscanf( line, "VmRSS: %lld", &val ) == 1 ) {
+				json_object_set_new( result, "processRss", json_integer( (json_int_t)( val * 1024 ) ) );
+			} else if ( sscanf( line, "VmSize: %lld", &val ) == 1 ) {
+				json_object_set_new( result, "processVirtual", json_integer( (json_int_t)( val * 1024 ) ) );
+			}
+		}
+		fclose( fh );
+	}
+	return result;
 }
 
 static bool sendReply(int sock, const char *status, const char *ctype, const char *payload, ssize_t plen, int keepAlive)
 {
 	if ( plen == -1 ) plen = strlen( payload );
+	if ( !sendHeader( sock, status, ctype, plen, keepAlive ) ) return false;
+	if ( !sock_sendAll( sock, payload, plen, 10 ) ) return false;
+	return finishReply( sock, keepAlive );
+}
+
+/**
+ * Send reply header.
+ * @param plen Content-Length, -1 if unknown (body ends when connection closes),
+ * -2 for chunked encoding
+ */
+static bool sendHeader(int sock, const char *status, const char *ctype, ssize_t plen, int keepAlive)
+{
 	char buffer[600];
+	char length[50];
 	const char *connection = ( keepAlive == HTTP_KEEPALIVE ) ? "Keep-Alive" : "Close";
+	if ( plen == -2 ) {
+		snprintf( length, sizeof(length), "Transfer-Encoding: chunked\r\n" );
+	} else if ( plen >= 0 ) {
+		snprintf( length, sizeof(length), "Content-Length: %u\r\n", (unsigned int)plen );
+	} else {
+		length[0] = '\0';
+	}
 	int hlen = snprintf(buffer, sizeof(buffer), "HTTP/1.1 %s\r\n"
 			"Connection: %s\r\n"
 			"Content-Type: %s; charset=utf-8\r\n"
-			"Content-Length: %u\r\n"
+			"%s"
 			"\r\n",
-			status, connection, ctype, (unsigned int)plen );
+			status, connection, ctype, length );
 	if ( hlen < 0 || hlen >= (int)sizeof(buffer) ) return false; // Truncated
 	if ( send( sock, buffer, hlen, MSG_MORE ) != hlen ) return false;
-	if ( !sock_sendAll( sock, payload, plen, 10 ) ) return false;
+	return true;
+}
+
+/**
+ * Call after sending a reply. If the connection is not kept alive,
+ * shut it down and wait for the client to close it.
+ * @return false if the connection should not be used anymore
+ */
+static bool finishReply(int sock, int keepAlive)
+{
 	if ( keepAlive == HTTP_CLOSE ) {
+		char buffer[600];
 		// Wait for flush
 		shutdown( sock, SHUT_WR );
 #ifdef AFL_MODE
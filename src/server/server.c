@@ -27,6 +27,12 @@
 #include "net.h"
 #include "altservers.h"
 #include "integrity.h"
+#include "ssdcache.h"
+#include "warmup.h"
+#include "bufcache.h"
+#include "dedup.h"
+#include "imageindex.h"
+#include "imagewatch.h"
 #include "threadpool.h"
 #include "rpc.h"
 
@@ -118,33 +124,51 @@ void dnbd3_cleanup()
 	// Kill connection to all clients
 	net_disconnectAll();
 
-	// Disable threadpool
-	threadpool_close();
-
 	// Terminate the altserver checking thread
 	altservers_shutdown();
 
-	// Terminate all uplinks
+	// Terminate all uplinks; they need the threadpool to save their cache maps
 	image_killUplinks();
+	uplink_globalsShutdown();
+
+	// Disable threadpool
+	threadpool_close();
 
 	// Terminate integrity checker
 	integrity_shutdown();
 
+	// Terminate SSD cache copy thread
+	ssdcache_shutdown();
+
+	// Terminate warmup thread
+	warmup_shutdown();
+
+	// Terminate dedup indexing thread
+	dedup_shutdown();
+
+	// Stop watching image directory
+	imagewatch_shutdown();
+
 	// Wait for clients to disconnect
 	net_waitForAllDisconnected();
 
 	// Watchdog not needed anymore
 	debug_locks_stop_watchdog();
 
+	// Remember which images were fine
+	imageindex_shutdown();
+
 	// Clean up images
 	retries = 5;
 	while ( !image_tryFreeAll() && --retries > 0 ) {
 		logadd( LOG_INFO, "Waiting for images to free...\n" );
 		sleep( 1 );
 	}
+	bufcache_shutdown();
 
 	free( _basePath );
 	free( _configDir );
+	log_stopAsync();
 	exit( EXIT_SUCCESS );
 }
 
@@ -291,9 +315,16 @@ int main(int argc, char *argv[])
 		}
 		exit( 0 );
 	}
+	if ( !log_startAsync() ) {
+		logadd( LOG_WARNING, "Could not start async logger, logging synchronously" );
+	}
 	image_serverStartup();
+	imageindex_init();
 	altservers_init();
 	integrity_init();
+	ssdcache_init();
+	bufcache_init();
+	dedup_init();
 	net_init();
 	uplink_globalsInit();
 	rpc_init();
@@ -333,6 +364,12 @@ int main(int argc, char *argv[])
 		return _shutdown ? 0 : 1;
 	}
 
+	// Start pulling hot blocks into the page cache
+	warmup_init();
+
+	// Pick up new images without SIGHUP
+	imagewatch_init();
+
 	// Give other threads some time to start up before accepting connections
 	usleep( 100000 );
 
@@ -340,7 +377,7 @@ int main(int argc, char *argv[])
 	listeners = setupNetwork( bindAddress );
 
 	// Initialize thread pool
-	if ( !threadpool_init( 8 ) ) {
+	if ( !threadpool_init( 8, _minThreads, _maxThreads, _maxQueuedJobs ) ) {
 		logadd( LOG_ERROR, "Could not init thread pool!\n" );
 		exit( EXIT_FAILURE );
 	}
@@ -357,7 +394,10 @@ int main(int argc, char *argv[])
 		if ( sigReload ) {
 			sigReload = false;
 			logadd( LOG_INFO, "SIGHUP received, re-scanning image directory" );
-			threadpool_run( &server_asyncImageListLoad, NULL );
+			if ( !threadpool_runInternal( &server_asyncImageListLoad, NULL ) ) {
+				logadd( LOG_WARNING, "Could not start re-scan of image directory, will retry" );
+				sigReload = true;
+			}
 		}
 		if ( sigLogCycle ) {
 			sigLogCycle = false;
@@ -386,6 +426,7 @@ int main(int argc, char *argv[])
 
 		if ( !threadpool_run( &net_handleNewConnection, (void *)dnbd3_client ) ) {
 			logadd( LOG_ERROR, "Could not start thread for new connection." );
+			close( fd );
 			free( dnbd3_client );
 			continue;
 		}
@@ -435,7 +476,7 @@ static poll_list_t* setupNetwork(char *bindAddress)
  */
 static dnbd3_client_t* dnbd3_prepareClient(struct sockaddr_storage *client, int fd)
 {
-	dnbd3_client_t *dnbd3_client = calloc( 1, sizeof(dnbd3_client_t) );
+	dnbd3_client_t *dnbd3_client = callocCacheAligned( sizeof(dnbd3_client_t) );
 	if ( dnbd3_client == NULL ) { // This will never happen thanks to memory overcommit
 		logadd( LOG_ERROR, "Could not alloc dnbd3_client_t for new client." );
 		return NULL;
@@ -0,0 +1,409 @@
+#include "ssdcache.h"
+
+#include "helper.h"
+#include "locks.h"
+#include "image.h"
+#include "fileutil.h"
+#include "../shared/timing.h"
+
+#include <assert.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#define SSD_MAP_MAGIC (0x32737364) // "dss2"
+// Values of state[] greater than the hit counter
+#define SSD_QUEUED (254)
+#define SSD_PRESENT (255)
+
+typedef struct
+{
+	uint32_t magic;
+	uint32_t masterCrc32;
+	uint64_t realFilesize;
+	uint64_t inode;
+	uint64_t device;
+} ssdmap_header_t;
+
+struct _dnbd3_ssdcache
+{
+	char *path;           // path of cache file, map is at path + ".ssdmap"
+	atomic_int fd;        // -1 until first block is copied
+	atomic_bool discard;  // delete files on close
+	uint64_t inode;       // of image file when it was loaded, to detect it being replaced
+	uint64_t device;
+	int blocks;           // number of hash blocks in image
+	atomic_uchar state[]; // per hash block: hit counter, SSD_QUEUED or SSD_PRESENT
+};
+
+typedef struct
+{
+	dnbd3_image_t *image;
+	int block;
+} queue_entry;
+
+static pthread_t thread;
+static queue_entry copyQueue[SERVER_SSDCACHE_QUEUE];
+static pthread_mutex_t ssdQueueLock;
+static pthread_cond_t queueSignal;
+static int queueHead = 0;
+static int queueLen = -1;
+static bool haveThread = false;
+static atomic_bool bRunning = false;
+static atomic_uint_fast64_t usedBytes = 0;
+
+static void* ssdcache_main(void *data);
+static bool enqueue(dnbd3_image_t *image, int block);
+static void promote(dnbd3_image_t *image, int block);
+static bool openCacheFile(struct _dnbd3_ssdcache *ssd);
+static void saveMap(dnbd3_image_t *image);
+static uint64_t blockBytes(const dnbd3_image_t *image, int block);
+
+void ssdcache_init()
+{
+	if ( _ssdCachePath == NULL )
+		return;
+	assert( queueLen == -1 );
+	if ( !mkdir_p( _ssdCachePath ) || access( _ssdCachePath, W_OK ) != 0 ) {
+		logadd( LOG_WARNING, "SSD cache directory %s is not writable, disabling SSD cache", _ssdCachePath );
+		free( _ssdCachePath );
+		_ssdCachePath = NULL;
+		return;
+	}
+	mutex_init( &ssdQueueLock );
+	pthread_cond_init( &queueSignal, NULL );
+	queueLen = 0;
+	bRunning = true;
+	pthread_attr_t attrs;
+	initThreadAttrs( &attrs, false );
+	haveThread = ( 0 == thread_create( &thread, &attrs, &ssdcache_main, (void *)NULL ) );
+	if ( !haveThread ) {
+		bRunning = false;
+		logadd( LOG_WARNING, "Could not start SSD cache thread. No new blocks will be copied to %s", _ssdCachePath );
+	}
+	pthread_attr_destroy( &attrs );
+	logadd( LOG_INFO, "SSD cache tier enabled in %s", _ssdCachePath );
+}
+
+void ssdcache_shutdown()
+{
+	if ( queueLen == -1 )
+		return;
+	logadd( LOG_DEBUG1, "Shutting down SSD cache thread...\n" );
+	mutex_lock( &ssdQueueLock );
+	pthread_cond_signal( &queueSignal );
+	mutex_unlock( &ssdQueueLock );
+	if ( haveThread ) {
+		thread_join( thread, NULL );
+	}
+	// Don't destroy lock, images still call ssdcache_imageClose() when being freed
+	logadd( LOG_DEBUG1, "SSD cache thread exited normally.\n" );
+}
+
+void ssdcache_imageOpen(dnbd3_image_t *image)
+{
+	if ( _ssdCachePath == NULL || image->realFilesize == 0 )
+		return;
+	const size_t baseLen = strlen( _basePath );
+	if ( strncmp( image->path, _basePath, baseLen ) != 0 || image->path[baseLen] != '/' )
+		return;
+	// Copies are verified against, and the map tied to, the CRC-32 list
+	if ( image->crc32 == NULL && !image->crc32Deferred )
+		return;
+	struct stat st;
+	if ( stat( image->path, &st ) != 0 )
+		return;
+	const int blocks = IMGSIZE_TO_HASHBLOCKS( image->realFilesize );
+	struct _dnbd3_ssdcache *ssd = calloc( 1, sizeof(*ssd) + (size_t)blocks * sizeof(ssd->state[0]) );
+	if ( ssd == NULL )
+		return;
+	// Mirror directory structure of basePath
+	if ( asprintf( &ssd->path, "%s%s", _ssdCachePath, image->path + baseLen ) == -1 ) {
+		free( ssd );
+		return;
+	}
+	ssd->fd = -1;
+	ssd->blocks = blocks;
+	ssd->inode = (uint64_t)st.st_ino;
+	ssd->device = (uint64_t)st.st_dev;
+	// Load map of blocks already on SSD, if it belongs to this version of the image
+	char mapPath[strlen( ssd->path ) + 8];
+	snprintf( mapPath, sizeof(mapPath), "%s.ssdmap", ssd->path );
+	int mapFd = open( mapPath, O_RDONLY );
+	if ( mapFd != -1 ) {
+		ssdmap_header_t header;
+		uint8_t *map = malloc( (size_t)blocks );
+		if ( map != NULL && read( mapFd, &header, sizeof(header) ) == sizeof(header)
+				&& header.magic == SSD_MAP_MAGIC && header.masterCrc32 == image->masterCrc32
+				&& header.realFilesize == image->realFilesize
+				&& header.inode == ssd->inode && header.device == ssd->device
+				&& read( mapFd, map, (size_t)blocks ) == blocks ) {
+			ssd->fd = open( ssd->path, O_RDWR );
+			for ( int i = 0; i < blocks && ssd->fd != -1; ++i ) {
+				if ( map[i] != 0 ) {
+					ssd->state[i] = SSD_PRESENT;
+					usedBytes += blockBytes( image, i );
+				}
+			}
+		} else {
+			logadd( LOG_INFO, "Discarding stale SSD cache of %s:%d", image->name, (int)image->rid );
+			unlink( ssd->path );
+		}
+		free( map );
+		close( mapFd );
+	}
+	image->ssd = ssd;
+}
+
+void ssdcache_imageClose(dnbd3_image_t *image)
+{
+	struct _dnbd3_ssdcache *ssd = image->ssd;
+	if ( ssd == NULL )
+		return;
+	if ( queueLen != -1 ) {
+		// Make sure the copy thread never sees this image again
+		mutex_lock( &ssdQueueLock );
+		for ( int i = 0; i < queueLen; ++i ) {
+			queue_entry *entry = &copyQueue[(queueHead + i) % SERVER_SSDCACHE_QUEUE];
+			if ( entry->image == image ) {
+				entry->image = NULL;
+			}
+		}
+		mutex_unlock( &ssdQueueLock );
+	}
+	if ( ssd->fd != -1 ) {
+		close( ssd->fd );
+	}
+	for ( int i = 0; i < ssd->blocks; ++i ) {
+		if ( ssd->state[i] == SSD_PRESENT ) {
+			usedBytes -= blockBytes( image, i );
+		}
+	}
+	if ( ssd->discard ) {
+		char mapPath[strlen( ssd->path ) + 8];
+		snprintf( mapPath, sizeof(mapPath), "%s.ssdmap", ssd->path );
+		unlink( mapPath );
+		unlink( ssd->path );
+	}
+	free( ssd->path );
+	free( ssd );
+	image->ssd = NULL;
+}
+
+void ssdcache_discard(dnbd3_image_t *image)
+{
+	if ( image->ssd != NULL ) {
+		image->ssd->discard = true;
+	}
+}
+
+int ssdcache_getFd(dnbd3_image_t *image, uint64_t offset, uint32_t size, bool countHit)
+{
+	struct _dnbd3_ssdcache * const ssd = image->ssd;
+	if ( ssd == NULL || size == 0 )
+		return -1;
+	const int first = (int)( offset / HASH_BLOCK_SIZE );
+	const int last = (int)MIN( ( offset + size - 1 ) / HASH_BLOCK_SIZE, (uint64_t)ssd->blocks - 1 );
+	if ( first >= ssd->blocks )
+		return -1;
+	bool present = true;
+	for ( int i = first; i <= last; ++i ) {
+		if ( ssd->state[i] != SSD_PRESENT ) {
+			present = false;
+			break;
+		}
+	}
+	if ( present )
+		return ssd->fd;
+	if ( !countHit || !bRunning )
+		return -1;
+	const int minHits = MAX( 1, MIN( _ssdCacheMinHits, SSD_QUEUED - 1 ) );
+	unsigned char state = ssd->state[first];
+	if ( state >= SSD_QUEUED )
+		return -1;
+	if ( state + 1 < minHits ) {
+		atomic_compare_exchange_strong( &ssd->state[first], &state, (unsigned char)( state + 1 ) );
+	} else if ( atomic_compare_exchange_strong( &ssd->state[first], &state, SSD_QUEUED ) ) {
+		if ( !enqueue( image, first ) ) {
+			ssd->state[first] = 0;
+		}
+	}
+	return -1;
+}
+
+uint64_t ssdcache_getUsedBytes()
+{
+	return usedBytes;
+}
+
+static bool enqueue(dnbd3_image_t *image, int block)
+{
+	mutex_lock( &ssdQueueLock );
+	if ( queueLen >= SERVER_SSDCACHE_QUEUE ) {
+		mutex_unlock( &ssdQueueLock );
+		logadd( LOG_DEBUG1, "SSD cache queue full, not copying block %d of %s:%d", block, image->name, (int)image->rid );
+		return false;
+	}
+	queue_entry *entry = &copyQueue[(queueHead + queueLen) % SERVER_SSDCACHE_QUEUE];
+	entry->image = image;
+	entry->block = block;
+	queueLen++;
+	pthread_cond_signal( &queueSignal );
+	mutex_unlock( &ssdQueueLock );
+	return true;
+}
+
+static void* ssdcache_main(void * data UNUSED)
+{
+	setThreadName( "ssd-cache" );
+	blockNoncriticalSignals();
+	mutex_lock( &ssdQueueLock );
+	while ( !_shutdown ) {
+		if ( queueLen == 0 ) {
+			mutex_cond_wait( &queueSignal, &ssdQueueLock );
+			continue;
+		}
+		const queue_entry entry = copyQueue[queueHead];
+		queueHead = ( queueHead + 1 ) % SERVER_SSDCACHE_QUEUE;
+		queueLen--;
+		// The entry is cleared by ssdcache_imageClose() before the image is freed, so it's still
+		// valid while we hold the queue lock. Take a reference, unless it's about to be freed.
+		dnbd3_image_t * const image = entry.image;
+		bool use = false;
+		if ( image != NULL ) {
+			mutex_lock( &image->lock );
+			use = !image->retired || image->users != 0;
+			if ( use ) {
+				image->users++;
+			}
+			mutex_unlock( &image->lock );
+		}
+		mutex_unlock( &ssdQueueLock );
+		if ( use ) {
+			promote( image, entry.block );
+			image_release( image );
+		}
+		mutex_lock( &ssdQueueLock );
+	}
+	mutex_unlock( &ssdQueueLock );
+	bRunning = false;
+	return NULL;
+}
+
+/**
+ * Copy given hash block of image to SSD.
+ * Caller must hold a reference to the image.
+ */
+static void promote(dnbd3_image_t *image, int block)
+{
+	static ticks lastFullWarning;
+	struct _dnbd3_ssdcache * const ssd = image->ssd;
+	const uint64_t start = (uint64_t)block * HASH_BLOCK_SIZE;
+	const uint64_t len = blockBytes( image, block );
+	// Budget and free space
+	uint64_t avail = 0;
+	if ( ( _ssdCacheMaxSize != 0 && usedBytes + len > _ssdCacheMaxSize )
+			|| !file_freeDiskSpace( _ssdCachePath, NULL, &avail ) || avail < len + SERVER_SSDCACHE_MIN_FREE ) {
+		declare_now;
+		if ( timing_diff( &lastFullWarning, &now ) > 600 ) {
+			lastFullWarning = now;
+			logadd( LOG_INFO, "SSD cache is full (%" PRIu64 " MiB used)", (uint64_t)usedBytes / ( 1024 * 1024 ) );
+		}
+		goto fail;
+	}
+	// Only copy what we actually have, and what we can verify
+	image_ensureCrcList( image );
+	mutex_lock( &image->lock );
+	const bool complete = image_isHashBlockComplete( image->cache_map, block, image->realFilesize );
+	uint32_t * const crc32list = image->crc32;
+	mutex_unlock( &image->lock );
+	if ( crc32list == NULL ) {
+		logadd( LOG_DEBUG1, "SSD cache: No CRC-32 list for %s:%d, not copying block %d", image->name, (int)image->rid, block );
+		goto fail;
+	}
+	if ( !complete || !image_ensureOpen( image ) || !openCacheFile( ssd ) )
+		goto fail;
+	if ( !file_copyRange( image->readFd, start, ssd->fd, start, len ) ) {
+		logadd( LOG_WARNING, "SSD cache: Copying block %d of %s to %s failed (errno=%d)", block, image->path, ssd->path, errno );
+		goto fail;
+	}
+	if ( fdatasync( ssd->fd ) == -1 ) {
+		logadd( LOG_WARNING, "SSD cache: Cannot flush %s (errno=%d)", ssd->path, errno );
+		goto fail;
+	}
+	// Verify the copy, so we never serve garbage from the SSD
+	const int blocks[2] = { block, -1 };
+	if ( !image_checkBlocksCrc32( ssd->fd, crc32list, blocks, image->realFilesize ) ) {
+		logadd( LOG_WARNING, "SSD cache: CRC mismatch for block %d of %s:%d", block, image->name, (int)image->rid );
+		goto fail;
+	}
+	usedBytes += len;
+	ssd->state[block] = SSD_PRESENT;
+	saveMap( image );
+	logadd( LOG_DEBUG2, "Copied block %d of %s:%d to SSD", block, image->name, (int)image->rid );
+	return;
+fail:
+	ssd->state[block] = 0;
+}
+
+/**
+ * Open or create cache file. Only called from the copy thread.
+ */
+static bool openCacheFile(struct _dnbd3_ssdcache *ssd)
+{
+	if ( ssd->fd != -1 )
+		return true;
+	char *lastSlash = strrchr( ssd->path, '/' );
+	*lastSlash = '\0';
+	mkdir_p( ssd->path );
+	*lastSlash = '/';
+	const int fd = open( ssd->path, O_RDWR | O_CREAT, 0644 );
+	if ( fd == -1 ) {
+		logadd( LOG_WARNING, "SSD cache: Cannot create %s (errno=%d)", ssd->path, errno );
+		return false;
+	}
+	ssd->fd = fd;
+	return true;
+}
+
+/**
+ * Write out which blocks are on the SSD. Only called from the copy thread.
+ */
+static void saveMap(dnbd3_image_t *image)
+{
+	struct _dnbd3_ssdcache * const ssd = image->ssd;
+	char mapPath[strlen( ssd->path ) + 8];
+	snprintf( mapPath, sizeof(mapPath), "%s.ssdmap", ssd->path );
+	const size_t size = sizeof(ssdmap_header_t) + (size_t)ssd->blocks;
+	uint8_t *data = malloc( size );
+	if ( data == NULL )
+		return;
+	ssdmap_header_t * const header = (ssdmap_header_t*)data;
+	header->magic = SSD_MAP_MAGIC;
+	header->masterCrc32 = image->masterCrc32;
+	header->realFilesize = image->realFilesize;
+	header->inode = ssd->inode;
+	header->device = ssd->device;
+	for ( int i = 0; i < ssd->blocks; ++i ) {
+		data[sizeof(*header) + i] = ( ssd->state[i] == SSD_PRESENT );
+	}
+	const int fd = open( mapPath, O_WRONLY | O_CREAT, 0644 );
+	if ( fd == -1 ) {
+		logadd( LOG_WARNING, "SSD cache: Cannot write %s (errno=%d)", mapPath, errno );
+	} else {
+		if ( pwrite( fd, data, size, 0 ) != (ssize_t)size ) {
+			logadd( LOG_WARNING, "SSD cache: Cannot write %s (errno=%d)", mapPath, errno );
+		}
+		close( fd );
+	}
+	free( data );
+}
+
+static uint64_t blockBytes(const dnbd3_image_t *image, int block)
+{
+	return MIN( (uint64_t)HASH_BLOCK_SIZE, image->realFilesize - (uint64_t)block * HASH_BLOCK_SIZE );
+}
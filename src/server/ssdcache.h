@@ -0,0 +1,48 @@
+#ifndef _SSDCACHE_H_
+#define _SSDCACHE_H_
+
+#include "globals.h"
+
+/*
+ * Optional second storage tier: Hash blocks that get read a lot are
+ * copied from basePath to a cache file per image in ssdCachePath,
+ * which is then used instead of readFd to serve those blocks.
+ * Only images with a CRC-32 list are cached, so copies can be verified.
+ */
+
+void ssdcache_init();
+
+void ssdcache_shutdown();
+
+/**
+ * Set up SSD cache state for a freshly loaded image,
+ * picking up blocks that were copied in a previous run.
+ */
+void ssdcache_imageOpen(dnbd3_image_t *image);
+
+/**
+ * Tear down SSD cache state of image. Called when the image gets freed.
+ */
+void ssdcache_imageClose(dnbd3_image_t *image);
+
+/**
+ * Delete the image's SSD cache files once it gets freed,
+ * since the image itself is about to be deleted.
+ */
+void ssdcache_discard(dnbd3_image_t *image);
+
+/**
+ * Get fd to read given range from, if it's entirely on the SSD.
+ * Otherwise, if countHit is set, count an access to the first hash
+ * block of the range, which might eventually result in it being copied.
+ * @param countHit true if the client just moved to another hash block
+ * @return fd of SSD copy, -1 if range has to be read from readFd
+ */
+int ssdcache_getFd(dnbd3_image_t *image, uint64_t offset, uint32_t size, bool countHit);
+
+/**
+ * Number of bytes currently stored in the SSD cache.
+ */
+uint64_t ssdcache_getUsedBytes();
+
+#endif
@@ -0,0 +1,44 @@
+#include "stats.h"
+
+#include <stdatomic.h>
+
+/*
+ * Counters are spread over several shards, each on its own cache lines.
+ * Every thread picks a shard the first time it counts something, so
+ * threads serving different clients don't fight over the same line.
+ * Reading sums up all shards, which is only done for the RPC interface.
+ */
+#define SHARD_COUNT 32
+
+// Size of counters rounded up to whole cache lines
+#define SHARD_SIZE ( ( STATS_COUNT * sizeof(atomic_uint_fast64_t) + CACHE_LINE_SIZE - 1 ) / CACHE_LINE_SIZE * CACHE_LINE_SIZE )
+
+typedef union {
+	_Alignas(CACHE_LINE_SIZE) atomic_uint_fast64_t counter[STATS_COUNT];
+	char padding[SHARD_SIZE];
+} shard_t;
+
+_Static_assert( sizeof(((shard_t*)0)->counter) <= sizeof(shard_t), "Stats shard too small for its counters" );
+_Static_assert( sizeof(shard_t) % CACHE_LINE_SIZE == 0, "Stats shard shares a cache line with the next one" );
+
+static shard_t shards[SHARD_COUNT];
+static atomic_uint nextShard = 0;
+static _Thread_local shard_t *myShard = NULL;
+
+void stats_add(stats_counter_t counter, uint64_t value)
+{
+	if ( unlikely( myShard == NULL ) ) {
+		myShard = &shards[atomic_fetch_add_explicit( &nextShard, 1, memory_order_relaxed ) % SHARD_COUNT];
+	}
+	// Relaxed ordering is fine, we only care about the sum eventually adding up
+	atomic_fetch_add_explicit( &myShard->counter[counter], value, memory_order_relaxed );
+}
+
+uint64_t stats_get(stats_counter_t counter)
+{
+	uint64_t sum = 0;
+	for ( int i = 0; i < SHARD_COUNT; ++i ) {
+		sum += atomic_load_explicit( &shards[i].counter[counter], memory_order_relaxed );
+	}
+	return sum;
+}
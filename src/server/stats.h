@@ -0,0 +1,22 @@
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include "globals.h"
+
+typedef enum {
+	STATS_BYTES_SENT = 0,  // Payload bytes sent to clients
+	STATS_BYTES_RECEIVED,  // Payload bytes received from uplink servers
+	STATS_REQUESTS,        // Block requests by clients
+	STATS_CACHE_HITS,      // Block requests served from local storage
+	STATS_CACHE_MISSES,    // Block requests that had to be relayed to an uplink server
+	STATS_UPLINK_REQUESTS, // Block requests sent to uplink servers, including background replication
+	STATS_SSD_HITS,        // Block requests served from the SSD cache tier
+	STATS_DEDUP_BYTES,     // Bytes copied from other local revisions instead of fetching them from uplink servers
+	STATS_COUNT
+} stats_counter_t;
+
+void stats_add(stats_counter_t counter, uint64_t value);
+
+uint64_t stats_get(stats_counter_t counter);
+
+#endif /* STATS_H_ */
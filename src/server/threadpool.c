@@ -2,30 +2,75 @@
 #include "globals.h"
 #include "helper.h"
 #include "locks.h"
+#include "../shared/timing.h"
 
-typedef struct _entry_t {
-	struct _entry_t *next;
-	pthread_t thread;
-	dnbd3_signal_t* signal;
+typedef struct {
 	void *(*startRoutine)(void *);
 	void * arg;
-} entry_t;
+} job_t;
+
+typedef struct {
+	job_t *jobs;      // Ring buffer
+	int size;         // Capacity of ring buffer
+	int head;
+	int len;
+} jobqueue_t;
 
-static void *threadpool_worker(void *entryPtr);
+static void *threadpool_worker(void *unused);
+static bool enqueue(void *(*startRoutine)(void *), void *arg, bool internal);
+static int pendingLocked();
+static bool spawnWorkerLocked();
+static bool initQueue(jobqueue_t *q, int size);
+static bool pushLocked(jobqueue_t *q, void *(*startRoutine)(void *), void *arg);
+static job_t popLocked(jobqueue_t *q);
 
 static pthread_attr_t threadAttrs;
 
 static int maxIdleThreads = -1;
-static entry_t *pool = NULL;
+static int minThreads = 0;
+static int maxThreads = 0;    // Limit for client jobs; internal jobs get SERVER_THREADS_RESERVED more
 static pthread_mutex_t poolLock;
+static pthread_cond_t poolSignal;
+// All below protected by poolLock
+static int threadCount = 0;
+static int idleCount = 0;
+static int startingCount = 0; // Spawned, but not waiting for jobs yet
+static int clientRunning = 0; // Threads running a client job
+static jobqueue_t clientQueue;
+static jobqueue_t internalQueue; // Always picked up before client jobs
+static int maxBacklog = 0;    // Max. number of client jobs waiting while no thread can take them
+static bool poolShutdown = false;
+static ticks lastFullWarning;
 
-bool threadpool_init(int maxIdle)
+bool threadpool_init(int maxIdle, int minThreadCount, int maxThreadCount, int maxQueued)
 {
 	if ( maxIdle < 0 || maxIdleThreads >= 0 ) return false;
+	if ( maxThreadCount < 1 || maxQueued < 1 ) return false;
+	if ( minThreadCount < 0 ) minThreadCount = 0;
+	if ( minThreadCount > maxThreadCount ) minThreadCount = maxThreadCount;
+	// Room for one job per thread that is about to pick it up, plus the backlog
+	if ( !initQueue( &clientQueue, maxQueued + maxThreadCount ) )
+		return false;
+	if ( !initQueue( &internalQueue, SERVER_THREADS_RESERVED ) ) {
+		free( clientQueue.jobs );
+		return false;
+	}
+	maxBacklog = maxQueued;
 	mutex_init( &poolLock );
+	pthread_cond_init( &poolSignal, NULL );
 	maxIdleThreads = maxIdle;
-	pthread_attr_init( &threadAttrs );
-	pthread_attr_setdetachstate( &threadAttrs, PTHREAD_CREATE_DETACHED );
+	minThreads = minThreadCount;
+	maxThreads = maxThreadCount;
+	timing_get( &lastFullWarning );
+	initThreadAttrs( &threadAttrs, true );
+	// Pre-spawn workers so the first clients don't pay for thread creation
+	mutex_lock( &poolLock );
+	while ( threadCount < minThreads ) {
+		if ( !spawnWorkerLocked() ) break;
+	}
+	mutex_unlock( &poolLock );
+	logadd( LOG_DEBUG1, "Thread pool started with %d threads (min %d, max %d + %d reserved, queue %d)",
+			threadCount, minThreads, maxThreads, SERVER_THREADS_RESERVED, maxBacklog );
 	return true;
 }
 
@@ -35,92 +80,215 @@ void threadpool_close()
 	if ( maxIdleThreads < 0 ) return;
 	mutex_lock( &poolLock );
 	maxIdleThreads = -1;
-	entry_t *ptr = pool;
-	while ( ptr != NULL ) {
-		entry_t *current = ptr;
-		ptr = ptr->next;
-		signal_call( current->signal );
-	}
+	poolShutdown = true;
+	clientQueue.len = 0;
+	internalQueue.len = 0;
+	pthread_cond_broadcast( &poolSignal );
 	mutex_unlock( &poolLock );
+	// Give idle workers a chance to leave before tearing down the lock
+	int retries = 100;
+	for ( ;; ) {
+		mutex_lock( &poolLock );
+		const int idle = idleCount;
+		mutex_unlock( &poolLock );
+		if ( idle == 0 || --retries == 0 ) break;
+		usleep( 10000 );
+	}
+	if ( retries == 0 ) {
+		logadd( LOG_DEBUG1, "Thread pool: Idle threads didn't exit in time" );
+		return;
+	}
 	mutex_destroy( &poolLock );
+	pthread_cond_destroy( &poolSignal );
 }
 
 bool threadpool_run(void *(*startRoutine)(void *), void *arg)
 {
+	return enqueue( startRoutine, arg, false );
+}
+
+bool threadpool_runInternal(void *(*startRoutine)(void *), void *arg)
+{
+	return enqueue( startRoutine, arg, true );
+}
+
+void threadpool_getStats(int *threads, int *idle, int *queued)
+{
+	if ( maxIdleThreads < 0 ) {
+		*threads = *idle = *queued = 0;
+		return;
+	}
 	mutex_lock( &poolLock );
-	entry_t *entry = pool;
-	if ( entry != NULL ) pool = entry->next;
+	*threads = threadCount;
+	*idle = idleCount;
+	*queued = clientQueue.len + internalQueue.len;
 	mutex_unlock( &poolLock );
-	if ( entry == NULL ) {
-		entry = (entry_t*)malloc( sizeof(entry_t) );
-		if ( entry == NULL ) {
-			logadd( LOG_WARNING, "Could not alloc entry_t for new thread\n" );
-			return false;
+}
+
+/**
+ * Queue job and make sure there is a thread to pick it up.
+ * @param internal never reject because of the backlog limit, and run
+ *        before any client jobs, on reserved threads if necessary
+ */
+static bool enqueue(void *(*startRoutine)(void *), void *arg, bool internal)
+{
+	if ( startRoutine == NULL ) return false;
+	mutex_lock( &poolLock );
+	if ( poolShutdown ) {
+		mutex_unlock( &poolLock );
+		return false;
+	}
+	// Jobs that can be started right away by a thread, one that is idle, starting
+	// or yet to be spawned, don't count as backlog
+	if ( !internal && clientQueue.len >= ( maxThreads - clientRunning ) + maxBacklog ) {
+		// Backpressure: Every thread is busy and the backlog is full
+		declare_now;
+		if ( timing_diff( &lastFullWarning, &now ) >= 10 ) {
+			lastFullWarning = now;
+			logadd( LOG_WARNING, "Thread pool exhausted (%d threads busy, %d jobs queued), rejecting work", threadCount, clientQueue.len );
 		}
-		entry->signal = signal_newBlocking();
-		if ( entry->signal == NULL ) {
-			logadd( LOG_WARNING, "Could not create signal for new thread pool thread\n" );
-			free( entry );
+		mutex_unlock( &poolLock );
+		return false;
+	}
+	jobqueue_t * const q = internal ? &internalQueue : &clientQueue;
+	if ( !pushLocked( q, startRoutine, arg ) ) {
+		mutex_unlock( &poolLock );
+		logadd( LOG_WARNING, "Thread pool: Cannot grow job queue" );
+		return false;
+	}
+	if ( pendingLocked() > idleCount + startingCount && threadCount < maxThreads + SERVER_THREADS_RESERVED ) {
+		// Not enough idle threads to pick up all queued jobs, try to add another one
+		if ( !spawnWorkerLocked() && threadCount == 0 ) {
+			// Nobody will ever pick this up, undo
+			q->len--;
+			mutex_unlock( &poolLock );
 			return false;
 		}
-		if ( 0 != thread_create( &(entry->thread), &threadAttrs, threadpool_worker, (void*)entry ) ) {
-			logadd( LOG_WARNING, "Could not create new thread for thread pool\n" );
-			signal_close( entry->signal );
-			free( entry );
-			return false;
+	}
+	if ( idleCount > 0 ) {
+		pthread_cond_signal( &poolSignal );
+	}
+	mutex_unlock( &poolLock );
+	return true;
+}
+
+/**
+ * Number of queued jobs a thread could start right now. Only maxThreads
+ * threads may run client jobs at the same time, the others are reserved
+ * for internal ones.
+ * Locks on: poolLock (must already be held by caller)
+ */
+static int pendingLocked()
+{
+	return internalQueue.len + MIN( clientQueue.len, maxThreads - clientRunning );
+}
+
+/**
+ * Allocate ring buffer for size jobs.
+ */
+static bool initQueue(jobqueue_t *q, int size)
+{
+	q->jobs = malloc( sizeof(job_t) * (size_t)size );
+	if ( q->jobs == NULL ) return false;
+	q->size = size;
+	q->head = 0;
+	q->len = 0;
+	return true;
+}
+
+/**
+ * Append job to queue, doubling its size if it's full,
+ * which is only needed for internal jobs.
+ * Locks on: poolLock (must already be held by caller)
+ */
+static bool pushLocked(jobqueue_t *q, void *(*startRoutine)(void *), void *arg)
+{
+	if ( q->len >= q->size ) {
+		const int size = q->size * 2;
+		job_t *jobs = malloc( sizeof(job_t) * (size_t)size );
+		if ( jobs == NULL ) return false;
+		for ( int i = 0; i < q->len; ++i ) {
+			jobs[i] = q->jobs[(q->head + i) % q->size];
 		}
+		free( q->jobs );
+		q->jobs = jobs;
+		q->size = size;
+		q->head = 0;
 	}
-	entry->next = NULL;
-	entry->startRoutine = startRoutine;
-	entry->arg = arg;
-	signal_call( entry->signal );
+	job_t *job = &q->jobs[(q->head + q->len) % q->size];
+	job->startRoutine = startRoutine;
+	job->arg = arg;
+	q->len++;
+	return true;
+}
+
+/**
+ * Take first job from non-empty queue.
+ * Locks on: poolLock (must already be held by caller)
+ */
+static job_t popLocked(jobqueue_t *q)
+{
+	const job_t job = q->jobs[q->head];
+	q->head = ( q->head + 1 ) % q->size;
+	q->len--;
+	return job;
+}
+
+/**
+ * Create another worker thread.
+ * Locks on: poolLock (must already be held by caller)
+ */
+static bool spawnWorkerLocked()
+{
+	pthread_t thread;
+	if ( 0 != thread_create( &thread, &threadAttrs, threadpool_worker, NULL ) ) {
+		logadd( LOG_WARNING, "Could not create new thread for thread pool" );
+		return false;
+	}
+	threadCount++;
+	startingCount++;
 	return true;
 }
 
 /**
  * This is a worker thread of our thread pool.
  */
-static void *threadpool_worker(void *entryPtr)
+static void *threadpool_worker(void *unused UNUSED)
 {
 	blockNoncriticalSignals();
-	entry_t *entry = (entry_t*)entryPtr;
+	setThreadName( "[pool]" );
+	mutex_lock( &poolLock );
+	startingCount--;
 	for ( ;; ) {
-		// Wait for signal from outside that we have work to do
-		int ret = signal_clear( entry->signal );
-		if ( _shutdown ) break;
-		if ( ret > 0 ) {
-			if ( entry->startRoutine == NULL ) {
-				logadd( LOG_DEBUG1, "Worker woke up but has no work to do!" );
-				continue;
-			}
-			// Start assigned work
-			(*entry->startRoutine)( entry->arg );
-			// Reset vars for safety
-			entry->startRoutine = NULL;
-			entry->arg = NULL;
-			if ( _shutdown ) break;
-			// Put thread back into pool if there are less than maxIdleThreds threads, just die otherwise
-			int threadCount = 0;
-			mutex_lock( &poolLock );
-			entry_t *ptr = pool;
-			while ( ptr != NULL ) {
-				threadCount++;
-				ptr = ptr->next;
-			}
-			if ( threadCount >= maxIdleThreads ) {
-				mutex_unlock( &poolLock );
+		if ( pendingLocked() == 0 ) {
+			// Nothing we may start - go idle, or die if there are enough idle threads already
+			if ( poolShutdown || ( idleCount >= maxIdleThreads && threadCount > minThreads ) )
 				break;
-			}
-			entry->next = pool;
-			pool = entry;
-			mutex_unlock( &poolLock );
-			setThreadName( "[pool]" );
-		} else {
-			logadd( LOG_DEBUG1, "Unexpected return value %d for signal_wait in threadpool worker!", ret );
+			idleCount++;
+			do {
+				mutex_cond_wait( &poolSignal, &poolLock );
+			} while ( pendingLocked() == 0 && !poolShutdown );
+			idleCount--;
+			if ( poolShutdown ) break;
+		}
+		// Take next job, internal ones first
+		const bool internal = internalQueue.len != 0;
+		const job_t job = popLocked( internal ? &internalQueue : &clientQueue );
+		if ( !internal ) {
+			clientRunning++;
+		}
+		mutex_unlock( &poolLock );
+		// Start assigned work
+		(*job.startRoutine)( job.arg );
+		if ( _shutdown ) return NULL;
+		setThreadName( "[pool]" );
+		mutex_lock( &poolLock );
+		if ( !internal ) {
+			clientRunning--;
 		}
 	}
-	signal_close( entry->signal );
-	free( entry );
+	threadCount--;
+	mutex_unlock( &poolLock );
 	return NULL;
 }
 
@@ -7,9 +7,16 @@
  * Initialize the thread pool. This must be called before using
  * threadpool_run, and must only be called once.
  * @param maxIdleThreadCount maximum number of idle threads in the pool
+ * @param minThreadCount number of threads to spawn right away; the pool
+ *        will never shrink below this
+ * @param maxThreadCount hard limit for the number of threads running jobs
+ *        of threadpool_run; SERVER_THREADS_RESERVED more threads can be
+ *        spawned for jobs of threadpool_runInternal
+ * @param maxQueued maximum number of jobs waiting for a free thread
+ *        once maxThreadCount has been reached
  * @return true if initialized successfully
  */
-bool threadpool_init(int maxIdleThreadCount);
+bool threadpool_init(int maxIdleThreadCount, int minThreadCount, int maxThreadCount, int maxQueued);
 
 /**
  * Shut down threadpool.
@@ -19,11 +26,29 @@ void threadpool_close();
 
 /**
  * Run a thread using the thread pool.
+ * If all threads are busy and the pool cannot grow any further,
+ * the job will be queued until a thread becomes available.
  * @param startRoutine function to run in new thread
  * @param arg argument to pass to thead
- * @return true if thread was started
+ * @return true if the job was started or queued, false if the
+ *         pool is exhausted and the job queue is full
  */
 bool threadpool_run(void *(*startRoutine)(void *), void *arg);
 
+/**
+ * Like threadpool_run, but for jobs of the server itself, which must
+ * not be dropped or held up just because many clients are connecting
+ * right now. The job is queued even if the backlog is full, and started
+ * before any jobs of threadpool_run, on a reserved thread if necessary.
+ * @return false only if the pool is shutting down or out of memory
+ */
+bool threadpool_runInternal(void *(*startRoutine)(void *), void *arg);
+
+/**
+ * Get current number of threads in the pool, how many of
+ * them are idle, and how many jobs are waiting for a thread.
+ */
+void threadpool_getStats(int *threads, int *idle, int *queued);
+
 #endif
 
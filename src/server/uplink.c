@@ -3,10 +3,14 @@
 #include "locks.h"
 #include "image.h"
 #include "altservers.h"
+#include "stats.h"
+#include "threadpool.h"
+#include "net.h"
 #include "../shared/sockhelper.h"
 #include "../shared/protocol.h"
 #include "../shared/timing.h"
 #include "../shared/crc32.h"
+#include "../serialize.h"
 
 #include <assert.h>
 #include <inttypes.h>
@@ -14,6 +18,9 @@
 #include <poll.h>
 #include <unistd.h>
 #include <stdatomic.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
 
 #define FILE_BYTES_PER_MAP_BYTE ( DNBD3_BLOCK_SIZE * 8 )
 #define MAP_BYTES_PER_HASH_BLOCK (int)( HASH_BLOCK_SIZE / FILE_BYTES_PER_MAP_BYTE )
@@ -21,34 +28,243 @@
 
 #define REP_NONE ( (uint64_t)0xffffffffffffffff )
 
-static atomic_uint_fast64_t totalBytesReceived = 0;
+// Events passed to uplink_process()
+#define EV_SIGNAL     (1)
+#define EV_SOCKET     (2)
+#define EV_SIGNAL_ERR (4)
+#define EV_SOCKET_ERR (8)
+
+#define REACTOR_MAX_EVENTS (64)
+
+// Work done by the thread pool for the reactors, see uplink_dispatch()
+#define JOB_RECEIVE (1) // Receive payload of reply, cache it and send it to clients
+#define JOB_SAVE    (2) // fsync image file and save cache map
+#define JOB_CRC     (3) // Get CRC-32 list from new server before using the connection
+
+// Max. number of clients a reply is relayed to while it's still arriving, see uplink_streamBegin()
+#define STREAM_MAX_CLIENTS (16)
+
+// Kind of event source, stored in the lower bits of the pointer used as epoll/poll tag
+#define TAG_SIGNAL  ( (uint64_t)0 )
+#define TAG_SOCKET  ( (uint64_t)1 )
+#define TAG_SESSION ( (uint64_t)2 )
+#define TAG_MASK    ( (uint64_t)3 )
+
+// Part of handle that is the offset of the request, the upper bits are the slot and its generation
+#define HANDLE_OFFSET_MASK ( ( (uint64_t)1 << DNBD3_HANDLE_SLOT_SHIFT ) - 1 )
+#define HANDLE_GEN_SHIFT (56)
+
+/*
+ * Connection to another server, shared by uplinks of one reactor. Each
+ * uplink selects its image into a slot of the connection, which is then
+ * carried in the handle of all its requests, see DNBD3_HANDLE_SLOT.
+ * Only accessed by the reactor thread.
+ */
+typedef struct _uplink_session
+{
+	struct _uplink_session *next;
+	dnbd3_host_t server;
+	int fd;
+	int version;                // remote server protocol version
+	int numLinks;
+	int revents;                // events not yet processed by uplink_sessionProcess()
+	bool dead;                  // closed, will be freed by uplink_reactorReap()
+	bool busy;                  // a job receives from the connection right now, see uplink_dispatch()
+	struct _uplink_reactor *reactor;
+	ticks lastKeepalive;
+	dnbd3_connection_t *links[SERVER_UPLINK_SESSION_IMAGES]; // uplink by slot
+	uint8_t gen[SERVER_UPLINK_SESSION_IMAGES]; // bumped whenever a slot is taken, so late replies for its previous user are ignored
+	bool draining[SERVER_UPLINK_SESSION_IMAGES]; // slot released, but remote server didn't confirm yet; see uplink_leaveSession()
+} uplink_session_t;
+
+/*
+ * All uplinks are handled by a few reactor threads. Each one waits for
+ * events on the sockets and signals of its uplinks, and once a second
+ * runs the periodic work (keep-alive, RTT checks) of all its uplinks.
+ * Reactors only read reply headers; everything that might block is
+ * handed to the thread pool.
+ */
+typedef struct _uplink_reactor
+{
+	pthread_t thread;
+	dnbd3_signal_t *wakeup;       // new uplinks were queued, or jobs finished
+	pthread_mutex_t lock;         // protects incoming and done
+	dnbd3_connection_t *incoming; // new uplinks not picked up by the reactor yet
+	struct _uplink_job *done;     // finished jobs not picked up by the reactor yet
+	atomic_int count;             // number of uplinks, for picking the least busy reactor
+	// Only accessed by the reactor thread
+	int jobs;                     // jobs handed to the thread pool that didn't finish yet
+	dnbd3_connection_t *links;    // uplinks handled by this reactor
+	dnbd3_connection_t *dead;     // detached uplinks, freed once altservers doesn't use them anymore
+	uplink_session_t *sessions;   // shared connections of this reactor's uplinks
+#ifdef __linux__
+	int epollFd;
+#else
+	struct pollfd *pfd;           // poll set, rebuilt before every poll()
+	uint64_t *pfdTag;             // TAG_* and uplink or session of each entry in pfd
+	int pfdCapacity;
+#endif
+} uplink_reactor_t;
 
-static void* uplink_mainloop(void *data);
+/*
+ * Work handed from a reactor to the thread pool. Once done, it's passed back
+ * to the reactor, which then continues with the uplink or shared connection.
+ */
+typedef struct _uplink_job
+{
+	struct _uplink_job *next;
+	uplink_reactor_t *reactor;
+	int type;                   // JOB_*
+	dnbd3_connection_t *link;   // NULL if the reply isn't for any uplink and just gets discarded
+	uplink_session_t *session;  // shared connection the reply arrives on, NULL if own connection
+	int fd;                     // socket, or image file to fsync for JOB_SAVE
+	dnbd3_reply_t reply;        // JOB_RECEIVE: header of reply
+	bool final;                 // JOB_SAVE: uplink was detached, take it off its image when done
+	bool ok;                    // JOB_RECEIVE: connection is still fine
+} uplink_job_t;
+
+static pthread_attr_t threadAttrs;
+
+// For uplink_shutdown() to wait until the uplink is off its image
+static pthread_mutex_t shutdownLock;
+static pthread_cond_t shutdownDone;
+
+// Reactors are started when the first uplink is created
+static pthread_mutex_t reactorLock;
+static uplink_reactor_t reactors[SERVER_UPLINK_REACTORS];
+static int numReactors = 0;
+
+// Idle receive buffers, shared by all uplinks
+static pthread_mutex_t recvPoolLock;
+static struct {
+	uint8_t *buffer;
+	uint32_t len;
+} recvPool[SERVER_UPLINK_RECVBUF_POOL];
+
+/*
+ * Client a reply from the uplink server is relayed to while it's being received.
+ */
+typedef struct
+{
+	dnbd3_client_t *client;
+	int index;                  // position of request in queue, which stays ULR_PROCESSING until uplink_streamEnd()
+	uint64_t handle;
+	uint64_t from, to;          // range requested by client, without the parts sent from local cache
+	uint32_t localHead, localTail; // see dnbd3_queued_request_t
+	uint32_t sent;              // bytes of payload sent so far, without localHead
+	bool failed;                // reply couldn't be sent completely, client got disconnected
+} uplink_stream_t;
+
+static uplink_reactor_t* uplink_getReactor();
+static bool uplink_startReactor(uplink_reactor_t *r);
+static void* uplink_reactorMain(void *data);
+static int uplink_reactorWait(uplink_reactor_t *r, int timeoutMs);
+static void uplink_reactorAdopt(uplink_reactor_t *r);
+static void uplink_reactorNote(uint64_t tag, bool isError);
+static void uplink_reactorHandle(uplink_reactor_t *r, uint64_t tag);
+static void uplink_reactorRun(uplink_reactor_t *r, dnbd3_connection_t *link, int revents);
+static void uplink_reactorWatchSocket(uplink_reactor_t *r, dnbd3_connection_t *link);
+static void uplink_reactorReap(uplink_reactor_t *r, bool wait);
+static void uplink_reactorFinish(uplink_reactor_t *r);
+static void uplink_dispatch(uplink_reactor_t *r, const uplink_job_t *job);
+static void* uplink_jobMain(void *data);
+static bool uplink_isBusy(dnbd3_connection_t *link);
+static bool uplink_process(dnbd3_connection_t *link, int revents);
+static void uplink_detach(dnbd3_connection_t *link);
+static void uplink_startSave(dnbd3_connection_t *link, bool final);
+static void uplink_free(dnbd3_connection_t *link);
+static void uplink_useConnection(dnbd3_connection_t *link, int fd);
+static void uplink_connected(dnbd3_connection_t *link);
+static void uplink_closeConnection(dnbd3_connection_t *link);
+static bool uplink_joinSession(dnbd3_connection_t *link, int fd);
+static bool uplink_attachSession(dnbd3_connection_t *link, uplink_session_t *s);
+static void uplink_leaveSession(dnbd3_connection_t *link, bool release);
+static bool uplink_sessionWatch(uplink_session_t *s, bool watch);
+static void uplink_sessionProcess(uplink_session_t *s, int revents);
+static void uplink_sessionReceive(uplink_session_t *s);
+static bool uplink_sessionSelected(dnbd3_connection_t *link, const dnbd3_reply_t *reply);
+static void uplink_sessionFailed(uplink_session_t *s);
+static void uplink_sessionKeepalive(uplink_session_t *s, ticks *now);
 static void uplink_sendRequests(dnbd3_connection_t *link, bool newOnly);
 static int uplink_findNextIncompleteHashBlock(dnbd3_connection_t *link, const int lastBlockIndex);
 static void uplink_handleReceive(dnbd3_connection_t *link);
+static void uplink_receive(uplink_reactor_t *r, dnbd3_connection_t *link, uplink_session_t *s, const dnbd3_reply_t *reply);
+static bool uplink_handleReply(dnbd3_connection_t *link, int fd, const dnbd3_reply_t *reply);
+static int uplink_streamBegin(dnbd3_connection_t *link, uint64_t start, uint64_t end, uplink_stream_t *stream);
+static void uplink_streamRelay(dnbd3_connection_t *link, uint64_t start, uint32_t received, uplink_stream_t *stream, int num);
+static bool uplink_streamEnd(dnbd3_connection_t *link, uplink_stream_t *stream, int num, bool complete);
+static void uplink_streamFail(uplink_stream_t *s);
+static uint32_t uplink_writeCache(dnbd3_connection_t *link, uint64_t start, uint32_t from, uint32_t to);
+static void uplink_receiveDone(dnbd3_connection_t *link);
+static bool uplink_discardPayload(int fd, uint32_t size);
+static bool uplink_sendLocal(dnbd3_connection_t *link, int sock, uint64_t from, uint32_t len);
 static int uplink_sendKeepalive(const int fd);
-static void uplink_addCrc32(dnbd3_connection_t *uplink);
+static void uplink_addCrc32(dnbd3_connection_t *uplink, int sock);
 static void uplink_sendReplicationRequest(dnbd3_connection_t *link);
 static bool uplink_reopenCacheFd(dnbd3_connection_t *link, const bool force);
-static bool uplink_saveCacheMap(dnbd3_connection_t *link);
+static bool uplink_saveCacheMap(dnbd3_image_t *image, int fd);
 static bool uplink_connectionShouldShutdown(dnbd3_connection_t *link);
 static void uplink_connectionFailed(dnbd3_connection_t *link, bool findNew);
+static void uplink_connectionLost(dnbd3_connection_t *link, bool findNew);
+static bool uplink_resizeQueue(dnbd3_connection_t *link, int capacity);
+static void uplink_getRecvBuffer(dnbd3_connection_t *link);
+static void uplink_putRecvBuffer(dnbd3_connection_t *link);
 
 // ############ uplink connection handling
 
 void uplink_globalsInit()
 {
+	initThreadAttrs( &threadAttrs, false );
+	mutex_init( &recvPoolLock );
+	mutex_init( &reactorLock );
+	mutex_init( &shutdownLock );
+	pthread_cond_init( &shutdownDone, NULL );
 }
 
-uint64_t uplink_getTotalBytesReceived()
+/**
+ * Stop all reactor threads, which shuts down all uplinks.
+ * Only call while shutting down the server.
+ */
+void uplink_globalsShutdown()
 {
-	return (uint64_t)totalBytesReceived;
+	mutex_lock( &reactorLock );
+	for ( int i = 0; i < numReactors; ++i ) {
+		signal_call( reactors[i].wakeup );
+	}
+	for ( int i = 0; i < numReactors; ++i ) {
+		uplink_reactor_t * const r = &reactors[i];
+		thread_join( r->thread, NULL );
+#ifdef __linux__
+		close( r->epollFd );
+#else
+		free( r->pfd );
+		free( r->pfdTag );
+#endif
+		signal_close( r->wakeup );
+		mutex_destroy( &r->lock );
+	}
+	numReactors = 0;
+	mutex_unlock( &reactorLock );
+}
+
+/**
+ * Get amount of memory held by idle receive buffers in the pool.
+ * Locks on: recvPoolLock
+ */
+uint64_t uplink_getRecvPoolBytes()
+{
+	uint64_t bytes = 0;
+	mutex_lock( &recvPoolLock );
+	for ( int i = 0; i < SERVER_UPLINK_RECVBUF_POOL; ++i ) {
+		bytes += recvPool[i].len;
+	}
+	mutex_unlock( &recvPoolLock );
+	return bytes;
 }
 
 /**
  * Create and initialize an uplink instance for the given
- * image. Uplinks run in their own thread.
+ * image. Uplinks are handled by one of the reactor threads.
  * Locks on: _images[].lock
  */
 bool uplink_init(dnbd3_image_t *image, int sock, dnbd3_host_t *host, int version)
@@ -57,7 +273,9 @@ bool uplink_init(dnbd3_image_t *image, int sock, dnbd3_host_t *host, int version
 	dnbd3_connection_t *link = NULL;
 	assert( image != NULL );
 	mutex_lock( &image->lock );
-	if ( image->uplink != NULL && !image->uplink->shutdown ) {
+	if ( image->uplink != NULL ) {
+		// If it's shutting down, it stays on the image until its cache map is saved,
+		// and uplink_free() brings up a new one if the image is still incomplete
 		mutex_unlock( &image->lock );
 		if ( sock >= 0 ) close( sock );
 		return true; // There's already an uplink, so should we consider this success or failure?
@@ -66,20 +284,35 @@ bool uplink_init(dnbd3_image_t *image, int sock, dnbd3_host_t *host, int version
 		logadd( LOG_WARNING, "Uplink was requested for image %s, but it is already complete", image->name );
 		goto failure;
 	}
-	link = image->uplink = calloc( 1, sizeof(dnbd3_connection_t) );
+	link = image->uplink = callocCacheAligned( sizeof(dnbd3_connection_t) );
 	mutex_init( &link->queueLock );
+	pthread_cond_init( &link->relayDone, NULL );
 	mutex_init( &link->rttLock );
 	mutex_init( &link->sendMutex );
 	link->image = image;
 	link->bytesReceived = 0;
 	link->idleTime = 0;
 	link->queueLen = 0;
+	link->queueCapacity = 0;
+	link->queue = NULL;
+	if ( !uplink_resizeQueue( link, SERVER_UPLINK_QUEUE_INIT ) ) {
+		logadd( LOG_ERROR, "Could not allocate queue for new uplink." );
+		goto failure;
+	}
 	mutex_lock( &link->sendMutex );
 	link->fd = -1;
 	mutex_unlock( &link->sendMutex );
 	link->cacheFd = -1;
-	link->signal = NULL;
+	link->watchedFd = -1;
+	link->signal = signal_new();
+	if ( link->signal == NULL ) {
+		logadd( LOG_WARNING, "error creating signal. Uplink unavailable." );
+		goto failure;
+	}
 	link->replicationHandle = REP_NONE;
+	link->altCheckInterval = SERVER_RTT_INTERVAL_INIT;
+	timing_get( &link->nextAltCheck );
+	link->lastKeepalive = link->nextAltCheck;
 	mutex_lock( &link->rttLock );
 	link->cycleDetected = false;
 	if ( sock >= 0 ) {
@@ -94,14 +327,25 @@ bool uplink_init(dnbd3_image_t *image, int sock, dnbd3_host_t *host, int version
 	mutex_unlock( &link->rttLock );
 	link->recvBufferLen = 0;
 	link->shutdown = false;
-	if ( 0 != thread_create( &(link->thread), NULL, &uplink_mainloop, (void *)link ) ) {
-		logadd( LOG_ERROR, "Could not start thread for new uplink." );
+	uplink_reactor_t * const reactor = uplink_getReactor();
+	if ( reactor == NULL ) {
+		logadd( LOG_ERROR, "Could not start reactor thread for new uplink." );
 		goto failure;
 	}
+	link->reactor = reactor;
+	reactor->count++;
+	mutex_lock( &reactor->lock );
+	link->next = reactor->incoming;
+	reactor->incoming = link;
+	mutex_unlock( &reactor->lock );
+	signal_call( reactor->wakeup );
 	mutex_unlock( &image->lock );
 	return true;
 failure: ;
 	if ( link != NULL ) {
+		if ( link->signal != NULL ) signal_close( link->signal );
+		pthread_cond_destroy( &link->relayDone );
+		free( link->queue );
 		free( link );
 		link = image->uplink = NULL;
 	}
@@ -110,14 +354,15 @@ failure: ;
 }
 
 /**
- * Locks on image.lock, uplink.lock
+ * Shut down uplink of image, and wait until it saved the cache map
+ * and is off the image. Must not be called by a reactor or a job of
+ * the uplinks; images are freed by image_freeRetired() for that reason.
+ * Locks on shutdownLock, image.lock, uplink.lock
  * Calling it multiple times, even concurrently, will
  * not break anything.
  */
 void uplink_shutdown(dnbd3_image_t *image)
 {
-	bool join = false;
-	pthread_t thread;
 	assert( image != NULL );
 	mutex_lock( &image->lock );
 	if ( image->uplink == NULL ) {
@@ -129,28 +374,38 @@ void uplink_shutdown(dnbd3_image_t *image)
 	if ( !uplink->shutdown ) {
 		uplink->shutdown = true;
 		signal_call( uplink->signal );
-		thread = uplink->thread;
-		join = true;
 	}
 	mutex_unlock( &uplink->queueLock );
-	bool wait = image->uplink != NULL;
+	// A reactor would wait for itself, or for a job it needs to finish first
+	assert( !pthread_equal( pthread_self(), uplink->reactor->thread ) );
 	mutex_unlock( &image->lock );
-	if ( join ) thread_join( thread, NULL );
-	while ( wait ) {
-		usleep( 5000 );
+	mutex_lock( &shutdownLock );
+	for ( ;; ) {
 		mutex_lock( &image->lock );
-		wait = image->uplink != NULL && image->uplink->shutdown;
+		const bool wait = image->uplink != NULL && image->uplink->shutdown;
 		mutex_unlock( &image->lock );
+		if ( !wait )
+			break;
+		mutex_cond_wait( &shutdownDone, &shutdownLock );
 	}
+	mutex_unlock( &shutdownLock );
 }
 
 /**
- * Remove given client from uplink request queue
+ * Remove given client from uplink request queue. If a reply is being sent
+ * to the client right now, wait for that, so the client can be freed
+ * once this returns.
  * Locks on: uplink.queueLock
  */
 void uplink_removeClient(dnbd3_connection_t *uplink, dnbd3_client_t *client)
 {
 	mutex_lock( &uplink->queueLock );
+	for (int i = uplink->queueLen - 1; i >= 0; --i) {
+		if ( uplink->queue[i].client == client && uplink->queue[i].status == ULR_PROCESSING ) {
+			mutex_cond_wait( &uplink->relayDone, &uplink->queueLock );
+			i = uplink->queueLen; // Start over, queue might have changed
+		}
+	}
 	for (int i = uplink->queueLen - 1; i >= 0; --i) {
 		if ( uplink->queue[i].client == client ) {
 			uplink->queue[i].client = NULL;
@@ -163,31 +418,34 @@ void uplink_removeClient(dnbd3_connection_t *uplink, dnbd3_client_t *client)
 
 /**
  * Request a chunk of data through an uplink server
+ * The client's reply additionally contains localHead bytes before and
+ * localTail bytes after the requested chunk, which must already be cached.
  * Locks on: image.lock, uplink.queueLock
  */
-bool uplink_request(dnbd3_client_t *client, uint64_t handle, uint64_t start, uint32_t length, uint8_t hops)
+bool uplink_request(dnbd3_client_t *client, dnbd3_image_t *image, uint64_t handle, uint64_t start, uint32_t length,
+		uint32_t localHead, uint32_t localTail, uint8_t hops)
 {
-	if ( client == NULL || client->image == NULL ) return false;
+	if ( client == NULL || image == NULL ) return false;
 	if ( length > (uint32_t)_maxPayload ) {
 		logadd( LOG_WARNING, "Cannot relay request by client; length of %" PRIu32 " exceeds maximum payload", length );
 		return false;
 	}
-	mutex_lock( &client->image->lock );
-	if ( client->image->uplink == NULL ) {
-		mutex_unlock( &client->image->lock );
+	mutex_lock( &image->lock );
+	if ( image->uplink == NULL ) {
+		mutex_unlock( &image->lock );
 		logadd( LOG_DEBUG1, "Uplink request for image with no uplink" );
 		return false;
 	}
-	dnbd3_connection_t * const uplink = client->image->uplink;
+	dnbd3_connection_t * const uplink = image->uplink;
 	if ( uplink->shutdown ) {
-		mutex_unlock( &client->image->lock );
+		mutex_unlock( &image->lock );
 		logadd( LOG_DEBUG1, "Uplink request for image with uplink shutting down" );
 		return false;
 	}
 	// Check if the client is the same host as the uplink. If so assume this is a circular proxy chain
 	// This might be a false positive if there are multiple instances running on the same host (IP)
 	if ( hops != 0 && isSameAddress( &uplink->currentServer, &client->host ) ) {
-		mutex_unlock( &client->image->lock );
+		mutex_unlock( &image->lock );
 		logadd( LOG_WARNING, "Proxy cycle detected (same host)." );
 		mutex_lock( &uplink->rttLock );
 		uplink->cycleDetected = true;
@@ -204,7 +462,7 @@ bool uplink_request(dnbd3_client_t *client, uint64_t handle, uint64_t start, uin
 	const uint64_t end = start + length;
 
 	mutex_lock( &uplink->queueLock );
-	mutex_unlock( &client->image->lock );
+	mutex_unlock( &image->lock );
 	for (i = 0; i < uplink->queueLen; ++i) {
 		if ( freeSlot == -1 && uplink->queue[i].status == ULR_FREE ) {
 			freeSlot = i;
@@ -238,12 +496,18 @@ bool uplink_request(dnbd3_client_t *client, uint64_t handle, uint64_t start, uin
 			logadd( LOG_WARNING, "Uplink queue is full, consider increasing SERVER_MAX_UPLINK_QUEUE. Dropping client..." );
 			return false;
 		}
+		if ( uplink->queueLen >= uplink->queueCapacity
+				&& !uplink_resizeQueue( uplink, MIN( uplink->queueCapacity * 2, SERVER_MAX_UPLINK_QUEUE ) ) ) {
+			mutex_unlock( &uplink->queueLock );
+			logadd( LOG_WARNING, "Cannot grow uplink queue. Dropping client..." );
+			return false;
+		}
 		freeSlot = uplink->queueLen++;
 	}
 	// Do not send request to uplink server if we have a matching pending request AND the request either has the
 	// status ULR_NEW OR we found a free slot with LOWER index than the one we attach to. Otherwise
 	// explicitly send this request to the uplink server. The second condition mentioned here is to prevent
-	// a race condition where the reply for the outstanding request already arrived and the uplink thread
+	// a race condition where the reply for the outstanding request already arrived and the reactor thread
 	// is currently traversing the request queue. As it is processing the queue from highest to lowest index, it might
 	// already have passed the index of the free slot we determined, but not reached the existing request we just found above.
 	if ( foundExisting != -1 && existingType != ULR_NEW && freeSlot > foundExisting ) foundExisting = -1; // -1 means "send request"
@@ -259,6 +523,8 @@ bool uplink_request(dnbd3_client_t *client, uint64_t handle, uint64_t start, uin
 	// Fill structure
 	uplink->queue[freeSlot].from = start;
 	uplink->queue[freeSlot].to = end;
+	uplink->queue[freeSlot].localHead = localHead;
+	uplink->queue[freeSlot].localTail = localTail;
 	uplink->queue[freeSlot].handle = handle;
 	uplink->queue[freeSlot].client = client;
 	//int old = uplink->queue[freeSlot].status;
@@ -277,20 +543,25 @@ bool uplink_request(dnbd3_client_t *client, uint64_t handle, uint64_t start, uin
 	if ( mutex_trylock( &uplink->sendMutex ) != 0 ) {
 		logadd( LOG_DEBUG2, "Could not trylock send mutex, queueing uplink request" );
 	} else {
-		if ( uplink->fd == -1 ) {
+		if ( uplink->fd == -1 || uplink->session != NULL ) {
+			// Shared connections are only written to by the reactor thread
 			mutex_unlock( &uplink->sendMutex );
 			logadd( LOG_DEBUG2, "Cannot do direct uplink request: No socket open" );
 		} else {
-			const uint64_t reqStart = uplink->queue[freeSlot].from & ~(uint64_t)(DNBD3_BLOCK_SIZE - 1);
-			const uint32_t reqSize = (uint32_t)(((uplink->queue[freeSlot].to + DNBD3_BLOCK_SIZE - 1) & ~(uint64_t)(DNBD3_BLOCK_SIZE - 1)) - reqStart);
+			// Queue might have been reallocated since we unlocked it, use our own copy of the range
+			const uint64_t reqStart = start & ~(uint64_t)(DNBD3_BLOCK_SIZE - 1);
+			const uint32_t reqSize = (uint32_t)(((end + DNBD3_BLOCK_SIZE - 1) & ~(uint64_t)(DNBD3_BLOCK_SIZE - 1)) - reqStart);
 			if ( hops < 200 ) ++hops;
 			const bool ret = dnbd3_get_block( uplink->fd, reqStart, reqSize, reqStart, COND_HOPCOUNT( uplink->version, hops ) );
 			mutex_unlock( &uplink->sendMutex );
+			stats_add( STATS_UPLINK_REQUESTS, 1 );
 			if ( !ret ) {
 				logadd( LOG_DEBUG2, "Could not send out direct uplink request, queueing" );
 			} else {
 				mutex_lock( &uplink->queueLock );
-				if ( uplink->queue[freeSlot].handle == handle && uplink->queue[freeSlot].client == client && uplink->queue[freeSlot].status == ULR_NEW ) {
+				// Slot might be gone already if the reply arrived and the queue shrunk in the meantime
+				if ( freeSlot < uplink->queueLen && uplink->queue[freeSlot].handle == handle
+						&& uplink->queue[freeSlot].client == client && uplink->queue[freeSlot].status == ULR_NEW ) {
 					uplink->queue[freeSlot].status = ULR_PENDING;
 					logadd( LOG_DEBUG2, "Succesful direct uplink request" );
 				} else {
@@ -303,287 +574,1091 @@ bool uplink_request(dnbd3_client_t *client, uint64_t handle, uint64_t start, uin
 		}
 	}
 
-	if ( foundExisting == -1 ) { // Only wake up uplink thread if the request needs to be relayed
+	if ( foundExisting == -1 ) { // Only wake up reactor thread if the request needs to be relayed
 		if ( signal_call( uplink->signal ) == SIGNAL_ERROR ) {
-			logadd( LOG_WARNING, "Cannot wake up uplink thread; errno=%d", (int)errno );
+			logadd( LOG_WARNING, "Cannot wake up uplink reactor; errno=%d", (int)errno );
 		}
 	}
 	return true;
 }
 
+// ############ reactor threads
+
 /**
- * Uplink thread.
+ * Get reactor with the least uplinks, starting
+ * the reactor threads if they're not running yet.
+ * Locks on: reactorLock
+ */
+static uplink_reactor_t* uplink_getReactor()
+{
+	uplink_reactor_t *best = NULL;
+	mutex_lock( &reactorLock );
+	while ( numReactors < SERVER_UPLINK_REACTORS && uplink_startReactor( &reactors[numReactors] ) ) {
+		numReactors++;
+	}
+	for ( int i = 0; i < numReactors; ++i ) {
+		if ( best == NULL || reactors[i].count < best->count ) {
+			best = &reactors[i];
+		}
+	}
+	mutex_unlock( &reactorLock );
+	return best;
+}
+
+static bool uplink_startReactor(uplink_reactor_t *r)
+{
+	r->wakeup = signal_new();
+	if ( r->wakeup == NULL )
+		return false;
+	mutex_init( &r->lock );
+	r->incoming = r->links = r->dead = NULL;
+	r->done = NULL;
+	r->sessions = NULL;
+	r->count = 0;
+	r->jobs = 0;
+#ifdef __linux__
+	struct epoll_event ev = { .events = EPOLLIN, .data.u64 = 0 };
+	r->epollFd = epoll_create1( EPOLL_CLOEXEC );
+	if ( r->epollFd == -1 || epoll_ctl( r->epollFd, EPOLL_CTL_ADD, signal_getWaitFd( r->wakeup ), &ev ) == -1 ) {
+		logadd( LOG_WARNING, "Could not set up epoll for uplink reactor (errno=%d)", errno );
+		if ( r->epollFd != -1 ) close( r->epollFd );
+		goto failure;
+	}
+#else
+	r->pfd = NULL;
+	r->pfdTag = NULL;
+	r->pfdCapacity = 0;
+#endif
+	if ( 0 != thread_create( &r->thread, &threadAttrs, &uplink_reactorMain, (void *)r ) ) {
+#ifdef __linux__
+		close( r->epollFd );
+#endif
+		goto failure;
+	}
+	return true;
+failure: ;
+	signal_close( r->wakeup );
+	mutex_destroy( &r->lock );
+	return false;
+}
+
+/**
+ * Reactor thread.
  * Locks are irrelevant as this is never called from another function
  */
-static void* uplink_mainloop(void *data)
-{
-#define EV_SIGNAL (0)
-#define EV_SOCKET (1)
-#define EV_COUNT  (2)
-	struct pollfd events[EV_COUNT];
-	dnbd3_connection_t * const link = (dnbd3_connection_t*)data;
-	int numSocks, i, waitTime;
-	int altCheckInterval = SERVER_RTT_INTERVAL_INIT;
-	uint32_t discoverFailCount = 0;
-	uint32_t unsavedSeconds = 0;
-	ticks nextAltCheck, lastKeepalive;
-	char buffer[200];
-	memset( events, 0, sizeof(events) );
-	timing_get( &nextAltCheck );
-	lastKeepalive = nextAltCheck;
-	//
-	assert( link != NULL );
-	setThreadName( "idle-uplink" );
+static void* uplink_reactorMain(void *data)
+{
+	uplink_reactor_t * const r = (uplink_reactor_t*)data;
+	ticks nextTick;
+	setThreadName( "uplink" );
 	blockNoncriticalSignals();
-	// Make sure file is open for writing
-	if ( !uplink_reopenCacheFd( link, false ) ) {
-		// It might have failed - still offer proxy mode, we just can't cache
-		logadd( LOG_WARNING, "Cannot open cache file %s for writing (errno=%d); will just proxy traffic without caching!", link->image->path, errno );
+	timing_gets( &nextTick, 1 );
+	while ( !_shutdown ) {
+		declare_now;
+		const int waitTime = (int)MIN( timing_diffMs( &now, &nextTick ), 1000 );
+		if ( uplink_reactorWait( r, waitTime ) == -1 && errno != EINTR ) {
+			logadd( LOG_DEBUG1, "Waiting for uplink events failed (errno=%d)", (int)errno );
+			usleep( 10000 );
+		}
+		if ( _shutdown )
+			break;
+		timing_get( &now );
+		if ( timing_reachedPrecise( &nextTick, &now ) ) {
+			// Periodic work of all uplinks; uplink_process() checks what's due
+			timing_gets( &nextTick, 1 );
+			for ( uplink_session_t *s = r->sessions; s != NULL; s = s->next ) {
+				if ( !s->dead && !s->busy ) {
+					uplink_sessionKeepalive( s, &now );
+				}
+			}
+			for ( dnbd3_connection_t *link = r->links; link != NULL; link = link->next ) {
+				if ( !link->detached ) {
+					uplink_reactorRun( r, link, 0 );
+				}
+			}
+		}
+		uplink_reactorReap( r, false );
 	}
-	//
-	link->signal = signal_new();
-	if ( link->signal == NULL ) {
-		logadd( LOG_WARNING, "error creating signal. Uplink unavailable." );
-		goto cleanup;
+	// Server is shutting down, this includes uplinks that were just created
+	uplink_reactorAdopt( r );
+	for ( dnbd3_connection_t *link = r->links; link != NULL; link = link->next ) {
+		if ( !uplink_isBusy( link ) ) {
+			uplink_detach( link );
+		}
 	}
-	events[EV_SIGNAL].events = POLLIN;
-	events[EV_SIGNAL].fd = signal_getWaitFd( link->signal );
-	events[EV_SOCKET].fd = -1;
-	while ( !_shutdown && !link->shutdown ) {
-		// poll()
-		mutex_lock( &link->rttLock );
-		waitTime = link->rttTestResult == RTT_DOCHANGE ? 0 : -1;
-		mutex_unlock( &link->rttLock );
-		if ( waitTime == 0 ) {
-			// Nothing
-		} else if ( link->fd == -1 && !uplink_connectionShouldShutdown( link ) ) {
-			waitTime = 1000;
+	// Busy uplinks are detached once their job finished, see uplink_reactorRun()
+	while ( r->jobs > 0 ) {
+		signal_wait( r->wakeup, 1000 );
+		uplink_reactorFinish( r );
+	}
+	uplink_reactorReap( r, true );
+	return NULL;
+}
+
+/**
+ * Wait for events on any uplink or shared connection of this reactor, and handle them.
+ * All events are noted first, so an uplink with events on its signal and socket
+ * is handled just once.
+ * @return number of events, -1 on error
+ */
+static int uplink_reactorWait(uplink_reactor_t *r, int timeoutMs)
+{
+	bool wakeup = false;
+#ifdef __linux__
+	struct epoll_event events[REACTOR_MAX_EVENTS];
+	const int ret = epoll_wait( r->epollFd, events, REACTOR_MAX_EVENTS, timeoutMs );
+	if ( ret == -1 )
+		return -1;
+	for ( int i = 0; i < ret; ++i ) {
+		if ( events[i].data.u64 == 0 ) {
+			wakeup = true;
 		} else {
-			declare_now;
-			waitTime = (int)timing_diffMs( &now, &nextAltCheck );
-			if ( waitTime < 100 ) waitTime = 100;
-			if ( waitTime > 5000 ) waitTime = 5000;
-		}
-		events[EV_SOCKET].fd = link->fd;
-		numSocks = poll( events, EV_COUNT, waitTime );
-		if ( _shutdown || link->shutdown ) goto cleanup;
-		if ( numSocks == -1 ) { // Error?
-			if ( errno == EINTR ) continue;
-			logadd( LOG_DEBUG1, "poll() error %d", (int)errno );
-			usleep( 10000 );
+			uplink_reactorNote( events[i].data.u64, ( events[i].events & ( EPOLLERR | EPOLLHUP | EPOLLRDHUP ) ) != 0 );
+		}
+	}
+	for ( int i = 0; i < ret; ++i ) {
+		if ( events[i].data.u64 != 0 ) {
+			uplink_reactorHandle( r, events[i].data.u64 );
+		}
+	}
+#else
+	int count = 1;
+	for ( dnbd3_connection_t *link = r->links; link != NULL; link = link->next ) {
+		count += 2;
+	}
+	for ( uplink_session_t *s = r->sessions; s != NULL; s = s->next ) {
+		count++;
+	}
+	if ( count > r->pfdCapacity ) {
+		struct pollfd *pfd = realloc( r->pfd, (size_t)count * sizeof(*pfd) );
+		if ( pfd != NULL ) r->pfd = pfd;
+		uint64_t *pfdTag = realloc( r->pfdTag, (size_t)count * sizeof(*pfdTag) );
+		if ( pfdTag != NULL ) r->pfdTag = pfdTag;
+		if ( pfd == NULL || pfdTag == NULL )
+			return -1;
+		r->pfdCapacity = count;
+	}
+	count = 0;
+	r->pfd[count].fd = signal_getWaitFd( r->wakeup );
+	r->pfd[count].events = POLLIN;
+	r->pfdTag[count++] = 0;
+	for ( dnbd3_connection_t *link = r->links; link != NULL; link = link->next ) {
+		if ( link->detached ) continue;
+		r->pfd[count].fd = signal_getWaitFd( link->signal );
+		r->pfd[count].events = POLLIN;
+		r->pfdTag[count++] = (uintptr_t)link | TAG_SIGNAL;
+		if ( link->fd != -1 && link->session == NULL && !link->busy ) {
+			r->pfd[count].fd = link->fd;
+			r->pfd[count].events = POLLIN;
+			r->pfdTag[count++] = (uintptr_t)link | TAG_SOCKET;
+		}
+	}
+	for ( uplink_session_t *s = r->sessions; s != NULL; s = s->next ) {
+		if ( s->dead || s->busy ) continue;
+		r->pfd[count].fd = s->fd;
+		r->pfd[count].events = POLLIN;
+		r->pfdTag[count++] = (uintptr_t)s | TAG_SESSION;
+	}
+	const int ret = poll( r->pfd, (nfds_t)count, timeoutMs );
+	if ( ret == -1 )
+		return -1;
+	wakeup = r->pfd[0].revents != 0;
+	for ( int i = 1; i < count; ++i ) {
+		if ( r->pfd[i].revents != 0 ) {
+			uplink_reactorNote( r->pfdTag[i], ( r->pfd[i].revents & ( POLLERR | POLLHUP | POLLNVAL ) ) != 0 );
+		}
+	}
+	for ( int i = 1; i < count; ++i ) {
+		if ( r->pfd[i].revents != 0 ) {
+			uplink_reactorHandle( r, r->pfdTag[i] );
+		}
+	}
+#endif
+	if ( wakeup ) {
+		signal_clear( r->wakeup );
+		uplink_reactorFinish( r );
+		uplink_reactorAdopt( r );
+	}
+	return ret;
+}
+
+/**
+ * Remember event for uplink or shared connection the tag refers to.
+ */
+static void uplink_reactorNote(uint64_t tag, bool isError)
+{
+	if ( ( tag & TAG_MASK ) == TAG_SESSION ) {
+		uplink_session_t * const s = (uplink_session_t*)(uintptr_t)( tag & ~TAG_MASK );
+		s->revents |= isError ? EV_SOCKET_ERR : EV_SOCKET;
+		return;
+	}
+	dnbd3_connection_t * const link = (dnbd3_connection_t*)(uintptr_t)( tag & ~TAG_MASK );
+	if ( ( tag & TAG_MASK ) == TAG_SOCKET ) {
+		link->revents |= isError ? EV_SOCKET_ERR : EV_SOCKET;
+	} else {
+		link->revents |= isError ? EV_SIGNAL_ERR : EV_SIGNAL;
+	}
+}
+
+/**
+ * Handle events noted for uplink or shared connection the tag refers to,
+ * if they weren't handled yet.
+ */
+static void uplink_reactorHandle(uplink_reactor_t *r, uint64_t tag)
+{
+	if ( ( tag & TAG_MASK ) == TAG_SESSION ) {
+		uplink_session_t * const s = (uplink_session_t*)(uintptr_t)( tag & ~TAG_MASK );
+		const int revents = s->revents;
+		s->revents = 0;
+		// If busy, the socket is watched again once the job is done, which reports anything left
+		if ( revents != 0 && !s->dead && !s->busy ) {
+			uplink_sessionProcess( s, revents );
+		}
+		return;
+	}
+	dnbd3_connection_t * const link = (dnbd3_connection_t*)(uintptr_t)( tag & ~TAG_MASK );
+	const int revents = link->revents;
+	link->revents = 0;
+	if ( revents != 0 && !link->detached ) {
+		uplink_reactorRun( r, link, revents );
+	}
+}
+
+/**
+ * Pick up uplinks that were queued by uplink_init().
+ */
+static void uplink_reactorAdopt(uplink_reactor_t *r)
+{
+	mutex_lock( &r->lock );
+	dnbd3_connection_t *list = r->incoming;
+	r->incoming = NULL;
+	mutex_unlock( &r->lock );
+	while ( list != NULL ) {
+		dnbd3_connection_t * const link = list;
+		list = link->next;
+		link->next = r->links;
+		r->links = link;
+		if ( link->detached )
+			continue; // Was shut down before we got to it
+		// Make sure file is open for writing
+		if ( !uplink_reopenCacheFd( link, false ) ) {
+			// It might have failed - still offer proxy mode, we just can't cache
+			logadd( LOG_WARNING, "Cannot open cache file %s for writing (errno=%d); will just proxy traffic without caching!", link->image->path, errno );
+		}
+#ifdef __linux__
+		struct epoll_event ev = { .events = EPOLLIN, .data.u64 = (uintptr_t)link | TAG_SIGNAL };
+		if ( epoll_ctl( r->epollFd, EPOLL_CTL_ADD, signal_getWaitFd( link->signal ), &ev ) == -1 ) {
+			logadd( LOG_WARNING, "Cannot watch signal of uplink (errno=%d). Uplink unavailable.", errno );
+			uplink_detach( link );
 			continue;
 		}
-		// Check if server switch is in order
-		mutex_lock( &link->rttLock );
-		if ( link->rttTestResult != RTT_DOCHANGE ) {
-			mutex_unlock( &link->rttLock );
-		} else {
-			link->rttTestResult = RTT_IDLE;
-			// The rttTest worker thread has finished our request.
-			// And says it's better to switch to another server
-			const int fd = link->fd;
-			mutex_lock( &link->sendMutex );
-			link->fd = link->betterFd;
-			mutex_unlock( &link->sendMutex );
-			link->betterFd = -1;
-			link->currentServer = link->betterServer;
-			link->version = link->betterVersion;
-			link->cycleDetected = false;
+#endif
+		// Try to get going right away by using a connection we already have, if we don't need the
+		// CRC-32 list from it; the RTT measurements will still look for a better server later on
+		if ( link->image->crc32 != NULL ) {
+			mutex_lock( &link->rttLock );
+			const bool idle = link->rttTestResult == RTT_IDLE && link->betterFd == -1;
 			mutex_unlock( &link->rttLock );
-			discoverFailCount = 0;
-			if ( fd != -1 ) close( fd );
-			link->replicationHandle = REP_NONE;
-			link->image->working = true;
-			link->replicatedLastBlock = false; // Reset this to be safe - request could've been sent but reply was never received
-			buffer[0] = '@';
-			if ( host_to_string( &link->currentServer, buffer + 1, sizeof(buffer) - 1 ) ) {
-				logadd( LOG_DEBUG1, "(Uplink %s) Now connected to %s\n", link->image->name, buffer + 1 );
-				setThreadName( buffer );
-			}
-			// If we don't have a crc32 list yet, see if the new server has one
-			if ( link->image->crc32 == NULL ) {
-				uplink_addCrc32( link );
-			}
-			// Re-send all pending requests
-			uplink_sendRequests( link, false );
-			uplink_sendReplicationRequest( link );
-			events[EV_SOCKET].events = POLLIN | POLLRDHUP;
-			timing_gets( &nextAltCheck, altCheckInterval );
-			// The rtt worker already did the handshake for our image, so there's nothing
-			// more to do here
-		}
-		// Check events
-		// Signal
-		if ( (events[EV_SIGNAL].revents & (POLLERR | POLLHUP | POLLRDHUP | POLLNVAL)) ) {
-			logadd( LOG_WARNING, "poll error on signal in uplink_mainloop!" );
-			goto cleanup;
-		} else if ( (events[EV_SIGNAL].revents & POLLIN) ) {
-			// signal triggered -> pending requests
-			if ( signal_clear( link->signal ) == SIGNAL_ERROR ) {
-				logadd( LOG_WARNING, "Errno on signal on uplink for %s! Things will break!", link->image->name );
+			for ( uplink_session_t *s = r->sessions; idle && s != NULL; s = s->next ) {
+				if ( uplink_attachSession( link, s ) ) {
+					timing_gets( &link->nextAltCheck, link->altCheckInterval );
+					break;
+				}
 			}
+		}
+		uplink_reactorRun( r, link, 0 );
+	}
+}
+
+/**
+ * Let uplink handle given events (or just do periodic work if 0),
+ * and take it down if it's shutting down. While a job uses the
+ * connection of the uplink, new requests are still sent, but
+ * everything else waits until uplink_reactorFinish().
+ */
+static void uplink_reactorRun(uplink_reactor_t *r, dnbd3_connection_t *link, int revents)
+{
+	revents |= link->revents;
+	link->revents = 0;
+	if ( uplink_isBusy( link ) ) {
+		if ( revents & EV_SIGNAL ) {
+			signal_clear( link->signal );
 			if ( link->fd != -1 ) {
-				// Uplink seems fine, relay requests to it...
 				uplink_sendRequests( link, true );
-			} else { // No uplink; maybe it was shutdown since it was idle for too long
-				link->idleTime = 0;
 			}
 		}
-		// Uplink socket
-		if ( (events[EV_SOCKET].revents & (POLLERR | POLLHUP | POLLRDHUP | POLLNVAL)) ) {
-			uplink_connectionFailed( link, true );
-			logadd( LOG_DEBUG1, "Uplink gone away, panic!\n" );
-			setThreadName( "panic-uplink" );
-		} else if ( (events[EV_SOCKET].revents & POLLIN) ) {
-			uplink_handleReceive( link );
-			if ( _shutdown || link->shutdown ) goto cleanup;
+		link->revents = revents;
+		return;
+	}
+	if ( !uplink_process( link, revents ) || ( !uplink_isBusy( link ) && ( _shutdown || link->shutdown ) ) ) {
+		uplink_detach( link );
+		return;
+	}
+	uplink_reactorWatchSocket( r, link );
+}
+
+/**
+ * Make sure the reactor watches the current socket of the uplink.
+ * This is called right after uplink_process() and whenever a job
+ * starts or finishes using the socket, which are the only places
+ * the socket gets replaced or closed, so if the old socket is closed
+ * already, its fd cannot have been reused yet.
+ */
+static void uplink_reactorWatchSocket(uplink_reactor_t *r UNUSED, dnbd3_connection_t *link)
+{
+	// Shared connections are watched by their session, and nobody watches while a job uses the socket
+	const int fd = link->session == NULL && !link->busy ? link->fd : -1;
+	if ( fd == link->watchedFd )
+		return;
+#ifdef __linux__
+	if ( link->watchedFd != -1 ) {
+		// Fails if the socket was closed already, which removed it anyways
+		epoll_ctl( r->epollFd, EPOLL_CTL_DEL, link->watchedFd, NULL );
+	}
+	link->watchedFd = -1;
+	if ( fd != -1 ) {
+		struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP, .data.u64 = (uintptr_t)link | TAG_SOCKET };
+		if ( epoll_ctl( r->epollFd, EPOLL_CTL_ADD, fd, &ev ) == -1 ) {
+			logadd( LOG_WARNING, "Cannot watch socket of uplink for %s (errno=%d)", link->image->name, errno );
+			return;
+		}
+	}
+#endif
+	link->watchedFd = fd;
+}
+
+/**
+ * Free uplinks that were detached, once the altservers thread
+ * is not measuring them anymore.
+ * @param wait if true, wait for the altservers thread if it's busy
+ */
+static void uplink_reactorReap(uplink_reactor_t *r, bool wait)
+{
+	dnbd3_connection_t **it = &r->links;
+	while ( *it != NULL ) {
+		dnbd3_connection_t * const link = *it;
+		if ( !link->detached || !link->saved ) {
+			it = &link->next;
+			continue;
 		}
-		declare_now;
-		uint32_t timepassed = timing_diff( &lastKeepalive, &now );
-		if ( timepassed >= SERVER_UPLINK_KEEPALIVE_INTERVAL ) {
-			lastKeepalive = now;
-			link->idleTime += timepassed;
-			unsavedSeconds += timepassed;
-			if ( unsavedSeconds > 240 || ( unsavedSeconds > 60 && link->idleTime >= 20 && link->idleTime <= 70 ) ) {
-				// fsync/save every 4 minutes, or every 60 seconds if link is idle
-				unsavedSeconds = 0;
-				uplink_saveCacheMap( link );
+		*it = link->next;
+		link->next = r->dead;
+		r->dead = link;
+	}
+	while ( r->dead != NULL ) {
+		dnbd3_connection_t * const link = r->dead;
+		if ( wait ) {
+			altservers_removeUplink( link );
+		} else if ( !altservers_tryRemoveUplink( link ) ) {
+			break; // Measurement in progress, try again later
+		}
+		r->dead = link->next;
+		uplink_free( link );
+	}
+	for ( uplink_session_t **sit = &r->sessions; *sit != NULL; ) {
+		uplink_session_t * const s = *sit;
+		if ( !s->dead ) {
+			sit = &s->next;
+			continue;
+		}
+		*sit = s->next;
+		free( s );
+	}
+}
+
+/**
+ * Continue with uplinks and shared connections whose jobs are done.
+ */
+static void uplink_reactorFinish(uplink_reactor_t *r)
+{
+	mutex_lock( &r->lock );
+	uplink_job_t *list = r->done;
+	r->done = NULL;
+	mutex_unlock( &r->lock );
+	while ( list != NULL ) {
+		uplink_job_t * const job = list;
+		list = job->next;
+		r->jobs--;
+		dnbd3_connection_t * const link = job->link;
+		uplink_session_t * const s = job->session;
+		if ( job->type == JOB_SAVE ) {
+			link->saving = false;
+			if ( job->final ) {
+				link->saved = true;
+			} else if ( link->detached ) {
+				uplink_startSave( link, true );
 			}
-			// Keep-alive
-			if ( link->fd != -1 && link->replicationHandle == REP_NONE ) {
-				// Send keep-alive if nothing is happening
-				if ( uplink_sendKeepalive( link->fd ) ) {
-					// Re-trigger periodically, in case it requires a minimum user count
-					uplink_sendReplicationRequest( link );
-				} else {
-					uplink_connectionFailed( link, true );
-					logadd( LOG_DEBUG1, "Error sending keep-alive, panic!\n" );
-					setThreadName( "panic-uplink" );
+		} else if ( job->type == JOB_CRC ) {
+			link->busy = false;
+			if ( _shutdown || link->shutdown ) {
+				close( job->fd );
+			} else {
+				uplink_useConnection( link, job->fd );
+			}
+			uplink_reactorRun( r, link, 0 );
+		} else if ( s == NULL ) {
+			link->busy = false;
+			if ( job->ok ) {
+				uplink_receiveDone( link );
+			} else {
+				uplink_putRecvBuffer( link );
+				uplink_connectionFailed( link, true );
+			}
+			uplink_reactorRun( r, link, 0 );
+		} else {
+			// Uplinks of the shared connection might have been waiting for it
+			dnbd3_connection_t *waiting[SERVER_UPLINK_SESSION_IMAGES];
+			int num = 0;
+			for ( int i = 0; i < SERVER_UPLINK_SESSION_IMAGES; ++i ) {
+				if ( s->links[i] != NULL ) {
+					waiting[num++] = s->links[i];
 				}
 			}
-			// Don't keep link established if we're idle for too much
-			if ( link->fd != -1 && uplink_connectionShouldShutdown( link ) ) {
-				mutex_lock( &link->sendMutex );
-				close( link->fd );
-				link->fd = events[EV_SOCKET].fd = -1;
-				mutex_unlock( &link->sendMutex );
-				link->cycleDetected = false;
-				if ( link->recvBufferLen != 0 ) {
-					link->recvBufferLen = 0;
-					free( link->recvBuffer );
-					link->recvBuffer = NULL;
+			s->busy = false;
+			if ( !job->ok || !uplink_sessionWatch( s, true ) ) {
+				uplink_sessionFailed( s );
+			} else if ( link != NULL ) {
+				uplink_receiveDone( link );
+			}
+			for ( int i = 0; i < num; ++i ) {
+				if ( !waiting[i]->detached && ( waiting[i]->revents != 0 || waiting[i]->shutdown || _shutdown ) ) {
+					uplink_reactorRun( r, waiting[i], 0 );
 				}
-				logadd( LOG_DEBUG1, "Closing idle uplink for image %s:%d", link->image->name, (int)link->image->rid );
-				setThreadName( "idle-uplink" );
 			}
 		}
-		// See if we should trigger an RTT measurement
-		mutex_lock( &link->rttLock );
-		const int rttTestResult = link->rttTestResult;
+		free( job );
+	}
+}
+
+/**
+ * Hand job to the thread pool. While a job uses the connection of an uplink
+ * or a shared connection, it is busy and its socket isn't watched, so the
+ * reactor doesn't touch it until uplink_reactorFinish() picked up the result.
+ */
+static void uplink_dispatch(uplink_reactor_t *r, const uplink_job_t *job)
+{
+	uplink_job_t * const copy = malloc( sizeof(*copy) );
+	if ( copy == NULL ) {
+		logadd( LOG_ERROR, "Out of memory when trying to hand off uplink work" );
+		exit( 1 );
+	}
+	*copy = *job;
+	copy->reactor = r;
+	r->jobs++;
+	if ( !threadpool_runInternal( &uplink_jobMain, copy ) ) {
+		uplink_jobMain( copy );
+	}
+}
+
+/**
+ * Do the blocking work of a reactor, see uplink_dispatch().
+ */
+static void* uplink_jobMain(void *data)
+{
+	uplink_job_t * const job = (uplink_job_t*)data;
+	uplink_reactor_t * const r = job->reactor;
+	dnbd3_connection_t * const link = job->link;
+	if ( job->type == JOB_SAVE ) {
+		dnbd3_image_t * const image = link->image;
+		uplink_saveCacheMap( image, job->fd );
+		if ( !job->final ) {
+			if ( job->fd != -1 ) close( job->fd );
+		} else {
+			mutex_lock( &image->lock );
+			if ( image->uplink == link ) {
+				image->uplink = NULL;
+			}
+			mutex_unlock( &image->lock );
+			// Do not access link->image from here on, the image might be freed
+			mutex_lock( &shutdownLock );
+			pthread_cond_broadcast( &shutdownDone );
+			mutex_unlock( &shutdownLock );
+		}
+	} else if ( job->type == JOB_CRC ) {
+		uplink_addCrc32( link, job->fd );
+	} else if ( link == NULL ) {
+		job->ok = uplink_discardPayload( job->fd, job->reply.size );
+	} else {
+		job->ok = uplink_handleReply( link, job->fd, &job->reply );
+	}
+	mutex_lock( &r->lock );
+	job->next = r->done;
+	r->done = job;
+	mutex_unlock( &r->lock );
+	signal_call( r->wakeup );
+	return NULL;
+}
+
+/**
+ * @return true if a job uses the connection of uplink right now
+ */
+static bool uplink_isBusy(dnbd3_connection_t *link)
+{
+	return link->busy || ( link->session != NULL && link->session->busy );
+}
+
+/**
+ * Handle events of uplink, and do periodic work if due.
+ * Only called by the reactor thread of the uplink.
+ * @return false if the uplink should be taken down
+ */
+static bool uplink_process(dnbd3_connection_t *link, int revents)
+{
+	// Check if server switch is in order
+	mutex_lock( &link->rttLock );
+	if ( link->rttTestResult != RTT_DOCHANGE ) {
 		mutex_unlock( &link->rttLock );
-		if ( rttTestResult == RTT_IDLE || rttTestResult == RTT_DONTCHANGE ) {
-			if ( timing_reached( &nextAltCheck, &now ) || ( link->fd == -1 && !uplink_connectionShouldShutdown( link ) ) || link->cycleDetected ) {
-				// It seems it's time for a check
-				if ( image_isComplete( link->image ) ) {
-					// Quit work if image is complete
-					logadd( LOG_INFO, "Replication of %s complete.", link->image->name );
-					setThreadName( "finished-uplink" );
-					goto cleanup;
-				} else if ( !uplink_connectionShouldShutdown( link ) ) {
-					// Not complete - do measurement
-					altservers_findUplink( link ); // This will set RTT_INPROGRESS (synchronous)
-					if ( _backgroundReplication == BGR_FULL && link->nextReplicationIndex == -1 ) {
-						link->nextReplicationIndex = 0;
-					}
+	} else {
+		link->rttTestResult = RTT_IDLE;
+		// The rttTest worker thread has finished our request.
+		// And says it's better to switch to another server
+		const int fd = link->betterFd;
+		link->betterFd = -1;
+		link->cycleDetected = false;
+		mutex_unlock( &link->rttLock );
+		uplink_closeConnection( link );
+		mutex_lock( &link->sendMutex );
+		link->currentServer = link->betterServer;
+		link->version = link->betterVersion;
+		mutex_unlock( &link->sendMutex );
+		link->discoverFailCount = 0;
+		link->replicationHandle = REP_NONE;
+		// The socket was replaced, so events are for the old one
+		revents &= ~( EV_SOCKET | EV_SOCKET_ERR );
+		// If we don't have a crc32 list yet, see if the new server has one
+		if ( link->image->crc32 == NULL ) {
+			link->busy = true;
+			link->revents |= revents;
+			uplink_dispatch( link->reactor, &(uplink_job_t){ .type = JOB_CRC, .link = link, .fd = fd } );
+			return true;
+		}
+		uplink_useConnection( link, fd );
+	}
+	// Check events
+	// Signal
+	if ( revents & EV_SIGNAL_ERR ) {
+		logadd( LOG_WARNING, "poll error on signal of uplink for %s!", link->image->name );
+		return false;
+	} else if ( revents & EV_SIGNAL ) {
+		// signal triggered -> pending requests
+		if ( signal_clear( link->signal ) == SIGNAL_ERROR ) {
+			logadd( LOG_WARNING, "Errno on signal on uplink for %s! Things will break!", link->image->name );
+		}
+		if ( link->fd != -1 ) {
+			// Uplink seems fine, relay requests to it...
+			uplink_sendRequests( link, true );
+		} else { // No uplink; maybe it was shutdown since it was idle for too long
+			link->idleTime = 0;
+		}
+	}
+	// Uplink socket
+	if ( revents & EV_SOCKET_ERR ) {
+		uplink_connectionFailed( link, true );
+		logadd( LOG_DEBUG1, "Uplink gone away, panic!\n" );
+	} else if ( revents & EV_SOCKET ) {
+		uplink_handleReceive( link );
+		if ( link->busy ) return true; // Rest is done once the job receiving the reply is finished
+		if ( _shutdown || link->shutdown ) return false;
+	}
+	declare_now;
+	uint32_t timepassed = timing_diff( &link->lastKeepalive, &now );
+	if ( timepassed >= SERVER_UPLINK_KEEPALIVE_INTERVAL ) {
+		link->lastKeepalive = now;
+		link->idleTime += timepassed;
+		link->unsavedSeconds += timepassed;
+		if ( link->unsavedSeconds > 240 || ( link->unsavedSeconds > 60 && link->idleTime >= 20 && link->idleTime <= 70 ) ) {
+			// fsync/save every 4 minutes, or every 60 seconds if link is idle
+			link->unsavedSeconds = 0;
+			uplink_startSave( link, false );
+		}
+		// Give back memory if the queue was large, but most of it is unused by now
+		mutex_lock( &link->queueLock );
+		if ( link->queueCapacity > SERVER_UPLINK_QUEUE_INIT && link->queueLen < link->queueCapacity / 4 ) {
+			uplink_resizeQueue( link, MAX( link->queueCapacity / 2, SERVER_UPLINK_QUEUE_INIT ) );
+		}
+		mutex_unlock( &link->queueLock );
+		// Keep-alive, done by the session for shared connections
+		if ( link->fd != -1 && link->replicationHandle == REP_NONE ) {
+			// Send keep-alive if nothing is happening
+			if ( link->session != NULL || uplink_sendKeepalive( link->fd ) ) {
+				// Re-trigger periodically, in case it requires a minimum user count
+				uplink_sendReplicationRequest( link );
+			} else {
+				uplink_connectionFailed( link, true );
+				logadd( LOG_DEBUG1, "Error sending keep-alive, panic!\n" );
+			}
+		}
+		// Don't keep link established if we're idle for too much
+		if ( ( link->fd != -1 || link->session != NULL ) && uplink_connectionShouldShutdown( link ) ) {
+			uplink_closeConnection( link );
+			link->cycleDetected = false;
+			logadd( LOG_DEBUG1, "Closing idle uplink for image %s:%d", link->image->name, (int)link->image->rid );
+		}
+	}
+	// See if we should trigger an RTT measurement
+	mutex_lock( &link->rttLock );
+	const int rttTestResult = link->rttTestResult;
+	mutex_unlock( &link->rttLock );
+	if ( rttTestResult == RTT_IDLE || rttTestResult == RTT_DONTCHANGE ) {
+		if ( timing_reached( &link->nextAltCheck, &now ) || link->cycleDetected
+				|| ( link->fd == -1 && link->session == NULL && !uplink_connectionShouldShutdown( link ) ) ) {
+			// It seems it's time for a check
+			if ( image_isComplete( link->image ) ) {
+				// Quit work if image is complete
+				logadd( LOG_INFO, "Replication of %s complete.", link->image->name );
+				return false;
+			} else if ( !uplink_connectionShouldShutdown( link ) ) {
+				// Not complete - do measurement
+				altservers_findUplink( link ); // This will set RTT_INPROGRESS (synchronous)
+				if ( _backgroundReplication == BGR_FULL && link->nextReplicationIndex == -1 ) {
+					link->nextReplicationIndex = 0;
 				}
-				altCheckInterval = MIN(altCheckInterval + 1, SERVER_RTT_INTERVAL_MAX);
-				timing_set( &nextAltCheck, &now, altCheckInterval );
 			}
-		} else if ( rttTestResult == RTT_NOT_REACHABLE ) {
-			mutex_lock( &link->rttLock );
-			link->rttTestResult = RTT_IDLE;
-			mutex_unlock( &link->rttLock );
-			discoverFailCount++;
-			timing_set( &nextAltCheck, &now, (discoverFailCount < SERVER_RTT_BACKOFF_COUNT ? altCheckInterval : SERVER_RTT_INTERVAL_FAILED) );
+			link->altCheckInterval = MIN(link->altCheckInterval + 1, SERVER_RTT_INTERVAL_MAX);
+			timing_set( &link->nextAltCheck, &now, link->altCheckInterval );
 		}
+	} else if ( rttTestResult == RTT_NOT_REACHABLE ) {
+		mutex_lock( &link->rttLock );
+		link->rttTestResult = RTT_IDLE;
+		mutex_unlock( &link->rttLock );
+		link->discoverFailCount++;
+		timing_set( &link->nextAltCheck, &now, (link->discoverFailCount < SERVER_RTT_BACKOFF_COUNT ? link->altCheckInterval : SERVER_RTT_INTERVAL_FAILED) );
+	}
 #ifdef _DEBUG
-		if ( link->fd != -1 && !link->shutdown ) {
-			bool resend = false;
-			ticks deadline;
-			timing_set( &deadline, &now, -10 );
-			mutex_lock( &link->queueLock );
-			for (i = 0; i < link->queueLen; ++i) {
-				if ( link->queue[i].status != ULR_FREE && timing_reached( &link->queue[i].entered, &deadline ) ) {
-					snprintf( buffer, sizeof(buffer), "[DEBUG %p] Starving request slot %d detected:\n"
-							"%s\n(from %" PRIu64 " to %" PRIu64 ", status: %d)\n", (void*)link, i, link->queue[i].client->image->name,
-							link->queue[i].from, link->queue[i].to, link->queue[i].status );
-					link->queue[i].entered = now;
+	if ( link->fd != -1 && !link->shutdown ) {
+		char buffer[200];
+		bool resend = false;
+		ticks deadline;
+		timing_set( &deadline, &now, -10 );
+		mutex_lock( &link->queueLock );
+		for (int i = 0; i < link->queueLen; ++i) {
+			if ( link->queue[i].status != ULR_FREE && timing_reached( &link->queue[i].entered, &deadline ) ) {
+				snprintf( buffer, sizeof(buffer), "[DEBUG %p] Starving request slot %d detected:\n"
+						"%s\n(from %" PRIu64 " to %" PRIu64 ", status: %d)\n", (void*)link, i, link->image->name,
+						link->queue[i].from, link->queue[i].to, link->queue[i].status );
+				link->queue[i].entered = now;
 #ifdef _DEBUG_RESEND_STARVING
-					link->queue[i].status = ULR_NEW;
-					resend = true;
+				link->queue[i].status = ULR_NEW;
+				resend = true;
 #endif
-					mutex_unlock( &link->queueLock );
-					logadd( LOG_WARNING, "%s", buffer );
-					mutex_lock( &link->queueLock );
-				}
+				mutex_unlock( &link->queueLock );
+				logadd( LOG_WARNING, "%s", buffer );
+				mutex_lock( &link->queueLock );
 			}
-			mutex_unlock( &link->queueLock );
-			if ( resend )
-				uplink_sendRequests( link, true );
 		}
-#endif
+		mutex_unlock( &link->queueLock );
+		if ( resend )
+			uplink_sendRequests( link, true );
+	}
+#endif
+	return true;
+}
+
+/**
+ * Take uplink out of service: Stop watching it, and save its cache map,
+ * which takes it off the image when done. It will be freed by
+ * uplink_reactorReap() after that.
+ * Only called by the reactor thread of the uplink, never while it's busy.
+ */
+static void uplink_detach(dnbd3_connection_t *link)
+{
+	if ( link->detached )
+		return;
+	link->detached = true;
+	link->revents = 0;
+	mutex_lock( &link->queueLock );
+	link->shutdown = true;
+	mutex_unlock( &link->queueLock );
+#ifdef __linux__
+	// Signal stays open until freed, the altservers thread might still use it
+	epoll_ctl( link->reactor->epollFd, EPOLL_CTL_DEL, signal_getWaitFd( link->signal ), NULL );
+	if ( link->watchedFd != -1 ) {
+		epoll_ctl( link->reactor->epollFd, EPOLL_CTL_DEL, link->watchedFd, NULL );
+	}
+#endif
+	link->watchedFd = -1;
+	uplink_closeConnection( link );
+	uplink_startSave( link, true );
+}
+
+/**
+ * Let a job save the cache map of the uplink, unless one is doing so already.
+ * Then, saving again after detaching is left to uplink_reactorFinish().
+ * @param final uplink was detached, take it off its image afterwards
+ */
+static void uplink_startSave(dnbd3_connection_t *link, bool final)
+{
+	if ( link->saving )
+		return;
+	int fd = link->cacheFd;
+	if ( !final && fd != -1 ) {
+		// Jobs receiving for the uplink might reopen the cache file meanwhile
+		fd = dup( fd );
+		if ( fd == -1 ) {
+			logadd( LOG_DEBUG1, "Cannot save cache map of %s, dup failed (errno=%d)", link->image->name, errno );
+			return;
+		}
+	}
+	link->saving = true;
+	uplink_dispatch( link->reactor, &(uplink_job_t){ .type = JOB_SAVE, .link = link, .fd = fd, .final = final } );
+}
+
+/**
+ * Free detached uplink, and create a new one for its image
+ * if it's not complete. Only called by uplink_reactorReap().
+ */
+static void uplink_free(dnbd3_connection_t *link)
+{
+	link->reactor->count--;
+	signal_close( link->signal );
+	if ( link->betterFd != -1 ) {
+		close( link->betterFd );
+	}
+	mutex_destroy( &link->queueLock );
+	pthread_cond_destroy( &link->relayDone );
+	mutex_destroy( &link->rttLock );
+	mutex_destroy( &link->sendMutex );
+	free( link->recvBuffer );
+	link->recvBuffer = NULL;
+	free( link->queue );
+	link->queue = NULL;
+	if ( link->cacheFd != -1 ) {
+		close( link->cacheFd );
+	}
+	dnbd3_image_t *image = image_lock( link->image );
+	free( link ); // !!!
+	if ( image != NULL ) {
+		if ( !_shutdown && image->cache_map != NULL ) {
+			// Ingegrity checker must have found something in the meantime
+			uplink_init( image, -1, NULL, 0 );
+		}
+		image_release( image );
+	}
+}
+
+/**
+ * Start using connection to new server, which the rtt worker already
+ * did the handshake for our image with.
+ */
+static void uplink_useConnection(dnbd3_connection_t *link, int fd)
+{
+	if ( !uplink_joinSession( link, fd ) ) {
+		// Use as our own connection
+		mutex_lock( &link->sendMutex );
+		link->fd = fd;
+		mutex_unlock( &link->sendMutex );
+		uplink_connected( link );
+	}
+	timing_gets( &link->nextAltCheck, link->altCheckInterval );
+}
+
+/**
+ * Uplink has a working connection now (again), get things going.
+ */
+static void uplink_connected(dnbd3_connection_t *link)
+{
+	char buffer[200];
+	link->image->working = true;
+	link->replicatedLastBlock = false; // Reset this to be safe - request could've been sent but reply was never received
+	if ( host_to_string( &link->currentServer, buffer, sizeof(buffer) ) ) {
+		if ( link->session != NULL ) {
+			logadd( LOG_DEBUG1, "(Uplink %s) Now connected to %s (shared connection, slot %d)\n", link->image->name, buffer, link->slot );
+		} else {
+			logadd( LOG_DEBUG1, "(Uplink %s) Now connected to %s\n", link->image->name, buffer );
+		}
+	}
+	// Re-send all pending requests
+	uplink_sendRequests( link, false );
+	uplink_sendReplicationRequest( link );
+}
+
+/**
+ * Close connection of uplink, or leave the shared connection it uses.
+ */
+static void uplink_closeConnection(dnbd3_connection_t *link)
+{
+	if ( link->session != NULL ) {
+		uplink_leaveSession( link, true );
+		return;
+	}
+	if ( link->fd == -1 )
+		return;
+	mutex_lock( &link->sendMutex );
+	close( link->fd );
+	link->fd = -1;
+	mutex_unlock( &link->sendMutex );
+}
+
+// ############ shared connections
+
+/**
+ * Use a shared connection to the server fd is connected to. The image of
+ * the uplink is already selected on fd. If this reactor has a shared
+ * connection to that server already, the image gets selected on it too,
+ * and fd is closed. Otherwise, fd becomes a new shared connection.
+ * @return false if no shared connection can be used, fd should be
+ * used as the uplink's own connection then
+ */
+static bool uplink_joinSession(dnbd3_connection_t *link, int fd)
+{
+	uplink_reactor_t * const r = link->reactor;
+	// Remote server only allows this for other servers
+	if ( link->noSession || _pretendClient || link->version < DNBD3_MIN_VERSION_MULTI_IMAGE )
+		return false;
+	for ( uplink_session_t *s = r->sessions; s != NULL; s = s->next ) {
+		if ( !s->dead && isSameAddressPort( &s->server, &link->currentServer ) && uplink_attachSession( link, s ) ) {
+			close( fd );
+			return true;
+		}
+	}
+	uplink_session_t * const s = calloc( 1, sizeof(*s) );
+	if ( s == NULL )
+		return false;
+#ifdef __linux__
+	struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP, .data.u64 = (uintptr_t)s | TAG_SESSION };
+	if ( epoll_ctl( r->epollFd, EPOLL_CTL_ADD, fd, &ev ) == -1 ) {
+		logadd( LOG_WARNING, "Cannot watch shared uplink connection (errno=%d)", errno );
+		free( s );
+		return false;
+	}
+#endif
+	s->server = link->currentServer;
+	s->fd = fd;
+	s->version = link->version;
+	s->reactor = r;
+	timing_get( &s->lastKeepalive );
+	s->next = r->sessions;
+	r->sessions = s;
+	// Image was selected during handshake, which is slot 0
+	s->links[0] = link;
+	s->numLinks = 1;
+	link->slot = 0;
+	link->handleBits = 0;
+	mutex_lock( &link->sendMutex );
+	link->session = s;
+	link->fd = fd;
+	mutex_unlock( &link->sendMutex );
+	uplink_connected( link );
+	return true;
+}
+
+/**
+ * Select image of uplink on shared connection. The uplink can use the
+ * connection once the remote server confirmed, see uplink_sessionSelected().
+ * @return false if there is no free slot, or the request couldn't be sent
+ */
+static bool uplink_attachSession(dnbd3_connection_t *link, uplink_session_t *s)
+{
+	if ( s->dead || s->busy || link->noSession || _pretendClient || s->numLinks >= SERVER_UPLINK_SESSION_IMAGES )
+		return false;
+	int slot;
+	for ( slot = 1; slot < SERVER_UPLINK_SESSION_IMAGES && ( s->links[slot] != NULL || s->draining[slot] ); ++slot ) { }
+	if ( slot == SERVER_UPLINK_SESSION_IMAGES )
+		return false;
+	const uint64_t handleBits = ( (uint64_t)++s->gen[slot] << HANDLE_GEN_SHIFT ) | ( (uint64_t)slot << DNBD3_HANDLE_SLOT_SHIFT );
+	if ( !dnbd3_select_image_handle( s->fd, link->image->name, (uint16_t)link->image->rid, SI_SERVER_FLAGS, handleBits ) ) {
+		uplink_sessionFailed( s );
+		return false;
+	}
+	s->links[slot] = link;
+	s->numLinks++;
+	link->slot = slot;
+	link->handleBits = handleBits;
+	mutex_lock( &link->sendMutex );
+	link->session = s;
+	link->fd = -1; // Until confirmed
+	link->currentServer = s->server;
+	link->version = s->version;
+	mutex_unlock( &link->sendMutex );
+	return true;
+}
+
+/**
+ * Stop using shared connection. It's closed once the last uplink left.
+ * A released slot isn't taken again before the remote server replied to the
+ * release. It answers requests in order and waits for pending relays when
+ * releasing, so no replies for the previous user can follow, and the
+ * generation counter cannot wrap around onto a request still in flight.
+ * @param release tell remote server it can free the slot
+ */
+static void uplink_leaveSession(dnbd3_connection_t *link, bool release)
+{
+	uplink_session_t * const s = link->session;
+	s->links[link->slot] = NULL;
+	s->numLinks--;
+	mutex_lock( &link->sendMutex );
+	link->session = NULL;
+	link->fd = -1;
+	mutex_unlock( &link->sendMutex );
+	if ( s->numLinks == 0 ) {
+		s->dead = true;
+#ifdef __linux__
+		epoll_ctl( link->reactor->epollFd, EPOLL_CTL_DEL, s->fd, NULL );
+#endif
+		close( s->fd );
+		s->fd = -1;
+	} else if ( release && link->slot != 0 ) {
+		s->draining[link->slot] = true;
+		if ( !dnbd3_select_image_handle( s->fd, "", 0, SI_SERVER_FLAGS, link->handleBits ) ) {
+			uplink_sessionFailed( s );
+		}
+	}
+	link->handleBits = 0;
+}
+
+/**
+ * Start or stop watching shared connection.
+ * @return false if it cannot be watched
+ */
+static bool uplink_sessionWatch(uplink_session_t *s, bool watch)
+{
+#ifdef __linux__
+	if ( !watch ) {
+		epoll_ctl( s->reactor->epollFd, EPOLL_CTL_DEL, s->fd, NULL );
+		return true;
+	}
+	struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP, .data.u64 = (uintptr_t)s | TAG_SESSION };
+	if ( epoll_ctl( s->reactor->epollFd, EPOLL_CTL_ADD, s->fd, &ev ) == -1 ) {
+		logadd( LOG_WARNING, "Cannot watch shared uplink connection (errno=%d)", errno );
+		return false;
+	}
+#endif
+	return true;
+}
+
+/**
+ * Handle events of shared connection.
+ */
+static void uplink_sessionProcess(uplink_session_t *s, int revents)
+{
+	if ( revents & EV_SOCKET_ERR ) {
+		logadd( LOG_DEBUG1, "Shared uplink connection gone away, panic!\n" );
+		uplink_sessionFailed( s );
+	} else if ( revents & EV_SOCKET ) {
+		uplink_sessionReceive( s );
+	}
+}
+
+/**
+ * Read reply headers from shared connection and hand the replies to the
+ * uplinks by slot. Receiving the payload is left to a job, which makes the
+ * connection busy until the job is done.
+ */
+static void uplink_sessionReceive(uplink_session_t *s)
+{
+	dnbd3_reply_t reply;
+	int ret;
+	while ( !s->dead ) {
+		ret = dnbd3_read_reply( s->fd, &reply, false );
+		if ( unlikely( ret == REPLY_INTR ) && likely( !_shutdown ) ) continue;
+		if ( ret == REPLY_AGAIN ) break;
+		if ( unlikely( ret != REPLY_OK ) ) {
+			logadd( LOG_INFO, "Uplink: Error %d on shared connection", ret );
+			goto error_cleanup;
+		}
+		if ( unlikely( reply.size > (uint32_t)_maxPayload ) ) {
+			logadd( LOG_WARNING, "Pure evil: Uplink server sent too much payload (%" PRIu32 ") on shared connection", reply.size );
+			goto error_cleanup;
+		}
+		const int slot = DNBD3_HANDLE_SLOT( reply.handle );
+		dnbd3_connection_t * const link = slot < SERVER_UPLINK_SESSION_IMAGES ? s->links[slot] : NULL;
+		if ( reply.cmd == CMD_KEEPALIVE || link == NULL || link->handleBits != ( reply.handle & ~HANDLE_OFFSET_MASK ) ) {
+			// Not for any uplink, or for the previous user of the slot
+			if ( link == NULL && reply.cmd == CMD_SELECT_IMAGE && slot < SERVER_UPLINK_SESSION_IMAGES
+					&& (uint8_t)( reply.handle >> HANDLE_GEN_SHIFT ) == s->gen[slot] ) {
+				s->draining[slot] = false; // Remote server confirmed release
+			}
+			if ( reply.size != 0 ) {
+				uplink_receive( s->reactor, NULL, s, &reply );
+				return;
+			}
+			continue;
+		}
+		reply.handle &= HANDLE_OFFSET_MASK;
+		if ( reply.cmd != CMD_SELECT_IMAGE ) {
+			uplink_receive( s->reactor, link, s, &reply );
+			return;
+		}
+		if ( !uplink_sessionSelected( link, &reply ) )
+			goto error_cleanup;
+		if ( _shutdown || link->shutdown ) {
+			uplink_detach( link );
+		}
 	}
-	cleanup: ;
-	altservers_removeUplink( link );
-	uplink_saveCacheMap( link );
-	mutex_lock( &link->image->lock );
-	if ( link->image->uplink == link ) {
-		link->image->uplink = NULL;
+	return;
+error_cleanup: ;
+	uplink_sessionFailed( s );
+}
+
+/**
+ * Remote server replied to selecting image of uplink on shared connection.
+ * @return false if the connection broke
+ */
+static bool uplink_sessionSelected(dnbd3_connection_t *link, const dnbd3_reply_t *reply)
+{
+	serialized_buffer_t buffer;
+	uint16_t rid = 0;
+	uint64_t size = 0;
+	if ( reply->size > MAX_PAYLOAD )
+		return false;
+	if ( reply->size != 0 ) {
+		if ( sock_recv( link->session->fd, buffer.buffer, reply->size ) != (ssize_t)reply->size )
+			return false;
+		serializer_reset_read( &buffer, reply->size );
+		serializer_get_uint16( &buffer ); // protocol version
+		serializer_get_string( &buffer ); // name
+		rid = serializer_get_uint16( &buffer );
+		size = serializer_get_uint64( &buffer );
+	}
+	if ( link->fd != -1 )
+		return true; // Already confirmed
+	if ( reply->size == 0 || rid != link->image->rid || size != link->image->virtualFilesize ) {
+		// Let RTT measurements find a server, using an own connection
+		logadd( LOG_DEBUG1, "(Uplink %s) Image not available on shared connection", link->image->name );
+		uplink_leaveSession( link, reply->size != 0 );
+		link->noSession = true;
+		return true;
 	}
-	mutex_lock( &link->queueLock );
-	const int fd = link->fd;
-	const dnbd3_signal_t* signal = link->signal;
 	mutex_lock( &link->sendMutex );
-	link->fd = -1;
+	link->fd = link->session->fd;
 	mutex_unlock( &link->sendMutex );
-	link->signal = NULL;
-	if ( !link->shutdown ) {
-		link->shutdown = true;
-		thread_detach( link->thread );
-	}
-	// Do not access link->image after unlocking, since we set
-	// image->uplink to NULL. Acquire with image_lock first,
-	// like done below when checking whether to re-init uplink
-	mutex_unlock( &link->image->lock );
-	mutex_unlock( &link->queueLock );
-	if ( fd != -1 ) close( fd );
-	if ( signal != NULL ) signal_close( signal );
-	// Wait for the RTT check to finish/fail if it's in progress
-	while ( link->rttTestResult == RTT_INPROGRESS )
-		usleep( 10000 );
-	if ( link->betterFd != -1 ) {
-		close( link->betterFd );
-	}
-	mutex_destroy( &link->queueLock );
-	mutex_destroy( &link->rttLock );
-	mutex_destroy( &link->sendMutex );
-	free( link->recvBuffer );
-	link->recvBuffer = NULL;
-	if ( link->cacheFd != -1 ) {
-		close( link->cacheFd );
+	uplink_connected( link );
+	return true;
+}
+
+/**
+ * Shared connection broke, all uplinks using it need to look for a new server.
+ */
+static void uplink_sessionFailed(uplink_session_t *s)
+{
+	if ( s->dead )
+		return;
+	altservers_serverFailed( &s->server );
+	for ( int i = 0; i < SERVER_UPLINK_SESSION_IMAGES && !s->dead; ++i ) {
+		dnbd3_connection_t * const link = s->links[i];
+		if ( link == NULL ) continue;
+		uplink_leaveSession( link, false );
+		uplink_putRecvBuffer( link );
+		uplink_connectionLost( link, !link->detached );
 	}
-	dnbd3_image_t *image = image_lock( link->image );
-	free( link ); // !!!
-	if ( image != NULL ) {
-		if ( !_shutdown && image->cache_map != NULL ) {
-			// Ingegrity checker must have found something in the meantime
-			uplink_init( image, -1, NULL, 0 );
-		}
-		image_release( image );
+}
+
+/**
+ * Send keep-alive on shared connection if due.
+ */
+static void uplink_sessionKeepalive(uplink_session_t *s, ticks *now)
+{
+	if ( timing_diff( &s->lastKeepalive, now ) < SERVER_UPLINK_KEEPALIVE_INTERVAL )
+		return;
+	s->lastKeepalive = *now;
+	if ( !uplink_sendKeepalive( s->fd ) ) {
+		logadd( LOG_DEBUG1, "Error sending keep-alive on shared connection, panic!\n" );
+		uplink_sessionFailed( s );
 	}
-	return NULL ;
 }
 
+// ############ requests
+
 static void uplink_sendRequests(dnbd3_connection_t *link, bool newOnly)
 {
 	// Scan for new requests
@@ -602,8 +1677,9 @@ static void uplink_sendRequests(dnbd3_connection_t *link, bool newOnly)
 		mutex_unlock( &link->queueLock );
 		if ( hops < 200 ) ++hops;
 		mutex_lock( &link->sendMutex );
-		const bool ret = dnbd3_get_block( link->fd, reqStart, reqSize, reqStart, COND_HOPCOUNT( link->version, hops ) );
+		const bool ret = dnbd3_get_block( link->fd, reqStart, reqSize, reqStart | link->handleBits, COND_HOPCOUNT( link->version, hops ) );
 		mutex_unlock( &link->sendMutex );
+		stats_add( STATS_UPLINK_REQUESTS, 1 );
 		if ( !ret ) {
 			// Non-critical - if the connection dropped or the server was changed
 			// the thread will re-send this request as soon as the connection
@@ -667,7 +1743,7 @@ static void uplink_sendReplicationRequest(dnbd3_connection_t *link)
 		replicationIndex = uplink_findNextIncompleteHashBlock( link, endByte );
 	}
 	if ( replicationIndex == -1 ) {
-		// Replication might be complete, uplink_mainloop should take care....
+		// Replication might be complete, uplink_process should take care....
 		link->nextReplicationIndex = -1;
 		return;
 	}
@@ -675,8 +1751,9 @@ static void uplink_sendReplicationRequest(dnbd3_connection_t *link)
 	link->replicationHandle = offset;
 	const uint32_t size = (uint32_t)MIN( image->virtualFilesize - offset, FILE_BYTES_PER_MAP_BYTE );
 	mutex_lock( &link->sendMutex );
-	bool sendOk = dnbd3_get_block( link->fd, offset, size, link->replicationHandle, COND_HOPCOUNT( link->version, 1 ) );
+	bool sendOk = dnbd3_get_block( link->fd, offset, size, link->replicationHandle | link->handleBits, COND_HOPCOUNT( link->version, 1 ) );
 	mutex_unlock( &link->sendMutex );
+	stats_add( STATS_UPLINK_REQUESTS, 1 );
 	if ( !sendOk ) {
 		logadd( LOG_DEBUG1, "Error sending background replication request to uplink server!\n" );
 		return;
@@ -741,13 +1818,13 @@ static int uplink_findNextIncompleteHashBlock(dnbd3_connection_t *link, const in
 }
 
 /**
- * Receive data from uplink server and process/dispatch
- * Locks on: link.lock, images[].lock
+ * Read reply header from uplink server and let a job receive
+ * and process the payload.
  */
 static void uplink_handleReceive(dnbd3_connection_t *link)
 {
-	dnbd3_reply_t inReply, outReply;
-	int ret, i;
+	dnbd3_reply_t inReply;
+	int ret;
 	for (;;) {
 		ret = dnbd3_read_reply( link->fd, &inReply, false );
 		if ( unlikely( ret == REPLY_INTR ) && likely( !_shutdown && !link->shutdown ) ) continue;
@@ -768,164 +1845,541 @@ static void uplink_handleReceive(dnbd3_connection_t *link)
 			logadd( LOG_WARNING, "Pure evil: Uplink server sent too much payload (%" PRIu32 ") for %s", inReply.size, link->image->path );
 			goto error_cleanup;
 		}
+		if ( inReply.size == 0 && inReply.cmd == CMD_KEEPALIVE )
+			continue;
+		uplink_receive( link->reactor, link, NULL, &inReply );
+		return;
+	}
+	uplink_receiveDone( link );
+	return;
+	// Error handling from failed receive or message parsing
+	error_cleanup: ;
+	uplink_putRecvBuffer( link );
+	uplink_connectionFailed( link, true );
+}
 
-		if ( unlikely( link->recvBufferLen < inReply.size ) ) {
-			link->recvBufferLen = MIN((uint32_t)_maxPayload, inReply.size + 65536);
-			link->recvBuffer = realloc( link->recvBuffer, link->recvBufferLen );
-			if ( link->recvBuffer == NULL ) {
-				logadd( LOG_ERROR, "Out of memory when trying to allocate receive buffer for uplink" );
-				exit( 1 );
-			}
+/**
+ * Let a job receive the payload of reply. Until it's done, the uplink is
+ * busy, or the shared connection s if the reply arrived on one.
+ * @param link uplink the reply is for, NULL to discard the payload
+ */
+static void uplink_receive(uplink_reactor_t *r, dnbd3_connection_t *link, uplink_session_t *s, const dnbd3_reply_t *reply)
+{
+	if ( s != NULL ) {
+		s->busy = true;
+		uplink_sessionWatch( s, false );
+	} else {
+		link->busy = true;
+		uplink_reactorWatchSocket( r, link );
+	}
+	uplink_dispatch( r, &(uplink_job_t){ .type = JOB_RECEIVE, .link = link, .session = s,
+			.fd = s != NULL ? s->fd : link->fd, .reply = *reply } );
+}
+
+/**
+ * Receive payload of reply for uplink from fd, cache it and
+ * send it to all clients waiting for it. Done by a job.
+ * @return false if receiving the payload failed
+ */
+static bool uplink_handleReply(dnbd3_connection_t *link, int fd, const dnbd3_reply_t *reply)
+{
+	const dnbd3_reply_t inReply = *reply;
+	dnbd3_reply_t outReply;
+	int i;
+	if ( link->recvBuffer == NULL ) {
+		uplink_getRecvBuffer( link );
+	}
+	if ( unlikely( link->recvBufferLen < inReply.size ) ) {
+		link->recvBufferLen = MIN((uint32_t)_maxPayload, inReply.size + 65536);
+		link->recvBuffer = realloc( link->recvBuffer, link->recvBufferLen );
+		if ( link->recvBuffer == NULL ) {
+			logadd( LOG_ERROR, "Out of memory when trying to allocate receive buffer for uplink" );
+			exit( 1 );
 		}
-		if ( unlikely( (uint32_t)sock_recv( link->fd, link->recvBuffer, inReply.size ) != inReply.size ) ) {
+	}
+	if ( unlikely( inReply.cmd != CMD_GET_BLOCK ) ) {
+		// Bail out if we're not interested
+		if ( unlikely( (uint32_t)sock_recv( fd, link->recvBuffer, inReply.size ) != inReply.size ) ) {
 			logadd( LOG_INFO, "Lost connection to uplink server of %s (payload)", link->image->path );
-			goto error_cleanup;
+			return false;
 		}
-		// Payload read completely
-		// Bail out if we're not interested
-		if ( unlikely( inReply.cmd != CMD_GET_BLOCK ) ) continue;
-		// Is a legit block reply
-		struct iovec iov[2];
-		const uint64_t start = inReply.handle;
-		const uint64_t end = inReply.handle + inReply.size;
-		totalBytesReceived += inReply.size;
-		link->bytesReceived += inReply.size;
-		// 1) Write to cache file
-		if ( unlikely( link->cacheFd == -1 ) ) {
-			uplink_reopenCacheFd( link, false );
-		}
-		if ( likely( link->cacheFd != -1 ) ) {
-			int err = 0;
-			bool tryAgain = true; // Allow one retry in case we run out of space or the write fd became invalid
-			uint32_t done = 0;
-			ret = 0;
-			while ( done < inReply.size ) {
-				ret = (int)pwrite( link->cacheFd, link->recvBuffer + done, inReply.size - done, start + done );
-				if ( unlikely( ret == -1 ) ) {
-					err = errno;
-					if ( err == EINTR ) continue;
-					if ( err == ENOSPC || err == EDQUOT ) {
-						// try to free 256MiB
-						if ( !tryAgain || !image_ensureDiskSpaceLocked( 256ull * 1024 * 1024, true ) ) break;
-						tryAgain = false;
-						continue; // Success, retry write
-					}
-					if ( err == EBADF || err == EINVAL || err == EIO ) {
-						if ( !tryAgain || !uplink_reopenCacheFd( link, true ) )
-							break;
-						tryAgain = false;
-						continue; // Write handle to image successfully re-opened, try again
-					}
-					logadd( LOG_DEBUG1, "Error trying to cache data for %s:%d -- errno=%d", link->image->name, (int)link->image->rid, err );
-					break;
+		return true;
+	}
+	// Is a legit block reply
+	struct iovec iov[2];
+	const uint64_t start = inReply.handle;
+	const uint64_t end = inReply.handle + inReply.size;
+	// 1) Take clients we can relay the payload to while it's still arriving
+	uplink_stream_t stream[STREAM_MAX_CLIENTS];
+	int numStream = 0;
+	if ( inReply.size >= 2 * SERVER_UPLINK_STREAM_CHUNK ) {
+		numStream = uplink_streamBegin( link, start, end, stream );
+	}
+	// 2) Receive payload, relaying and caching it in chunks if there are any such clients
+	const uint32_t chunk = numStream == 0 ? inReply.size : SERVER_UPLINK_STREAM_CHUNK;
+	uint32_t done = 0, relayed = 0, cached = 0;
+	int intrs = 0;
+	while ( done < inReply.size ) {
+		const ssize_t ret = recv( fd, link->recvBuffer + done, inReply.size - done, MSG_NOSIGNAL );
+		if ( unlikely( ret <= 0 ) ) {
+			if ( ret == -1 && errno == EINTR && ++intrs < 10 ) continue;
+			logadd( LOG_INFO, "Lost connection to uplink server of %s (payload)", link->image->path );
+			// Clients got incomplete replies, but whatever arrived is still fine for the cache
+			uplink_streamEnd( link, stream, numStream, false );
+			if ( cached == relayed ) {
+				cached = uplink_writeCache( link, start, cached, done );
+			}
+			if ( cached > 0 ) {
+				image_updateCachemap( link->image, start, start + cached, true );
+			}
+			return false;
+		}
+		done += (uint32_t)ret;
+		if ( done - relayed < chunk && done < inReply.size )
+			continue;
+		// Cache as long as it's contiguous
+		if ( cached == relayed ) {
+			cached = uplink_writeCache( link, start, cached, done );
+		}
+		uplink_streamRelay( link, start, done, stream, numStream );
+		relayed = done;
+	}
+	stats_add( STATS_BYTES_RECEIVED, inReply.size );
+	link->bytesReceived += inReply.size;
+	bool served = uplink_streamEnd( link, stream, numStream, true );
+	if ( cached < inReply.size ) {
+		cached = uplink_writeCache( link, start, cached, inReply.size );
+	}
+	if ( likely( cached > 0 ) ) {
+		image_updateCachemap( link->image, start, start + cached, true );
+	}
+	// 3) Figure out which other clients are interested in it
+	mutex_lock( &link->queueLock );
+	for (i = 0; i < link->queueLen; ++i) {
+		dnbd3_queued_request_t * const req = &link->queue[i];
+		assert( req->status != ULR_PROCESSING );
+		if ( req->status != ULR_PENDING && req->status != ULR_NEW ) continue;
+		assert( req->client != NULL );
+		if ( req->from >= start && req->to <= end ) { // Match :-)
+			req->status = ULR_PROCESSING;
+		}
+	}
+	// 4) Send to interested clients - iterate backwards so request collaboration works, and
+	// so we can decrease queueLen on the fly while iterating. Should you ever change this to start
+	// from 0, you also need to change the "attach to existing request"-logic in uplink_request()
+	outReply.magic = dnbd3_packet_magic;
+	for ( i = link->queueLen - 1; i >= 0; --i ) {
+		dnbd3_queued_request_t * const req = &link->queue[i];
+		if ( req->status == ULR_PROCESSING ) {
+			size_t bytesSent = 0;
+			assert( req->from >= start && req->to <= end );
+			dnbd3_client_t * const client = req->client;
+			outReply.cmd = CMD_GET_BLOCK;
+			outReply.handle = req->handle;
+			const uint64_t from = req->from;
+			const uint32_t localHead = req->localHead, localTail = req->localTail;
+			outReply.size = (uint32_t)( req->to - req->from ) + localHead + localTail;
+			iov[0].iov_base = &outReply;
+			iov[0].iov_len = sizeof outReply;
+			iov[1].iov_base = link->recvBuffer + (req->from - start);
+			iov[1].iov_len = (size_t)( req->to - req->from );
+			fixup_reply( outReply );
+			// Stays ULR_PROCESSING until we're done with client, see uplink_removeClient()
+			served = true;
+			mutex_unlock( &link->queueLock );
+			net_lockSend( client );
+			if ( client->sock != -1 && localHead == 0 && localTail == 0 ) {
+				ssize_t sent = writev( client->sock, iov, 2 );
+				if ( sent > (ssize_t)sizeof outReply ) {
+					bytesSent = (size_t)sent - sizeof outReply;
 				}
-				if ( unlikely( ret <= 0 || (uint32_t)ret > inReply.size - done ) ) {
-					logadd( LOG_WARNING, "Unexpected return value %d from pwrite to %s:%d", ret, link->image->name, (int)link->image->rid );
-					break;
+			} else if ( client->sock != -1 ) {
+				// Assemble reply from local cache and what we just received
+				if ( sock_sendAll( client->sock, &outReply, sizeof outReply, 1 ) == (ssize_t)sizeof outReply
+						&& uplink_sendLocal( link, client->sock, from - localHead, localHead )
+						&& sock_sendAll( client->sock, iov[1].iov_base, iov[1].iov_len, 1 ) == (ssize_t)iov[1].iov_len
+						&& uplink_sendLocal( link, client->sock, from + iov[1].iov_len, localTail ) ) {
+					bytesSent = iov[1].iov_len + localHead + localTail;
+				} else {
+					shutdown( client->sock, SHUT_RDWR );
 				}
-				done += (uint32_t)ret;
-			}
-			if ( likely( done > 0 ) ) {
-				image_updateCachemap( link->image, start, start + done, true );
 			}
-			if ( unlikely( ret == -1 && ( err == EBADF || err == EINVAL || err == EIO ) ) ) {
-				logadd( LOG_WARNING, "Error writing received data for %s:%d (errno=%d); disabling caching.",
-						link->image->name, (int)link->image->rid, err );
+			mutex_unlock( &client->sendMutex );
+			if ( bytesSent != 0 ) {
+				client->bytesSent += bytesSent;
+				stats_add( STATS_BYTES_SENT, bytesSent );
 			}
+			mutex_lock( &link->queueLock );
+			link->queue[i].status = ULR_FREE;
+			link->queue[i].client = NULL;
+			pthread_cond_broadcast( &link->relayDone );
 		}
-		// 2) Figure out which clients are interested in it
-		mutex_lock( &link->queueLock );
-		for (i = 0; i < link->queueLen; ++i) {
-			dnbd3_queued_request_t * const req = &link->queue[i];
-			assert( req->status != ULR_PROCESSING );
-			if ( req->status != ULR_PENDING && req->status != ULR_NEW ) continue;
-			assert( req->client != NULL );
-			if ( req->from >= start && req->to <= end ) { // Match :-)
-				req->status = ULR_PROCESSING;
+		// Queue might have been reallocated while we didn't hold the lock, so don't use req
+		if ( link->queue[i].status == ULR_FREE && i == link->queueLen - 1 ) link->queueLen--;
+	}
+	mutex_unlock( &link->queueLock );
+#ifdef _DEBUG
+	if ( !served && start != link->replicationHandle ) {
+		logadd( LOG_DEBUG2, "%p, %s -- Unmatched reply: %" PRIu64 " to %" PRIu64, (void*)link, link->image->name, start, end );
+	}
+#endif
+	if ( start == link->replicationHandle ) {
+		// Was our background replication
+		link->replicationHandle = REP_NONE;
+		// Try to remove from fs cache if no client was interested in this data
+		if ( !served && link->cacheFd != -1 ) {
+			posix_fadvise( link->cacheFd, start, inReply.size, POSIX_FADV_DONTNEED );
+		}
+	}
+	if ( served ) {
+		// Was some client -- reset idle counter
+		link->idleTime = 0;
+		// Re-enable replication if disabled
+		if ( link->nextReplicationIndex == -1 ) {
+			link->nextReplicationIndex = (int)( start / FILE_BYTES_PER_MAP_BYTE ) & MAP_INDEX_HASH_START_MASK;
+		}
+	}
+	return true;
+}
+
+/**
+ * Take requests that are satisfied by the reply for [start, end), if their
+ * client isn't busy sending something else. The payload is relayed to them
+ * while it's still arriving. Their sendMutex is only held while sending a
+ * piece; client.streaming keeps others from sending in between, see
+ * net_lockSend(). The requests stay ULR_PROCESSING until uplink_streamEnd(),
+ * so the clients cannot be freed in the meantime.
+ * Locks on: link.queueLock, client.sendMutex
+ * @return number of clients taken
+ */
+static int uplink_streamBegin(dnbd3_connection_t *link, uint64_t start, uint64_t end, uplink_stream_t *stream)
+{
+	int num = 0;
+	mutex_lock( &link->queueLock );
+	for ( int i = link->queueLen - 1; i >= 0 && num < STREAM_MAX_CLIENTS; --i ) {
+		dnbd3_queued_request_t * const req = &link->queue[i];
+		if ( ( req->status == ULR_PENDING || req->status == ULR_NEW ) && req->from >= start && req->to <= end
+				&& mutex_trylock( &req->client->sendMutex ) == 0 ) {
+			if ( req->client->sock == -1 || req->client->streaming ) {
+				mutex_unlock( &req->client->sendMutex );
+				continue;
 			}
+			req->client->streaming = true;
+			mutex_unlock( &req->client->sendMutex );
+			stream[num++] = (uplink_stream_t){ .client = req->client, .index = i, .handle = req->handle, .from = req->from, .to = req->to,
+					.localHead = req->localHead, .localTail = req->localTail };
+			req->status = ULR_PROCESSING;
 		}
-		// 3) Send to interested clients - iterate backwards so request collaboration works, and
-		// so we can decrease queueLen on the fly while iterating. Should you ever change this to start
-		// from 0, you also need to change the "attach to existing request"-logic in uplink_request()
+	}
+	mutex_unlock( &link->queueLock );
+	dnbd3_reply_t outReply;
+	for ( int i = 0; i < num; ++i ) {
+		uplink_stream_t * const s = &stream[i];
 		outReply.magic = dnbd3_packet_magic;
-		bool served = false;
-		for ( i = link->queueLen - 1; i >= 0; --i ) {
-			dnbd3_queued_request_t * const req = &link->queue[i];
-			if ( req->status == ULR_PROCESSING ) {
-				size_t bytesSent = 0;
-				assert( req->from >= start && req->to <= end );
-				dnbd3_client_t * const client = req->client;
-				outReply.cmd = CMD_GET_BLOCK;
-				outReply.handle = req->handle;
-				outReply.size = (uint32_t)( req->to - req->from );
-				iov[0].iov_base = &outReply;
-				iov[0].iov_len = sizeof outReply;
-				iov[1].iov_base = link->recvBuffer + (req->from - start);
-				iov[1].iov_len = outReply.size;
-				fixup_reply( outReply );
-				req->status = ULR_FREE;
-				req->client = NULL;
-				served = true;
-				mutex_lock( &client->sendMutex );
-				mutex_unlock( &link->queueLock );
-				if ( client->sock != -1 ) {
-					ssize_t sent = writev( client->sock, iov, 2 );
-					if ( sent > (ssize_t)sizeof outReply ) {
-						bytesSent = (size_t)sent - sizeof outReply;
-					}
-				}
-				mutex_unlock( &client->sendMutex );
-				if ( bytesSent != 0 ) {
-					client->bytesSent += bytesSent;
+		outReply.cmd = CMD_GET_BLOCK;
+		outReply.handle = s->handle;
+		outReply.size = (uint32_t)( s->to - s->from ) + s->localHead + s->localTail;
+		fixup_reply( outReply );
+		mutex_lock( &s->client->sendMutex );
+		s->failed = s->client->sock == -1
+				|| sock_sendAll( s->client->sock, &outReply, sizeof outReply, 1 ) != (ssize_t)sizeof outReply
+				|| !uplink_sendLocal( link, s->client->sock, s->from - s->localHead, s->localHead );
+		mutex_unlock( &s->client->sendMutex );
+		if ( s->failed ) {
+			uplink_streamFail( s );
+		}
+	}
+	return num;
+}
+
+/**
+ * Send what arrived so far of the reply starting at start to the clients.
+ * @param received number of bytes in receive buffer
+ */
+static void uplink_streamRelay(dnbd3_connection_t *link, uint64_t start, uint32_t received, uplink_stream_t *stream, int num)
+{
+	const uint64_t available = start + received;
+	for ( int i = 0; i < num; ++i ) {
+		uplink_stream_t * const s = &stream[i];
+		const uint64_t pos = s->from + s->sent;
+		if ( s->failed || pos >= MIN( s->to, available ) )
+			continue;
+		const uint32_t len = (uint32_t)( MIN( s->to, available ) - pos );
+		ssize_t ret = -1;
+		mutex_lock( &s->client->sendMutex );
+		if ( s->client->sock != -1 ) {
+			ret = sock_sendAll( s->client->sock, link->recvBuffer + ( pos - start ), len, 1 );
+		}
+		mutex_unlock( &s->client->sendMutex );
+		if ( ret > 0 ) {
+			s->sent += (uint32_t)ret;
+		}
+		if ( ret != (ssize_t)len ) {
+			uplink_streamFail( s );
+		}
+	}
+}
+
+/**
+ * Done relaying, send the parts of the replies that are cached locally,
+ * then let others use the clients' sockets again.
+ * If the reply is incomplete because the uplink failed, the clients
+ * are disconnected, as they already got part of the reply.
+ * @return true if there were any clients
+ */
+static bool uplink_streamEnd(dnbd3_connection_t *link, uplink_stream_t *stream, int num, bool complete)
+{
+	for ( int i = 0; i < num; ++i ) {
+		uplink_stream_t * const s = &stream[i];
+		if ( !complete && !s->failed ) {
+			uplink_streamFail( s );
+		}
+		mutex_lock( &s->client->sendMutex );
+		if ( !s->failed ) {
+			if ( s->client->sock != -1 && uplink_sendLocal( link, s->client->sock, s->to, s->localTail ) ) {
+				s->sent += s->localHead + s->localTail;
+			} else {
+				s->failed = true;
+				if ( s->client->sock != -1 ) {
+					shutdown( s->client->sock, SHUT_RDWR );
 				}
-				mutex_lock( &link->queueLock );
 			}
-			if ( req->status == ULR_FREE && i == link->queueLen - 1 ) link->queueLen--;
 		}
-		mutex_unlock( &link->queueLock );
-#ifdef _DEBUG
-		if ( !served && start != link->replicationHandle ) {
-			logadd( LOG_DEBUG2, "%p, %s -- Unmatched reply: %" PRIu64 " to %" PRIu64, (void*)link, link->image->name, start, end );
+		s->client->streaming = false;
+		pthread_cond_broadcast( &s->client->streamDone );
+		mutex_unlock( &s->client->sendMutex );
+		if ( s->sent != 0 ) {
+			s->client->bytesSent += s->sent;
+			stats_add( STATS_BYTES_SENT, s->sent );
 		}
-#endif
-		if ( start == link->replicationHandle ) {
-			// Was our background replication
-			link->replicationHandle = REP_NONE;
-			// Try to remove from fs cache if no client was interested in this data
-			if ( !served && link->cacheFd != -1 ) {
-				posix_fadvise( link->cacheFd, start, inReply.size, POSIX_FADV_DONTNEED );
+	}
+	if ( num == 0 )
+		return false;
+	// Done with clients, see uplink_removeClient()
+	mutex_lock( &link->queueLock );
+	for ( int i = 0; i < num; ++i ) {
+		link->queue[stream[i].index].status = ULR_FREE;
+		link->queue[stream[i].index].client = NULL;
+	}
+	while ( link->queueLen > 0 && link->queue[link->queueLen - 1].status == ULR_FREE ) {
+		link->queueLen--;
+	}
+	pthread_cond_broadcast( &link->relayDone );
+	mutex_unlock( &link->queueLock );
+	return true;
+}
+
+/**
+ * Client didn't get its reply completely, and there's no way to resume it.
+ * Shut down its connection, so it reconnects and asks again.
+ * Locks on: client.sendMutex
+ */
+static void uplink_streamFail(uplink_stream_t *s)
+{
+	s->failed = true;
+	mutex_lock( &s->client->sendMutex );
+	if ( s->client->sock != -1 ) {
+		shutdown( s->client->sock, SHUT_RDWR );
+	}
+	mutex_unlock( &s->client->sendMutex );
+}
+
+/**
+ * Write part [from, to) of receive buffer to cache file, where the
+ * receive buffer holds the reply starting at start.
+ * @return end of part that was written
+ */
+static uint32_t uplink_writeCache(dnbd3_connection_t *link, uint64_t start, uint32_t from, uint32_t to)
+{
+	if ( unlikely( link->cacheFd == -1 ) ) {
+		uplink_reopenCacheFd( link, false );
+	}
+	if ( unlikely( link->cacheFd == -1 ) )
+		return from;
+	int err = 0, ret = 0;
+	bool tryAgain = true; // Allow one retry in case the write fd became invalid
+	uint32_t done = from;
+	while ( done < to ) {
+		ret = (int)pwrite( link->cacheFd, link->recvBuffer + done, to - done, start + done );
+		if ( unlikely( ret == -1 ) ) {
+			err = errno;
+			if ( err == EINTR ) continue;
+			if ( err == ENOSPC || err == EDQUOT ) {
+				// Freeing an image waits for its uplink, which might share the connection
+				// this job keeps busy, so leave it to housekeeping. What isn't cached now
+				// gets requested again later.
+				image_requestDiskSpace( link->image, 256ull * 1024 * 1024 );
+				break;
 			}
-		}
-		if ( served ) {
-			// Was some client -- reset idle counter
-			link->idleTime = 0;
-			// Re-enable replication if disabled
-			if ( link->nextReplicationIndex == -1 ) {
-				link->nextReplicationIndex = (int)( start / FILE_BYTES_PER_MAP_BYTE ) & MAP_INDEX_HASH_START_MASK;
+			if ( err == EBADF || err == EINVAL || err == EIO ) {
+				if ( !tryAgain || !uplink_reopenCacheFd( link, true ) )
+					break;
+				tryAgain = false;
+				continue; // Write handle to image successfully re-opened, try again
 			}
+			logadd( LOG_DEBUG1, "Error trying to cache data for %s:%d -- errno=%d", link->image->name, (int)link->image->rid, err );
+			break;
+		}
+		if ( unlikely( ret <= 0 || (uint32_t)ret > to - done ) ) {
+			logadd( LOG_WARNING, "Unexpected return value %d from pwrite to %s:%d", ret, link->image->name, (int)link->image->rid );
+			break;
 		}
+		done += (uint32_t)ret;
+	}
+	if ( unlikely( ret == -1 && ( err == EBADF || err == EINVAL || err == EIO ) ) ) {
+		logadd( LOG_WARNING, "Error writing received data for %s:%d (errno=%d); disabling caching.",
+				link->image->name, (int)link->image->rid, err );
 	}
+	return done;
+}
+
+/**
+ * Done receiving for now, give back receive buffer
+ * and continue replication if nothing else is pending.
+ */
+static void uplink_receiveDone(dnbd3_connection_t *link)
+{
+	uplink_putRecvBuffer( link );
 	if ( link->replicationHandle == REP_NONE ) {
 		mutex_lock( &link->queueLock );
 		const bool rep = ( link->queueLen == 0 );
 		mutex_unlock( &link->queueLock );
 		if ( rep ) uplink_sendReplicationRequest( link );
 	}
-	return;
-	// Error handling from failed receive or message parsing
-	error_cleanup: ;
-	uplink_connectionFailed( link, true );
+}
+
+/**
+ * Read and throw away payload of reply nobody is interested in.
+ */
+static bool uplink_discardPayload(int fd, uint32_t size)
+{
+	char buffer[4096];
+	while ( size > 0 ) {
+		const uint32_t chunk = MIN( size, (uint32_t)sizeof(buffer) );
+		if ( sock_recv( fd, buffer, chunk ) != (ssize_t)chunk )
+			return false;
+		size -= chunk;
+	}
+	return true;
+}
+
+/**
+ * Send [from, from + len) of the image to a client, which needs to be
+ * cached locally already.
+ */
+static bool uplink_sendLocal(dnbd3_connection_t *link, int sock, uint64_t from, uint32_t len)
+{
+	if ( len == 0 )
+		return true;
+	const uint32_t bufLen = MIN( len, SERVER_UPLINK_STREAM_CHUNK );
+	char *buffer = malloc( bufLen );
+	if ( buffer == NULL )
+		return false;
+	bool ok = true;
+	while ( ok && len > 0 ) {
+		const uint32_t chunk = MIN( len, bufLen );
+		const ssize_t ret = pread( link->image->readFd, buffer, chunk, (off_t)from );
+		if ( ret == -1 && errno == EINTR )
+			continue;
+		if ( ret == -1 ) {
+			logadd( LOG_DEBUG1, "Cannot read cached part of %s:%d (errno=%d)", link->image->name, (int)link->image->rid, errno );
+			ok = false;
+			break;
+		}
+		// Beyond end of file, which can only be the padding of the last block
+		memset( buffer + ret, 0, chunk - (size_t)ret );
+		ok = sock_sendAll( sock, buffer, chunk, 1 ) == (ssize_t)chunk;
+		from += chunk;
+		len -= chunk;
+	}
+	free( buffer );
+	return ok;
+}
+
+/**
+ * Resize the request queue of given uplink. Must not shrink
+ * below the current queueLen.
+ * Locks on: Caller must hold link.queueLock (or have exclusive access)
+ */
+static bool uplink_resizeQueue(dnbd3_connection_t *link, int capacity)
+{
+	assert( capacity >= link->queueLen );
+	if ( capacity == link->queueCapacity ) return true;
+	dnbd3_queued_request_t *queue = realloc( link->queue, (size_t)capacity * sizeof(*queue) );
+	if ( queue == NULL ) return false;
+	link->queue = queue;
+	link->queueCapacity = capacity;
+	return true;
+}
+
+/**
+ * Take a receive buffer from the pool, preferably the largest one.
+ * Leaves recvBuffer NULL if the pool is empty, it will then be
+ * allocated by the caller.
+ * Locks on: recvPoolLock
+ */
+static void uplink_getRecvBuffer(dnbd3_connection_t *link)
+{
+	int best = -1;
+	mutex_lock( &recvPoolLock );
+	for ( int i = 0; i < SERVER_UPLINK_RECVBUF_POOL; ++i ) {
+		if ( recvPool[i].buffer != NULL && ( best == -1 || recvPool[i].len > recvPool[best].len ) ) {
+			best = i;
+		}
+	}
+	if ( best != -1 ) {
+		link->recvBuffer = recvPool[best].buffer;
+		link->recvBufferLen = recvPool[best].len;
+		recvPool[best].buffer = NULL;
+		recvPool[best].len = 0;
+	}
+	mutex_unlock( &recvPoolLock );
+}
+
+/**
+ * Return this uplink's receive buffer to the pool, or free it
+ * if it is very large or the pool is full.
+ * Locks on: recvPoolLock
+ */
+static void uplink_putRecvBuffer(dnbd3_connection_t *link)
+{
+	if ( link->recvBuffer == NULL ) return;
+	if ( link->recvBufferLen <= SERVER_UPLINK_RECVBUF_KEEP ) {
+		mutex_lock( &recvPoolLock );
+		for ( int i = 0; i < SERVER_UPLINK_RECVBUF_POOL; ++i ) {
+			if ( recvPool[i].buffer == NULL ) {
+				recvPool[i].buffer = link->recvBuffer;
+				recvPool[i].len = link->recvBufferLen;
+				link->recvBuffer = NULL;
+				break;
+			}
+		}
+		mutex_unlock( &recvPoolLock );
+	}
+	free( link->recvBuffer );
+	link->recvBuffer = NULL;
+	link->recvBufferLen = 0;
 }
 
 static void uplink_connectionFailed(dnbd3_connection_t *link, bool findNew)
 {
+	if ( link->session != NULL ) {
+		// Affects all uplinks using it
+		uplink_sessionFailed( link->session );
+		return;
+	}
 	if ( link->fd == -1 )
 		return;
 	altservers_serverFailed( &link->currentServer );
-	mutex_lock( &link->sendMutex );
-	close( link->fd );
-	link->fd = -1;
-	mutex_unlock( &link->sendMutex );
+	uplink_closeConnection( link );
+	uplink_connectionLost( link, findNew );
+}
+
+/**
+ * Connection of uplink is gone, optionally look for a new server.
+ */
+static void uplink_connectionLost(dnbd3_connection_t *link, bool findNew)
+{
 	link->replicationHandle = REP_NONE;
 	if ( _backgroundReplication == BGR_FULL && link->nextReplicationIndex == -1 ) {
 		link->nextReplicationIndex = 0;
@@ -954,16 +2408,18 @@ static int uplink_sendKeepalive(const int fd)
 	return send( fd, &request, sizeof(request), MSG_NOSIGNAL ) == sizeof(request);
 }
 
-static void uplink_addCrc32(dnbd3_connection_t *uplink)
+/**
+ * Get CRC-32 list of image via sock, which must not be used by the reactor yet.
+ * Done by a job.
+ */
+static void uplink_addCrc32(dnbd3_connection_t *uplink, int sock)
 {
 	dnbd3_image_t *image = uplink->image;
 	if ( image == NULL || image->virtualFilesize == 0 ) return;
 	size_t bytes = IMGSIZE_TO_HASHBLOCKS( image->virtualFilesize ) * sizeof(uint32_t);
 	uint32_t masterCrc;
 	uint32_t *buffer = malloc( bytes );
-	mutex_lock( &uplink->sendMutex );
-	bool sendOk = dnbd3_get_crc32( uplink->fd, &masterCrc, buffer, &bytes );
-	mutex_unlock( &uplink->sendMutex );
+	bool sendOk = dnbd3_get_crc32( sock, &masterCrc, buffer, &bytes );
 	if ( !sendOk || bytes == 0 ) {
 		free( buffer );
 		return;
@@ -976,8 +2432,15 @@ static void uplink_addCrc32(dnbd3_connection_t *uplink)
 		free( buffer );
 		return;
 	}
-	uplink->image->masterCrc32 = masterCrc;
-	uplink->image->crc32 = buffer;
+	mutex_lock( &image->lock );
+	if ( image->crc32 != NULL ) {
+		mutex_unlock( &image->lock );
+		free( buffer );
+		return;
+	}
+	image->masterCrc32 = masterCrc;
+	image->crc32 = buffer;
+	mutex_unlock( &image->lock );
 	const size_t len = strlen( uplink->image->path ) + 30;
 	char path[len];
 	snprintf( path, len, "%s.crc", uplink->image->path );
@@ -1008,17 +2471,32 @@ static bool uplink_reopenCacheFd(dnbd3_connection_t *link, const bool force)
 }
 
 /**
- * Saves the cache map of the given image.
+ * Saves the cache map of the given image, after making sure
+ * everything it marks as cached is on disk. Done by a job.
  * Return true on success.
- * Locks on: imageListLock, image.lock
+ * Locks on: image.lock
+ * @param fd image file to fsync, -1 if none
  */
-static bool uplink_saveCacheMap(dnbd3_connection_t *link)
+static bool uplink_saveCacheMap(dnbd3_image_t *image, int fd)
 {
-	dnbd3_image_t *image = link->image;
 	assert( image != NULL );
 
-	if ( link->cacheFd != -1 ) {
-		if ( fsync( link->cacheFd ) == -1 ) {
+	// Lock and get a copy of the cache map, as it could be freed by another thread that is just about to
+	// figure out that this image's cache copy is complete. Get it before syncing, as jobs of the uplink might
+	// still write to the image file, so only what's marked in the map right now is covered by the fsync
+	uint8_t *map = NULL;
+	size_t size = 0;
+	mutex_lock( &image->lock );
+	if ( image->cache_map != NULL && image->virtualFilesize >= DNBD3_BLOCK_SIZE ) {
+		size = IMGSIZE_TO_MAPBYTES(image->virtualFilesize);
+		map = malloc( size );
+		memcpy( map, image->cache_map, size );
+	}
+	// Unlock. Use path without locking, it should never change after initialization of the image
+	mutex_unlock( &image->lock );
+
+	if ( fd != -1 ) {
+		if ( fsync( fd ) == -1 ) {
 			// A failing fsync means we have no guarantee that any data
 			// since the last fsync (or open if none) has been saved. Apart
 			// from keeping the cache_map from the last successful fsync
@@ -1030,28 +2508,15 @@ static bool uplink_saveCacheMap(dnbd3_connection_t *link)
 		}
 	}
 
-	if ( image->cache_map == NULL ) return true;
+	if ( map == NULL ) return true;
 	logadd( LOG_DEBUG2, "Saving cache map of %s:%d", image->name, (int)image->rid );
-	mutex_lock( &image->lock );
-	// Lock and get a copy of the cache map, as it could be freed by another thread that is just about to
-	// figure out that this image's cache copy is complete
-	if ( image->cache_map == NULL || image->virtualFilesize < DNBD3_BLOCK_SIZE ) {
-		mutex_unlock( &image->lock );
-		return true;
-	}
-	const size_t size = IMGSIZE_TO_MAPBYTES(image->virtualFilesize);
-	uint8_t *map = malloc( size );
-	memcpy( map, image->cache_map, size );
-	// Unlock. Use path and cacheFd without locking. path should never change after initialization of the image,
-	// cacheFd is owned by the uplink thread and we don't want to hold a spinlock during I/O
-	mutex_unlock( &image->lock );
 	assert( image->path != NULL );
 	char mapfile[strlen( image->path ) + 4 + 1];
 	strcpy( mapfile, image->path );
 	strcat( mapfile, ".map" );
 
-	int fd = open( mapfile, O_WRONLY | O_CREAT, 0644 );
-	if ( fd == -1 ) {
+	const int mapFd = open( mapfile, O_WRONLY | O_CREAT, 0644 );
+	if ( mapFd == -1 ) {
 		const int err = errno;
 		free( map );
 		logadd( LOG_WARNING, "Could not open file to write cache map to disk (errno=%d) file %s", err, mapfile );
@@ -1060,7 +2525,7 @@ static bool uplink_saveCacheMap(dnbd3_connection_t *link)
 
 	size_t done = 0;
 	while ( done < size ) {
-		const ssize_t ret = write( fd, map, size - done );
+		const ssize_t ret = write( mapFd, map, size - done );
 		if ( ret == -1 ) {
 			if ( errno == EINTR ) continue;
 			logadd( LOG_WARNING, "Could not write cache map (errno=%d) file %s", errno, mapfile );
@@ -1072,10 +2537,10 @@ static bool uplink_saveCacheMap(dnbd3_connection_t *link)
 		}
 		done += (size_t)ret;
 	}
-	if ( fsync( fd ) == -1 ) {
+	if ( fsync( mapFd ) == -1 ) {
 		logadd( LOG_WARNING, "fsync() on image map %s failed with errno %d", mapfile, errno );
 	}
-	close( fd );
+	close( mapFd );
 	free( map );
 	return true;
 }
@@ -6,13 +6,16 @@
 
 void uplink_globalsInit();
 
-uint64_t uplink_getTotalBytesReceived();
+void uplink_globalsShutdown();
+
+uint64_t uplink_getRecvPoolBytes();
 
 bool uplink_init(dnbd3_image_t *image, int sock, dnbd3_host_t *host, int version);
 
 void uplink_removeClient(dnbd3_connection_t *uplink, dnbd3_client_t *client);
 
-bool uplink_request(dnbd3_client_t *client, uint64_t handle, uint64_t start, uint32_t length, uint8_t hopCount);
+bool uplink_request(dnbd3_client_t *client, dnbd3_image_t *image, uint64_t handle, uint64_t start, uint32_t length,
+		uint32_t localHead, uint32_t localTail, uint8_t hopCount);
 
 void uplink_shutdown(dnbd3_image_t *image);
 
@@ -0,0 +1,350 @@
+#include "warmup.h"
+
+#include "helper.h"
+#include "locks.h"
+#include "../shared/fdsignal.h"
+#include "../shared/timing.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#define HEAT_MAGIC (0x74616568) // "heat"
+
+typedef struct
+{
+	uint32_t magic;
+	uint32_t blocks;
+} heat_header_t;
+
+typedef struct
+{
+	dnbd3_image_t *image;
+	int block;
+	uint16_t heat;
+} heat_entry_t;
+
+typedef struct
+{
+	dnbd3_image_t *image;
+	void *addr;
+	size_t len;
+} pinned_t;
+
+static pthread_t thread;
+static bool haveThread = false;
+static dnbd3_signal_t *runSignal = NULL;
+static pthread_mutex_t pinLock;
+// Protected by pinLock
+static pinned_t *pinned = NULL;
+static int pinnedCount = 0;
+static atomic_uint_fast64_t pinnedBytes = 0;
+
+static void* warmup_main(void *data);
+static void warmAll();
+static void saveAll(bool decay);
+static void saveHeat(dnbd3_image_t *image);
+static bool pinBlock(dnbd3_image_t *image, int block, uint64_t len);
+static int cmpHeat(const void *a, const void *b);
+static uint64_t blockBytes(const dnbd3_image_t *image, int block);
+
+static inline bool isEnabled()
+{
+	return _warmupSize != 0 || _warmupLockSize != 0;
+}
+
+void warmup_init()
+{
+	if ( !isEnabled() )
+		return;
+	mutex_init( &pinLock );
+	runSignal = signal_newBlocking();
+	if ( runSignal == NULL ) {
+		logadd( LOG_WARNING, "Could not create signal for warmup thread" );
+		return;
+	}
+	pthread_attr_t attrs;
+	initThreadAttrs( &attrs, false );
+	haveThread = ( 0 == thread_create( &thread, &attrs, &warmup_main, (void *)NULL ) );
+	if ( !haveThread ) {
+		logadd( LOG_WARNING, "Could not start warmup thread" );
+	}
+	pthread_attr_destroy( &attrs );
+}
+
+void warmup_shutdown()
+{
+	if ( !haveThread )
+		return;
+	logadd( LOG_DEBUG1, "Shutting down warmup thread...\n" );
+	signal_call( runSignal );
+	thread_join( thread, NULL );
+	haveThread = false;
+	logadd( LOG_DEBUG1, "Warmup thread exited normally.\n" );
+}
+
+void warmup_imageOpen(dnbd3_image_t *image)
+{
+	if ( !isEnabled() || image->realFilesize == 0 )
+		return;
+	const int blocks = IMGSIZE_TO_HASHBLOCKS( image->realFilesize );
+	image->heat = calloc( (size_t)blocks, sizeof(*image->heat) );
+	if ( image->heat == NULL )
+		return;
+	char path[strlen( image->path ) + 6];
+	snprintf( path, sizeof(path), "%s.heat", image->path );
+	const int fd = open( path, O_RDONLY );
+	if ( fd == -1 )
+		return;
+	heat_header_t header;
+	uint16_t *data = malloc( (size_t)blocks * sizeof(uint16_t) );
+	const ssize_t len = (ssize_t)( (size_t)blocks * sizeof(uint16_t) );
+	if ( data != NULL && read( fd, &header, sizeof(header) ) == sizeof(header)
+			&& header.magic == HEAT_MAGIC && header.blocks == (uint32_t)blocks
+			&& read( fd, data, (size_t)len ) == len ) {
+		for ( int i = 0; i < blocks; ++i ) {
+			image->heat[i] = MIN( data[i], WARMUP_HEAT_MAX );
+		}
+	}
+	free( data );
+	close( fd );
+}
+
+void warmup_imageClose(dnbd3_image_t *image)
+{
+	if ( image->heat == NULL )
+		return;
+	mutex_lock( &pinLock );
+	for ( int i = pinnedCount - 1; i >= 0; --i ) {
+		if ( pinned[i].image != image )
+			continue;
+		munmap( pinned[i].addr, pinned[i].len );
+		pinnedBytes -= pinned[i].len;
+		pinned[i] = pinned[--pinnedCount];
+	}
+	mutex_unlock( &pinLock );
+	saveHeat( image );
+	free( (void*)image->heat );
+	image->heat = NULL;
+}
+
+uint64_t warmup_getLockedBytes()
+{
+	return pinnedBytes;
+}
+
+static void* warmup_main(void *data UNUSED)
+{
+	setThreadName( "warmup" );
+	blockNoncriticalSignals();
+	warmAll();
+	ticks nextDecay;
+	timing_gets( &nextDecay, SERVER_HEAT_DECAY_INTERVAL );
+	while ( !_shutdown ) {
+		signal_wait( runSignal, SERVER_HEAT_SAVE_INTERVAL * 1000 );
+		if ( _shutdown )
+			break;
+		declare_now;
+		const bool decay = timing_reached( &nextDecay, &now );
+		if ( decay ) {
+			timing_gets( &nextDecay, SERVER_HEAT_DECAY_INTERVAL );
+		}
+		saveAll( decay );
+	}
+	return NULL;
+}
+
+/**
+ * Read hottest blocks of all images into page cache, and
+ * lock the top ones in memory, according to configured budgets.
+ */
+static void warmAll()
+{
+	int imageCount;
+	dnbd3_image_t **images = image_getAllReferenced( &imageCount );
+	if ( images == NULL )
+		return;
+	int total = 0;
+	for ( int i = 0; i < imageCount; ++i ) {
+		if ( images[i]->heat != NULL ) {
+			total += IMGSIZE_TO_HASHBLOCKS( images[i]->realFilesize );
+		}
+	}
+	heat_entry_t *entries = malloc( (size_t)MAX( total, 1 ) * sizeof(*entries) );
+	int count = 0;
+	for ( int i = 0; i < imageCount && entries != NULL; ++i ) {
+		dnbd3_image_t * const image = images[i];
+		if ( image->heat == NULL )
+			continue;
+		const int blocks = IMGSIZE_TO_HASHBLOCKS( image->realFilesize );
+		for ( int b = 0; b < blocks; ++b ) {
+			const uint16_t heat = (uint16_t)atomic_load_explicit( &image->heat[b], memory_order_relaxed );
+			if ( heat == 0 )
+				continue;
+			entries[count].image = image;
+			entries[count].block = b;
+			entries[count].heat = heat;
+			count++;
+		}
+	}
+	if ( count > 0 ) {
+		qsort( entries, (size_t)count, sizeof(*entries), &cmpHeat );
+	}
+	uint64_t warmed = 0, lockBudget = _warmupLockSize, warmBudget = _warmupSize;
+	int warmedBlocks = 0;
+	declare_now;
+	ticks start = now;
+	for ( int i = 0; i < count && !_shutdown; ++i ) {
+		dnbd3_image_t * const image = entries[i].image;
+		const uint64_t len = blockBytes( image, entries[i].block );
+		if ( len > lockBudget && len > warmBudget )
+			break;
+		mutex_lock( &image->lock );
+		const bool complete = image_isHashBlockComplete( image->cache_map, (uint64_t)entries[i].block, image->realFilesize );
+		mutex_unlock( &image->lock );
+		if ( !complete || !image_ensureOpen( image ) )
+			continue;
+		if ( len <= lockBudget ) {
+			if ( pinBlock( image, entries[i].block, len ) ) {
+				lockBudget -= len;
+				warmed += len;
+				warmedBlocks++;
+				continue;
+			}
+			// Don't try again if the limit was reached
+			lockBudget = 0;
+		}
+		if ( len <= warmBudget ) {
+			const off_t offset = (off_t)entries[i].block * HASH_BLOCK_SIZE;
+			if ( posix_fadvise( image->readFd, offset, (off_t)len, POSIX_FADV_WILLNEED ) == 0 ) {
+				warmBudget -= len;
+				warmed += len;
+				warmedBlocks++;
+			}
+		}
+	}
+	timing_get( &now );
+	if ( warmedBlocks != 0 ) {
+		logadd( LOG_INFO, "Warmup: Requested %" PRIu64 " MiB in %d blocks, %" PRIu64 " MiB pinned, took %ds",
+				warmed / ( 1024 * 1024 ), warmedBlocks, (uint64_t)pinnedBytes / ( 1024 * 1024 ),
+				(int)timing_diff( &start, &now ) );
+	}
+	free( entries );
+	for ( int i = 0; i < imageCount; ++i ) {
+		image_release( images[i] );
+	}
+	free( images );
+}
+
+/**
+ * mmap given block and lock it in memory, which also reads it from disk.
+ */
+static bool pinBlock(dnbd3_image_t *image, int block, uint64_t len)
+{
+	void *addr = mmap( NULL, (size_t)len, PROT_READ, MAP_SHARED, image->readFd, (off_t)block * HASH_BLOCK_SIZE );
+	if ( addr == MAP_FAILED ) {
+		logadd( LOG_WARNING, "Warmup: Cannot mmap block %d of %s (errno=%d)", block, image->path, errno );
+		return false;
+	}
+	if ( mlock( addr, (size_t)len ) != 0 ) {
+		const int err = errno;
+		munmap( addr, (size_t)len );
+		logadd( LOG_WARNING, "Warmup: Cannot lock more than %" PRIu64 " MiB in memory (errno=%d), check RLIMIT_MEMLOCK",
+				(uint64_t)pinnedBytes / ( 1024 * 1024 ), err );
+		return false;
+	}
+	mutex_lock( &pinLock );
+	pinned_t *tmp = realloc( pinned, (size_t)( pinnedCount + 1 ) * sizeof(*pinned) );
+	if ( tmp == NULL ) {
+		mutex_unlock( &pinLock );
+		munmap( addr, (size_t)len );
+		return false;
+	}
+	pinned = tmp;
+	pinned[pinnedCount].image = image;
+	pinned[pinnedCount].addr = addr;
+	pinned[pinnedCount].len = (size_t)len;
+	pinnedCount++;
+	pinnedBytes += len;
+	mutex_unlock( &pinLock );
+	return true;
+}
+
+/**
+ * Write heat data of all images to disk.
+ * @param decay halve all counters afterwards, so old access patterns fade out
+ */
+static void saveAll(bool decay)
+{
+	int imageCount;
+	dnbd3_image_t **images = image_getAllReferenced( &imageCount );
+	if ( images == NULL )
+		return;
+	for ( int i = 0; i < imageCount; ++i ) {
+		dnbd3_image_t * const image = images[i];
+		if ( image->heat != NULL ) {
+			saveHeat( image );
+			if ( decay ) {
+				const int blocks = IMGSIZE_TO_HASHBLOCKS( image->realFilesize );
+				for ( int b = 0; b < blocks; ++b ) {
+					// Subtract instead of store, so concurrent increments don't get lost
+					const uint16_t heat = (uint16_t)atomic_load_explicit( &image->heat[b], memory_order_relaxed );
+					atomic_fetch_sub_explicit( &image->heat[b], (uint16_t)( heat - heat / 2 ), memory_order_relaxed );
+				}
+			}
+		}
+		image_release( image );
+	}
+	free( images );
+}
+
+static void saveHeat(dnbd3_image_t *image)
+{
+	const int blocks = IMGSIZE_TO_HASHBLOCKS( image->realFilesize );
+	const size_t size = sizeof(heat_header_t) + (size_t)blocks * sizeof(uint16_t);
+	uint8_t *data = malloc( size );
+	if ( data == NULL )
+		return;
+	heat_header_t * const header = (heat_header_t*)data;
+	uint16_t * const counters = (uint16_t*)( data + sizeof(*header) );
+	header->magic = HEAT_MAGIC;
+	header->blocks = (uint32_t)blocks;
+	bool any = false;
+	for ( int i = 0; i < blocks; ++i ) {
+		counters[i] = (uint16_t)atomic_load_explicit( &image->heat[i], memory_order_relaxed );
+		any = any || counters[i] != 0;
+	}
+	char path[strlen( image->path ) + 6];
+	snprintf( path, sizeof(path), "%s.heat", image->path );
+	if ( !any ) {
+		unlink( path );
+		free( data );
+		return;
+	}
+	const int fd = open( path, O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+	if ( fd == -1 ) {
+		logadd( LOG_DEBUG1, "Cannot write %s (errno=%d)", path, errno );
+	} else {
+		if ( write( fd, data, size ) != (ssize_t)size ) {
+			logadd( LOG_DEBUG1, "Cannot write %s (errno=%d)", path, errno );
+		}
+		close( fd );
+	}
+	free( data );
+}
+
+static int cmpHeat(const void *a, const void *b)
+{
+	const heat_entry_t *x = a, *y = b;
+	return (int)y->heat - (int)x->heat;
+}
+
+static uint64_t blockBytes(const dnbd3_image_t *image, int block)
+{
+	return MIN( (uint64_t)HASH_BLOCK_SIZE, image->realFilesize - (uint64_t)block * HASH_BLOCK_SIZE );
+}
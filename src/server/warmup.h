@@ -0,0 +1,50 @@
+#ifndef _WARMUP_H_
+#define _WARMUP_H_
+
+#include "image.h"
+
+/*
+ * Record how often each hash block of an image gets visited by clients,
+ * and use that data after a restart to pull the hottest blocks into the
+ * page cache, optionally pinning the very hottest ones in memory.
+ */
+
+#define WARMUP_HEAT_MAX (65000)
+
+/**
+ * Start warming thread. Call once the image list has been loaded.
+ */
+void warmup_init();
+
+void warmup_shutdown();
+
+/**
+ * Allocate heat counters for image, loading
+ * previously recorded data if available.
+ */
+void warmup_imageOpen(dnbd3_image_t *image);
+
+/**
+ * Save heat counters, unpin any locked regions, free everything.
+ */
+void warmup_imageClose(dnbd3_image_t *image);
+
+/**
+ * A client started reading from the given hash block.
+ */
+static inline void warmup_countAccess(dnbd3_image_t *image, int block)
+{
+	if ( image->heat == NULL || block >= IMGSIZE_TO_HASHBLOCKS( image->realFilesize ) )
+		return;
+	// Leave some headroom for concurrent increments instead of using CAS
+	if ( atomic_load_explicit( &image->heat[block], memory_order_relaxed ) < WARMUP_HEAT_MAX ) {
+		atomic_fetch_add_explicit( &image->heat[block], 1, memory_order_relaxed );
+	}
+}
+
+/**
+ * Number of bytes currently pinned in memory.
+ */
+uint64_t warmup_getLockedBytes();
+
+#endif
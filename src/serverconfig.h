@@ -5,17 +5,36 @@
 
 // +++++ Performance/memory related
 #define SERVER_MAX_CLIENTS 4000
+#define SERVER_CLIENT_LIST_SHARDS 16 // Client list is split into this many independently locked parts
 #define SERVER_MAX_IMAGES  5000
 #define SERVER_MAX_ALTS    100
+#define CACHE_LINE_SIZE 64 // Used to separate frequently written struct members from read-mostly ones
+#define SERVER_THREAD_STACK_MIN (64 * 1024) // Lower bound for configurable thread stack size
+#define SERVER_THREAD_GUARD_SIZE (64 * 1024) // Guard area below each thread's stack; larger than any single stack frame we use
+#define SERVER_THREADS_RESERVED 16 // Threads the pool keeps for the server's own jobs (uplinks, seeding) on top of maxThreads
 // +++++ Uplink handling (proxy mode)
 #define SERVER_UPLINK_FAIL_INCREASE 5 // On server failure, increase numFails by this value
 #define SERVER_BAD_UPLINK_THRES  40 // Thresold for numFails at which we ignore a server for the time span below
 #define SERVER_BAD_UPLINK_IGNORE 180 // How many seconds is a server ignored
 #define SERVER_MAX_UPLINK_QUEUE  1500 // Maximum number of queued requests per uplink
+#define SERVER_UPLINK_QUEUE_INIT   16 // Initial size of uplink request queue; grows on demand, shrinks when idle
+#define SERVER_UPLINK_RECVBUF_POOL  8 // Number of idle receive buffers kept around for reuse by any uplink
+#define SERVER_UPLINK_RECVBUF_KEEP (2 * 1024 * 1024) // Don't keep larger receive buffers in pool
 #define SERVER_UPLINK_QUEUELEN_THRES  900 // Threshold where we start dropping incoming clients
+#define SERVER_UPLINK_REACTORS  4 // Number of threads handling the connections of all uplinks
+#define SERVER_UPLINK_STREAM_CHUNK (64 * 1024) // Relay larger replies from uplink server to clients in chunks of this size while they arrive
+#define SERVER_UPLINK_SESSION_IMAGES 64 // Max. number of images sharing one connection to another server (at most 256)
 #define SERVER_MAX_PENDING_ALT_CHECKS 500 // Length of queue for pending alt checks requested by uplinks
 
 #define SERVER_CACHE_MAP_SAVE_INTERVAL 90
+#define SERVER_SSDCACHE_QUEUE 100 // Max number of hash blocks waiting to be copied to the SSD cache
+#define SERVER_HEAT_SAVE_INTERVAL 3600 // Write per image access statistics for warmup to disk this often
+#define SERVER_HEAT_DECAY_INTERVAL 86400 // Halve access statistics this often so old patterns fade out
+#define SERVER_BUFCACHE_CHUNK (256 * 1024) // Unit of the direct I/O buffer cache; multiple of the page size
+#define SERVER_READAHEAD_MIN (256 * 1024) // Initial readahead window once a client is detected as reading sequentially
+#define SERVER_PREFETCH_REQUESTS 32 // Max. number of pipelined requests per client whose data is read in the background
+#define SERVER_DEDUP_RESCAN_INTERVAL 600 // Look for complete images without block index this often
+#define SERVER_SSDCACHE_MIN_FREE (1024ll * 1024 * 1024) // Stop copying blocks to SSD if free space drops below this
 
 // Time in ms to wait for a read/write call to complete on an uplink connection
 #define SOCKET_TIMEOUT_UPLINK 5000
@@ -51,6 +70,8 @@
 
 // How many seconds have to pass after the last client disconnected until the imagefd is closed
 #define UNUSED_FD_TIMEOUT 3600
+// Same for freeing the CRC-32 list
+#define UNUSED_CRC_TIMEOUT 1800
 
 #endif
 
@@ -19,6 +19,7 @@
  */
 
 #include "log.h"
+#include "fdsignal.h"
 #include <stdarg.h>
 #include <pthread.h>
 #include <stdlib.h>
@@ -27,8 +28,35 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <time.h>
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
 
 #define LINE_LEN (800)
+// Number of slots in async ring buffer, must be a power of two
+#define ASYNC_SLOTS (512)
+// Size of buffer the writer thread collects file output in
+#define ASYNC_BATCH_BYTES (64 * 1024)
+#define ASYNC_STACK_SIZE (64 * 1024)
+
+/**
+ * One pending log line. seq is used as in Dmitry Vyukov's bounded
+ * queue: A slot is free for position p if seq == p, and holds
+ * a record for the reader if seq == p + 1.
+ */
+typedef struct {
+	atomic_size_t seq;
+	logmask_t mask;
+	uint16_t len;
+	uint16_t stdoutOffset;
+	bool toFile, toStdout;
+	char text[LINE_LEN];
+} logslot_t;
 
 static pthread_mutex_t logLock = PTHREAD_MUTEX_INITIALIZER;
 static _Atomic logmask_t maskFile = 31;
@@ -39,9 +67,37 @@ static int logFd = -1;
 
 static bool consoleTimestamps = false;
 
+// Async mode, see log_startAsync()
+static logslot_t *ring = NULL;
+static _Atomic(bool) asyncActive = false;
+static atomic_size_t enqueuePos;
+static size_t dequeuePos; // Only touched by writer thread
+static _Atomic(bool) writerSleeping = false;
+static atomic_int writerStop = 0; // 1 = stop requested, 2 = final pass
+static dnbd3_signal_t *writerSignal = NULL;
+static pthread_t writerThread;
+static atomic_uint_fast64_t droppedLines = 0;
+// Everything enqueued before this position has been written out, see waitFlushed()
+static pthread_mutex_t flushLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flushCond = PTHREAD_COND_INITIALIZER;
+static size_t flushedPos = 0;
+static bool writerDone = false;
+
 
 static int writeLevel(char *buffer, logmask_t level);
 
+static bool enqueueLine(logmask_t mask, const char *buffer, size_t len, size_t stdoutOffset, bool toFile, bool toStdout, size_t *position);
+
+static void waitFlushed(size_t position);
+
+static void setFlushed(size_t position, bool done);
+
+static void writeToFile(const char *buffer, size_t len);
+
+static void writeToConsole(const char *line, bool flush);
+
+static void *writerMain(void *unused);
+
 
 bool log_hasMask(const logmask_t mask)
 {
@@ -118,32 +174,280 @@ void logadd(const logmask_t mask, const char *fmt, ...)
 		buffer[offset++] = '\n';
 		buffer[offset] = '\0';
 	}
-	if ( toFile ) {
-		pthread_mutex_lock( &logLock );
-		if ( logFd >= 0 ) {
-			size_t done = 0;
-			while (done < offset ) {
-				const ssize_t wr = write( logFd, buffer + done, offset - done );
-				if ( wr < 0 ) {
-					if ( errno == EINTR ) continue;
-					printf( "Logging to file failed! (errno=%d)\n", errno );
-					break;
-				}
-				done += (size_t)wr;
+	if ( consoleTimestamps ) stdoutLine = buffer;
+	if ( atomic_load_explicit( &asyncActive, memory_order_acquire ) ) {
+		size_t pos;
+		if ( enqueueLine( mask, buffer, offset, (size_t)( stdoutLine - buffer ), toFile, toStdout, &pos ) ) {
+			// Errors might be followed by exit() or a crash, so wait until the
+			// writer got this far. Queueing them keeps the log in order.
+			if ( mask == LOG_ERROR ) {
+				waitFlushed( pos );
 			}
+			return;
+		}
+		if ( mask != LOG_ERROR ) {
+			atomic_fetch_add_explicit( &droppedLines, 1, memory_order_relaxed );
+			return;
 		}
-		pthread_mutex_unlock( &logLock );
+		// Never drop errors; write directly, even if that means out of order
+	}
+	if ( toFile ) {
+		writeToFile( buffer, offset );
 	}
 	if ( toStdout ) {
-		if ( consoleTimestamps ) stdoutLine = buffer;
+		writeToConsole( stdoutLine, true );
+	}
+}
+
+bool log_startAsync()
+{
+	if ( ring != NULL )
+		return true;
+	ring = malloc( sizeof(*ring) * ASYNC_SLOTS );
+	if ( ring == NULL )
+		return false;
+	for ( size_t i = 0; i < ASYNC_SLOTS; ++i ) {
+		atomic_init( &ring[i].seq, i );
+	}
+	atomic_init( &enqueuePos, 0 );
+	dequeuePos = 0;
+	flushedPos = 0;
+	writerDone = false;
+	writerStop = 0;
+	writerSignal = signal_newBlocking();
+	if ( writerSignal == NULL )
+		goto fail;
+	pthread_attr_t attr;
+	pthread_attr_init( &attr );
+	pthread_attr_setstacksize( &attr, ASYNC_STACK_SIZE );
+	const int ret = pthread_create( &writerThread, &attr, &writerMain, NULL );
+	pthread_attr_destroy( &attr );
+	if ( ret != 0 )
+		goto fail;
+	atomic_store_explicit( &asyncActive, true, memory_order_release );
+	atexit( &log_stopAsync );
+	return true;
+fail:
+	if ( writerSignal != NULL ) {
+		signal_close( writerSignal );
+		writerSignal = NULL;
+	}
+	free( ring );
+	ring = NULL;
+	return false;
+}
+
+void log_stopAsync()
+{
+	if ( !atomic_exchange( &asyncActive, false ) )
+		return;
+	// From here on, new lines are written synchronously again; the writer
+	// flushes whatever is still queued, then exits.
+	writerStop = 1;
+	signal_call( writerSignal );
+	pthread_join( writerThread, NULL );
+	signal_close( writerSignal );
+	writerSignal = NULL;
+	// Keep ring allocated - a producer that checked asyncActive right
+	// before we cleared it might still be writing to a slot.
+}
+
+uint64_t log_getDroppedCount()
+{
+	return atomic_load_explicit( &droppedLines, memory_order_relaxed );
+}
+
+/**
+ * Put formatted line into ring buffer. Lock-free, safe to call
+ * from any number of threads concurrently.
+ * Returns false if the ring buffer is full, otherwise the
+ * line's position in the queue is stored in *position.
+ */
+static bool enqueueLine(logmask_t mask, const char *buffer, size_t len, size_t stdoutOffset, bool toFile, bool toStdout, size_t *position)
+{
+	logslot_t *slot;
+	size_t pos = atomic_load_explicit( &enqueuePos, memory_order_relaxed );
+	for ( ;; ) {
+		slot = &ring[pos & ( ASYNC_SLOTS - 1 )];
+		const size_t seq = atomic_load_explicit( &slot->seq, memory_order_acquire );
+		const intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+		if ( diff == 0 ) {
+			if ( atomic_compare_exchange_weak_explicit( &enqueuePos, &pos, pos + 1,
+						memory_order_relaxed, memory_order_relaxed ) )
+				break;
+		} else if ( diff < 0 ) {
+			return false; // Full
+		} else {
+			pos = atomic_load_explicit( &enqueuePos, memory_order_relaxed );
+		}
+	}
+	slot->mask = mask;
+	slot->len = (uint16_t)len;
+	slot->stdoutOffset = (uint16_t)stdoutOffset;
+	slot->toFile = toFile;
+	slot->toStdout = toStdout;
+	memcpy( slot->text, buffer, len + 1 );
+	atomic_store_explicit( &slot->seq, pos + 1, memory_order_release );
+	*position = pos;
+	// Only pay for the syscall if the writer is actually waiting
+	if ( atomic_load( &writerSleeping ) && atomic_exchange( &writerSleeping, false ) ) {
+		signal_call( writerSignal );
+	}
+	return true;
+}
+
+/**
+ * Block until the writer thread wrote out the line at given queue
+ * position, or exited.
+ */
+static void waitFlushed(size_t position)
+{
+	pthread_mutex_lock( &flushLock );
+	while ( !writerDone && (intptr_t)( flushedPos - position ) <= 0 ) {
+		// Timed, as a line might have been queued just after the writer's final pass
+		struct timespec ts;
+		clock_gettime( CLOCK_REALTIME, &ts );
+		ts.tv_nsec += 100 * 1000 * 1000;
+		if ( ts.tv_nsec >= 1000 * 1000 * 1000 ) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000 * 1000 * 1000;
+		}
+		pthread_cond_timedwait( &flushCond, &flushLock, &ts );
+	}
+	pthread_mutex_unlock( &flushLock );
+}
+
+static void setFlushed(size_t position, bool done)
+{
+	pthread_mutex_lock( &flushLock );
+	flushedPos = position;
+	writerDone = done;
+	pthread_cond_broadcast( &flushCond );
+	pthread_mutex_unlock( &flushLock );
+}
+
+static void writeToFile(const char *buffer, size_t len)
+{
+	pthread_mutex_lock( &logLock );
+	if ( logFd >= 0 ) {
+		size_t done = 0;
+		while ( done < len ) {
+			const ssize_t wr = write( logFd, buffer + done, len - done );
+			if ( wr < 0 ) {
+				if ( errno == EINTR ) continue;
+				printf( "Logging to file failed! (errno=%d)\n", errno );
+				break;
+			}
+			done += (size_t)wr;
+		}
+	}
+	pthread_mutex_unlock( &logLock );
+}
+
+static void writeToConsole(const char *line, bool flush)
+{
+#ifdef AFL_MODE
+	fputs( line, stderr );
+	if ( flush ) fflush( stderr );
+#else
+	fputs( line, stdout );
+	if ( flush ) fflush( stdout );
+#endif
+}
+
+/**
+ * Writer thread for async mode. Drains the ring buffer, collecting
+ * everything destined for the log file in one buffer so it can be
+ * written with a single syscall, and flushes stdout once per batch.
+ */
+static void *writerMain(void *unused __attribute__ ((unused)))
+{
+	sigset_t sigmask;
+	sigfillset( &sigmask );
+	pthread_sigmask( SIG_BLOCK, &sigmask, NULL );
+#ifdef __linux__
+	prctl( PR_SET_NAME, (unsigned long)"[log]", 0, 0, 0 );
+#endif
+	char *batch = malloc( ASYNC_BATCH_BYTES );
+	uint64_t reportedDrops = 0;
+	for ( ;; ) {
+		size_t batchLen = 0;
+		bool consoleUsed = false;
+		const size_t batchStart = dequeuePos;
+		for ( ;; ) {
+			logslot_t *slot = &ring[dequeuePos & ( ASYNC_SLOTS - 1 )];
+			if ( atomic_load_explicit( &slot->seq, memory_order_acquire ) != dequeuePos + 1 )
+				break; // Empty
+			if ( slot->toFile ) {
+				if ( batch == NULL || batchLen + slot->len > ASYNC_BATCH_BYTES ) {
+					writeToFile( batch, batchLen );
+					batchLen = 0;
+				}
+				if ( batch == NULL ) {
+					writeToFile( slot->text, slot->len );
+				} else {
+					memcpy( batch + batchLen, slot->text, slot->len );
+					batchLen += slot->len;
+				}
+			}
+			if ( slot->toStdout ) {
+				writeToConsole( slot->text + slot->stdoutOffset, false );
+				consoleUsed = true;
+			}
+			atomic_store_explicit( &slot->seq, dequeuePos + ASYNC_SLOTS, memory_order_release );
+			dequeuePos++;
+		}
+		if ( batchLen != 0 ) {
+			writeToFile( batch, batchLen );
+		}
+		if ( consoleUsed ) {
 #ifdef AFL_MODE
-		fputs( stdoutLine, stderr );
-		fflush( stderr );
+			fflush( stderr );
 #else
-		fputs( stdoutLine, stdout );
-		fflush( stdout );
+			fflush( stdout );
 #endif
+		}
+		if ( dequeuePos != batchStart ) {
+			setFlushed( dequeuePos, false );
+		}
+		const uint64_t drops = atomic_load_explicit( &droppedLines, memory_order_relaxed );
+		if ( drops != reportedDrops ) {
+			// Synchronous path, so this can't be dropped itself
+			char msg[120];
+			time_t rawtime;
+			struct tm timeinfo;
+			time( &rawtime );
+			localtime_r( &rawtime, &timeinfo );
+			size_t len = strftime( msg, sizeof(msg), "[%d.%m. %H:%M:%S] ", &timeinfo );
+			const size_t levelOffset = len;
+			len += writeLevel( msg + len, LOG_WARNING );
+			snprintf( msg + len, sizeof(msg) - len, "Log buffer full, dropped %" PRIu64 " lines\n", drops - reportedDrops );
+			reportedDrops = drops;
+			if ( maskFile & LOG_WARNING ) writeToFile( msg, strlen( msg ) );
+			if ( maskCon & LOG_WARNING ) writeToConsole( consoleTimestamps ? msg : msg + levelOffset, true );
+		}
+		if ( writerStop ) {
+			// asyncActive is already false, only lines that were in flight can still
+			// appear; do one more pass after a moment to catch those.
+			if ( writerStop == 1 ) {
+				writerStop = 2;
+				usleep( 1000 );
+				continue;
+			}
+			break;
+		}
+		// Announce that we're going to sleep, then re-check the queue, so we
+		// can't miss a line that was added in between
+		atomic_store( &writerSleeping, true );
+		logslot_t *slot = &ring[dequeuePos & ( ASYNC_SLOTS - 1 )];
+		if ( atomic_load_explicit( &slot->seq, memory_order_acquire ) != dequeuePos + 1 && !writerStop ) {
+			signal_wait( writerSignal, 1000 );
+		}
+		atomic_store( &writerSleeping, false );
 	}
+	setFlushed( dequeuePos, true );
+	free( batch );
+	return NULL;
 }
 
 ssize_t log_fetch(char *buffer, int size)
@@ -23,6 +23,7 @@
 
 #include <stdbool.h>
 #include <unistd.h>
+#include <stdint.h>
 
 typedef unsigned int logmask_t;
 #define LOG_ERROR    ((logmask_t)1)  // Fatal error, server will terminate
@@ -57,6 +58,25 @@ bool log_openLogFile(const char *path);
 void logadd(const logmask_t mask, const char *text, ...)
 	__attribute__ ((format (printf, 2, 3)));
 
+/**
+ * Switch to asynchronous logging: logadd() only formats the line and
+ * puts it into a lock-free ring buffer, a dedicated thread writes it out.
+ * Lines are dropped (and counted) if the buffer is full. LOG_ERROR is
+ * queued too, but logadd() waits until the writer thread wrote it.
+ */
+bool log_startAsync();
+
+/**
+ * Flush pending lines and go back to synchronous logging.
+ * Registered via atexit() by log_startAsync().
+ */
+void log_stopAsync();
+
+/**
+ * Number of lines dropped because the async buffer was full.
+ */
+uint64_t log_getDroppedCount();
+
 /**
  * Return last size bytes of log.
  */
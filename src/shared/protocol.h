@@ -22,6 +22,17 @@
 // 2017-11-02: Macro to set flags in select image message properly if we're a server, as BG_REP depends on global var
 #define SI_SERVER_FLAGS ( (_pretendClient ? 0 : FLAGS8_SERVER) | (_backgroundReplication == BGR_FULL ? FLAGS8_BG_REP : 0) )
 
+// 2026-10-17: Protocol v5: A server connected to another server can send CMD_SELECT_IMAGE again
+// after the handshake, to select additional images on the same connection. The image is put
+// into the slot (1-255) given in bits 48-55 of the request's handle, and the reply is sent with
+// the same handle, with an empty payload if the image is not available. An empty name just
+// frees the slot. From then on, all
+// requests on that connection carry the slot of the image they refer to in their handle, with
+// slot 0 being the image selected during the handshake. Replies carry the handle as usual.
+#define DNBD3_HANDLE_SLOT_SHIFT (48)
+#define DNBD3_HANDLE_SLOT(handle) ( (int)( ( (handle) >> DNBD3_HANDLE_SLOT_SHIFT ) & 0xff ) )
+#define DNBD3_MIN_VERSION_MULTI_IMAGE (5)
+
 #define REPLY_OK (0)
 #define REPLY_ERRNO (-1)
 #define REPLY_AGAIN (-2)
@@ -55,7 +66,7 @@ static inline bool dnbd3_get_reply(int sock, dnbd3_reply_t *reply)
 	return ret == REPLY_OK;
 }
 
-static inline bool dnbd3_select_image(int sock, const char *name, uint16_t rid, uint8_t flags8)
+static inline bool dnbd3_select_image_handle(int sock, const char *name, uint16_t rid, uint8_t flags8, uint64_t handle)
 {
 	serialized_buffer_t serialized;
 	dnbd3_request_t request;
@@ -69,8 +80,8 @@ static inline bool dnbd3_select_image(int sock, const char *name, uint16_t rid,
 	request.magic = dnbd3_packet_magic;
 	request.cmd = CMD_SELECT_IMAGE;
 	request.size = (uint32_t)len;
+	request.handle = handle;
 #ifdef _DEBUG
-	request.handle = 0;
 	request.offset = 0;
 #endif
 	fixup_request( request );
@@ -85,6 +96,11 @@ static inline bool dnbd3_select_image(int sock, const char *name, uint16_t rid,
 	return ret == len + (ssize_t)sizeof(request);
 }
 
+static inline bool dnbd3_select_image(int sock, const char *name, uint16_t rid, uint8_t flags8)
+{
+	return dnbd3_select_image_handle( sock, name, rid, flags8, 0 );
+}
+
 static inline bool dnbd3_get_block(int sock, uint64_t offset, uint32_t size, uint64_t handle, uint8_t hopCount)
 {
 	dnbd3_request_t request;
@@ -124,6 +140,34 @@ static inline bool dnbd3_get_crc32(int sock, uint32_t *master, void *buffer, siz
 	return sock_recv( sock, buffer, reply.size ) == (ssize_t)reply.size;
 }
 
+/**
+ * Get content hashes of image blocks, starting at block index first.
+ * Only supported by servers with protocol version >= 4.
+ * @param count in: capacity of buffer in entries, out: number of entries received; 0 if not available
+ */
+static inline bool dnbd3_get_block_hashes(int sock, uint64_t first, uint64_t *buffer, uint32_t *count)
+{
+	dnbd3_request_t request;
+	dnbd3_reply_t reply;
+	request.magic = dnbd3_packet_magic;
+	request.handle = 0;
+	request.cmd = CMD_GET_BLOCK_HASHES;
+	request.offset = first;
+	request.size = 0;
+	fixup_request( request );
+	if ( sock_sendAll( sock, &request, sizeof(request), 2 ) != (ssize_t)sizeof(request) ) return false;
+	if ( !dnbd3_get_reply( sock, &reply ) ) return false;
+	if ( reply.cmd != CMD_GET_BLOCK_HASHES || reply.size % sizeof(uint64_t) != 0
+			|| reply.size / sizeof(uint64_t) > *count ) return false;
+	*count = (uint32_t)( reply.size / sizeof(uint64_t) );
+	if ( reply.size == 0 ) return true;
+	if ( sock_recv( sock, buffer, reply.size ) != (ssize_t)reply.size ) return false;
+	for ( uint32_t i = 0; i < *count; ++i ) {
+		buffer[i] = net_order_64( buffer[i] );
+	}
+	return true;
+}
+
 /**
  * Pass a full serialized_buffer_t and a socket fd. Parsed data will be returned in further arguments.
  * Note that all strings will point into the passed buffer, so there's no need to free them.
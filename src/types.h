@@ -148,6 +148,7 @@ typedef struct
 #define CMD_LATEST_RID          6
 #define CMD_SET_CLIENT_MODE     7
 #define CMD_GET_CRC32           8
+#define CMD_GET_BLOCK_HASHES    9
 
 #define DNBD3_REQUEST_SIZE     24
 #pragma pack(1)